@@ -1,16 +1,10 @@
-#ifdef _WIN32
-#include "windows-compat.h" // usleep() on windows
-#else
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE
-#endif
-#include <unistd.h> // usleep() on Linux and Mac
-#endif
-
 #include <stdlib.h>
 #include <GLFW/glfw3.h>
 #include "kuhl-util.h"
 #include "dgr.h"
+#include "capture.h"
+#include "texstream.h"
+#include "framepace.h"
 
 static int viewmat_swapinterval = 0;
 static float fps = 0;
@@ -150,125 +144,30 @@ float bufferswap_fps(void)
 
 static void bufferswap_simple(void)
 {
+	framepace_before_swap();
 	glfwSwapBuffers(kuhl_get_window());
 	bufferswap_stats_fps();
+	framepace_after_swap(0);
 	return;
 }
 
 
 
-static void bufferswap_latencyreduce()
+/** Swaps the buffers and then sleeps so that the next frame is drawn
+ * as close to the next vsync as possible. See framepace.h. */
+static void bufferswap_latencyreduce(void)
 {
-	
-	static int count = 0;
-	if(count < 100)
-		count++;
-	static int avgRenderingLastFrame = -1;
-	static int avgRenderingLastFrameDev = 0;
-	static int avgWaitingForVsync = -1;
-	static long postswap_prev = -1;
-	static long postsleep_prev = -1;
-
-
-	static int vsyncTime = -1; //**< microseconds/frame
-	if(vsyncTime == -1)
+	static int showedMessage = 0;
+	if(!showedMessage)
 	{
-		int refreshRate = bufferswap_get_refresh_rate();
-		if(refreshRate == 59)
-			refreshRate = 60;
-		// 1 / (frames/second) * 1000000 microseconds/second = microseconds/frame
-		vsyncTime = (int) (1.0/refreshRate * 1000000);
-		msg(MSG_INFO, "Latency reduction is turned on; assuming monitor is %dHz and we have %d microseconds/frame\n", refreshRate, vsyncTime);
-		msg(MSG_INFO, "Set bufferswap.latencyreduce to 0 to disable latency reduction.\n", refreshRate, vsyncTime);
+		msg(MSG_INFO, "Latency reduction is turned on. Set bufferswap.latencyreduce to 0 to disable latency reduction.\n");
+		showedMessage = 1;
 	}
 
-	
-	GLFWwindow *window = kuhl_get_window();
-	/* We can call glFinish() to ensure that all rendering is done so
-	 * that our preswap time has a higher chance of being
-	 * accurate. Otherwise, our the time spent in swapbuffers can be
-	 * both the time waiting for vsync and the time waiting for the
-	 * previous OpenGL calls to finish. For more information, see:
-	 * https://www.opengl.org/wiki/Performance
-	 *
-	 * Skipping glFinish() may result in a slight performance increase
-	 * and may have a detrimental impact on our latency reduction
-	 * code.
-	 */
-	//glFinish();
-	long preswap = kuhl_microseconds();
-	glfwSwapBuffers(window);
+	framepace_before_swap();
+	glfwSwapBuffers(kuhl_get_window());
 	bufferswap_stats_fps();
-	long postswap = kuhl_microseconds();
-
-
-
-	int timeWaitingForVsync = postswap - preswap;
-
-	if(count < 10) // initialize averages, skip first few frames.
-	{
-		if(count > 2)
-			avgRenderingLastFrame = (float) (preswap - postsleep_prev);
-		
-		avgWaitingForVsync = (float) timeWaitingForVsync;
-		postswap_prev = postswap;
-		postsleep_prev = postswap; // we aren't sleeping.
-		return;
-	}
-
-	/* Figure out if we missed a frame */
-	int elapsed = postswap - postswap_prev;
-	/* How much time does it appear that we miss the vsync by. */
-	int missedBy = elapsed - vsyncTime;
-	if(missedBy < 0)
-		missedBy = 0;
-	
-	const float alpha = .98f; // weight to put on running average
-
-	// Update average waiting for vsync time. Note: The wait time can
-	// get large if the frame rate is low. I.e., if we miss a vsync,
-	// we have to wait until the next vsync. We calculate the time
-	// waiting for vsync for informational purposes only.
-	avgWaitingForVsync    = alpha * avgWaitingForVsync    + (1-alpha) * timeWaitingForVsync;
-
-	/* Update our estimates of the time it takes to render a
-	 * frame---both the average and our estimate of the deviation.  */
-	int timeRenderingLastFrame = preswap - postsleep_prev;
-	avgRenderingLastFrame    = alpha * avgRenderingLastFrame    + (1-alpha) * timeRenderingLastFrame;
-	avgRenderingLastFrameDev = alpha * avgRenderingLastFrameDev + (1-alpha) * abs(avgRenderingLastFrame-timeRenderingLastFrame);
-	
-	if(count < 60) // collected enough data so our averages are reasonable.
-	{
-		postswap_prev = postswap;
-		postsleep_prev = postswap; // we aren't sleeping.
-		return;
-	}
-
-	/* Add in more time based on our deviation estimate */
-	int renderingTimeMax = avgRenderingLastFrame + avgRenderingLastFrameDev * 2;
-
-	/* We have vsyncTime until the next vsync. Subtract out expected
-	 * rendering time and the buffer time. Also subtract out
-	 * additional time if we missed one or more frames. */
-	static const int safetyNet = 1500;
-	int sleepTime = (int) (vsyncTime - safetyNet - renderingTimeMax);
-
-#if 0
-	msg(MSG_INFO, "Sleeping for %6d = %6d(avail) - %d(safety) - %d(rendermax) \n", sleepTime, vsyncTime, safetyNet, renderingTimeMax);
-	msg(MSG_INFO, "LastRender=%d AvgRender=%d AvgRenderDev=%d VsyncWait=%d AvgVsyncWait=%df MissedBy=%ld",
-	    timeRenderingLastFrame, avgRenderingLastFrame, avgRenderingLastFrameDev, timeWaitingForVsync, avgWaitingForVsync, missedBy);
-#endif
-	
-	postsleep_prev = postswap;
-	postswap_prev = postswap;
-
-	if(sleepTime > 0)
-	{
-		usleep(sleepTime);
-		postsleep_prev = kuhl_microseconds();
-	}
-
-	return;
+	framepace_after_swap(1);
 }
 
 /** Get swap interval settings and apply them by calling glfwSwapInterval().
@@ -327,14 +226,26 @@ void bufferswap(void)
 		needsInit = 0;
 	}
 	
+	static kuhl_config_handle latencyReduce = NULL;
+	if(latencyReduce == NULL)
+		latencyReduce = kuhl_config_handle_get("bufferswap.latencyreduce");
+
 	dgr_update(1,0); // DGR Master should send before blocking at swap.
 
 	/* Swap the buffers */
 	if(viewmat_swapinterval == 0 ||
-	   kuhl_config_boolean("bufferswap.latencyreduce", 1,1) == 0) // if FPS is unrestricted.
+	   kuhl_config_handle_boolean(latencyReduce, 1,1) == 0) // if FPS is unrestricted.
 		bufferswap_simple();
 	else
 		bufferswap_latencyreduce();
 
+	/* Copy out any frames that have finished being read back for
+	 * kuhl_video_record(). */
+	capture_poll();
+
+	/* Upload or evict levels of streamed textures based on what was
+	 * drawn this frame. */
+	texstream_update();
+
 	dgr_update(0,1); // DGR Slave should receive after swap (and before drawing)
 }
@@ -18,7 +18,10 @@
       latency. If we use "latency reduction", we will instead do (1)
       sleep just long enough so that we can render the graphics right
       before the vsync, (2) render graphics, (3) wait until vsync to
-      swap buffers (hopefully not long!), (4) swap buffers.
+      swap buffers (hopefully not long!), (4) swap buffers. The
+      timing is handled by framepace.c, which measures when the GPU
+      finishes each frame and also estimates the motion-to-photon
+      latency.
 
     * It allows you to change the "Swap interval". Historically, you
       could only say "wait for vsync" to swap buffers (then your FPS
@@ -50,6 +53,7 @@ extern "C" {
 
 void bufferswap(void);
 float bufferswap_fps(void);
+int bufferswap_get_refresh_rate(void);
 
 #ifdef __cplusplus
 } // end extern "C"
@@ -3,6 +3,7 @@
 #include "camcontrol-vrpn.h"
 #include "vecmat.h"
 #include "vrpn-help.h"
+#include "framepace.h"
 
 camcontrolVrpn::camcontrolVrpn(dispmode *currentDisplayMode, const char *inObject, const char *inHostname)
 	:camcontrol(currentDisplayMode)
@@ -30,7 +31,9 @@ camcontrolVrpn::~camcontrolVrpn()
 viewmat_eye camcontrolVrpn::get_separate(float pos[3], float rot[16], viewmat_eye requestedEye)
 {
 	viewmat_eye returnVal = VIEWMAT_EYE_MIDDLE;
-	vrpn_get(object, hostname, pos, rot);
+	/* Predict where the object will be when this frame appears on the
+	 * screen (if vrpn.predict is set in the config file). */
+	vrpn_get_predicted(object, hostname, framepace_predicted_display(), pos, rot);
 
 	/* In many cases, the code above is all we need to do. Some
 	 * objects, need to be adjusted or rotated, however. */
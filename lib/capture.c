@@ -0,0 +1,827 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#ifdef HAVE_FFMPEG
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+#endif
+
+#include "capture.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "kuhl-nodep.h"
+#include "list-typed.h"
+#include "msg.h"
+#include "stb_image_write.h"
+
+/** Number of pixel buffer objects that frames are read into. With 3,
+ * a frame is copied out of its buffer two frames after it was read. */
+#define CAPTURE_PBO_COUNT 3
+
+/** A frame which has been copied out of OpenGL and is waiting to be
+ * encoded (or a recycled frame which is waiting to be reused). */
+typedef struct
+{
+	char filename[1024];   /**< File to write the frame to */
+	int width, height;     /**< Size of the frame in pixels */
+	unsigned char *pixels; /**< RGB pixels, top row first */
+	size_t capacity;       /**< Number of bytes allocated for pixels */
+	int toVideo;           /**< Set if the frame should be added to the video stream instead of written to filename */
+} capture_frame;
+
+LIST_TYPED(capture_frame_list, capture_frame*)
+QUEUE_TYPED(capture_frame_queue, capture_frame*)
+
+/** A pixel buffer object which a frame is read into. */
+typedef struct
+{
+	GLuint pbo;
+	GLsync fence;          /**< Signaled when the read has finished, NULL if the slot is empty */
+	int width, height;     /**< Size of the frame in the buffer */
+	size_t size;           /**< Size of the buffer in bytes */
+	char filename[1024];   /**< File to write the frame to */
+	int toVideo;           /**< Set if the frame should be added to the video stream */
+} capture_slot;
+
+static capture_slot slots[CAPTURE_PBO_COUNT];
+static int nextSlot = 0; /**< The slot to read the next frame into (also the oldest slot) */
+
+/** Frames waiting to be encoded and the threads that encode them. */
+typedef struct
+{
+	capture_frame_queue frames; /**< Frames waiting to be encoded */
+	int numThreads;       /**< Number of threads encoding these frames, 0 to encode on the calling thread */
+#ifdef HAVE_PTHREADS
+	pthread_t *threads;
+	pthread_cond_t notEmpty; /**< Signaled when a frame is added */
+#endif
+	int quit;             /**< Set when the threads should exit once the queue is empty */
+} capture_queue;
+
+static int initialized = 0;
+static int maxQueue = 8;       /**< Maximum number of frames in each queue */
+static capture_queue imageQueue; /**< Frames written to image files (any number of threads) */
+static capture_queue videoQueue; /**< Frames added to the video stream (at most one thread so they stay in order) */
+static capture_frame_list freeFrames; /**< Frames that can be reused */
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notFull = PTHREAD_COND_INITIALIZER;  /**< Broadcast when a frame is removed from a queue */
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;     /**< Signaled when all frames have been encoded */
+static int encoding = 0; /**< Number of frames the encoder threads are working on */
+#endif
+
+#ifdef HAVE_FFMPEG
+/** A video file which frames are encoded into with libavcodec. */
+typedef struct
+{
+	char filename[1024];
+	AVFormatContext *fmt;
+	AVCodecContext *ctx;
+	AVStream *stream;
+	AVFrame *frame;          /**< Frame in the encoder's pixel format */
+	AVPacket *pkt;
+	struct SwsContext *sws;  /**< Converts captured RGB frames into the encoder's format */
+	int64_t nextPts;
+	int headerWritten;
+	long bytes;              /**< Number of bytes of encoded video */
+} capture_stream;
+
+static capture_stream *videoStream = NULL;
+#endif
+
+/* Statistics. Protected by mutex. */
+static long framesCaptured = 0;
+static long framesWritten = 0;
+static long writeErrors = 0;
+static long writeErrorsReported = 0;
+static char lastError[1024] = "";
+static long queueStalls = 0;      /**< Times the render thread waited for the encoders */
+static long queueStallUsec = 0;   /**< Total time the render thread waited for the encoders */
+static long readbackStalls = 0;   /**< Times the render thread waited for the GPU to finish a read */
+static int queueHighWater = 0;    /**< Most frames that were ever waiting in a queue */
+static long videoFrames = 0;      /**< Frames added to the video stream */
+static long videoEncodeUsec = 0;  /**< Time spent converting and encoding video frames */
+
+static void capture_lock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&mutex);
+#endif
+}
+
+static void capture_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&mutex);
+#endif
+}
+
+/* Returns a frame which can hold an image of the requested size,
+ * reusing a previously allocated frame if possible. */
+static capture_frame* capture_get_frame(int width, int height)
+{
+	capture_frame *frame = NULL;
+	capture_lock();
+	if(capture_frame_list_pop(&freeFrames, &frame) == 0)
+		frame = NULL;
+	capture_unlock();
+
+	if(frame == NULL)
+	{
+		frame = kuhl_malloc(sizeof(capture_frame));
+		frame->pixels = NULL;
+		frame->capacity = 0;
+	}
+	size_t size = (size_t)width*height*3;
+	if(frame->capacity < size)
+	{
+		free(frame->pixels);
+		frame->pixels = kuhl_malloc(size);
+		frame->capacity = size;
+	}
+	frame->width = width;
+	frame->height = height;
+	frame->toVideo = 0;
+	return frame;
+}
+
+/* Writes a frame to disk. Called by the encoder threads, so this must
+ * not call OpenGL or msg().
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int capture_encode(const capture_frame *frame)
+{
+	const char *s = frame->filename;
+	size_t len = strlen(s);
+	int stride = frame->width*3;
+	if(len > 4 && !strcmp(s + len - 4, ".png"))
+		return stbi_write_png(s, frame->width, frame->height, 3, frame->pixels, stride);
+	else if(len > 4 && !strcmp(s + len - 4, ".jpg"))
+		return stbi_write_jpg(s, frame->width, frame->height, 3, frame->pixels, 95);
+	else if(len > 4 && !strcmp(s + len - 4, ".tga"))
+		return stbi_write_tga(s, frame->width, frame->height, 3, frame->pixels);
+	else if(len > 4 && !strcmp(s + len - 4, ".bmp"))
+		return stbi_write_bmp(s, frame->width, frame->height, 3, frame->pixels);
+	return 0;
+}
+
+#ifdef HAVE_FFMPEG
+/* Sends a frame (or NULL to flush the encoder) to the encoder and
+ * writes any packets that it produces to the file. */
+static int capture_stream_write(capture_stream *s, AVFrame *frame)
+{
+	if(avcodec_send_frame(s->ctx, frame) < 0)
+		return 0;
+	while(1)
+	{
+		int ret = avcodec_receive_packet(s->ctx, s->pkt);
+		if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 1;
+		if(ret < 0)
+			return 0;
+		av_packet_rescale_ts(s->pkt, s->ctx->time_base, s->stream->time_base);
+		s->pkt->stream_index = s->stream->index;
+		s->bytes += s->pkt->size;
+		if(av_interleaved_write_frame(s->fmt, s->pkt) < 0)
+			return 0;
+	}
+}
+
+/* Converts a captured frame into the encoder's pixel format and
+ * encodes it. Called by the video thread, so this must not call
+ * OpenGL or msg(). If the window was resized, the frame is scaled to
+ * the size of the video. */
+static int capture_stream_encode(capture_stream *s, const capture_frame *frame)
+{
+	s->sws = sws_getCachedContext(s->sws, frame->width, frame->height, AV_PIX_FMT_RGB24,
+	                              s->ctx->width, s->ctx->height, s->ctx->pix_fmt,
+	                              SWS_BILINEAR, NULL, NULL, NULL);
+	if(s->sws == NULL || av_frame_make_writable(s->frame) < 0)
+		return 0;
+
+	const uint8_t *src[] = { frame->pixels };
+	const int srcStride[] = { frame->width*3 };
+	sws_scale(s->sws, src, srcStride, 0, frame->height, s->frame->data, s->frame->linesize);
+	s->frame->pts = s->nextPts++;
+	return capture_stream_write(s, s->frame);
+}
+
+/* Finishes writing a video file (if it was successfully opened) and
+ * frees the stream. */
+static void capture_stream_close(capture_stream *s)
+{
+	if(s->headerWritten)
+	{
+		capture_stream_write(s, NULL);
+		av_write_trailer(s->fmt);
+	}
+	if(s->fmt && !(s->fmt->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&(s->fmt->pb));
+	avformat_free_context(s->fmt);
+	avcodec_free_context(&(s->ctx));
+	av_frame_free(&(s->frame));
+	av_packet_free(&(s->pkt));
+	sws_freeContext(s->sws);
+	free(s);
+}
+
+/* Opens a video file and an encoder for it. The codec is chosen with
+ * the capture.codec config option. */
+static capture_stream* capture_stream_open(const char *filename, int width, int height, int fps)
+{
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+	av_register_all();
+#endif
+
+	const char *codecName = kuhl_config_get("capture.codec");
+	if(codecName == NULL)
+		codecName = "libx264";
+	const AVCodec *codec = avcodec_find_encoder_by_name(codecName);
+	if(codec == NULL)
+	{
+		msg(MSG_WARNING, "Video encoder '%s' is not available, using ffv1 instead.", codecName);
+		codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+		if(codec == NULL)
+		{
+			msg(MSG_ERROR, "Video encoder ffv1 is not available.");
+			return NULL;
+		}
+	}
+
+	capture_stream *s = kuhl_malloc(sizeof(capture_stream));
+	memset(s, 0, sizeof(capture_stream));
+	snprintf(s->filename, 1024, "%s", filename);
+
+	avformat_alloc_output_context2(&(s->fmt), NULL, NULL, filename);
+	if(s->fmt == NULL)
+	{
+		msg(MSG_ERROR, "Unable to find a container format for '%s'", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+	s->stream = avformat_new_stream(s->fmt, NULL);
+	s->ctx = avcodec_alloc_context3(codec);
+	if(s->stream == NULL || s->ctx == NULL)
+	{
+		msg(MSG_ERROR, "Unable to allocate video stream for '%s'", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+
+	/* Most encoders need an even width and height when the chroma is
+	 * subsampled. */
+	s->ctx->width = width & ~1;
+	s->ctx->height = height & ~1;
+	s->ctx->time_base = (AVRational){ 1, fps };
+	s->ctx->framerate = (AVRational){ fps, 1 };
+	s->ctx->thread_count = 0; // let the encoder choose
+	/* ffv1 is lossless, so keep the RGB values exactly (planar GBR)
+	 * instead of converting to YUV. */
+	if(codec->id == AV_CODEC_ID_FFV1)
+		s->ctx->pix_fmt = AV_PIX_FMT_GBRP;
+	else
+		s->ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+	if(codec->id == AV_CODEC_ID_H264)
+	{
+		const char *preset = kuhl_config_get("capture.preset");
+		const char *crf = kuhl_config_get("capture.crf");
+		av_opt_set(s->ctx->priv_data, "preset", preset ? preset : "veryfast", 0);
+		av_opt_set(s->ctx->priv_data, "crf", crf ? crf : "18", 0);
+	}
+	if(s->fmt->oformat->flags & AVFMT_GLOBALHEADER)
+		s->ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if(avcodec_open2(s->ctx, codec, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Unable to open video encoder '%s'", codec->name);
+		capture_stream_close(s);
+		return NULL;
+	}
+	avcodec_parameters_from_context(s->stream->codecpar, s->ctx);
+	s->stream->time_base = s->ctx->time_base;
+
+	/* Allocate everything that capture_stream_close() needs to flush
+	 * the encoder before we write the header. */
+	s->frame = av_frame_alloc();
+	s->pkt = av_packet_alloc();
+	if(s->frame == NULL || s->pkt == NULL)
+	{
+		msg(MSG_ERROR, "Unable to allocate video frame for '%s'", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+	s->frame->format = s->ctx->pix_fmt;
+	s->frame->width = s->ctx->width;
+	s->frame->height = s->ctx->height;
+	if(av_frame_get_buffer(s->frame, 0) < 0)
+	{
+		msg(MSG_ERROR, "Unable to allocate video frame for '%s'", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+
+	if(!(s->fmt->oformat->flags & AVFMT_NOFILE) &&
+	   avio_open(&(s->fmt->pb), filename, AVIO_FLAG_WRITE) < 0)
+	{
+		msg(MSG_ERROR, "Unable to open '%s' for writing", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+	if(avformat_write_header(s->fmt, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Unable to write header to '%s'", filename);
+		capture_stream_close(s);
+		return NULL;
+	}
+	s->headerWritten = 1;
+
+	msg(MSG_INFO, "Recording %dx%d video at %d frames per second to %s using %s",
+	    s->ctx->width, s->ctx->height, fps, filename, codec->name);
+	return s;
+}
+#endif // HAVE_FFMPEG
+
+/* Encodes a frame, records the result and recycles the frame. */
+static void capture_encode_and_release(capture_frame *frame)
+{
+	int ok = 0;
+	const char *dest = frame->filename;
+#ifdef HAVE_FFMPEG
+	if(frame->toVideo)
+	{
+		long start = kuhl_microseconds();
+		ok = capture_stream_encode(videoStream, frame);
+		dest = videoStream->filename;
+		capture_lock();
+		videoFrames++;
+		videoEncodeUsec += kuhl_microseconds() - start;
+		capture_unlock();
+	}
+	else
+#endif
+		ok = capture_encode(frame);
+
+	capture_lock();
+	if(ok)
+		framesWritten++;
+	else
+	{
+		writeErrors++;
+		snprintf(lastError, 1024, "%s", dest);
+	}
+	capture_frame_list_push(&freeFrames, frame);
+	capture_unlock();
+}
+
+#ifdef HAVE_PTHREADS
+/* Encodes frames from a capture_queue until the queue is empty and
+ * the quit flag is set. */
+static void* capture_worker(void *arg)
+{
+	capture_queue *q = (capture_queue*) arg;
+	pthread_mutex_lock(&mutex);
+	while(1)
+	{
+		while(q->quit == 0 && capture_frame_queue_length(&q->frames) == 0)
+			pthread_cond_wait(&(q->notEmpty), &mutex);
+		capture_frame *frame = NULL;
+		if(capture_frame_queue_remove(&q->frames, &frame) == 0)
+			break; // quit and nothing left to encode
+		encoding++;
+		pthread_cond_broadcast(&notFull);
+		pthread_mutex_unlock(&mutex);
+
+		capture_encode_and_release(frame);
+
+		pthread_mutex_lock(&mutex);
+		encoding--;
+		if(encoding == 0 && capture_frame_queue_length(&imageQueue.frames) == 0 &&
+		   capture_frame_queue_length(&videoQueue.frames) == 0)
+			pthread_cond_broadcast(&idle);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/* Starts up to 'count' threads which encode the frames in a queue. */
+static void capture_queue_start(capture_queue *q, int count)
+{
+	q->quit = 0;
+	q->numThreads = 0;
+	if(count < 1)
+		return;
+	q->threads = malloc(sizeof(pthread_t)*count);
+	for(int i=0; i<count; i++)
+	{
+		if(pthread_create(&(q->threads[i]), NULL, capture_worker, q) != 0)
+		{
+			msg(MSG_WARNING, "Failed to create capture thread %d", i);
+			break;
+		}
+		q->numThreads++;
+	}
+}
+
+/* Waits for the threads to encode everything in the queue and then
+ * stops them. */
+static void capture_queue_stop(capture_queue *q)
+{
+	pthread_mutex_lock(&mutex);
+	q->quit = 1;
+	pthread_cond_broadcast(&(q->notEmpty));
+	pthread_mutex_unlock(&mutex);
+	for(int i=0; i<q->numThreads; i++)
+		pthread_join(q->threads[i], NULL);
+	free(q->threads);
+	q->threads = NULL;
+	q->numThreads = 0;
+}
+#endif
+
+/* Hands a frame to the encoder threads. If the queue is full, waits
+ * for the encoders to catch up so that we never drop frames. */
+static void capture_enqueue(capture_frame *frame)
+{
+	capture_lock();
+	framesCaptured++;
+	capture_unlock();
+
+#ifdef HAVE_PTHREADS
+	capture_queue *q = frame->toVideo ? &videoQueue : &imageQueue;
+	if(q->numThreads > 0)
+	{
+		pthread_mutex_lock(&mutex);
+		if(capture_frame_queue_length(&q->frames) >= maxQueue)
+		{
+			long start = kuhl_microseconds();
+			while(capture_frame_queue_length(&q->frames) >= maxQueue)
+				pthread_cond_wait(&notFull, &mutex);
+			queueStalls++;
+			queueStallUsec += kuhl_microseconds() - start;
+		}
+		capture_frame_queue_add(&q->frames, frame);
+		if(capture_frame_queue_length(&q->frames) > queueHighWater)
+			queueHighWater = capture_frame_queue_length(&q->frames);
+		pthread_cond_signal(&(q->notEmpty));
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+#endif
+	capture_encode_and_release(frame);
+}
+
+/* Copies an image from OpenGL (bottom row first) into a frame (top
+ * row first). */
+static void capture_copy_flip(capture_frame *frame, const unsigned char *src)
+{
+	size_t rowBytes = (size_t)frame->width*3;
+	for(int y=0; y<frame->height; y++)
+		memcpy(frame->pixels + rowBytes*(frame->height-1-y), src + rowBytes*y, rowBytes);
+}
+
+/* Copies a frame out of a pixel buffer object and sends it to the
+ * encoders. The caller must ensure the fence has signaled (or accept
+ * that mapping the buffer will wait). */
+static void capture_retire(capture_slot *slot)
+{
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	const unsigned char *src = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot->size, GL_MAP_READ_BIT);
+	if(src != NULL)
+	{
+		capture_frame *frame = capture_get_frame(slot->width, slot->height);
+		snprintf(frame->filename, 1024, "%s", slot->filename);
+		frame->toVideo = slot->toVideo;
+		capture_copy_flip(frame, src);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		capture_enqueue(frame);
+	}
+	else
+		msg(MSG_ERROR, "Unable to map pixel buffer for %s", slot->filename);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteSync(slot->fence);
+	slot->fence = NULL;
+	kuhl_errorcheck();
+}
+
+/* Waits for the GPU to finish reading every frame in the pixel buffer
+ * objects and sends them to the encoders. */
+static void capture_retire_all(void)
+{
+	for(int i=0; i<CAPTURE_PBO_COUNT; i++)
+	{
+		capture_slot *slot = &slots[(nextSlot+i) % CAPTURE_PBO_COUNT];
+		if(slot->fence == NULL)
+			continue;
+		glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		capture_retire(slot);
+	}
+}
+
+/* Finishes the video file (if one is being recorded) once all of the
+ * frames that have been sent to the video thread are encoded. */
+static void capture_video_finish(void)
+{
+#ifdef HAVE_FFMPEG
+	if(videoStream == NULL)
+		return;
+#ifdef HAVE_PTHREADS
+	capture_queue_stop(&videoQueue);
+#endif
+	msg(MSG_INFO, "Wrote %ld frames (%.1f MiB) to %s", (long) videoStream->nextPts,
+	    videoStream->bytes/(1024.0*1024.0), videoStream->filename);
+	capture_stream_close(videoStream);
+	videoStream = NULL;
+#endif
+}
+
+static void capture_exit(void)
+{
+	/* Finish any frames still in the pixel buffers if we still have
+	 * an OpenGL context. */
+	if(glfwGetCurrentContext() != NULL)
+		capture_retire_all();
+	capture_video_finish();
+#ifdef HAVE_PTHREADS
+	capture_queue_stop(&imageQueue);
+#endif
+
+	if(framesCaptured > 0)
+		capture_print_stats();
+}
+
+static void capture_init(void)
+{
+	if(initialized)
+		return;
+	initialized = 1;
+
+	maxQueue = kuhl_config_int("capture.queue", 8, 8);
+	if(maxQueue < 1)
+		maxQueue = 1;
+	memset(&imageQueue, 0, sizeof(capture_queue));
+	memset(&videoQueue, 0, sizeof(capture_queue));
+	capture_frame_queue_init(&imageQueue.frames, maxQueue);
+	capture_frame_queue_init(&videoQueue.frames, maxQueue);
+	capture_frame_list_init(&freeFrames, 2*maxQueue+CAPTURE_PBO_COUNT);
+	memset(slots, 0, sizeof(slots));
+
+	/* We flip the rows ourselves while copying frames out of OpenGL. */
+	stbi_flip_vertically_on_write(0);
+
+#ifdef HAVE_PTHREADS
+	pthread_cond_init(&(imageQueue.notEmpty), NULL);
+	pthread_cond_init(&(videoQueue.notEmpty), NULL);
+	capture_queue_start(&imageQueue, kuhl_config_int("capture.threads", 2, 2));
+#endif
+	msg(MSG_DEBUG, "Capture: %d encoder thread(s), queues hold %d frames", imageQueue.numThreads, maxQueue);
+	atexit(capture_exit);
+}
+
+/** Reads the current contents of the framebuffer and writes it to an
+ * image file. The pixels are read immediately but the file is written
+ * by an encoder thread, so the file may not exist yet when this
+ * function returns. Call capture_flush() to wait for the file.
+ *
+ * @param filename The file to write. The type of the file is
+ * determined by the extension: png, jpg, tga or bmp.
+ */
+void capture_screenshot(const char *filename)
+{
+	capture_init();
+	capture_poll();
+
+	int width, height;
+	glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+	capture_frame *frame = capture_get_frame(width, height);
+	snprintf(frame->filename, 1024, "%s", filename);
+
+	/* Read straight into a recycled frame and flip it in place. */
+	GLint packAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, frame->pixels);
+	glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+	kuhl_errorcheck();
+	kuhl_flip_texture_array(frame->pixels, width, height, 3);
+	capture_enqueue(frame);
+}
+
+/* Starts reading the framebuffer into the next pixel buffer object. */
+static void capture_read(const char *filename, int toVideo)
+{
+	capture_init();
+	capture_poll();
+
+	/* If the slot is still in use, we are capturing faster than the
+	 * GPU can read the frames back. Wait for the oldest frame. */
+	capture_slot *slot = &slots[nextSlot];
+	if(slot->fence != NULL)
+	{
+		glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		capture_retire(slot);
+		readbackStalls++;
+	}
+
+	int width, height;
+	glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+	size_t size = (size_t)width*height*3;
+	if(slot->pbo == 0)
+		glGenBuffers(1, &(slot->pbo));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	if(slot->size != size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		slot->size = size;
+	}
+	slot->width = width;
+	slot->height = height;
+	slot->toVideo = toVideo;
+	snprintf(slot->filename, 1024, "%s", filename);
+
+	GLint packAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_errorcheck();
+
+	nextSlot = (nextSlot+1) % CAPTURE_PBO_COUNT;
+}
+
+/** Starts reading the current contents of the framebuffer into a
+ * pixel buffer object. The frame is copied out of the buffer by a
+ * later call to capture_poll() (bufferswap() calls it every frame)
+ * once the GPU has finished reading it, and is then written to disk
+ * by an encoder thread.
+ *
+ * @param filename The file to write. The type of the file is
+ * determined by the extension: png, jpg, tga or bmp. BMP files are
+ * the fastest to write.
+ */
+void capture_video_frame(const char *filename)
+{
+	capture_read(filename, 0);
+}
+
+/** Opens a video file which capture_video_append() adds frames
+ * to. Frames are encoded with libavcodec on a background thread. The
+ * codec is chosen with the capture.codec config option: "libx264"
+ * (default) or "ffv1" (lossless). For libx264, capture.preset
+ * (default "veryfast") and capture.crf (default 18) set the speed and
+ * quality. The size of the video is the size of the framebuffer when
+ * this function is called; if the window is resized later, frames
+ * are scaled to fit.
+ *
+ * @param filename The video file to create. The container is chosen
+ * from the extension; ".mkv" works with every codec.
+ *
+ * @param fps The frame rate of the video.
+ *
+ * @return 1 if the video file was opened, 0 if it wasn't (for
+ * example, if libkuhl was compiled without FFmpeg).
+ */
+int capture_video_start(const char *filename, int fps)
+{
+#ifndef HAVE_FFMPEG
+	msg(MSG_WARNING, "Library is not compiled against FFMpeg, unable to record %s", filename);
+	return 0;
+#else
+	capture_init();
+	if(videoStream != NULL)
+	{
+		msg(MSG_ERROR, "Unable to record %s, already recording %s", filename, videoStream->filename);
+		return 0;
+	}
+	int width, height;
+	glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+	videoStream = capture_stream_open(filename, width, height, fps);
+	if(videoStream == NULL)
+		return 0;
+#ifdef HAVE_PTHREADS
+	capture_queue_start(&videoQueue, 1);
+#endif
+	return 1;
+#endif
+}
+
+/** Reads the current contents of the framebuffer and adds it to the
+ * video file opened by capture_video_start(). Like
+ * capture_video_frame(), this doesn't wait for the GPU or the
+ * encoder unless they have fallen behind.
+ */
+void capture_video_append(void)
+{
+#ifdef HAVE_FFMPEG
+	if(videoStream != NULL)
+		capture_read(videoStream->filename, 1);
+#endif
+}
+
+/** Adds any frames which haven't been encoded yet to the video file
+ * opened by capture_video_start() and closes the file. Called
+ * automatically when the program exits. Must be called on the thread
+ * which owns the OpenGL context.
+ */
+void capture_video_stop(void)
+{
+	if(initialized == 0)
+		return;
+	capture_retire_all();
+	capture_video_finish();
+}
+
+/** Copies any frames that the GPU has finished reading out of the
+ * pixel buffer objects and sends them to the encoders. Never waits for
+ * the GPU. Also prints a message if an encoder failed to write a
+ * file. Must be called on the thread which owns the OpenGL context.
+ */
+void capture_poll(void)
+{
+	if(initialized == 0)
+		return;
+
+	/* Retire frames in the order they were captured. */
+	for(int i=0; i<CAPTURE_PBO_COUNT; i++)
+	{
+		capture_slot *slot = &slots[(nextSlot+i) % CAPTURE_PBO_COUNT];
+		if(slot->fence == NULL)
+			continue;
+		GLenum status = glClientWaitSync(slot->fence, 0, 0);
+		if(status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		capture_retire(slot);
+	}
+
+	capture_lock();
+	long errors = writeErrors;
+	char failed[1024];
+	snprintf(failed, 1024, "%s", lastError);
+	capture_unlock();
+	if(errors > writeErrorsReported)
+	{
+		msg(MSG_ERROR, "Failed to write %ld captured frame(s), most recently to %s (note: STB can only write png, jpg, tga, and bmp files.)",
+		    errors-writeErrorsReported, failed);
+		writeErrorsReported = errors;
+	}
+}
+
+/** Waits for all captured frames to be read back from the GPU and
+ * written to disk (or sent to the video encoder). Must be called on
+ * the thread which owns the OpenGL context.
+ */
+void capture_flush(void)
+{
+	if(initialized == 0)
+		return;
+
+	capture_retire_all();
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&mutex);
+	while(encoding > 0 ||
+	      (imageQueue.numThreads > 0 && capture_frame_queue_length(&imageQueue.frames) > 0) ||
+	      (videoQueue.numThreads > 0 && capture_frame_queue_length(&videoQueue.frames) > 0))
+		pthread_cond_wait(&idle, &mutex);
+	pthread_mutex_unlock(&mutex);
+#endif
+	capture_poll();
+}
+
+/** Prints statistics about the frames which have been captured. If
+ * the render thread had to wait for the encoders often, increase
+ * capture.queue or capture.threads (or use a faster codec).
+ */
+void capture_print_stats(void)
+{
+	capture_lock();
+	msg(MSG_INFO, "Capture: %ld frame(s) captured, %ld written, %ld failed. "
+	    "Waited for encoders %ld time(s) (%.1f ms total, queue peaked at %d of %d frames), waited for GPU readback %ld time(s).",
+	    framesCaptured, framesWritten, writeErrors,
+	    queueStalls, queueStallUsec/1000.0, queueHighWater, maxQueue, readbackStalls);
+	if(videoFrames > 0)
+		msg(MSG_INFO, "Capture: %ld video frame(s) encoded, %.2f ms/frame.",
+		    videoFrames, videoEncodeUsec/1000.0/videoFrames);
+	capture_unlock();
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Captures the contents of the framebuffer and writes them to image
+    files without stalling the render thread.
+
+    Frames are read back into a ring of pixel buffer objects and a
+    fence is placed after each read. A frame is copied out of its
+    buffer a frame or two later once the fence has signaled (i.e.,
+    without waiting for the GPU). The copied frames are placed in a
+    bounded queue and encoded by worker threads. Frame buffers are
+    recycled so that recording doesn't allocate memory every frame.
+
+    If libkuhl is compiled with FFmpeg, frames can instead be encoded
+    directly into a video file (see capture_video_start()) on a
+    dedicated thread so that long recordings don't need large numbers
+    of intermediate image files.
+
+    Most programs will use kuhl_screenshot() or kuhl_video_record()
+    instead of calling these functions directly.
+
+    Config options:
+    capture.threads - Number of encoder threads (default 2).
+    capture.queue - Maximum number of frames waiting to be encoded (default 8).
+    capture.codec - Video encoder: libx264 (default), ffv1 (lossless), or "images" to make kuhl_video_record() write image files.
+    capture.preset - libx264 preset (default veryfast).
+    capture.crf - libx264 quality, lower is better (default 18).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void capture_screenshot(const char *filename);
+void capture_video_frame(const char *filename);
+int capture_video_start(const char *filename, int fps);
+void capture_video_append(void);
+void capture_video_stop(void);
+void capture_poll(void);
+void capture_flush(void);
+void capture_print_stats(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
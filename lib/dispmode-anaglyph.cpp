@@ -109,9 +109,13 @@ void dispmodeAnaglyph::get_frustum(float result[6], int viewportID)
 	int viewportH = viewport[3];
 
 	float aspect = viewportW/(float)viewportH;
-	float nearPlane = kuhl_config_float("nearplane", 0.1f, 0.1f);
-	float farPlane = kuhl_config_float("farplane", 200.0f, 200.0f);
-	float vfov = kuhl_config_float("vfov", 65.0f, 65.0f);
+	/* This is called every frame, use handles to avoid looking up the keys each time. */
+	static kuhl_config_handle nearHandle = kuhl_config_handle_get("nearplane");
+	static kuhl_config_handle farHandle = kuhl_config_handle_get("farplane");
+	static kuhl_config_handle vfovHandle = kuhl_config_handle_get("vfov");
+	float nearPlane = kuhl_config_handle_float(nearHandle, 0.1f, 0.1f);
+	float farPlane = kuhl_config_handle_float(farHandle, 200.0f, 200.0f);
+	float vfov = kuhl_config_handle_float(vfovHandle, 65.0f, 65.0f);
 	float fovyRad = (float) (vfov * M_PI/180.0f);
 	float height = nearPlane * tanf(fovyRad/2.0f);
 	float width = height * aspect;
@@ -0,0 +1,470 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#ifdef _WIN32
+#include "windows-compat.h" // usleep() on windows
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <unistd.h> // usleep() on Linux and Mac
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/glew.h>
+
+#include "framepace.h"
+#include "bufferswap.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "msg.h"
+
+/** Number of frames that we can wait for GPU timestamps from. */
+#define FRAMEPACE_SLOTS 4
+/** Number of recent frames that the prediction is based on. */
+#define FRAMEPACE_HISTORY 120
+/** Number of frames to collect before we start sleeping. */
+#define FRAMEPACE_WARMUP 30
+/** Width of the motion-to-photon histogram buckets in microseconds. */
+#define FRAMEPACE_BUCKET 250
+#define FRAMEPACE_BUCKETS 400
+#define FRAMEPACE_MAX_CALLBACKS 8
+
+/* Timing information for one frame. */
+typedef struct
+{
+	unsigned long frame;
+	long wake;      /**< When the frame started (after we finished sleeping) */
+	long input;     /**< First call to framepace_sample_input() during the frame, -1 if none */
+	long preswap;   /**< When we started swapping the buffers */
+	long postswap;  /**< When swapping the buffers returned */
+	int predicted;  /**< Predicted time to render the frame, 0 if we didn't predict */
+	int margin;     /**< Safety margin used when sleeping before the frame */
+	int sleep;      /**< Time slept before the frame */
+	int missed;     /**< Did the frame miss a vsync? */
+	GLuint query;   /**< Timestamp query after the last command in the frame */
+	int pending;    /**< Are we waiting for the query result? */
+} framepace_frame;
+
+static int initialized = 0;
+static int vsyncTime = 0;        /**< Microseconds per monitor refresh */
+static int useTimer = 0;         /**< Can we use GPU timestamp queries? */
+static float percentile = 95;
+static int minMargin = 500;
+static int margin = 500;         /**< Current safety margin in microseconds */
+static int recoverFrames = 0;    /**< Frames left where we don't sleep after a missed vsync */
+static long gpuOffset = 0;       /**< Add to GPU time in microseconds to get kuhl_microseconds() time */
+static FILE *logFile = NULL;
+
+static unsigned long frame = 0;  /**< Number of the frame being rendered */
+static framepace_frame current;  /**< Frame being rendered now */
+static framepace_frame slots[FRAMEPACE_SLOTS];
+static long prevPostswap = -1;
+
+static int history[FRAMEPACE_HISTORY]; /**< Recent render times in microseconds */
+static int historyCount = 0;
+static int historyIndex = 0;
+
+static struct
+{
+	void (*func)(void *data);
+	void *data;
+} callbacks[FRAMEPACE_MAX_CALLBACKS];
+static int numCallbacks = 0;
+
+static struct
+{
+	unsigned long frames;
+	unsigned long missed;
+	unsigned long paced;       /**< Frames that we slept before */
+	double sleepUsec;
+	double renderUsec;
+	unsigned long renderFrames;
+	unsigned long gpuFrames;   /**< Frames timed with a GPU timestamp */
+	unsigned long mtpFrames;
+	double mtpUsec;
+	unsigned long mtpHistogram[FRAMEPACE_BUCKETS];
+	int mtpMax;
+} stats;
+
+
+static void framepace_exit(void)
+{
+	framepace_print_stats();
+	if(logFile != NULL)
+	{
+		fclose(logFile);
+		logFile = NULL;
+	}
+}
+
+/** Find the offset between the GPU clock and kuhl_microseconds(). */
+static void framepace_calibrate(void)
+{
+	GLint64 gpuNow = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+	gpuOffset = kuhl_microseconds() - (long) (gpuNow / 1000);
+}
+
+static void framepace_init(void)
+{
+	if(initialized)
+		return;
+	initialized = 1;
+
+	int refreshRate = bufferswap_get_refresh_rate();
+	if(refreshRate == 59)
+		refreshRate = 60;
+	if(refreshRate <= 0)
+		refreshRate = 60;
+	// 1 / (frames/second) * 1000000 microseconds/second = microseconds/frame
+	vsyncTime = (int) (1.0/refreshRate * 1000000);
+
+	percentile = kuhl_config_float("framepace.percentile", 95, 95);
+	if(percentile < 50 || percentile > 100)
+	{
+		msg(MSG_WARNING, "framepace.percentile should be between 50 and 100. You have set it to %f\n", percentile);
+		percentile = 95;
+	}
+	minMargin = kuhl_config_int("framepace.margin", 500, 500);
+	if(minMargin < 0)
+		minMargin = 0;
+	margin = minMargin;
+
+	useTimer = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+	if(useTimer)
+	{
+		for(int i=0; i<FRAMEPACE_SLOTS; i++)
+		{
+			glGenQueries(1, &(slots[i].query));
+			slots[i].pending = 0;
+		}
+		framepace_calibrate();
+	}
+	else
+		msg(MSG_WARNING, "Timer queries are not supported, frame pacing can't measure when the GPU finishes drawing.");
+
+	const char *logFilename = kuhl_config_get("framepace.log");
+	if(logFilename != NULL)
+	{
+		logFile = fopen(logFilename, "w");
+		if(logFile == NULL)
+			msg(MSG_ERROR, "Unable to write frame timing to '%s'", logFilename);
+		else
+			fprintf(logFile, "frame,render_us,predicted_us,margin_us,sleep_us,missed,gpu,motion_to_photon_us\n");
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	current.wake = kuhl_microseconds();
+	current.input = -1;
+	current.margin = margin;
+	atexit(framepace_exit);
+
+	msg(MSG_DEBUG, "Frame pacing: assuming monitor is %dHz (%d microseconds/frame), predicting render time with the %g percentile.", refreshRate, vsyncTime, percentile);
+}
+
+static int framepace_compare_int(const void *a, const void *b)
+{
+	int x = *(const int*)a;
+	int y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+/** Predicts how long the next frame will take to render based on
+ * the recent frames. */
+static int framepace_predict(void)
+{
+	int sorted[FRAMEPACE_HISTORY];
+	memcpy(sorted, history, sizeof(int)*historyCount);
+	qsort(sorted, historyCount, sizeof(int), framepace_compare_int);
+	int index = (int) (percentile/100.0f * (historyCount-1) + 0.5f);
+	return sorted[index];
+}
+
+/** Records the timing of a frame once we know when the GPU finished
+ * drawing it.
+
+    @param f The frame.
+
+    @param gpuDone When the GPU finished drawing the frame (in
+    kuhl_microseconds() time), or -1 if we don't know.
+*/
+static void framepace_finish(const framepace_frame *f, long gpuDone)
+{
+	long done = f->preswap;
+	if(gpuDone > done)
+		done = gpuDone;
+
+	int render = (int) (done - f->wake);
+	if(render < 0)
+		render = 0;
+	history[historyIndex] = render;
+	historyIndex = (historyIndex+1) % FRAMEPACE_HISTORY;
+	if(historyCount < FRAMEPACE_HISTORY)
+		historyCount++;
+	stats.renderUsec += render;
+	stats.renderFrames++;
+	if(gpuDone >= 0)
+		stats.gpuFrames++;
+
+	/* The frame is displayed at the first vsync after the buffers
+	 * are swapped and the GPU is done. We assume that swapping the
+	 * buffers returns right after that vsync and that the middle of
+	 * the screen lights up half of a refresh later. */
+	int mtp = -1;
+	if(f->input >= 0)
+	{
+		long photon = f->postswap;
+		if(done > photon)
+			photon = done;
+		photon += vsyncTime/2;
+		mtp = (int) (photon - f->input);
+		if(mtp < 0)
+			mtp = 0;
+
+		stats.mtpFrames++;
+		stats.mtpUsec += mtp;
+		int bucket = mtp / FRAMEPACE_BUCKET;
+		if(bucket >= FRAMEPACE_BUCKETS)
+			bucket = FRAMEPACE_BUCKETS-1;
+		stats.mtpHistogram[bucket]++;
+		if(mtp > stats.mtpMax)
+			stats.mtpMax = mtp;
+	}
+
+	if(logFile != NULL)
+		fprintf(logFile, "%lu,%d,%d,%d,%d,%d,%d,%d\n", f->frame, render, f->predicted,
+		        f->margin, f->sleep, f->missed, gpuDone >= 0, mtp);
+}
+
+/** Collects the results of timestamp queries that have finished
+ * without waiting for the GPU. */
+static void framepace_poll(void)
+{
+	for(int i=0; i<FRAMEPACE_SLOTS; i++)
+	{
+		/* Handle the frames in the order that they were drawn. */
+		framepace_frame *f = &(slots[(frame+1+i) % FRAMEPACE_SLOTS]);
+		if(!f->pending)
+			continue;
+
+		GLint available = 0;
+		glGetQueryObjectiv(f->query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if(!available)
+			return; // later frames won't be done either.
+
+		GLuint64 gpuTime = 0;
+		glGetQueryObjectui64v(f->query, GL_QUERY_RESULT, &gpuTime);
+		f->pending = 0;
+		framepace_finish(f, (long) (gpuTime/1000) + gpuOffset);
+	}
+}
+
+/** Should be called right before the buffers are swapped. Places a
+ * GPU timestamp after all of the drawing commands in the frame. */
+void framepace_before_swap(void)
+{
+	framepace_init();
+
+	framepace_frame *f = &(slots[frame % FRAMEPACE_SLOTS]);
+	if(f->pending)
+	{
+		/* The GPU is more than FRAMEPACE_SLOTS frames behind; use
+		 * the CPU time for that frame instead of waiting. */
+		f->pending = 0;
+		framepace_finish(f, -1);
+	}
+
+	GLuint query = f->query;
+	*f = current;
+	f->query = query;
+	f->frame = frame;
+	f->preswap = kuhl_microseconds();
+	if(useTimer)
+	{
+		glQueryCounter(f->query, GL_TIMESTAMP);
+		f->pending = 1;
+	}
+}
+
+/** Sleeps until the given kuhl_microseconds() time. */
+static void framepace_sleep_until(long wakeTime)
+{
+	long remain = wakeTime - kuhl_microseconds();
+	if(remain > 0)
+		usleep(remain);
+}
+
+/** Should be called right after the buffers are swapped. If pace is
+    set, sleeps until the latest time that we can start the next
+    frame and still expect it to finish before the next vsync.
+
+    @param pace Set to 1 to sleep before the next frame, 0 to only
+    collect statistics (e.g., when the frame rate isn't limited by
+    vsync). Missed vsyncs are only counted when pace is set.
+*/
+void framepace_after_swap(int pace)
+{
+	framepace_frame *f = &(slots[frame % FRAMEPACE_SLOTS]);
+	long postswap = kuhl_microseconds();
+	f->postswap = postswap;
+
+	/* Figure out if we missed a vsync. Without pacing, the frames
+	 * don't necessarily line up with vsync, so a long frame isn't a
+	 * miss. */
+	if(pace && prevPostswap >= 0 && postswap - prevPostswap > vsyncTime*3/2)
+	{
+		f->missed = 1;
+		stats.missed++;
+	}
+	prevPostswap = postswap;
+	stats.frames++;
+
+	if(!f->pending)
+		framepace_finish(f, -1);
+	if(useTimer)
+	{
+		framepace_poll();
+		/* The GPU and CPU clocks can drift apart, recalibrate every
+		 * few seconds. */
+		if(frame % 600 == 599)
+			framepace_calibrate();
+	}
+
+	/* If we missed the vsync, add time to the margin and don't sleep
+	 * for a few frames so that we can catch back up. Otherwise,
+	 * slowly shrink the margin back down to the minimum. */
+	if(f->missed && pace)
+	{
+		margin += vsyncTime/8;
+		if(margin > vsyncTime/2)
+			margin = vsyncTime/2;
+		recoverFrames = 2;
+	}
+	else if(margin > minMargin)
+		margin -= (margin - minMargin + 63) / 64;
+
+	frame++;
+	memset(&current, 0, sizeof(current));
+	current.input = -1;
+	current.margin = margin;
+
+	if(pace && recoverFrames > 0)
+		recoverFrames--;
+	else if(pace && historyCount >= FRAMEPACE_WARMUP)
+	{
+		/* We have until the next vsync to render the next
+		 * frame. Subtract out our prediction of the rendering time
+		 * and the safety margin. */
+		current.predicted = framepace_predict();
+		long wakeTime = postswap + vsyncTime - current.predicted - margin;
+		if(wakeTime > postswap)
+		{
+			framepace_sleep_until(wakeTime);
+			current.sleep = (int) (kuhl_microseconds() - postswap);
+			stats.paced++;
+			stats.sleepUsec += current.sleep;
+		}
+	}
+	current.wake = kuhl_microseconds();
+
+	for(int i=0; i<numCallbacks; i++)
+		callbacks[i].func(callbacks[i].data);
+}
+
+/** Should be called when a program reads input (e.g., tracking data)
+    that will be used to draw the current frame. The input should be
+    read as late as possible---after bufferswap() returns and right
+    before drawing. The first call in each frame is used to estimate
+    the motion-to-photon latency.
+
+    @return The time that the frame is expected to appear on the
+    screen in the same units as kuhl_microseconds().
+*/
+long framepace_sample_input(void)
+{
+	if(!initialized)
+		framepace_init();
+	if(current.input < 0)
+		current.input = kuhl_microseconds();
+	return framepace_predicted_display();
+}
+
+/** Returns the time that the frame currently being rendered is
+ * expected to appear on the screen (the middle of the screen, in the
+ * same units as kuhl_microseconds()). */
+long framepace_predicted_display(void)
+{
+	if(!initialized)
+		framepace_init();
+	/* The next vsync after the previous swap, plus half of the time
+	 * it takes to scan out the frame. */
+	long now = kuhl_microseconds();
+	if(prevPostswap < 0)
+		return now + vsyncTime + vsyncTime/2;
+	long vsync = prevPostswap + vsyncTime;
+	if(vsync < now)
+		vsync += ((now - vsync) / vsyncTime + 1) * vsyncTime;
+	return vsync + vsyncTime/2;
+}
+
+/** Registers a function that is called right after frame pacing
+    finishes sleeping (i.e., right before the next frame is drawn). It
+    can be used to poll input devices as late as possible.
+
+    @param callback The function to call.
+    @param data A pointer passed to the callback.
+*/
+void framepace_add_input_callback(void (*callback)(void *data), void *data)
+{
+	if(numCallbacks >= FRAMEPACE_MAX_CALLBACKS)
+	{
+		msg(MSG_ERROR, "Too many frame pacing input callbacks (maximum %d).", FRAMEPACE_MAX_CALLBACKS);
+		return;
+	}
+	callbacks[numCallbacks].func = callback;
+	callbacks[numCallbacks].data = data;
+	numCallbacks++;
+}
+
+/** Returns the time in microseconds below which the given percent of
+ * the motion-to-photon estimates are. */
+static int framepace_mtp_percentile(float percent)
+{
+	unsigned long target = (unsigned long) (percent/100.0f * stats.mtpFrames);
+	unsigned long count = 0;
+	for(int i=0; i<FRAMEPACE_BUCKETS; i++)
+	{
+		count += stats.mtpHistogram[i];
+		if(count >= target)
+			return (i+1)*FRAMEPACE_BUCKET;
+	}
+	return stats.mtpMax;
+}
+
+/** Prints statistics about frame pacing and motion-to-photon latency. */
+void framepace_print_stats(void)
+{
+	if(stats.frames == 0)
+		return;
+	msg(MSG_INFO, "Frame pacing: %lu frames, %lu missed vsync, slept before %lu frames (%.2f ms/frame), %.2f ms/frame rendering (%lu timed on GPU), margin %.2f ms.",
+	    stats.frames, stats.missed, stats.paced,
+	    stats.paced ? stats.sleepUsec/1000.0/stats.paced : 0.0,
+	    stats.renderFrames ? stats.renderUsec/1000.0/stats.renderFrames : 0.0,
+	    stats.gpuFrames, margin/1000.0);
+	if(stats.mtpFrames > 0)
+		msg(MSG_INFO, "Frame pacing: estimated motion-to-photon latency %.2f ms mean, %.2f ms median, %.2f ms 95th percentile, %.2f ms max (%lu frames).",
+		    stats.mtpUsec/1000.0/stats.mtpFrames,
+		    framepace_mtp_percentile(50)/1000.0,
+		    framepace_mtp_percentile(95)/1000.0,
+		    stats.mtpMax/1000.0, stats.mtpFrames);
+}
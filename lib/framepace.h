@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Frame pacing for latency reduction. After the buffers are swapped,
+    framepace_after_swap() sleeps so that the next frame starts as
+    late as possible while still finishing before the next vsync.
+
+    The time it takes to render a frame is measured from when the
+    frame starts until the GPU finishes drawing it (using GPU
+    timestamp queries, which are read a few frames later so that we
+    never wait for the GPU). The next frame is predicted to take as
+    long as a high percentile of the recent frames rather than the
+    average, so that occasional slow frames don't cause us to miss
+    vsync. When a vsync is missed anyway, the safety margin grows and
+    we skip sleeping for a couple of frames; the margin then shrinks
+    back slowly.
+
+    Programs that read input themselves should do so as late as
+    possible (after bufferswap() returns and right before drawing) and
+    call framepace_sample_input() when they do. It returns the time
+    that the frame is expected to appear on the screen, which can be
+    used to predict where a tracked object will be. viewmat calls it
+    when it reads tracking data. Functions registered with
+    framepace_add_input_callback() are called right after the sleep.
+
+    The time between sampling input and the frame appearing on the
+    screen (motion-to-photon latency) is estimated for each frame and
+    summarized when the program exits.
+
+    Config options:
+    - bufferswap.latencyreduce - Set to 0 to disable frame pacing (default 1).
+    - framepace.percentile - Percentile of recent frame times used to predict the next frame (default 95).
+    - framepace.margin - Minimum safety margin in microseconds (default 500).
+    - framepace.log - If set, write the timing of every frame into this CSV file.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void framepace_before_swap(void);
+void framepace_after_swap(int pace);
+long framepace_sample_input(void);
+long framepace_predicted_display(void);
+void framepace_add_input_callback(void (*callback)(void *data), void *data);
+void framepace_print_stats(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -7,10 +7,12 @@
  * @author Scott Kuhl
  */
 #include "windows-compat.h"
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
 #include "kuhl-nodep.h"
+#include "msg.h"
 #include "kalman.h"
 #include "vecmat.h"
 
@@ -70,9 +72,10 @@ float kalman_estimate(kalman_state * state, float measured, long measured_time)
 	*/
 	double q[9];
 	{
-		double row1[3] = { pow(dt,5)/20, pow(dt,4)/8, pow(dt,3)/6 };
-		double row2[3] = { pow(dt,4)/8, pow(dt,3)/3, pow(dt,2)/2 };
-		double row3[3] = { pow(dt,3)/6, pow(dt,2)/2, dt };
+		double dt2 = dt*dt, dt3 = dt2*dt, dt4 = dt3*dt, dt5 = dt4*dt;
+		double row1[3] = { dt5/20, dt4/8, dt3/6 };
+		double row2[3] = { dt4/8, dt3/3, dt2/2 };
+		double row3[3] = { dt3/6, dt2/2, dt };
 		mat3d_setRow(q, row1, 0);
 		mat3d_setRow(q, row2, 1);
 		mat3d_setRow(q, row3, 2);
@@ -202,3 +205,231 @@ void kalman_initialize(kalman_state * state, float sigma_meas, float qScale)
 	// Converts our state into the set of variables we are measuring.
 	vec3d_set(state->h, 1,0,0);
 }
+
+
+/** Initializes a kalman_multi_state struct. Each channel starts in the
+   same state that kalman_initialize() would put it in.
+
+   @param state A pointer to a kalman_multi_state struct which should be initialized.
+
+   @param channels The number of channels to filter (at most KALMAN_MULTI_MAX).
+
+   @param sigma_meas An array of 'channels' values containing the
+   standard deviation of the measurement noise of each channel.
+
+   @param qScale A value near 0 indicates high confidence in our
+   model. See kalman_initialize().
+*/
+void kalman_multi_initialize(kalman_multi_state *state, int channels, const float sigma_meas[], float qScale)
+{
+	if(channels < 1 || channels > KALMAN_MULTI_MAX)
+	{
+		msg(MSG_FATAL, "kalman_multi_initialize(): Can't filter %d channels (must be 1 to %d).\n", channels, KALMAN_MULTI_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(state, 0, sizeof(kalman_multi_state));
+	state->isEnabled = 1;
+	state->predictOnly = 0;
+	state->channels = channels;
+	state->time_prev = -1;
+	state->qScale = qScale;
+	state->dt = -1; // Q hasn't been computed yet
+
+	/* Unused channels are filtered too (and the results are ignored),
+	 * so give them sensible values. */
+	for(int c=0; c<KALMAN_MULTI_MAX; c++)
+	{
+		float sigma = sigma_meas[c < channels ? c : 0];
+		state->r[c] = sigma * sigma;
+		state->p[0][c] = 1; // P = identity * sigma_model
+		state->p[3][c] = 1;
+		state->p[5][c] = 1;
+	}
+}
+
+/** Given a kalman_multi_state and a new measurement of every channel,
+ * replaces each measurement with a filtered value. This produces the
+ * same results as calling kalman_estimate() on each channel but
+ * computes the timestep, A, and Q only once. Since H only selects the
+ * position, the matrix multiplies in kalman_estimate() are written
+ * out here and only the terms that can be nonzero are computed.
+ *
+ * @param state A kalman_multi_state struct initialized by kalman_multi_initialize()
+ *
+ * @param values An array with one unfiltered measurement per
+ * channel. The filtered values are written back into this array.
+ *
+ * @param measured_time The time that the values were recorded in
+ * microseconds. If -1, we will use the current time.
+ */
+void kalman_multi_estimate(kalman_multi_state *state, double values[], long measured_time)
+{
+	if(state->isEnabled == 0)
+		return;
+
+	if(measured_time == -1)
+		measured_time = kuhl_microseconds();
+	if(state->time_prev == -1)
+		state->time_prev = measured_time-1;
+	double dt = (measured_time - state->time_prev)/1000000.0;
+	double h = .5*dt*dt;
+
+	/* Trackers usually send records at a fixed rate, so Q rarely needs
+	 * to be recomputed. See kalman_estimate() for where Q comes from. */
+	if(dt != state->dt)
+	{
+		double dt2 = dt*dt, dt3 = dt2*dt, dt4 = dt3*dt, dt5 = dt4*dt;
+		double qs = state->qScale;
+		state->q[0] = qs*dt5/20; state->q[1] = qs*dt4/8;  state->q[2] = qs*dt3/6;
+		                         state->q[3] = qs*dt3/3;  state->q[4] = qs*dt2/2;
+		                                                  state->q[5] = qs*dt;
+		state->dt = dt;
+	}
+	const double q00 = state->q[0], q01 = state->q[1], q02 = state->q[2];
+	const double q11 = state->q[3], q12 = state->q[4], q22 = state->q[5];
+
+	double z[KALMAN_MULTI_MAX];
+	for(int c=0; c<KALMAN_MULTI_MAX; c++)
+		z[c] = c < state->channels ? values[c] : 0;
+
+	double *x0 = state->x[0], *x1 = state->x[1], *x2 = state->x[2];
+	double *p00 = state->p[0], *p01 = state->p[1], *p02 = state->p[2];
+	double *p11 = state->p[3], *p12 = state->p[4], *p22 = state->p[5];
+
+	if(state->predictOnly)
+	{
+		for(int c=0; c<state->channels; c++)
+			values[c] = x0[c] + dt*x1[c] + h*x2[c];
+		return;
+	}
+
+	/* Every channel is independent, so the compiler can vectorize this
+	 * loop. It always runs over KALMAN_MULTI_MAX channels so that the
+	 * loop has a fixed length. */
+	for(int c=0; c<KALMAN_MULTI_MAX; c++)
+	{
+		// === PREDICTION ===
+		// xk_minus = A * xk_prev
+		double xm0 = x0[c] + dt*x1[c] + h*x2[c];
+		double xm1 = x1[c] + dt*x2[c];
+		double xm2 = x2[c];
+
+		// Pminus = A * P * A^T + Q
+		double b00 = p00[c] + dt*p01[c] + h*p02[c]; // A*P
+		double b01 = p01[c] + dt*p11[c] + h*p12[c];
+		double b02 = p02[c] + dt*p12[c] + h*p22[c];
+		double b11 = p11[c] + dt*p12[c];
+		double b12 = p12[c] + dt*p22[c];
+		double m00 = b00 + dt*b01 + h*b02 + q00;    // (A*P)*A^T + Q
+		double m01 = b01 + dt*b02 + q01;
+		double m02 = b02 + q02;
+		double m11 = b11 + dt*b12 + q11;
+		double m12 = b12 + q12;
+		double m22 = p22[c] + q22;
+
+		// === MEASUREMENT UPDATE or CORRECTION ===
+		// K = Pminus * H^T * (H * Pminus * H^T + R)^-1
+		double inv_s = 1/(m00 + state->r[c]);
+		double k0 = m00*inv_s, k1 = m01*inv_s, k2 = m02*inv_s;
+
+		// x = x + K * ( obs - H * x )
+		double paren = z[c] - xm0;
+		x0[c] = xm0 + k0*paren;
+		x1[c] = xm1 + k1*paren;
+		x2[c] = xm2 + k2*paren;
+
+		// P = P - (K * H) * P
+		p00[c] = m00 - k0*m00;
+		p01[c] = m01 - k0*m01;
+		p02[c] = m02 - k0*m02;
+		p11[c] = m11 - k1*m01;
+		p12[c] = m12 - k1*m02;
+		p22[c] = m22 - k2*m02;
+	}
+
+	state->time_prev = measured_time;
+	for(int c=0; c<state->channels; c++)
+		values[c] = x0[c];
+}
+
+
+/** Initializes a kalman_quat_state struct.
+
+   @param state A pointer to a kalman_quat_state struct which should be initialized.
+
+   @param sigma_meas Standard deviation of the measurement noise in
+   radians. (A small rotation by angle a changes the x, y, and z
+   components of a quaternion by about a/2.)
+
+   @param qScale A value near 0 indicates high confidence in our
+   model. See kalman_initialize().
+*/
+void kalman_quat_initialize(kalman_quat_state *state, float sigma_meas, float qScale)
+{
+	float sigma[3] = { sigma_meas, sigma_meas, sigma_meas };
+	kalman_multi_initialize(&(state->rot), 3, sigma, qScale);
+	state->isEnabled = 1;
+	state->hasQuat = 0;
+	vec4d_set(state->quat, 0, 0, 0, 1);
+}
+
+/** Given a kalman_quat_state and a new orientation, replace the
+ * orientation with a filtered orientation. The filtered orientation
+ * is always unit length and it does not matter if the tracking system
+ * sometimes sends q and other times sends -q for the same orientation.
+ *
+ * @param state A kalman_quat_state struct initialized by kalman_quat_initialize()
+ *
+ * @param quat The newest, unfiltered orientation (x,y,z,w). It is
+ * replaced with the filtered orientation.
+ *
+ * @param measured_time The time that 'quat' was recorded in
+ * microseconds. If -1, we will use the current time.
+ */
+void kalman_quat_estimate(kalman_quat_state *state, double quat[4], long measured_time)
+{
+	if(state->isEnabled == 0)
+		return;
+
+	double measured[4];
+	quatd_normalize_new(measured, quat);
+
+	/* The first measurement becomes our estimate. */
+	if(state->hasQuat == 0)
+	{
+		vec4d_copy(state->quat, measured);
+		state->rot.time_prev = measured_time == -1 ? kuhl_microseconds() : measured_time;
+		state->hasQuat = 1;
+		vec4d_copy(quat, measured);
+		return;
+	}
+
+	/* Find the rotation from our estimate to the measurement:
+	 * delta = conjugate(estimate) * measured. Since q and -q are the
+	 * same orientation, use the one that is the shorter rotation. */
+	double conj[4] = { -state->quat[0], -state->quat[1], -state->quat[2], state->quat[3] };
+	double delta[4];
+	quatd_mult_quatd_new(delta, conj, measured);
+	double rotvec[3];
+	quatd_to_rotvec(rotvec, delta);
+
+	kalman_multi_estimate(&(state->rot), rotvec, measured_time);
+
+	/* Rotate our estimate by the filtered rotation vector. */
+	double step[4];
+	quatd_from_rotvec(step, rotvec);
+	double result[4];
+	quatd_mult_quatd_new(result, state->quat, step);
+	quatd_normalize(result);
+	vec4d_copy(quat, result);
+	if(state->rot.predictOnly)
+		return;
+
+	/* The estimate now includes the filtered rotation, so the filter
+	 * continues from no rotation away from the estimate (but keeps the
+	 * angular velocity and acceleration). */
+	vec4d_copy(state->quat, result);
+	for(int i=0; i<3; i++)
+		state->rot.x[0][i] = 0;
+}
@@ -30,6 +30,54 @@ typedef struct {
 void kalman_initialize(kalman_state * state, float sigma_meas, float qScale);
 float kalman_estimate(kalman_state * state, float measured, long measured_time);
 
+
+/** Maximum number of channels in a kalman_multi_state. */
+#define KALMAN_MULTI_MAX 8
+
+/** Filters several 1D channels that are measured at the same time
+ * (e.g., the x, y, and z position of a tracked object or the
+ * positions of several objects from the same tracker frame) using the
+ * same model as kalman_estimate(). All channels share one transition
+ * matrix (A) and one process noise matrix (Q) since they share the
+ * same timestep. The per-channel state is stored as arrays of
+ * KALMAN_MULTI_MAX values (structure of arrays) so that the compiler
+ * can update every channel at once with SIMD instructions. */
+typedef struct {
+	int isEnabled;   /**< If set to 0, disable kalman filter */
+	int predictOnly; /**< If 1, return the predicted value without updating the filter */
+	int channels;    /**< Number of channels being filtered */
+	long time_prev;  /**< Time of previous measurement in microseconds */
+
+	double qScale;   /**< Scaling factor for Q matrix (system error) */
+	double dt;       /**< Timestep (seconds) that q was computed for */
+	double q[6];     /**< Q for dt: q00, q01, q02, q11, q12, q22 */
+
+	double x[3][KALMAN_MULTI_MAX]; /**< Filtered position, velocity, and acceleration of each channel */
+	double p[6][KALMAN_MULTI_MAX]; /**< Estimated error of each channel: p00, p01, p02, p11, p12, p22 (P is symmetric) */
+	double r[KALMAN_MULTI_MAX];    /**< Variance of measurement error of each channel */
+} kalman_multi_state;
+
+void kalman_multi_initialize(kalman_multi_state *state, int channels, const float sigma_meas[], float qScale);
+void kalman_multi_estimate(kalman_multi_state *state, double values[], long measured_time);
+
+
+/** Filters an orientation. Filtering each component of a quaternion
+ * separately ignores that q and -q are the same orientation and
+ * produces quaternions that are not unit length. Instead, this filter
+ * measures how far each new orientation is rotated away from the
+ * current estimate (as a rotation vector), filters the three
+ * components of that rotation vector with a kalman_multi_state, and
+ * rotates the estimate by the filtered amount. */
+typedef struct {
+	int isEnabled;          /**< If set to 0, disable kalman filter */
+	int hasQuat;            /**< Set to 1 once quat contains an estimate */
+	double quat[4];         /**< Filtered orientation (x,y,z,w) */
+	kalman_multi_state rot; /**< Filtered rotation away from quat, and angular velocity and acceleration */
+} kalman_quat_state;
+
+void kalman_quat_initialize(kalman_quat_state *state, float sigma_meas, float qScale);
+void kalman_quat_estimate(kalman_quat_state *state, double quat[4], long measured_time);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
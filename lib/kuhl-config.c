@@ -21,12 +21,79 @@
 
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "kuhl-util.h"
 #include "cfg_parse.h"
 
 static struct cfg_struct *cfg = NULL;
 static char *cfg_filename = NULL;  /*< Filename that holds the configuration */
 
+/* Every key that has been looked up is stored in a hash table along
+ * with its value already parsed into each type. Later lookups of the
+ * same key don't need to search the config file or parse the value
+ * again. Entries are never freed or moved, so a pointer to an entry
+ * (a kuhl_config_handle) stays valid for the life of the program.
+ *
+ * Settings can be looked up from any thread: Loading the file and
+ * adding entries to the table is done while holding configMutex. An
+ * entry's value is only changed after kuhl_config_filename() selects
+ * a different file, which should be done on the main thread before
+ * other threads start. */
+struct kuhl_config_entry
+{
+	char *key;               /**< Key exactly as the caller provided it */
+	unsigned int hash;       /**< Hash of key */
+	unsigned int generation; /**< Value of configGeneration when the value was read */
+	const char *value;       /**< The value, NULL if it is missing or the empty string */
+	int booleanValue;        /**< 1 for true, 0 for false, -1 if the value isn't a boolean */
+	int hasInt;              /**< Set if the value could be parsed as an int */
+	int intValue;
+	int hasFloat;            /**< Set if the value could be parsed as a float */
+	float floatValue;
+	struct kuhl_config_entry *next; /**< Next entry in the same bucket */
+};
+
+static struct kuhl_config_entry **table = NULL;
+static unsigned int tableCapacity = 0; /**< Number of buckets (a power of 2) */
+static unsigned int tableSize = 0;     /**< Number of entries */
+/** Incremented when a different config file is selected so that the
+ * entries know to read their values again. */
+static unsigned int configGeneration = 1;
+
+#ifdef HAVE_PTHREADS
+/** Protects cfg, cfg_filename and the table. It is recursive because
+ * loading the file prints messages, and msg() reads settings the
+ * first time that it is called. */
+static pthread_mutex_t configMutex;
+static pthread_once_t configMutexOnce = PTHREAD_ONCE_INIT;
+
+static void kuhl_config_mutex_init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&configMutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+static void kuhl_config_lock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_once(&configMutexOnce, kuhl_config_mutex_init);
+	pthread_mutex_lock(&configMutex);
+#endif
+}
+
+static void kuhl_config_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&configMutex);
+#endif
+}
+
 /** Set the configuration file to be used. If another configuration
     file is already loaded, it will be unloaded and the new file will
     later be loaded when a key is requested.
@@ -37,9 +104,13 @@ static char *cfg_filename = NULL;  /*< Filename that holds the configuration */
  */
 void kuhl_config_filename(const char *filename)
 {
+	kuhl_config_lock();
 	// If the user sets the filename to the file we are already using.
 	if(cfg_filename != NULL && filename != NULL && strcmp(cfg_filename, filename) == 0)
+	{
+		kuhl_config_unlock();
 		return;
+	}
 
 	// Unload any settings we have already loaded.
 	if(cfg != NULL)
@@ -47,6 +118,7 @@ void kuhl_config_filename(const char *filename)
 		cfg_free(cfg);
 		cfg = NULL;
 	}
+	configGeneration++;
 
 	if(cfg_filename != NULL)
 		msg(MSG_WARNING, "We have already loaded config file '%s' but we are now switching to file '%s'. This can happen when the program requests a configuration value and then kuhl_config_filename is called.", cfg_filename, filename);
@@ -54,62 +126,191 @@ void kuhl_config_filename(const char *filename)
 	if(cfg_filename)
 		free(cfg_filename);
 	cfg_filename = strdup(filename);
+	kuhl_config_unlock();
 }
 
-
-/** Gets the value for a given key in the config file.
-
-    @param key The key to look up in the config file.
-
-    @return The value of the key as a string. If the key is missing,
-    or if the key is present but its value is the empty string, return
-    NULL.
-*/
-const char* kuhl_config_get(const char *key)
+/* Loads the config file (and any files that it includes). */
+static void kuhl_config_load(void)
 {
-	if(cfg == NULL)
+	int using_defaultFile = 0;
+	if(cfg_filename == NULL)
+	{
+		cfg_filename = strdup("settings.ini");
+		using_defaultFile = 1;
+	}
+	cfg = cfg_init();
+	char *filename = kuhl_find_file(cfg_filename);
+	if(cfg_load(cfg, filename, 1) == EXIT_FAILURE)
+	{
+		if(using_defaultFile)
+			msg(MSG_DEBUG, "Can't read/find default config file: %s\n", filename);
+		else
+			msg(MSG_ERROR, "Failed to read user-specified config file: %s\n", filename);
+	}
+	else
+		msg(MSG_DEBUG, "Using settings file at: %s\n", filename);
+	free(filename);
+
+	while(cfg_get(cfg, "include") != NULL)
 	{
-		int using_defaultFile = 0;
-		if(cfg_filename == NULL)
+		const char *include = cfg_get(cfg, "include");
+		filename = kuhl_find_file(include);
+		cfg_delete(cfg, "include");
+		if(kuhl_can_read_file(filename))
 		{
-			cfg_filename = "settings.ini";
-			using_defaultFile = 1;
+			msg(MSG_DEBUG, "Config file '%s' included '%s'.", cfg_filename, filename);
+			cfg_load(cfg, filename, 0); // don't overwrite
 		}
-		cfg = cfg_init();
-		char *filename = kuhl_find_file(cfg_filename);
-		if(cfg_load(cfg, filename, 1) == EXIT_FAILURE)
+		else
 		{
-			if(using_defaultFile)
-				msg(MSG_DEBUG, "Can't read/find default config file: %s\n", filename);
-			else
-				msg(MSG_ERROR, "Failed to read user-specified config file: %s\n", filename);
+			msg(MSG_ERROR, "Config file '%s' included '%s', but it doesn't exist or isn't readable.", cfg_filename, filename);
 		}
-		else
-			msg(MSG_DEBUG, "Using settings file at: %s\n", filename);
 		free(filename);
+	}
+}
+
+/* Reads the value of an entry from the config file and parses
+ * it. Must be called while holding configMutex. */
+static void kuhl_config_read_entry(struct kuhl_config_entry *e)
+{
+	if(cfg == NULL)
+		kuhl_config_load();
+
+	const char *value = cfg_get(cfg, e->key);
+	if(value != NULL && strlen(value) == 0)
+		value = NULL;
+	e->value = value;
+
+	e->booleanValue = -1;
+	e->hasInt = 0;
+	e->hasFloat = 0;
+	if(value != NULL)
+	{
+		if(strcasecmp(value, "true") == 0 ||
+		   strcasecmp(value, "yes") == 0 ||
+		   strcasecmp(value, "y") == 0 ||
+		   strcasecmp(value, "t") == 0 ||
+		   strcmp(value, "1") == 0)
+			e->booleanValue = 1;
+		else if(strcasecmp(value, "false") == 0 ||
+		        strcasecmp(value, "no") == 0 ||
+		        strcasecmp(value, "n") == 0 ||
+		        strcasecmp(value, "f") == 0 ||
+		        strcmp(value, "0") == 0)
+			e->booleanValue = 0;
+		e->hasInt = sscanf(value, "%d", &e->intValue) == 1;
+		e->hasFloat = sscanf(value, "%f", &e->floatValue) == 1;
+	}
+
+	/* Threads that don't hold the lock check the generation before
+	 * they use the other fields (see kuhl_config_refresh()). */
+	__atomic_store_n(&(e->generation), configGeneration, __ATOMIC_RELEASE);
+}
+
+/* Reads the value of an entry again if a different config file was
+ * selected since it was read. */
+static void kuhl_config_refresh(struct kuhl_config_entry *e)
+{
+	if(__atomic_load_n(&(e->generation), __ATOMIC_ACQUIRE) == configGeneration)
+		return;
+	kuhl_config_lock();
+	if(e->generation != configGeneration)
+		kuhl_config_read_entry(e);
+	kuhl_config_unlock();
+}
+
+/* FNV-1a hash of a string. */
+static unsigned int kuhl_config_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) key; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-		while(cfg_get(cfg, "include") != NULL)
+/* Finds the entry for a key, adding it to the table if this is the
+ * first time the key has been requested. Must be called while holding
+ * configMutex. */
+static struct kuhl_config_entry* kuhl_config_find(const char *key)
+{
+	unsigned int hash = kuhl_config_hash(key);
+	if(tableCapacity > 0)
+	{
+		for(struct kuhl_config_entry *e = table[hash & (tableCapacity-1)]; e != NULL; e = e->next)
 		{
-			const char *include = cfg_get(cfg, "include");
-			filename = kuhl_find_file(include);
-			cfg_delete(cfg, "include");
-			if(kuhl_can_read_file(filename))
+			if(e->hash == hash && strcmp(e->key, key) == 0)
 			{
-				msg(MSG_DEBUG, "Config file '%s' included '%s'.", cfg_filename, filename);
-				cfg_load(cfg, filename, 0); // don't overwrite
+				if(e->generation != configGeneration)
+					kuhl_config_read_entry(e);
+				return e;
 			}
-			else
+		}
+	}
+
+	struct kuhl_config_entry *e = kuhl_malloc(sizeof(struct kuhl_config_entry));
+	memset(e, 0, sizeof(struct kuhl_config_entry));
+	e->key = strdup(key);
+	e->hash = hash;
+	/* Loading the config file can print messages, which can look up
+	 * other keys. So, read the value before we modify the table. */
+	kuhl_config_read_entry(e);
+
+	if((tableSize+1)*2 > tableCapacity)
+	{
+		unsigned int newCapacity = tableCapacity ? tableCapacity*2 : 64;
+		struct kuhl_config_entry **newTable = calloc(newCapacity, sizeof(struct kuhl_config_entry*));
+		if(newTable == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate config table with %u entries.", newCapacity);
+			exit(EXIT_FAILURE);
+		}
+		for(unsigned int i=0; i<tableCapacity; i++)
+		{
+			struct kuhl_config_entry *old = table[i];
+			while(old != NULL)
 			{
-				msg(MSG_ERROR, "Config file '%s' included '%s', but it doesn't exist or isn't readable.", cfg_filename, filename);
+				struct kuhl_config_entry *next = old->next;
+				old->next = newTable[old->hash & (newCapacity-1)];
+				newTable[old->hash & (newCapacity-1)] = old;
+				old = next;
 			}
-			free(filename);
 		}
+		free(table);
+		table = newTable;
+		tableCapacity = newCapacity;
 	}
+	e->next = table[hash & (tableCapacity-1)];
+	table[hash & (tableCapacity-1)] = e;
+	tableSize++;
+	return e;
+}
 
-	const char *value = cfg_get(cfg, key);
-	if(value != NULL && strlen(value) == 0)
-		value = NULL;
-	return value;
+/* Like kuhl_config_find() but can be called from any thread. */
+static struct kuhl_config_entry* kuhl_config_lookup(const char *key)
+{
+	kuhl_config_lock();
+	struct kuhl_config_entry *e = kuhl_config_find(key);
+	kuhl_config_unlock();
+	return e;
+}
+
+
+/** Gets the value for a given key in the config file.
+
+    @param key The key to look up in the config file.
+
+    @return The value of the key as a string. If the key is missing,
+    or if the key is present but its value is the empty string, return
+    NULL.
+*/
+const char* kuhl_config_get(const char *key)
+{
+	if(key == NULL)
+		return NULL;
+	return kuhl_config_lookup(key)->value;
 }
 
 /** Checks if a key is set to a value in the config file.
@@ -119,7 +320,7 @@ const char* kuhl_config_get(const char *key)
     empty string. */
 int kuhl_config_isset(const char *key)
 {
-	return (kuhl_config_get(key) == NULL);
+	return (kuhl_config_get(key) != NULL);
 }
 
 /** Returns 1 if the key is set to true in the config file. Returns 0
@@ -128,49 +329,86 @@ int kuhl_config_isset(const char *key)
  * non-boolean value. */
 int kuhl_config_boolean(const char *key, int returnWhenMissing, int returnInvalidValue)
 {
-	const char *value = kuhl_config_get(key);
-	if(value == NULL)
+	if(key == NULL)
 		return returnWhenMissing;
-	else if(strcasecmp(value, "true") == 0 ||
-	   strcasecmp(value, "yes") == 0 ||
-	   strcasecmp(value, "y") == 0 ||
-	   strcasecmp(value, "t") == 0 ||
-	   strcmp(value, "1") == 0)
-		return 1;
-	else if(strcasecmp(value, "false") == 0 ||
-	        strcasecmp(value, "no") == 0 ||
-	        strcasecmp(value, "n") == 0 ||
-	        strcasecmp(value, "f") == 0 ||
-	        strcmp(value, "0") == 0)
-		return 0;
-	else
-		return returnInvalidValue;
+	return kuhl_config_handle_boolean(kuhl_config_lookup(key), returnWhenMissing, returnInvalidValue);
 }
 
 /** Reads a floating point number from the config file. Returns returnWhenMissing if the key is missing. Returns returnInvalidValue if they key is set to a non-floating point number. */
 float kuhl_config_float(const char *key, float returnWhenMissing, float returnInvalidValue)
 {
-	const char *value = kuhl_config_get(key);
-	if(value == NULL)
+	if(key == NULL)
 		return returnWhenMissing;
-
-	float f;
-	if(sscanf(value, "%f", &f) == 1)
-		return f;
-	else
-		return returnInvalidValue;
+	return kuhl_config_handle_float(kuhl_config_lookup(key), returnWhenMissing, returnInvalidValue);
 }
 
 /** Reads a floating point number from the config file. Returns returnWhenMissing if the key is missing. Returns returnInvalidValue if they key is set to a non-integer. */
 int kuhl_config_int(const char *key, int returnWhenMissing, int returnInvalidValue)
 {
-	const char *value = kuhl_config_get(key);
-	if(value == NULL)
+	if(key == NULL)
 		return returnWhenMissing;
+	return kuhl_config_handle_int(kuhl_config_lookup(key), returnWhenMissing, returnInvalidValue);
+}
 
-	int i;
-	if(sscanf(value, "%d", &i) == 1)
-		return i;
-	else
+
+/** Gets a handle for a key in the config file. Reading a setting
+ * through a handle doesn't require looking up the key or parsing the
+ * value, so code that runs every frame should get a handle once (for
+ * example, in a static variable) and then use the
+ * kuhl_config_handle_*() functions.
+
+    @code
+    static kuhl_config_handle latencyReduce = NULL;
+    if(latencyReduce == NULL)
+        latencyReduce = kuhl_config_handle_get("bufferswap.latencyreduce");
+    if(kuhl_config_handle_boolean(latencyReduce, 1, 1))
+        ...
+    @endcode
+
+    @param key The key to look up in the config file.
+
+    @return A handle which remains valid for the life of the program,
+    even if kuhl_config_filename() switches to a different file.
+ */
+kuhl_config_handle kuhl_config_handle_get(const char *key)
+{
+	if(key == NULL)
+		key = "";
+	return kuhl_config_lookup(key);
+}
+
+/** Like kuhl_config_get() but uses a handle from kuhl_config_handle_get(). */
+const char* kuhl_config_handle_string(kuhl_config_handle handle)
+{
+	kuhl_config_refresh(handle);
+	return handle->value;
+}
+
+/** Like kuhl_config_boolean() but uses a handle from kuhl_config_handle_get(). */
+int kuhl_config_handle_boolean(kuhl_config_handle handle, int returnWhenMissing, int returnInvalidValue)
+{
+	kuhl_config_refresh(handle);
+	if(handle->value == NULL)
+		return returnWhenMissing;
+	if(handle->booleanValue < 0)
 		return returnInvalidValue;
+	return handle->booleanValue;
+}
+
+/** Like kuhl_config_float() but uses a handle from kuhl_config_handle_get(). */
+float kuhl_config_handle_float(kuhl_config_handle handle, float returnWhenMissing, float returnInvalidValue)
+{
+	kuhl_config_refresh(handle);
+	if(handle->value == NULL)
+		return returnWhenMissing;
+	return handle->hasFloat ? handle->floatValue : returnInvalidValue;
+}
+
+/** Like kuhl_config_int() but uses a handle from kuhl_config_handle_get(). */
+int kuhl_config_handle_int(kuhl_config_handle handle, int returnWhenMissing, int returnInvalidValue)
+{
+	kuhl_config_refresh(handle);
+	if(handle->value == NULL)
+		return returnWhenMissing;
+	return handle->hasInt ? handle->intValue : returnInvalidValue;
 }
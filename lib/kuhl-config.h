@@ -18,12 +18,22 @@ extern "C" {
 #endif
 
 
+/** A handle to a setting in the config file. See
+ * kuhl_config_handle_get(). */
+typedef struct kuhl_config_entry* kuhl_config_handle;
+
 void kuhl_config_filename(const char *filename);
 const char* kuhl_config_get(const char *key);
 int kuhl_config_isset(const char *key);
 int kuhl_config_boolean(const char *key, int returnWhenMissing, int returnInvalidValue);
 float kuhl_config_float(const char *key, float returnWhenMissing, float returnInvalidValue);
 int kuhl_config_int(const char *key, int returnWhenMissing, int returnInvalidValue);
+
+kuhl_config_handle kuhl_config_handle_get(const char *key);
+const char* kuhl_config_handle_string(kuhl_config_handle handle);
+int kuhl_config_handle_boolean(kuhl_config_handle handle, int returnWhenMissing, int returnInvalidValue);
+float kuhl_config_handle_float(kuhl_config_handle handle, float returnWhenMissing, float returnInvalidValue);
+int kuhl_config_handle_int(kuhl_config_handle handle, int returnWhenMissing, int returnInvalidValue);
 	
 #ifdef __cplusplus
 }
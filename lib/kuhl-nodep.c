@@ -20,6 +20,7 @@
 #include <time.h>
 #include <sys/types.h>
 #include <ctype.h> // isspace()
+#include <errno.h>
 
 #ifndef _WIN32   // Linux, Mac
 #include <sys/time.h>
@@ -339,6 +340,11 @@ char* kuhl_text_read(const char *filename)
  * value. (2) Allows you to test to see how your program might run if
  * it were running on hardware with a lower frame rate.
  *
+ * The frames are spaced exactly 1/fps seconds apart (see
+ * kuhl_periodic_wait()). If a frame takes too long, the frames that
+ * we missed are skipped instead of being rendered as quickly as
+ * possible to catch up.
+ *
  * kuhl_limitfps() does not reduce tearing. Use glfwSwapInterval() to
  * change how tearing is handled.
  *
@@ -348,77 +354,186 @@ char* kuhl_text_read(const char *filename)
  */
 void kuhl_limitfps(int fps)
 {
-#ifndef _WIN32   // TODO, implement for windows!
+	static kuhl_periodic limitfps_timer;
+	static int limitfps_fps = 0;
 
-	/** The time at which kuhl_limitfps() was last called. */
-	static struct timeval limitfps_last = { .tv_sec = 0,.tv_usec = 0 };
+	if(fps <= 0)
+		return;
+	if(fps != limitfps_fps)
+	{
+		kuhl_periodic_init(&limitfps_timer, fps, 0);
+		limitfps_fps = fps;
+	}
+	kuhl_periodic_wait(&limitfps_timer);
+}
 
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+/** Returns the current time in nanoseconds from a monotonic clock. The
+ * clock isn't related to the time of day and never goes backwards
+ * (e.g., when the system time is changed by NTP), so it should be used
+ * for measuring elapsed time. 1 second = 1,000,000,000 nanoseconds. */
+int64_t kuhl_nanoseconds(void)
+{
+#if _WIN32
+	static LARGE_INTEGER freq = { .QuadPart = 0 };
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	// Split into seconds and the remainder so we don't overflow.
+	return (int64_t) (now.QuadPart / freq.QuadPart) * 1000000000LL +
+		(int64_t) (now.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/* How long before a deadline kuhl_sleep_until() stops sleeping and
+ * starts checking the clock in a loop. The operating system can
+ * oversleep by about this much. Sleep() on Windows is much coarser. */
+#ifdef _WIN32
+#define KUHL_SLEEP_SPIN_NS 2000000LL
+#else
+#define KUHL_SLEEP_SPIN_NS 100000LL
+#endif
 
-	if(limitfps_last.tv_usec == 0 && limitfps_last.tv_sec == 0)
+/** Sleeps until the given kuhl_nanoseconds() time. Most of the time is
+    spent sleeping. To avoid oversleeping, the last fraction of a
+    millisecond is spent checking the clock in a loop. Returns
+    immediately if the time has already passed.
+
+    @param deadline The kuhl_nanoseconds() time to wake up at.
+*/
+void kuhl_sleep_until(int64_t deadline)
+{
+	int64_t sleepUntil = deadline - KUHL_SLEEP_SPIN_NS;
+	int64_t now = kuhl_nanoseconds();
+	if(sleepUntil > now)
 	{
-		limitfps_last.tv_usec = tv.tv_usec;
-		limitfps_last.tv_sec  = tv.tv_sec;
-		return;
+#if defined(_WIN32)
+		Sleep((DWORD) ((sleepUntil - now) / 1000000));
+#elif defined(__APPLE__)
+		/* macOS lacks clock_nanosleep(). */
+		struct timespec ts;
+		ts.tv_sec = (sleepUntil - now) / 1000000000LL;
+		ts.tv_nsec = (sleepUntil - now) % 1000000000LL;
+		while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+#else
+		/* Sleeping until an absolute time doesn't drift if we are
+		 * interrupted by a signal and have to sleep again. */
+		struct timespec ts;
+		ts.tv_sec = sleepUntil / 1000000000LL;
+		ts.tv_nsec = sleepUntil % 1000000000LL;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+#endif
 	}
-	
-	// How many microseconds have elapsed since previous call to limitfps() was completed? */
-	suseconds_t elapsed_micro = (tv.tv_sec - limitfps_last.tv_sec)*1000000L + (tv.tv_usec - limitfps_last.tv_usec);
-	// printf("elapsed_micro %ld\n", elapsed_micro);
-	
-	// How many microseconds should elapse per frame?
-	float microspf = 1.0/fps * 1000000;
-	// printf("microsec per frame %f\n", microspf);
 
-	// How many microseconds do we have to kill? 
-	suseconds_t microsec_sleep = (suseconds_t)microspf - elapsed_micro;
-	if(microsec_sleep > 0)
+	while(kuhl_nanoseconds() < deadline)
+		;
+}
+
+/** Initializes a timer which wakes up periodically.
+
+    @param timer The timer to initialize.
+
+    @param hz The number of times per second that kuhl_periodic_wait()
+    should return.
+
+    @param catchUp If 1 and we fall behind, kuhl_periodic_wait()
+    returns immediately until we are caught back up (i.e., the number
+    of ticks always matches the elapsed time; useful when each tick
+    records or plays back a sample). If 0, the missed ticks are
+    skipped.
+*/
+void kuhl_periodic_init(kuhl_periodic *timer, double hz, int catchUp)
+{
+	memset(timer, 0, sizeof(kuhl_periodic));
+	timer->period = (int64_t) (1000000000.0 / hz + .5);
+	timer->catchUp = catchUp;
+}
+
+/** Sleeps until the next tick of a periodic timer. The ticks are
+    scheduled at fixed times from the first call (instead of a fixed
+    time after the previous call returned), so the timer doesn't drift
+    even if the work done between ticks varies. The first call returns
+    immediately.
+
+    @param timer A timer initialized with kuhl_periodic_init().
+
+    @return The number of ticks that were skipped because we fell
+    behind (always 0 if catchUp is set).
+*/
+int kuhl_periodic_wait(kuhl_periodic *timer)
+{
+	int64_t now = kuhl_nanoseconds();
+	if(timer->ticks == 0)
+	{
+		timer->next = now + timer->period;
+		timer->ticks = 1;
+		return 0;
+	}
+
+	int skipped = 0;
+	if(now >= timer->next)
 	{
-		/* Just calling usleep() works OK on some machines, but on
-		   others we sleep for too long. usleep() only guarantees that
-		   we will sleep at least as long as we request. It seemed to
-		   be a particular problem when we are trying to limit to
-		   100fps and on a macOS laptop. */
-		//usleep(microsec_sleep);
-
-		long first = kuhl_microseconds();
-		int loop = 1;
-		while(loop)
+		/* We are late for this tick. If we missed more ticks after
+		 * it, skip them. Don't try to catch up on more than a second
+		 * of ticks. */
+		timer->late++;
+		int64_t behind = (now - timer->next) / timer->period;
+		if(behind > 0 && (!timer->catchUp || behind * timer->period > 1000000000LL))
 		{
-			// How much more do we need to sleep?
-			long remain = microsec_sleep - (kuhl_microseconds() - first);
-
-			// If we have little time remaining, just return.
-			if(remain <= 2)
-				loop = 0;
-			else
-				usleep(remain / 2); // sleep half of the remaining time.
+			skipped = (int) behind;
+			timer->next += behind * timer->period;
 		}
 	}
 	else
-	{
-		// printf("Sleep not needed! We are %ld behind.\n", microsec_sleep);
-	}
+		kuhl_sleep_until(timer->next);
+
+	/* Positive jitter means that we woke up late. */
+	int64_t jitter = kuhl_nanoseconds() - timer->next;
+	timer->jitterSum += jitter;
+	timer->jitterSumSq += (double) jitter * jitter;
+	if(jitter > timer->jitterMax)
+		timer->jitterMax = jitter;
+
+	timer->next += timer->period;
+	timer->ticks++;
+	timer->skipped += skipped;
+	return skipped;
+}
 
-	gettimeofday(&limitfps_last, NULL);
-#endif
+/** Prints statistics about how close to the scheduled time a periodic
+    timer has been waking up.
+
+    @param timer The timer.
+
+    @param name A name for the timer to include in the message.
+*/
+void kuhl_periodic_print_stats(const kuhl_periodic *timer, const char *name)
+{
+	if(timer->ticks < 2)
+		return;
+	double n = timer->ticks - 1;
+	double mean = timer->jitterSum / n;
+	double variance = timer->jitterSumSq / n - mean*mean;
+	if(variance < 0)
+		variance = 0;
+	msg(MSG_INFO, "%s: %lu ticks at %.2f Hz, jitter %.1f us mean, %.1f us stddev, %.1f us max, late for %lu ticks, skipped %lu.",
+	    name, timer->ticks, 1000000000.0/timer->period,
+	    mean/1000.0, sqrt(variance)/1000.0, timer->jitterMax/1000.0,
+	    timer->late, timer->skipped);
 }
 
-/** Returns the current time in microseconds. 1 second = 1,000,000 microseconds. 1 millisecond = 1000 microseconds */
+/** Returns the current time in microseconds from a monotonic clock
+ * (see kuhl_nanoseconds()). 1 second = 1,000,000 microseconds. 1
+ * millisecond = 1000 microseconds */
 long kuhl_microseconds(void)
 {
-#if _WIN32
-	LARGE_INTEGER freq, start;
-	QueryPerformanceFrequency(&freq);
-	QueryPerformanceCounter(&start);
-	return (long) ((start.QuadPart * 1000000) / freq.QuadPart);
-#else
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	long us = (tv.tv_sec * 1000000L) + tv.tv_usec;
-	return us;
-#endif
+	return (long) (kuhl_nanoseconds() / 1000);
 }
 
 /** Returns the number of milliseconds since the first time this
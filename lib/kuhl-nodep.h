@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <stdint.h>
 #include "msg.h"
 
 // When compiling on windows, add suseconds_t and the rand48 functions.
@@ -36,6 +37,21 @@ typedef struct
 	float fps; /**< Current estimate of FPS? */
 } kuhl_fps_state;
 
+/** A timer which wakes up at a fixed rate. See kuhl_periodic_init()
+ * and kuhl_periodic_wait(). */
+typedef struct
+{
+	int64_t period;       /**< Nanoseconds between ticks */
+	int64_t next;         /**< kuhl_nanoseconds() time of the next tick */
+	int catchUp;          /**< Return immediately for ticks we fell behind on instead of skipping them? */
+	unsigned long ticks;  /**< Number of ticks so far */
+	unsigned long late;   /**< Number of times the tick had already passed when we waited for it */
+	unsigned long skipped; /**< Number of ticks skipped */
+	double jitterSum;     /**< Sum of the nanoseconds that we woke up after each tick */
+	double jitterSumSq;   /**< Sum of squares of the same */
+	int64_t jitterMax;    /**< Latest that we woke up after a tick */
+} kuhl_periodic;
+
 
 /** An alternative to malloc() which behaves the same way except it
  * prints a message when common errors occur (out of memory, trying to
@@ -53,6 +69,11 @@ void kuhl_shuffle(void *array, int n, int size);
 char* kuhl_trim_whitespace(char *str);
 double kuhl_gauss(void);
 
+int64_t kuhl_nanoseconds(void);
+void kuhl_sleep_until(int64_t deadline);
+void kuhl_periodic_init(kuhl_periodic *timer, double hz, int catchUp);
+int kuhl_periodic_wait(kuhl_periodic *timer);
+void kuhl_periodic_print_stats(const kuhl_periodic *timer, const char *name);
 long kuhl_microseconds(void);
 long kuhl_microseconds_start(void);
 long kuhl_milliseconds(void);
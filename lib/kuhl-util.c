@@ -23,11 +23,15 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h> // for FLT_MAX
+#include <stdint.h> // uint64_t
 #ifndef _WIN32
 #include <libgen.h> // for dirname()
 #include <sys/time.h> // gettimeofday()
 #include <unistd.h> // usleep()
+#include <fcntl.h> // open()
+#include <sys/mman.h> // mmap()
 #endif 
+#include <sys/stat.h> // stat(), fstat()
 
 #include <time.h> // time()
 #ifdef __linux__
@@ -38,6 +42,8 @@
 #include "kuhl-nodep.h"
 
 #include <assimp/cimport.h>
+#include <assimp/cfileio.h>
+#include <assimp/cexport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <assimp/anim.h>
@@ -57,6 +63,12 @@ static const char *texTypeListStr[TEX_TYPE_LEN] = {"DIFFUSE", "SPECULAR", "AMBIE
 
 #include "kuhl-util.h"
 #include "vecmat.h"
+#include "threadpool.h"
+#include "list-typed.h"
+#include "vecmat-batch.h"
+#include "capture.h"
+#include "texcompress.h"
+#include "texstream.h"
 #include "font8x8_basic.h"
 
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
@@ -892,7 +904,8 @@ static void kuhl_geometry_sanity_check(kuhl_geometry *geom)
 
 
 /** Applies a transformation matrix to an axis-aligned bounding box to
-    produce a new axis aligned bounding box.
+    produce a new axis aligned bounding box. To transform many
+    bounding boxes at once, use mat4f_bbox_transform_batch().
 
 
     @param bbox The bounding box to rotate (xmin, xmax, ymin, ...)
@@ -902,44 +915,7 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 {
 	if(mat == NULL)
 		return;
-
-	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
-
-	// The 8 vertices of the bounding box
-	float coords[8][3] = { {bbox[xmin], bbox[ymin], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmax] } };
-	// Transform the 8 vertices of the bounding box
-	for(int i=0; i<8; i++)
-		mat4f_mult_vec4f_new(coords[i], mat, coords[i]);
-	
-	/* Calculate new axis aligned bounding box */
-	for(int i=0; i<6; i=i+2) // set min values to the largest float
-		bbox[i] = FLT_MAX;
-	for(int i=1; i<6; i=i+2) // set max values to the smallest float
-		bbox[i] = -FLT_MAX;
-	for(unsigned int i=0; i<8; i++)
-	{
-		// Check for new min values
-		if(coords[i][0] < bbox[0])
-			bbox[0] = coords[i][0];
-		if(coords[i][1] < bbox[2])
-			bbox[2] = coords[i][1];
-		if(coords[i][2] < bbox[4])
-			bbox[4] = coords[i][2];
-
-		// Check for new max values
-		if(coords[i][0] > bbox[1])
-			bbox[1] = coords[i][0];
-		if(coords[i][1] > bbox[3])
-			bbox[3] = coords[i][1];
-		if(coords[i][2] > bbox[5])
-			bbox[5] = coords[i][2];
-	}
+	mat4f_bbox_transform_batch(bbox, bbox, 1, mat);
 }
     
 
@@ -986,6 +962,30 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 #endif
 
 
+/** Reports how large the textures in a kuhl_geometry object appear on
+ * the screen so that streamed textures are only loaded at the
+ * resolution they are needed at (see texstream.h). Does nothing for
+ * textures which aren't streamed.
+ *
+ * @param geom The geometry object that is being drawn.
+ *
+ * @param screenSize The approximate size of the geometry on the screen
+ * in pixels, such as the value from texstream_screen_size().
+ *
+ * @param kg_options If KG_FULL_LIST is set, the size is reported for
+ * all of the geometry in this list.
+ */
+void kuhl_geometry_texture_usage(kuhl_geometry *geom, float screenSize, int kg_options)
+{
+	for(; geom != NULL; geom = geom->next)
+	{
+		for(unsigned int i=0; i<geom->texture_count; i++)
+			texstream_use(geom->textures[i].textureId, screenSize);
+		if(!(kg_options & KG_FULL_LIST))
+			break;
+	}
+}
+
 /** Adds a texture to the provided kuhl_geometry object.
  *
  * @param geom The geometry object to add a texture to.
@@ -1194,6 +1194,7 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
 	}
 	
 	geom->program = program;
+	geom->boneTexLoc = glGetUniformLocation(program, "BoneTex");
 
 	/* Iterate through the vertex attributes in this kuhl_geometry
 	 * object and determine where these attributes should go in the
@@ -1429,6 +1430,7 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 	}
 
 	geom->program = program;
+	geom->boneTexLoc = glGetUniformLocation(program, "BoneTex");
 	geom->vertex_count = vertexCount;
 	geom->primitive_type = primitive_type;
 
@@ -1444,6 +1446,7 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 	geom->assimp_node  = NULL;
 	geom->assimp_scene = NULL;
 	geom->bones        = NULL;
+	geom->anim         = NULL;
 
 	geom->next = NULL;
 }
@@ -1515,6 +1518,15 @@ void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCou
 
 
 
+/* A texture buffer object which holds the bone matrices for all of
+ * the instances drawn with the palette (see
+ * kuhl_anim_instance_upload()). Each matrix uses four RGBA32F texels,
+ * one per column. */
+static GLuint kuhl_palette_buffer = 0;
+static GLuint kuhl_palette_texture = 0;
+static float *kuhl_palette_staging = NULL; /* Copy of the palette in CPU memory */
+static size_t kuhl_palette_capacity = 0;   /* Number of matrices that fit in kuhl_palette_staging */
+
 /** Draws a kuhl_geometry struct to the screen. The struct passed into
  * this function should have been set up with kuhl_geometry_new() and
  * at least one position attribute with kuhl_geometry_attrib() before
@@ -1597,6 +1609,8 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 		 * texture unit is enabled. */
 		glBindTexture(GL_TEXTURE_2D, tex->textureId);
 		kuhl_errorcheck();
+		/* Let texture streaming know that the texture is in use. */
+		texstream_use(tex->textureId, 0);
 	}
 
 	/* Set the HasTex variable if it exists in the GLSL program. */
@@ -1609,15 +1623,38 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 	 * GLSL program. If they are not active, don't print any warning
 	 * messages. */
 	int numBones = 0;
+	int boneOffset = -1;
+	/* The bone palette texture buffer always uses the texture unit
+	 * after the ones used by the geometry's textures. The sampler
+	 * must be set even if we don't use it because two samplers of
+	 * different types can't refer to the same texture unit. */
+	if(geom->boneTexLoc != -1)
+		glUniform1i(geom->boneTexLoc, MAX_TEXTURES);
 	if(geom->bones)
 	{
-		loc = glGetUniformLocation(geom->program, "BoneMat");
-		if(loc != -1)
+		if(geom->boneTexLoc != -1 && geom->bones->paletteOffset >= 0)
 		{
-			glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
+			/* The matrices were uploaded with the rest of the
+			 * instances in kuhl_anim_instance_upload(). */
+			glActiveTexture(GL_TEXTURE0+MAX_TEXTURES);
+			glBindTexture(GL_TEXTURE_BUFFER, kuhl_palette_texture);
+			boneOffset = geom->bones->paletteOffset;
 			numBones = geom->bones->count;
 		}
+		else
+		{
+			/* Only send the matrices that are actually used. */
+			loc = glGetUniformLocation(geom->program, "BoneMat");
+			if(loc != -1)
+			{
+				glUniformMatrix4fv(loc, geom->bones->count, 0, geom->bones->matrices[0]);
+				numBones = geom->bones->count;
+			}
+		}
 	}
+	loc = glGetUniformLocation(geom->program, "BoneOffset");
+	if(loc != -1)
+		glUniform1i(loc, boneOffset);
 	loc = glGetUniformLocation(geom->program, "NumBones");
 	if(loc != -1)
 	    glUniform1i(loc, numBones);
@@ -1697,6 +1734,12 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 		glBindTexture(GL_TEXTURE_2D, 0);
 		kuhl_errorcheck();
 	}
+	if(boneOffset >= 0)
+	{
+		glActiveTexture(GL_TEXTURE0+MAX_TEXTURES);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		kuhl_errorcheck();
+	}
 	
 	/* Indicate in the struct that we have successfully drawn this
 	 * geom once. */
@@ -1737,6 +1780,7 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 	// Delete this geometry object
 	geom->vertex_count = 0;
 	geom->program = 0;
+	geom->boneTexLoc = -1;
 	geom->texture_count = 0;
 	mat4f_identity(geom->matrix);
 	
@@ -1814,12 +1858,16 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	kuhl_errorcheck();
 
-	GLuint internalformat = kuhl_config_int("color.linear", 1, 1) ? GL_SRGB8 : GL_RGB8;
+	static kuhl_config_handle colorLinear = NULL;
+	if(colorLinear == NULL)
+		colorLinear = kuhl_config_handle_get("color.linear");
+	int linear = kuhl_config_handle_int(colorLinear, 1, 1);
+	GLuint internalformat = linear ? GL_SRGB8 : GL_RGB8;
 	GLuint imageformat = GL_RGB;
 	GLuint pixeldatatype = GL_UNSIGNED_BYTE;
 	if(components == 4)
 	{
-		internalformat = kuhl_config_int("color.linear", 1, 1) ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+		internalformat = linear ? GL_SRGB8_ALPHA8 : GL_RGBA8;
 		imageformat = GL_RGBA;
 	}
 	
@@ -2147,24 +2195,34 @@ kuhl_geometry* kuhl_label_geom(kuhl_geometry *geom, GLuint program, float *width
 /** This code flips an image vertically. This is helpful since OpenGL
  * puts the first pixel at the bottom left corner and other
  * image-handling libraries may put the pixel in the top left
- * corner. */
+ * corner. Doesn't allocate memory or print messages, so it can be
+ * called from worker threads.
+ *
+ * Images loaded with STB should be flipped with this function instead
+ * of with stbi_set_flip_vertically_on_load_thread(): that setting
+ * stays in place for every later image loaded by the same thread, and
+ * the main thread also runs thread pool jobs. */
 void kuhl_flip_texture_array(unsigned char *image, const int width, const int height, const int components) {
 	// printf("Flipping texture with width = %d, height = %d\n", width, height);
-	unsigned int bytesPerRow = components * width; // 1 byte per component
+	size_t bytesPerRow = (size_t) components * width; // 1 byte per component
 	unsigned int pivot = height/2;
 
-	unsigned char *temp = kuhl_malloc(bytesPerRow);
+	/* Swap the rows a piece at a time. */
+	unsigned char temp[4096];
 	for (unsigned i = 0; i < pivot; ++i) 
 	{
 		unsigned char *lineTop = (image + i * bytesPerRow);
 		unsigned char *lineBottom = (image + (height - i - 1) * bytesPerRow);
 		// printf("Swapping %d with %d\n", i, height-i-1);
 
-		memcpy(temp, lineTop, bytesPerRow);
-		memcpy(lineTop, lineBottom, bytesPerRow);
-		memcpy(lineBottom, temp, bytesPerRow);
+		for(size_t start = 0; start < bytesPerRow; start += sizeof(temp))
+		{
+			size_t n = bytesPerRow - start < sizeof(temp) ? bytesPerRow - start : sizeof(temp);
+			memcpy(temp, lineTop + start, n);
+			memcpy(lineTop + start, lineBottom + start, n);
+			memcpy(lineBottom + start, temp, n);
+		}
 	}
-	free(temp);
 }
 
 
@@ -2296,7 +2354,16 @@ float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint
 		return -1;
 	}
 
-	/* First try loading with STB. It supports most common image
+	/* Use the block compressed version of the image (made by the
+	 * texture-compress program) if there is one. */
+	char *foundFilename = kuhl_find_file(filename);
+	int width, height;
+	*texName = texcompress_load_cached(foundFilename, wrapS, wrapT, &width, &height);
+	free(foundFilename);
+	if(*texName != 0)
+		return width/(float)height;
+
+	/* Otherwise, try loading with STB. It supports most common image
 	 * formats and since it is in our codebase, are more certain it
 	 * will behave the same across machines. */
 	float aspectRatio = kuhl_read_texture_file_stb(filename, texName, wrapS, wrapT);
@@ -2353,97 +2420,70 @@ static void kuhl_screenshot_im(const char *outputImageFilename)
 #endif
 
 
-static void kuhl_screenshot_stb(const char *outputImageFilename)
-{
-	// Get window size
-	//int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
-	//int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
-	int windowWidth,windowHeight;
-	glfwGetFramebufferSize(kuhl_get_window(), &windowWidth, &windowHeight);
-
-	
-	int comp = 3; // 3 = RGB, 4 = RGBA
-	int stride_in_bytes = windowWidth*comp*sizeof(char);
-	// Allocate space for data from window
-	unsigned char *data = kuhl_malloc(stride_in_bytes*windowHeight);
-	// Read pixels from the window
-	glReadPixels(0,0,windowWidth,windowHeight,
-	             GL_RGB,GL_UNSIGNED_BYTE, data);
-	kuhl_errorcheck();
-
-	//kuhl_flip_texture_array(data, windowWidth, windowHeight, 3);
-	stbi_flip_vertically_on_write(1);
-
-	int ok=0;
-	const char *s = outputImageFilename;
-	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
-		ok = stbi_write_png(s, windowWidth, windowHeight, comp, data, stride_in_bytes);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".jpg"))
-		ok = stbi_write_jpg(s, windowWidth, windowHeight, comp, data, 95);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
-		ok = stbi_write_tga(s, windowWidth, windowHeight, comp, data);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
-		ok = stbi_write_bmp(s, windowWidth, windowHeight, comp, data);
-	free(data);
-	
-	if (!ok)
-	{
-		msg(MSG_FATAL, "Failed write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", outputImageFilename);
-		exit(EXIT_FAILURE);
-	}
-
-}
-
-
 /** Takes a screenshot of the current OpenGL screen and writes it to an image file.
 
-    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension. Suggestion: PNG files often work best for screenshots; try "output.png".
+    The pixels are read immediately, but the file is written by a
+    background thread (see capture.h). Call capture_flush() if you need
+    the file to exist before continuing.
+
+    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension (png, jpg, tga or bmp). Suggestion: PNG files often work best for screenshots; try "output.png".
 */
 void kuhl_screenshot(const char *outputImageFilename)
 {
-	kuhl_screenshot_stb(outputImageFilename);
+	capture_screenshot(outputImageFilename);
 //#ifdef KUHL_UTIL_USE_IMAGEMAGICK
 //	kuhl_screenshot_im(outputImageFilename);
 //#endif
 }
 
 
-/** Records individual frames to image files that can later be
-  combined into a single video file. Call this function every frame
-  and it will capture the image data from the frame buffer and write
-  it to an image file if enough time has elapsed to record a
-  frame. Each image filename will include a frame number. This
-  function writes TIFF files to avoid unnecessary computation
-  compressing images. Instructions for converting the image files into
-  a video file using ffmpeg or avconv will be printed to standard
-  out. This may run slowly if you are saving files to a non-local
-  filesystem.
+/** Records the frames that are displayed into a video file. Call
+  this function every frame and it will capture the image data from
+  the frame buffer if enough time has elapsed to record a frame.
+  Frames are read back asynchronously and encoded by background
+  threads (see capture.h), so recording does not wait for the GPU or
+  the disk unless the encoders fall behind.
+
+  If libkuhl was compiled with FFmpeg, the frames are encoded
+  directly into "fileLabel.mkv" (see the capture.codec config
+  option). Otherwise, or if capture.codec is set to "images", each
+  frame is written to a BMP file which includes a frame number and
+  instructions for converting the image files into a video file using
+  ffmpeg or avconv will be printed to standard out.
 
     @param fileLabel If fileLabel is set to "label", this function
-    will create files such as "label-00000000.tif"
+    will create "label.mkv" or files such as "label-00000000.bmp"
     
     @param fps The number of frames per second to record. Suggested value: 30.
  */
 void kuhl_video_record(const char *fileLabel, int fps)
 {
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-	static const char *exten = "tif";
-#else
 	static const char *exten = "bmp";
-#endif
 
 	static int kuhl_video_record_frame = 0; // filename counter
 	static long time_of_next_picture = 0;    // time to take next picture
+	static int useEncoder = 0; // encode directly into a video file?
 	int usec_between_pictures = 1000000/fps;  // integer division...
 	
 	if(time_of_next_picture == 0) // if first time called.
 	{
-		msg(MSG_INFO, "Recording %d frames per second. NOTE: If your screen is too large, then we may be unable to actually record images at the requested FPS rate.\n", fps);
-		msg(MSG_INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
-		msg(MSG_INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(MSG_INFO, " - or -\n");
-		msg(MSG_INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(MSG_INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		const char *codec = kuhl_config_get("capture.codec");
+		if(codec == NULL || strcmp(codec, "images") != 0)
+		{
+			char videoFilename[1024];
+			snprintf(videoFilename, 1024, "%s.mkv", fileLabel);
+			useEncoder = capture_video_start(videoFilename, fps);
+		}
+
+		if(useEncoder == 0)
+		{
+			msg(MSG_INFO, "Recording %d frames per second. NOTE: If your screen is too large, then we may be unable to actually record images at the requested FPS rate.\n", fps);
+			msg(MSG_INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
+			msg(MSG_INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			msg(MSG_INFO, " - or -\n");
+			msg(MSG_INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			msg(MSG_INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		}
 
 		time_of_next_picture = kuhl_microseconds() + usec_between_pictures;
 	}
@@ -2452,24 +2492,317 @@ void kuhl_video_record(const char *fileLabel, int fps)
 	if(kuhl_microseconds() > time_of_next_picture)
 	{
 		time_of_next_picture += usec_between_pictures;
+
+		if(useEncoder)
+		{
+			capture_video_append();
+			return;
+		}
 		
 		char filename[1024];
 		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
-		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
+		capture_video_frame(filename);
 		kuhl_video_record_frame++;
 	}
 }
 	
 
 
+#define KUHL_FNV1A_INIT 14695981039346656037ULL /**< Initial value for kuhl_private_fnv1a() */
+
+/* Adds bytes to a 64-bit FNV-1a hash. */
+static uint64_t kuhl_private_fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char*) data;
+	for(size_t i=0; i<len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 /** This struct is used internally by kuhl_util.c to keep track of all textures that are associated with models that have been loaded. */
 typedef struct {
 	char *textureFileName; /**< The filename of a texture */
 	GLuint textureID;      /**< The OpenGL texture name for that texture */
 } textureIdMapStruct;
-#define textureIdMapMaxSize 1024*32 /**< Maximum number of textures that can be loaded from models */
-static textureIdMapStruct textureIdMap[textureIdMapMaxSize]; /**<List of textures for the models */
-static int textureIdMapSize = 0; /**< Number of items in textureIdMap */
+static textureIdMapStruct *textureIdMap = NULL; /**< Hash table (open addressing) of textures for the models */
+static unsigned int textureIdMapCapacity = 0; /**< Number of slots in textureIdMap (a power of 2) */
+static unsigned int textureIdMapSize = 0; /**< Number of items in textureIdMap */
+
+/* Looks up a texture filename in textureIdMap.
+ *
+ * @param textureID Set to the OpenGL texture name if the texture is
+ * found. Can be NULL.
+ *
+ * @return 1 if the texture has been loaded, 0 otherwise.
+ */
+static int kuhl_private_texmap_find(const char *filename, GLuint *textureID)
+{
+	if(textureIdMapCapacity == 0)
+		return 0;
+	unsigned int mask = textureIdMapCapacity-1;
+	unsigned int i = (unsigned int) kuhl_private_fnv1a(KUHL_FNV1A_INIT, filename, strlen(filename)) & mask;
+	while(textureIdMap[i].textureFileName != NULL)
+	{
+		if(strcmp(textureIdMap[i].textureFileName, filename) == 0)
+		{
+			if(textureID)
+				*textureID = textureIdMap[i].textureID;
+			return 1;
+		}
+		i = (i+1) & mask;
+	}
+	return 0;
+}
+
+/* Adds a texture to textureIdMap, replacing any existing entry with
+ * the same filename. */
+static void kuhl_private_texmap_add(const char *filename, GLuint textureID)
+{
+	/* Keep the table at most half full so that probes are short. */
+	if((textureIdMapSize+1)*2 > textureIdMapCapacity)
+	{
+		textureIdMapStruct *old = textureIdMap;
+		unsigned int oldCapacity = textureIdMapCapacity;
+		textureIdMapCapacity = oldCapacity ? oldCapacity*2 : 64;
+		textureIdMap = calloc(textureIdMapCapacity, sizeof(textureIdMapStruct));
+		if(textureIdMap == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate texture map with %u entries.", textureIdMapCapacity);
+			exit(EXIT_FAILURE);
+		}
+		textureIdMapSize = 0;
+		for(unsigned int i=0; i<oldCapacity; i++)
+		{
+			if(old[i].textureFileName == NULL)
+				continue;
+			kuhl_private_texmap_add(old[i].textureFileName, old[i].textureID);
+			free(old[i].textureFileName);
+		}
+		free(old);
+	}
+
+	unsigned int mask = textureIdMapCapacity-1;
+	unsigned int i = (unsigned int) kuhl_private_fnv1a(KUHL_FNV1A_INIT, filename, strlen(filename)) & mask;
+	while(textureIdMap[i].textureFileName != NULL)
+	{
+		if(strcmp(textureIdMap[i].textureFileName, filename) == 0)
+		{
+			textureIdMap[i].textureID = textureID;
+			return;
+		}
+		i = (i+1) & mask;
+	}
+	textureIdMap[i].textureFileName = strdup(filename);
+	textureIdMap[i].textureID = textureID;
+	textureIdMapSize++;
+}
+
+/* Maximum number of bytes of decoded images that we hold in memory
+ * (and in a pixel buffer object) at once while loading the textures
+ * for a model. */
+#define KUHL_TEXTURE_BATCH_BYTES (256*1024*1024)
+
+/* A texture which needs to be loaded for a model. The image is
+ * decoded on a worker thread and uploaded on the main thread. */
+typedef struct
+{
+	char *fullpath;                /**< Name of the texture in textureIdMap */
+	char *filename;                /**< File to read (found with kuhl_find_file()), NULL if embedded */
+	const unsigned char *embedded; /**< Compressed image embedded in the model file, NULL if not embedded */
+	int embeddedLen;               /**< Number of bytes in embedded */
+	int width, height;             /**< Size of the image (found before it is decoded) */
+	size_t offset;                 /**< Where the image goes in the pixel buffer object */
+	unsigned char *pbo;            /**< The mapped pixel buffer object, NULL if not mapped */
+	int decoded;                   /**< Set to 1 by the worker if the image was decoded */
+	unsigned char *image;          /**< Decoded image if it couldn't be written into the pixel buffer */
+	GLuint texName;                /**< OpenGL texture, 0 if the texture couldn't be loaded */
+} kuhl_texture_job;
+
+/* Decodes one texture. Called by worker threads, so this must not
+ * call OpenGL or msg(). */
+static void kuhl_private_texture_decode(void *data, int index)
+{
+	kuhl_texture_job *job = &(((kuhl_texture_job*) data)[index]);
+	int width, height, comp;
+
+	unsigned char *image;
+	if(job->embedded)
+		image = stbi_load_from_memory(job->embedded, job->embeddedLen, &width, &height, &comp, STBI_rgb_alpha);
+	else
+		image = stbi_load(job->filename, &width, &height, &comp, STBI_rgb_alpha);
+	if(image == NULL || width != job->width || height != job->height)
+	{
+		stbi_image_free(image);
+		return;
+	}
+
+	/* Put the first pixel at the bottom left (see
+	 * kuhl_flip_texture_array()). */
+	if(job->pbo)
+	{
+		size_t bytesPerRow = (size_t)width*4;
+		for(int y=0; y<height; y++)
+			memcpy(job->pbo + job->offset + (size_t)y*bytesPerRow, image + (size_t)(height-1-y)*bytesPerRow, bytesPerRow);
+		stbi_image_free(image);
+	}
+	else
+	{
+		kuhl_flip_texture_array(image, width, height, 4);
+		job->image = image;
+	}
+	job->decoded = 1;
+}
+
+/* Decodes a batch of textures in parallel and uploads them through a
+ * single pixel buffer object. The worker threads decode each image
+ * straight into the mapped buffer; the main thread then creates the
+ * textures from offsets into the buffer, which lets the driver copy
+ * the data to the GPU asynchronously. */
+static void kuhl_private_texture_batch(kuhl_texture_job *jobs, int count, size_t bytes)
+{
+	GLuint pbo = 0;
+	unsigned char *mapped = NULL;
+	glGenBuffers(1, &pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+	mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+	kuhl_errorcheck();
+	if(mapped == NULL)
+	{
+		/* Decode into regular memory and upload without the PBO. */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo);
+		pbo = 0;
+	}
+
+	size_t offset = 0;
+	for(int i=0; i<count; i++)
+	{
+		jobs[i].pbo = mapped;
+		jobs[i].offset = offset;
+		offset += (size_t)jobs[i].width*jobs[i].height*4;
+	}
+
+	threadpool_for(threadpool_default(), count, kuhl_private_texture_decode, jobs);
+
+	if(pbo)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	for(int i=0; i<count; i++)
+	{
+		kuhl_texture_job *job = &(jobs[i]);
+		if(job->decoded == 0)
+			continue;
+		/* With a PBO bound, the "array" is an offset into the PBO. */
+		const unsigned char *array = pbo ? (const unsigned char*) (uintptr_t) job->offset : job->image;
+		job->texName = kuhl_read_texture_array(array, job->width, job->height, 4, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		msg(MSG_DEBUG, "Finished reading '%s' (%dx%d, texName=%d) with STB\n", job->fullpath, job->width, job->height, job->texName);
+		stbi_image_free(job->image);
+		job->image = NULL;
+	}
+	if(pbo)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo); // OpenGL keeps the buffer until the uploads finish.
+	}
+	kuhl_errorcheck();
+}
+
+/* Loads the textures for a model. The images are decoded in parallel
+ * by the library's thread pool and uploaded in batches. Textures that
+ * STB can't read are loaded afterwards with
+ * kuhl_read_texture_file() (which can fall back to ImageMagick) on
+ * the main thread.
+ *
+ * @param jobs The textures to load. texName is filled in for each of
+ * them.
+ *
+ * @param count Number of textures.
+ */
+static void kuhl_private_texture_load_jobs(kuhl_texture_job *jobs, int count)
+{
+	if(count == 0)
+		return;
+	long startTime = kuhl_microseconds();
+
+	/* Read the size of each image from its header so we know how
+	 * large the pixel buffer needs to be. Images which have a block
+	 * compressed version are loaded right away instead (they don't
+	 * need to be decoded). */
+	int compressed = 0;
+	int streamed = texstream_enabled();
+	for(int i=0; i<count; i++)
+	{
+		kuhl_texture_job *job = &(jobs[i]);
+		int comp;
+		int ok;
+		if(job->filename && streamed)
+			job->texName = texstream_load(job->filename, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		if(job->filename && job->texName == 0)
+			job->texName = texcompress_load_cached(job->filename, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, &job->width, &job->height);
+		if(job->texName != 0)
+		{
+			job->width = job->height = 0; // keep it out of the batches below
+			compressed++;
+			continue;
+		}
+		if(job->embedded)
+			ok = stbi_info_from_memory(job->embedded, job->embeddedLen, &job->width, &job->height, &comp);
+		else
+			ok = job->filename && stbi_info(job->filename, &job->width, &job->height, &comp);
+		if(!ok)
+			job->width = job->height = 0;
+	}
+
+	/* Sort the textures that STB can read into batches that fit into
+	 * KUHL_TEXTURE_BATCH_BYTES. */
+	kuhl_texture_job *batch = kuhl_malloc(sizeof(kuhl_texture_job)*count);
+	int *batchIndex = kuhl_malloc(sizeof(int)*count);
+	int batchCount = 0;
+	size_t batchBytes = 0;
+	for(int i=0; i<=count; i++)
+	{
+		size_t bytes = i < count ? (size_t)jobs[i].width*jobs[i].height*4 : 0;
+		if(batchCount > 0 && (i == count || batchBytes + bytes > KUHL_TEXTURE_BATCH_BYTES))
+		{
+			kuhl_private_texture_batch(batch, batchCount, batchBytes);
+			for(int b=0; b<batchCount; b++)
+				jobs[batchIndex[b]].texName = batch[b].texName;
+			batchCount = 0;
+			batchBytes = 0;
+		}
+		if(i < count && bytes > 0)
+		{
+			batch[batchCount] = jobs[i];
+			batchIndex[batchCount] = i;
+			batchCount++;
+			batchBytes += bytes;
+		}
+	}
+	free(batchIndex);
+	free(batch);
+
+	/* Use the old, serial path (with its error messages and
+	 * ImageMagick fallback) for anything that didn't work. */
+	int failed = 0;
+	for(int i=0; i<count; i++)
+	{
+		kuhl_texture_job *job = &(jobs[i]);
+		if(job->texName != 0)
+			continue;
+		failed++;
+		if(job->embedded)
+			msg(MSG_WARNING, "Unable to read embedded texture %s with STB.", job->fullpath);
+		else if(kuhl_read_texture_file(job->fullpath, &(job->texName)) < 0)
+			msg(MSG_WARNING, "Could not find or read texture %s\n", job->fullpath);
+	}
+
+	msg(MSG_INFO, "Loaded %d texture(s) using %d thread(s) in %ld ms (%d were %s, %d needed the fallback loader)",
+	    count, threadpool_size(threadpool_default()), (kuhl_microseconds()-startTime)/1000,
+	    compressed, streamed ? "streamed or precompressed" : "precompressed", failed);
+}
 
 
 /** Recursively traverse a tree of ASSIMP nodes and updates the
@@ -2803,108 +3136,512 @@ static char* kuhl_private_assimp_fullpath(const char *textureFile, const char *m
 }
 
 
-/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
- * object. This function also calls kuhl_tead_texture_file() when
- * necessary to load the appropriate texture files that the model
- * refers to. This function does not create any kuhl_geometry structs
- * for the model.
+/* The model cache stores the scene that ASSIMP creates after it
+ * imports and post-processes a model. Loading the cached scene skips
+ * parsing the original file and all of the post-processing, which can
+ * take several seconds for large models.
  *
- * @param modelFilename The filename of a model to load.
+ * The cache file is a kuhl_model_cache_header followed by the scene
+ * in ASSIMP's binary "assbin" format. The file is memory mapped and
+ * handed directly to ASSIMP. The header records a hash of the model
+ * file and the import options; if either changes, the cache is
+ * rebuilt.
  *
- * @param textureDirname The directory the textures for the model are
- * stored in. If textureDirname is NULL, we assume that the textures
- * are in the same directory as the model file.
+ * The scene also contains data from other files that ASSIMP opened
+ * while importing the model (.mtl files, external .gltf buffers,
+ * etc). We record those files while importing and store their names
+ * after the header along with a hash of their sizes and modification
+ * times. If any of them changed or disappeared, the cache is rebuilt.
  *
- * @return An ASSIMP aiScene object for the requested model. Returns
- * NULL on error.
+ * Config options:
+ * model.cache - Set to 0 to disable the cache (default 1).
+ * model.cache.dir - Directory to store the cache files in. By default,
+ * the cache is stored next to the model as "model.dae.kuhlcache".
  */
-static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname)
+#define KUHL_MODEL_CACHE_MAGIC "KUHLMDL"
+#define KUHL_MODEL_CACHE_VERSION 2
+
+typedef struct
 {
-	/* If we get here, we need to add the file to the sceneMap. */
-	msg(MSG_INFO, "Loading model: %s\n", modelFilename);
+	char magic[8];    /**< KUHL_MODEL_CACHE_MAGIC */
+	uint32_t version; /**< KUHL_MODEL_CACHE_VERSION */
+	uint32_t flags;   /**< ASSIMP post-processing flags used to create the scene */
+	uint64_t key;     /**< Hash of the model file and import options */
+	uint64_t depHash; /**< Hash of the names, sizes and modification times of the files ASSIMP opened */
+	uint64_t depLength; /**< Number of bytes of file names (each null terminated) after the header */
+	uint64_t length;  /**< Number of bytes of assbin data after the file names */
+} kuhl_model_cache_header;
+
+/** Names of the files that ASSIMP opened while importing a model. */
+LIST_TYPED(kuhl_model_deps, char*)
+
+/* The functions below let ASSIMP read files with stdio while we
+ * record which files it opened. */
+static size_t kuhl_private_aifile_read(struct aiFile *file, char *buffer, size_t size, size_t count)
+{
+	return fread(buffer, size, count, (FILE*) file->UserData);
+}
 
-	/* Write assimp messages to msg log */
-	struct aiLogStream stream;
-	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
-	if(stream.callback != msg_assimp_callback)
-	{
-		// we only need to set this up once.
-		stream.callback = msg_assimp_callback;
-		stream.user = strdup(modelFilename); // memory leak
-		aiAttachLogStream(&stream);
-	}
-	
-	/* Try loading the model. We are using a postprocessing preset
-	 * here so we don't have to set many options. */
-	char *modelFilenameVarying = strdup(modelFilename); // aiImportFile doesn't declare filaname parameter as const!
+static size_t kuhl_private_aifile_write(struct aiFile *file, const char *buffer, size_t size, size_t count)
+{
+	return fwrite(buffer, size, count, (FILE*) file->UserData);
+}
 
-	/* We will load the file and do significant processing (split
-	 * large meshes into smaller ones, triangulate polygons in meshes,
-	 * apply transformation matrices. For more information about model
-	 * loading options, see:
-	 * http://assimp.sourceforge.net/lib_html/postprocess_8h.html
-	 *
-	 * The postprocess procedures can greatly influence how long it
-	 * takes to load a model. If you are trying to load a large model,
-	 * try setting the post-process settings to 0.
-	 *
-	 * Other options which trigger multiple other options:
-	 * aiProcessPreset_TargetRealtime_Fast
-	 * aiProcessPreset_TargetRealtime_Quality
-	 * aiProcessPreset_TargetRealtime_MaxQuality
-	 *
-	 * Individual options:
-	 * 0                     - do nothing
-	 * aiProcess_Triangulate - Triangulate polygons into triangles
-	 * aiProcess_SortByPType - Put each primitive type into its own mesh
-	 * aiProcess_GenNormals  - Generate flat normals if normals aren't present in file
-	 * aiProcess_GenSmoothNormals - Generate smooth normals if normals aren't present in file
-	 * aiProcess_LimitBoneWeights - Limits bone weights per vertex to 4
-	 * aiProcess_JoinIdenticalVertices - Ensures that the model uses an index buffer.
-	 * aiProcess_PreTransformVertices - Pretransforms all vertices according to matrices in the model file
-	 */
+static size_t kuhl_private_aifile_tell(struct aiFile *file)
+{
+	return (size_t) ftell((FILE*) file->UserData);
+}
 
-	// If we are generating smooth normals, don't smooth edges that
-	// are 80 degrees or higher (i.e., use flat normals on a cube).
-	struct aiPropertyStore* propStore = aiCreatePropertyStore();
-	aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", 50.0f);
-	// Import/load the model
-	int aiProcessFlags = aiProcess_Triangulate|aiProcess_SortByPType; // required! Use only these flags for fast loading.
-	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
-	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
-	aiProcessFlags |= aiProcess_OptimizeMeshes|aiProcess_OptimizeGraph; // fixes models with many small meshes
-	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
-	free(modelFilenameVarying);
-	if(scene == NULL)
-		return NULL;
+static size_t kuhl_private_aifile_size(struct aiFile *file)
+{
+	FILE *f = (FILE*) file->UserData;
+	long pos = ftell(f);
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, pos, SEEK_SET);
+	return (size_t) size;
+}
 
-	/* Print warning messages if the model uses features that our code
-	 * doesn't support (even though ASSIMP might support them). */
-	if(scene->mNumCameras > 0)
-		msg(MSG_DEBUG, "%s: This model has %u camera(s) embedded in it that we are ignoring.\n",
-		       modelFilename, scene->mNumCameras);
-	if(scene->mNumLights > 0)
-		msg(MSG_DEBUG, "%s: This model has %u light(s) embedded in it that we are ignoring.\n",
-		       modelFilename, scene->mNumLights);
-	//if(scene->mNumTextures > 0)
-	//	msg(MSG_DEBUG, "%s: This model has %u texture(s) embedded in it.\n",
-	//	       modelFilename, scene->mNumTextures);
+static enum aiReturn kuhl_private_aifile_seek(struct aiFile *file, size_t offset, enum aiOrigin origin)
+{
+	int whence = SEEK_SET;
+	if(origin == aiOrigin_CUR)
+		whence = SEEK_CUR;
+	else if(origin == aiOrigin_END)
+		whence = SEEK_END;
+	if(fseek((FILE*) file->UserData, (long) offset, whence) != 0)
+		return aiReturn_FAILURE;
+	return aiReturn_SUCCESS;
+}
 
-	// Uncomment this line to print additional information about the model:
-	//kuhl_print_aiScene_info(modelFilename, scene);
+static void kuhl_private_aifile_flush(struct aiFile *file)
+{
+	fflush((FILE*) file->UserData);
+}
 
-	/* For safety, zero out our texture ID map if it is supposed to be empty right now. */
-	if(textureIdMapSize == 0)
-	{
-		for(int i=0; i<textureIdMapMaxSize; i++)
-		{
-			textureIdMap[i].textureFileName = NULL;
-			textureIdMap[i].textureID = 0;
-		}
-	}
+static struct aiFile* kuhl_private_aifile_open(struct aiFileIO *io, const char *filename, const char *mode)
+{
+	FILE *f = fopen(filename, mode);
+	if(f == NULL)
+		return NULL;
 
-	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
-	for(unsigned int m=0; m < scene->mNumMaterials; m++)
+	/* Remember the file (with an absolute path where we can, so that
+	 * the cache still works if the program runs in another directory). */
+	kuhl_model_deps *deps = (kuhl_model_deps*) io->UserData;
+	char *path = NULL;
+#ifndef _WIN32
+	path = realpath(filename, NULL);
+#endif
+	if(path == NULL)
+		path = strdup(filename);
+	int found = 0;
+	for(int i=0; i<deps->length && !found; i++)
+		found = strcmp(deps->data[i], path) == 0;
+	if(found)
+		free(path);
+	else
+		kuhl_model_deps_append(deps, path);
+
+	struct aiFile *file = kuhl_malloc(sizeof(struct aiFile));
+	file->ReadProc = kuhl_private_aifile_read;
+	file->WriteProc = kuhl_private_aifile_write;
+	file->TellProc = kuhl_private_aifile_tell;
+	file->FileSizeProc = kuhl_private_aifile_size;
+	file->SeekProc = kuhl_private_aifile_seek;
+	file->FlushProc = kuhl_private_aifile_flush;
+	file->UserData = (aiUserData) f;
+	return file;
+}
+
+static void kuhl_private_aifile_close(struct aiFileIO *io, struct aiFile *file)
+{
+	fclose((FILE*) file->UserData);
+	free(file);
+}
+
+/* Hashes the names, sizes and modification times of files.
+ *
+ * @return 1 on success, 0 if one of the files doesn't exist.
+ */
+static int kuhl_private_model_deps_hash(uint64_t *hash, char * const *paths, int count)
+{
+	uint64_t h = KUHL_FNV1A_INIT;
+	for(int i=0; i<count; i++)
+	{
+		struct stat st;
+		if(stat(paths[i], &st) != 0)
+			return 0;
+		int64_t info[3] = { (int64_t) st.st_size, (int64_t) st.st_mtime, 0 };
+#ifdef __linux__
+		info[2] = (int64_t) st.st_mtim.tv_nsec; // catch edits within the same second
+#endif
+		h = kuhl_private_fnv1a(h, paths[i], strlen(paths[i])+1);
+		h = kuhl_private_fnv1a(h, info, sizeof(info));
+	}
+	*hash = h;
+	return 1;
+}
+
+/* Calculates the key which identifies a cached model: A hash of the
+ * contents of the model file, the import options and the version of
+ * ASSIMP.
+ *
+ * @return 1 on success, 0 if the model file couldn't be read.
+ */
+static int kuhl_private_model_cache_key(uint64_t *key, const char *modelFilename,
+                                        unsigned int flags, float smoothingAngle)
+{
+	FILE *f = fopen(modelFilename, "rb");
+	if(f == NULL)
+		return 0;
+
+	uint64_t hash = KUHL_FNV1A_INIT;
+	const size_t bufSize = 1024*1024;
+	unsigned char *buf = kuhl_malloc(bufSize);
+	size_t len;
+	while((len = fread(buf, 1, bufSize, f)) > 0)
+		hash = kuhl_private_fnv1a(hash, buf, len);
+	int ok = !ferror(f);
+	free(buf);
+	fclose(f);
+
+	unsigned int options[5] = { KUHL_MODEL_CACHE_VERSION, flags,
+	                            aiGetVersionMajor(), aiGetVersionMinor(), aiGetVersionRevision() };
+	hash = kuhl_private_fnv1a(hash, options, sizeof(options));
+	hash = kuhl_private_fnv1a(hash, &smoothingAngle, sizeof(float));
+	*key = hash;
+	return ok;
+}
+
+/* Returns the name of the cache file for a model. The returned string
+ * should be free()'d. */
+static char* kuhl_private_model_cache_filename(const char *modelFilename, uint64_t key)
+{
+	char *path = kuhl_malloc(1024);
+	const char *dir = kuhl_config_get("model.cache.dir");
+	if(dir == NULL)
+		snprintf(path, 1024, "%s.kuhlcache", modelFilename);
+	else /* Several models with the same name might share the directory. */
+		snprintf(path, 1024, "%s/%016llx.kuhlcache", dir, (unsigned long long) key);
+	return path;
+}
+
+/* Loads a scene from the model cache.
+ *
+ * @return The scene or NULL if there is no valid cache file for the
+ * key and flags.
+ */
+static const struct aiScene* kuhl_private_model_cache_read(const char *cacheFilename,
+                                                           uint64_t key, unsigned int flags)
+{
+	size_t size = 0;
+	char *data = NULL;
+#ifndef _WIN32
+	int fd = open(cacheFilename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(kuhl_model_cache_header))
+	{
+		size = (size_t) st.st_size;
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED)
+			data = NULL;
+	}
+	close(fd);
+#else
+	FILE *f = fopen(cacheFilename, "rb");
+	if(f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long fileSize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(fileSize > (long) sizeof(kuhl_model_cache_header))
+	{
+		size = (size_t) fileSize;
+		data = kuhl_malloc(size);
+		if(fread(data, 1, size, f) != size)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+#endif
+	if(data == NULL)
+		return NULL;
+
+	const struct aiScene *scene = NULL;
+	kuhl_model_cache_header header;
+	memcpy(&header, data, sizeof(header));
+	int valid = memcmp(header.magic, KUHL_MODEL_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == KUHL_MODEL_CACHE_VERSION &&
+		header.key == key && header.flags == flags &&
+		header.depLength <= size - sizeof(header) &&
+		header.length == size - sizeof(header) - header.depLength;
+
+	/* Check that the other files that the model uses haven't changed. */
+	if(valid)
+	{
+		const char *names = data + sizeof(header);
+		kuhl_model_deps deps;
+		kuhl_model_deps_init(&deps, 8);
+		for(uint64_t i=0; i<header.depLength; i += strlen(names+i)+1)
+		{
+			if(memchr(names+i, '\0', header.depLength-i) == NULL)
+			{
+				valid = 0;
+				break;
+			}
+			kuhl_model_deps_append(&deps, (char*) names+i);
+		}
+		uint64_t depHash;
+		if(valid == 0 || !kuhl_private_model_deps_hash(&depHash, deps.data, deps.length) ||
+		   depHash != header.depHash)
+			valid = 0;
+		kuhl_model_deps_free(&deps);
+	}
+
+	if(valid)
+	{
+		scene = aiImportFileFromMemory(data + sizeof(header) + header.depLength, (unsigned int) header.length, 0, "assbin");
+		if(scene == NULL)
+			msg(MSG_WARNING, "Unable to read model cache %s: %s", cacheFilename, aiGetErrorString());
+	}
+	else
+		msg(MSG_DEBUG, "Model cache %s is out of date.", cacheFilename);
+
+#ifndef _WIN32
+	munmap(data, size);
+#else
+	free(data);
+#endif
+	return scene;
+}
+
+/* Writes a scene into the model cache. The file is written under a
+ * temporary name and then renamed so that other processes (such as
+ * DGR slaves sharing a file system) never see a partial file. Errors
+ * are not fatal---the model just won't be cached. */
+static void kuhl_private_model_cache_write(const char *cacheFilename, const struct aiScene *scene,
+                                           uint64_t key, unsigned int flags, const kuhl_model_deps *deps)
+{
+	uint64_t depHash;
+	if(!kuhl_private_model_deps_hash(&depHash, deps->data, deps->length))
+	{
+		msg(MSG_DEBUG, "Not caching model: a file it uses disappeared while it was imported.");
+		return;
+	}
+	uint64_t depLength = 0;
+	for(int i=0; i<deps->length; i++)
+		depLength += strlen(deps->data[i])+1;
+
+	const struct aiExportDataBlob *blob = aiExportSceneToBlob(scene, "assbin", 0);
+	if(blob == NULL)
+	{
+		msg(MSG_WARNING, "Unable to convert model into the cache format: %s", aiGetErrorString());
+		return;
+	}
+
+	kuhl_model_cache_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KUHL_MODEL_CACHE_MAGIC, sizeof(header.magic));
+	header.version = KUHL_MODEL_CACHE_VERSION;
+	header.flags = flags;
+	header.key = key;
+	header.depHash = depHash;
+	header.depLength = depLength;
+	header.length = blob->size;
+
+	char tmpFilename[1100];
+	snprintf(tmpFilename, 1100, "%s.%d.tmp", cacheFilename, (int) getpid());
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_DEBUG, "Unable to write model cache %s", tmpFilename);
+		aiReleaseExportBlob(blob);
+		return;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for(int i=0; i<deps->length && ok; i++)
+		ok = fwrite(deps->data[i], strlen(deps->data[i])+1, 1, f) == 1;
+	ok = ok && fwrite(blob->data, 1, blob->size, f) == blob->size;
+	if(fclose(f) != 0)
+		ok = 0;
+	aiReleaseExportBlob(blob);
+
+	if(ok == 0)
+	{
+		msg(MSG_WARNING, "Failed to write model cache %s", tmpFilename);
+		remove(tmpFilename);
+		return;
+	}
+#ifdef _WIN32
+	remove(cacheFilename); // rename() won't replace an existing file on Windows
+#endif
+	if(rename(tmpFilename, cacheFilename) != 0)
+	{
+		msg(MSG_WARNING, "Failed to rename %s to %s", tmpFilename, cacheFilename);
+		remove(tmpFilename);
+		return;
+	}
+	msg(MSG_INFO, "Saved model cache: %s (%lu bytes)", cacheFilename, (unsigned long) header.length);
+}
+
+/* Imports a model with ASSIMP using the model cache when possible.
+ *
+ * @param modelFilename The model to import.
+ *
+ * @param flags ASSIMP post-processing flags.
+ *
+ * @param smoothingAngle Value for the PP_GSN_MAX_SMOOTHING_ANGLE
+ * import property.
+ *
+ * @return The imported scene or NULL on error.
+ */
+static const struct aiScene* kuhl_private_assimp_import(const char *modelFilename,
+                                                        unsigned int flags, float smoothingAngle)
+{
+	long startTime = kuhl_microseconds();
+	int useCache = kuhl_config_boolean("model.cache", 1, 1);
+	uint64_t key = 0;
+	char *cacheFilename = NULL;
+	if(useCache && kuhl_private_model_cache_key(&key, modelFilename, flags, smoothingAngle))
+	{
+		cacheFilename = kuhl_private_model_cache_filename(modelFilename, key);
+		const struct aiScene *scene = kuhl_private_model_cache_read(cacheFilename, key, flags);
+		if(scene != NULL)
+		{
+			msg(MSG_INFO, "Loaded model from cache %s in %ld ms", cacheFilename,
+			    (kuhl_microseconds()-startTime)/1000);
+			free(cacheFilename);
+			return scene;
+		}
+	}
+
+	struct aiPropertyStore* propStore = aiCreatePropertyStore();
+	aiSetImportPropertyFloat(propStore, "PP_GSN_MAX_SMOOTHING_ANGLE", smoothingAngle);
+	char *modelFilenameVarying = strdup(modelFilename); // aiImportFile doesn't declare filaname parameter as const!
+
+	/* When caching, record the files that ASSIMP opens. */
+	kuhl_model_deps deps;
+	kuhl_model_deps_init(&deps, 8);
+	struct aiFileIO fileIO;
+	fileIO.OpenProc = kuhl_private_aifile_open;
+	fileIO.CloseProc = kuhl_private_aifile_close;
+	fileIO.UserData = (aiUserData) &deps;
+
+	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, flags,
+	                                                           cacheFilename ? &fileIO : NULL, propStore);
+	free(modelFilenameVarying);
+	aiReleasePropertyStore(propStore);
+	if(scene != NULL)
+	{
+		msg(MSG_INFO, "Imported model %s in %ld ms", modelFilename, (kuhl_microseconds()-startTime)/1000);
+		if(cacheFilename)
+			kuhl_private_model_cache_write(cacheFilename, scene, key, flags, &deps);
+	}
+	for(int i=0; i<deps.length; i++)
+		free(deps.data[i]);
+	kuhl_model_deps_free(&deps);
+	free(cacheFilename);
+	return scene;
+}
+
+/** Uses ASSIMP to load model (if needed) and returns ASSIMP aiScene
+ * object. This function also calls kuhl_tead_texture_file() when
+ * necessary to load the appropriate texture files that the model
+ * refers to. This function does not create any kuhl_geometry structs
+ * for the model.
+ *
+ * @param modelFilename The filename of a model to load.
+ *
+ * @param textureDirname The directory the textures for the model are
+ * stored in. If textureDirname is NULL, we assume that the textures
+ * are in the same directory as the model file.
+ *
+ * @return An ASSIMP aiScene object for the requested model. Returns
+ * NULL on error.
+ */
+static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename, const char *textureDirname)
+{
+	/* If we get here, we need to add the file to the sceneMap. */
+	msg(MSG_INFO, "Loading model: %s\n", modelFilename);
+
+	/* Write assimp messages to msg log */
+	struct aiLogStream stream;
+	stream = aiGetPredefinedLogStream(aiDefaultLogStream_STDOUT,NULL);
+	if(stream.callback != msg_assimp_callback)
+	{
+		// we only need to set this up once.
+		stream.callback = msg_assimp_callback;
+		stream.user = strdup(modelFilename); // memory leak
+		aiAttachLogStream(&stream);
+	}
+	
+	/* Try loading the model. We are using a postprocessing preset
+	 * here so we don't have to set many options.
+	 *
+	 * We will load the file and do significant processing (split
+	 * large meshes into smaller ones, triangulate polygons in meshes,
+	 * apply transformation matrices. For more information about model
+	 * loading options, see:
+	 * http://assimp.sourceforge.net/lib_html/postprocess_8h.html
+	 *
+	 * The postprocess procedures can greatly influence how long it
+	 * takes to load a model. If you are trying to load a large model,
+	 * try setting the post-process settings to 0.
+	 *
+	 * Other options which trigger multiple other options:
+	 * aiProcessPreset_TargetRealtime_Fast
+	 * aiProcessPreset_TargetRealtime_Quality
+	 * aiProcessPreset_TargetRealtime_MaxQuality
+	 *
+	 * Individual options:
+	 * 0                     - do nothing
+	 * aiProcess_Triangulate - Triangulate polygons into triangles
+	 * aiProcess_SortByPType - Put each primitive type into its own mesh
+	 * aiProcess_GenNormals  - Generate flat normals if normals aren't present in file
+	 * aiProcess_GenSmoothNormals - Generate smooth normals if normals aren't present in file
+	 * aiProcess_LimitBoneWeights - Limits bone weights per vertex to 4
+	 * aiProcess_JoinIdenticalVertices - Ensures that the model uses an index buffer.
+	 * aiProcess_PreTransformVertices - Pretransforms all vertices according to matrices in the model file
+	 */
+
+	// If we are generating smooth normals, don't smooth edges that
+	// are 80 degrees or higher (i.e., use flat normals on a cube).
+	float smoothingAngle = 50.0f;
+	// Import/load the model (or read it from the model cache)
+	int aiProcessFlags = aiProcess_Triangulate|aiProcess_SortByPType; // required! Use only these flags for fast loading.
+	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
+	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
+	aiProcessFlags |= aiProcess_OptimizeMeshes|aiProcess_OptimizeGraph; // fixes models with many small meshes
+	const struct aiScene* scene = kuhl_private_assimp_import(modelFilename, aiProcessFlags, smoothingAngle);
+	if(scene == NULL)
+		return NULL;
+
+	/* Print warning messages if the model uses features that our code
+	 * doesn't support (even though ASSIMP might support them). */
+	if(scene->mNumCameras > 0)
+		msg(MSG_DEBUG, "%s: This model has %u camera(s) embedded in it that we are ignoring.\n",
+		       modelFilename, scene->mNumCameras);
+	if(scene->mNumLights > 0)
+		msg(MSG_DEBUG, "%s: This model has %u light(s) embedded in it that we are ignoring.\n",
+		       modelFilename, scene->mNumLights);
+	//if(scene->mNumTextures > 0)
+	//	msg(MSG_DEBUG, "%s: This model has %u texture(s) embedded in it.\n",
+	//	       modelFilename, scene->mNumTextures);
+
+	// Uncomment this line to print additional information about the model:
+	//kuhl_print_aiScene_info(modelFilename, scene);
+
+	/* Make a list of the textures which need to be loaded. They are
+	 * all loaded at once (in parallel) after this loop. */
+	int numJobs = 0;
+	kuhl_texture_job *jobs = NULL;
+
+	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
+	for(unsigned int m=0; m < scene->mNumMaterials; m++)
 	{
 		for(int tt=0; tt<TEX_TYPE_LEN; tt++) // for each texture type
 		{
@@ -2936,17 +3673,13 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 			GLuint texIndex = 0;
 			if(aiGetMaterialTexture(scene->mMaterials[m], texTypeList[tt],  texIndex, &path, NULL, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS)
 			{
-				/* Don't load a texture that we have already loaded. */
+				/* Don't load a texture that we have already loaded
+				 * (or that is already in the list to load). */
 				char *fullpath = kuhl_private_assimp_fullpath(path.data, modelFilename, textureDirname);
-				int alreadyExists = 0;
-				for(int i=0; i<textureIdMapSize; i++)
-				{
-					if(strcmp(fullpath, textureIdMap[i].textureFileName) == 0)
-					{
-						alreadyExists=1;
-						break;
-					}
-				}
+				int alreadyExists = kuhl_private_texmap_find(fullpath, NULL);
+				for(int i=0; i<numJobs && !alreadyExists; i++)
+					if(strcmp(fullpath, jobs[i].fullpath) == 0)
+						alreadyExists = 1;
 
 				if(alreadyExists > 0) // no need to reload an already loaded texture
 				{
@@ -2954,6 +3687,16 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 					continue; // skip to next material.
 				}
 
+				jobs = realloc(jobs, sizeof(kuhl_texture_job)*(numJobs+1));
+				if(jobs == NULL)
+				{
+					msg(MSG_FATAL, "Failed to allocate memory for texture list.");
+					exit(EXIT_FAILURE);
+				}
+				kuhl_texture_job *job = &(jobs[numJobs]);
+				memset(job, 0, sizeof(kuhl_texture_job));
+				job->fullpath = fullpath;
+				numJobs++;
 
 				/* Load the embedded texture. In this case,
 				   path.data will be *1, *2, etc...
@@ -2963,22 +3706,12 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 				{
 					int embeddedInt = atoi(&path.data[1]);
 					struct aiTexture *embTex = scene->mTextures[embeddedInt];
-					unsigned char *image = NULL;
 					
 					msg(MSG_INFO, "Loading embedded texture %s width width %d, height %d, hint %s\n", modelFilename, embTex->mWidth, embTex->mHeight, embTex->achFormatHint);
 					if(embTex->mHeight == 0) // if compressed, mHeight=0 and mWidth is length of array
 					{
-						int components;
-						int width, height;
-						image = stbi_load_from_memory((unsigned char *)embTex->pcData, embTex->mWidth, &width, &height, &components, 4);
-						//FILE *f = fopen("/tmp/img.jpg", "w");
-						//fwrite(embTex->pcData, embTex->mWidth, 1, f);
-						//fclose(f);
-						//exit(1);
-						
-						msg(MSG_WARNING, "Compressed image actually has width %d, height %d, components %d\n", width, height, components);
-						texIndex = kuhl_read_texture_array(image, width, height, 4, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
-						free(image);
+						job->embedded = (const unsigned char*) embTex->pcData;
+						job->embeddedLen = embTex->mWidth;
 					}
 					else
 					{
@@ -2987,22 +3720,8 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 					}
 				}
 				/* Or, read the external texture */
-				else if(kuhl_read_texture_file(fullpath, &texIndex) < 0)
-					msg(MSG_WARNING, "%s refers to texture %s which we could not find at %s\n", modelFilename, path.data, fullpath);
-
-				/* Store the texture information in our list structure so
-				 * we can find the textureID from the filename when we
-				 * render the scene. */
-				if(textureIdMapSize >= textureIdMapMaxSize)
-				{
-					msg(MSG_FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
-					exit(EXIT_FAILURE);
-				}
-
-				textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
-				textureIdMap[textureIdMapSize].textureID = texIndex;
-				textureIdMapSize++;
-				free(fullpath);
+				else
+					job->filename = kuhl_find_file(fullpath);
 			} // end if texture exists
 			else
 				msg(MSG_WARNING, "Failed to load a %s texture for an unknown reason.\n", texTypeListStr[tt]);
@@ -3037,120 +3756,389 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 #endif
 	} // end for each material
 
+	/* Decode and upload the textures. Then, store the texture
+	 * information in our map so we can find the textureID from the
+	 * filename when we render the scene. */
+	kuhl_private_texture_load_jobs(jobs, numJobs);
+	for(int i=0; i<numJobs; i++)
+	{
+		kuhl_private_texmap_add(jobs[i].fullpath, jobs[i].texName);
+		free(jobs[i].fullpath);
+		free(jobs[i].filename);
+	}
+	free(jobs);
 
 	return scene;
 }
 
+/** Finds the keyframe which is at or immediately before the
+ * requested time. All ASSIMP key structs (aiVectorKey, aiQuatKey)
+ * begin with a double named mTime, so this function can search any
+ * of them if we tell it how large each key is.
+ *
+ * If a cursor is provided, we first check if the key that we found
+ * last time (or the one after it) is still the correct one. This
+ * makes lookups O(1) when an animation is played forward. If the
+ * cursor is wrong (e.g., the animation looped or the caller jumped
+ * to a different time), we fall back to a binary search and update
+ * the cursor.
+ *
+ * @param keys The array of keys to search.
+ * @param stride The size of each key in bytes.
+ * @param numKeys The number of keys in the array.
+ * @param ticks The time of the animation in TICKS.
+ * @param cursor The index of the key that was found last time. Updated by this function. Can be NULL.
+ * @return The index of the key at or before ticks. Returns 0 if
+ * ticks is before the first key and numKeys-1 if ticks is after the
+ * last key.
+ */
+static unsigned int kuhl_private_anim_key(const void *keys, size_t stride, unsigned int numKeys,
+                                          double ticks, unsigned int *cursor)
+{
+#define KEY_TIME(i) (*(const double*)((const char*)keys + (size_t)(i)*stride))
+	if(numKeys < 2 || ticks <= KEY_TIME(0))
+		return 0;
+	if(ticks >= KEY_TIME(numKeys-1))
+		return numKeys-1;
+
+	if(cursor != NULL && *cursor < numKeys-1)
+	{
+		unsigned int c = *cursor;
+		if(KEY_TIME(c) <= ticks && ticks < KEY_TIME(c+1))
+			return c;
+		/* Playing forward, we usually only need to advance one key. */
+		if(c+2 < numKeys && KEY_TIME(c+1) <= ticks && ticks < KEY_TIME(c+2))
+		{
+			*cursor = c+1;
+			return c+1;
+		}
+	}
+
+	/* Binary search. KEY_TIME(lo) <= ticks < KEY_TIME(hi) is always true. */
+	unsigned int lo = 0, hi = numKeys-1;
+	while(hi - lo > 1)
+	{
+		unsigned int mid = lo + (hi-lo)/2;
+		if(KEY_TIME(mid) <= ticks)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if(cursor != NULL)
+		*cursor = lo;
+	return lo;
+#undef KEY_TIME
+}
+
+/** Calculates how far between two keys a time is.
+
+    @param startTime The time of the first key.
+    @param endTime The time of the second key.
+    @param ticks A time between (or equal to) the two keys.
+    @return A value from 0 (at first key) to 1 (at second key).
+*/
+static float kuhl_private_anim_factor(double startTime, double endTime, double ticks)
+{
+	double deltaTime = endTime - startTime;
+	if(deltaTime <= 0)
+		return 0;
+	double factor = (ticks - startTime)/deltaTime;
+	if(factor < 0)
+		return 0;
+	if(factor > 1)
+		return 1;
+	return (float) factor;
+}
+
+/** Calculates the interpolated position, rotation and scaling of an
+ * aiNodeAnim at the given time.
+ *
+ * @param pos To be filled in with the position.
+ * @param rot To be filled in with the rotation quaternion (x,y,z,w).
+ * @param scale To be filled in with the scaling factors.
+ * @param na The aiNodeAnim to sample.
+ * @param ticks The time of the animation in TICKS (not seconds!)
+ * @param cursor Cursor for this channel, see kuhl_anim_sample(). Can be NULL.
+ */
+static void kuhl_private_anim_values(float pos[3], float rot[4], float scale[3],
+                                     const struct aiNodeAnim *na, double ticks,
+                                     kuhl_anim_cursor *cursor)
+{
+	/* Position: Find the two nearest keys and linearly interpolate between them. */
+	unsigned int start = kuhl_private_anim_key(na->mPositionKeys, sizeof(struct aiVectorKey),
+	                                           na->mNumPositionKeys, ticks,
+	                                           cursor ? &cursor->position : NULL);
+	unsigned int end = start+1 < na->mNumPositionKeys ? start+1 : start;
+	float factor = kuhl_private_anim_factor(na->mPositionKeys[start].mTime, na->mPositionKeys[end].mTime, ticks);
+	const struct aiVector3D *p0 = &(na->mPositionKeys[start].mValue);
+	const struct aiVector3D *p1 = &(na->mPositionKeys[end].mValue);
+	vec3f_set(pos,
+	          p0->x + (p1->x - p0->x)*factor,
+	          p0->y + (p1->y - p0->y)*factor,
+	          p0->z + (p1->z - p0->z)*factor);
+
+	/* Rotation: Find the two nearest keys and slerp between them. */
+	start = kuhl_private_anim_key(na->mRotationKeys, sizeof(struct aiQuatKey),
+	                              na->mNumRotationKeys, ticks,
+	                              cursor ? &cursor->rotation : NULL);
+	end = start+1 < na->mNumRotationKeys ? start+1 : start;
+	factor = kuhl_private_anim_factor(na->mRotationKeys[start].mTime, na->mRotationKeys[end].mTime, ticks);
+	const struct aiQuaternion *q0 = &(na->mRotationKeys[start].mValue);
+	const struct aiQuaternion *q1 = &(na->mRotationKeys[end].mValue);
+	float rotStart[4] = { q0->x, q0->y, q0->z, q0->w };
+	float rotEnd[4]   = { q1->x, q1->y, q1->z, q1->w };
+	if(start == end)
+		vec4f_copy(rot, rotStart);
+	else
+		quatf_slerp_new(rot, rotStart, rotEnd, factor);
+
+	/* Scaling: Find the two nearest keys and linearly interpolate between them. */
+	start = kuhl_private_anim_key(na->mScalingKeys, sizeof(struct aiVectorKey),
+	                              na->mNumScalingKeys, ticks,
+	                              cursor ? &cursor->scaling : NULL);
+	end = start+1 < na->mNumScalingKeys ? start+1 : start;
+	factor = kuhl_private_anim_factor(na->mScalingKeys[start].mTime, na->mScalingKeys[end].mTime, ticks);
+	const struct aiVector3D *s0 = &(na->mScalingKeys[start].mValue);
+	const struct aiVector3D *s1 = &(na->mScalingKeys[end].mValue);
+	vec3f_set(scale,
+	          s0->x + (s1->x - s0->x)*factor,
+	          s0->y + (s1->y - s0->y)*factor,
+	          s0->z + (s1->z - s0->z)*factor);
+}
+
+/** Creates the matrix translation * rotation * scaling without
+ * performing any matrix multiplications.
+ *
+ * @param result The resulting transformation matrix.
+ * @param pos The translation.
+ * @param rot The rotation quaternion (x,y,z,w).
+ * @param scale The scaling factors.
+ */
+static void kuhl_private_anim_compose(float result[16], const float pos[3], const float rot[4], const float scale[3])
+{
+	mat4f_rotateQuatVec_new(result, rot);
+	/* Scaling first scales each column of the rotation matrix */
+	for(int col=0; col<3; col++)
+		for(int row=0; row<3; row++)
+			result[col*4+row] *= scale[col];
+	/* Translation goes in the last column */
+	result[12] = pos[0];
+	result[13] = pos[1];
+	result[14] = pos[2];
+}
+
 /** Given a aiNodeAnim object and a time, return an appropriate
  * transformation matrix.
  *
- * @param transformResult The resulting transformation matrix.
- * @param na The aiNodeAnim to generate the matrix form.
+ * @param result The resulting transformation matrix (translation * rotation * scaling).
+ *
+ * @param na The aiNodeAnim to generate the matrix from.
+ *
  * @param ticks The time of the animation in TICKS (not seconds!)
+ *
+ * @param cursor Remembers which keys were used the last time this
+ * channel was sampled so that sampling an animation that is moving
+ * forward in time doesn't require searching the keys. Should be
+ * zeroed before the first use. If NULL, keys are found with a binary
+ * search.
+ */
+void kuhl_anim_sample(float result[16], const struct aiNodeAnim *na, double ticks, kuhl_anim_cursor *cursor)
+{
+	float pos[3], rot[4], scale[3];
+	kuhl_private_anim_values(pos, rot, scale, na, ticks, cursor);
+	kuhl_private_anim_compose(result, pos, rot, scale);
+}
+
+/** Resamples an animation channel at a uniform rate and stores the
+ * samples in a structure of arrays. Sampling the resulting track does
+ * not require searching for keys: The two samples surrounding a time
+ * are found by dividing the time by the sample spacing.
+ *
+ * @param track The track to fill in. Free with kuhl_anim_track_free().
+ *
+ * @param na The animation channel to resample.
+ *
+ * @param duration The duration of the animation (in ticks).
+ *
+ * @param ticksPerFrame The spacing between the samples (in ticks).
+ *
+ * @return 1 on success, 0 on failure.
  */
-static void kuhl_private_anim_matrix(float transformResult[16], const struct aiNodeAnim *na, double ticks)
+int kuhl_anim_track_new(kuhl_anim_track *track, const struct aiNodeAnim *na, double duration, double ticksPerFrame)
 {
+	memset(track, 0, sizeof(kuhl_anim_track));
+	if(ticksPerFrame <= 0 || duration < 0)
+		return 0;
+	
+	track->frames = (unsigned int) ceil(duration / ticksPerFrame) + 1;
+	track->ticksPerFrame = ticksPerFrame;
+	track->data = kuhl_malloc(sizeof(float)*10*track->frames);
+	if(track->data == NULL)
+		return 0;
+	for(int i=0; i<3; i++)
+	{
+		track->pos[i]   = track->data + track->frames*i;
+		track->scale[i] = track->data + track->frames*(3+i);
+	}
+	for(int i=0; i<4; i++)
+		track->rot[i] = track->data + track->frames*(6+i);
 
-	/* Find indices of start and stop position keys */
-	unsigned int positionStart = 0;
-	for(unsigned int j=0; j<na->mNumPositionKeys-1; j++)
-		if(ticks < na->mPositionKeys[j+1].mTime)
+	kuhl_anim_cursor cursor = { 0, 0, 0 };
+	for(unsigned int f=0; f<track->frames; f++)
+	{
+		double ticks = f * ticksPerFrame;
+		if(ticks > duration)
+			ticks = duration;
+		float pos[3], rot[4], scale[3];
+		kuhl_private_anim_values(pos, rot, scale, na, ticks, &cursor);
+		quatf_normalize(rot);
+		for(int i=0; i<3; i++)
 		{
-			positionStart = j;
-			break;
+			track->pos[i][f]   = pos[i];
+			track->scale[i][f] = scale[i];
 		}
-	unsigned int positionEnd = positionStart+1;
-	if(positionEnd >= na->mNumPositionKeys)
-		positionEnd = positionStart;
-	/* Determine where we are in relation to the two nearest keys */
-	float deltaTime = na->mPositionKeys[positionEnd].mTime - na->mPositionKeys[positionStart].mTime;
-	float factor;
-	if(deltaTime != 0)
-		factor = (ticks - na->mPositionKeys[positionStart].mTime)/deltaTime;
-	else
-		factor = 0;
+		for(int i=0; i<4; i++)
+			track->rot[i][f] = rot[i];
+	}
+	return 1;
+}
+
+/** Frees the samples stored in a kuhl_anim_track.
+
+    @param track The track created by kuhl_anim_track_new().
+*/
+void kuhl_anim_track_free(kuhl_anim_track *track)
+{
+	if(track == NULL)
+		return;
+	free(track->data);
+	memset(track, 0, sizeof(kuhl_anim_track));
+}
+
+/** Samples a track created by kuhl_anim_track_new().
+
+    @param result The resulting transformation matrix (translation * rotation * scaling). Set to the identity if the track has no samples.
+    @param track The track to sample.
+    @param ticks The time of the animation in TICKS (not seconds!)
+*/
+void kuhl_anim_track_sample(float result[16], const kuhl_anim_track *track, double ticks)
+{
+	if(track->frames == 0)
+	{
+		mat4f_identity(result);
+		return;
+	}
+
+	double f = ticks / track->ticksPerFrame;
+	if(f < 0)
+		f = 0;
+	unsigned int start = (unsigned int) f;
+	if(start >= track->frames-1)
+	{
+		start = track->frames-1;
+		f = start;
+	}
+	unsigned int end = start+1 < track->frames ? start+1 : start;
+	float factor = (float)(f - start);
+
+	float pos[3], rot[4], scale[3];
+	for(int i=0; i<3; i++)
+	{
+		pos[i]   = track->pos[i][start]   + (track->pos[i][end]   - track->pos[i][start])*factor;
+		scale[i] = track->scale[i][start] + (track->scale[i][end] - track->scale[i][start])*factor;
+	}
+	/* Samples are close together, so normalized linear
+	 * interpolation is indistinguishable from slerp here. */
+	float dot = 0;
+	for(int i=0; i<4; i++)
+		dot += track->rot[i][start] * track->rot[i][end];
+	float endSign = dot < 0 ? -1.0f : 1.0f;
+	for(int i=0; i<4; i++)
+		rot[i] = track->rot[i][start] + (endSign*track->rot[i][end] - track->rot[i][start])*factor;
+	quatf_normalize(rot);
 	
-	/* Interpolate between two nearest keys */
-	float positionValStart[3] = { na->mPositionKeys[positionStart].mValue.x,
-	                              na->mPositionKeys[positionStart].mValue.y,
-	                              na->mPositionKeys[positionStart].mValue.z };
-	float positionValEnd[3] = { na->mPositionKeys[positionEnd].mValue.x,
-	                            na->mPositionKeys[positionEnd].mValue.y,
-	                            na->mPositionKeys[positionEnd].mValue.z };
-	float positionValMid[3];
-	vec3f_scalarMult(positionValStart, (1-factor));
-	vec3f_scalarMult(positionValEnd, factor);
-	vec3f_add_new(positionValMid, positionValStart, positionValEnd);
-	float positionMatrix[16];
-	mat4f_translateVec_new(positionMatrix, positionValMid);
-
-	/* Find indices of start and stop rotation keys */
-	unsigned int rotationStart = 0;
-	for(unsigned int j=0; j<na->mNumRotationKeys-1; j++)
-		if(ticks < na->mRotationKeys[j+1].mTime)
+	kuhl_private_anim_compose(result, pos, rot, scale);
+}
+
+/** Creates the animation state for a model. The state contains a
+ * cursor for each channel of each animation (see kuhl_anim_sample())
+ * and, optionally, a copy of each channel resampled at a uniform rate
+ * (see kuhl_anim_track_new()).
+ *
+ * @param scene The ASSIMP scene containing the animations.
+ *
+ * @param resampleRate If positive, resample every animation at this
+ * many samples per second. If 0, the keys in the file are used
+ * directly.
+ *
+ * @return The animation state for the model or NULL if the model has
+ * no animations. Free with kuhl_anim_free().
+ */
+kuhl_anim* kuhl_anim_new(const struct aiScene *scene, float resampleRate)
+{
+	if(scene == NULL || scene->mNumAnimations == 0)
+		return NULL;
+
+	kuhl_anim *anim = kuhl_malloc(sizeof(kuhl_anim));
+	anim->scene = scene;
+	anim->numAnimations = scene->mNumAnimations;
+	anim->cursors = kuhl_malloc(sizeof(kuhl_anim_cursor*)*anim->numAnimations);
+	anim->tracks = NULL;
+	for(unsigned int a=0; a<anim->numAnimations; a++)
+	{
+		unsigned int numChannels = scene->mAnimations[a]->mNumChannels;
+		anim->cursors[a] = calloc(numChannels > 0 ? numChannels : 1, sizeof(kuhl_anim_cursor));
+	}
+
+	if(resampleRate <= 0)
+		return anim;
+
+	long startTime = kuhl_microseconds();
+	unsigned long samples = 0;
+	anim->tracks = kuhl_malloc(sizeof(kuhl_anim_track*)*anim->numAnimations);
+	for(unsigned int a=0; a<anim->numAnimations; a++)
+	{
+		const struct aiAnimation *an = scene->mAnimations[a];
+		anim->tracks[a] = NULL;
+		/* If we don't know how many ticks are in a second, we can't
+		 * resample. Use the keys in the file instead. */
+		if(an->mTicksPerSecond <= 0 || an->mNumChannels == 0)
+			continue;
+
+		double ticksPerFrame = an->mTicksPerSecond / resampleRate;
+		anim->tracks[a] = kuhl_malloc(sizeof(kuhl_anim_track)*an->mNumChannels);
+		for(unsigned int c=0; c<an->mNumChannels; c++)
 		{
-			rotationStart = j;
-			break;
+			kuhl_anim_track_new(&(anim->tracks[a][c]), an->mChannels[c], an->mDuration, ticksPerFrame);
+			samples += anim->tracks[a][c].frames;
 		}
-	unsigned int rotationEnd = rotationStart+1;
-	if(rotationEnd >= na->mNumRotationKeys)
-		rotationEnd = rotationStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mRotationKeys[rotationEnd].mTime - na->mRotationKeys[rotationStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mRotationKeys[rotationStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float rotationValStart[4] = { na->mRotationKeys[rotationStart].mValue.x,
-	                              na->mRotationKeys[rotationStart].mValue.y,
-	                              na->mRotationKeys[rotationStart].mValue.z,
-	                              na->mRotationKeys[rotationStart].mValue.w };
-	float rotationValEnd[4] = { na->mRotationKeys[rotationEnd].mValue.x,
-	                            na->mRotationKeys[rotationEnd].mValue.y,
-	                            na->mRotationKeys[rotationEnd].mValue.z,
-	                            na->mRotationKeys[rotationEnd].mValue.w };
-	float rotationValMid[4];
-	//vec4f_normalize(rotationValStart);
-	//vec4f_normalize(rotationValEnd);
-	quatf_slerp_new(rotationValMid, rotationValStart, rotationValEnd, factor);
-	float rotationMatrix[16];
-	mat4f_rotateQuatVec_new(rotationMatrix, rotationValMid);
-
-	/* Find indices of start and stop scaling keys */
-	unsigned int scalingStart = 0;
-	for(unsigned int j=0; j<na->mNumScalingKeys-1; j++)
-		if(ticks < na->mScalingKeys[j+1].mTime)
+	}
+	msg(MSG_DEBUG, "Resampled %u animation(s) at %.1f samples/sec (%lu samples) in %ld microseconds",
+	    anim->numAnimations, resampleRate, samples, kuhl_microseconds()-startTime);
+	return anim;
+}
+
+/** Frees animation state created by kuhl_anim_new().
+
+    @param anim The animation state to free.
+*/
+void kuhl_anim_free(kuhl_anim *anim)
+{
+	if(anim == NULL)
+		return;
+	for(unsigned int a=0; a<anim->numAnimations; a++)
+	{
+		free(anim->cursors[a]);
+		if(anim->tracks && anim->tracks[a])
 		{
-			scalingStart = j;
-			break;
+			for(unsigned int c=0; c<anim->scene->mAnimations[a]->mNumChannels; c++)
+				kuhl_anim_track_free(&(anim->tracks[a][c]));
+			free(anim->tracks[a]);
 		}
-	unsigned int scalingEnd = scalingStart+1;
-	if(scalingEnd >= na->mNumScalingKeys)
-		scalingEnd = scalingStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mScalingKeys[scalingEnd].mTime - na->mScalingKeys[scalingStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mScalingKeys[scalingStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float scalingValStart[3] = { na->mScalingKeys[scalingStart].mValue.x,
-	                             na->mScalingKeys[scalingStart].mValue.y,
-	                             na->mScalingKeys[scalingStart].mValue.z };
-	float scalingValEnd[3] = { na->mScalingKeys[scalingEnd].mValue.x,
-	                           na->mScalingKeys[scalingEnd].mValue.y,
-	                           na->mScalingKeys[scalingEnd].mValue.z };
-	float scalingValMid[3];
-	vec3f_scalarMult(scalingValStart, (1-factor));
-	vec3f_scalarMult(scalingValEnd, factor);
-	vec3f_add_new(scalingValMid, scalingValStart, scalingValEnd);
-	float scalingMatrix[16];
-	mat4f_scaleVec_new(scalingMatrix, scalingValMid);
-	
-	// transformResult = translation * rotation * scaling
-	mat4f_mult_mat4f_new(transformResult, positionMatrix, rotationMatrix);
-	mat4f_mult_mat4f_new(transformResult, transformResult, scalingMatrix);
+	}
+	free(anim->cursors);
+	free(anim->tracks);
+	free(anim);
 }
 
 /* Returns the transformation matrix for a node (without considering
@@ -3167,6 +4155,12 @@ static void kuhl_private_anim_matrix(float transformResult[16], const struct aiN
  * @param node The ASSIMP node object that we want animation
  * information about.
  *
+ * @param anim The animation state (resampled tracks) created by
+ * kuhl_anim_new() for this scene. Can be NULL.
+ *
+ * @param cursors The keyframe cursors for each channel of the
+ * requested animation. Can be NULL.
+ *
  * @param animationNum If the file contains more than one animation,
  * indicates which animation to use. If you don't know, set this to 0.
  *
@@ -3181,6 +4175,8 @@ static void kuhl_private_anim_matrix(float transformResult[16], const struct aiN
 static int kuhl_private_node_matrix(float transformResult[16],
                                     const struct aiScene *scene,
                                     const struct aiNode *node,
+                                    const kuhl_anim *anim,
+                                    kuhl_anim_cursor *cursors,
                                     unsigned int animationNum, double t)
 {
 	/* Copy the transform matrix from the node itself. This is the
@@ -3194,28 +4190,34 @@ static int kuhl_private_node_matrix(float transformResult[16],
 	if(animationNum >= scene->mNumAnimations || t < 0)
 		return 0;
 
-	struct aiAnimation *anim = scene->mAnimations[animationNum];
+	struct aiAnimation *animation = scene->mAnimations[animationNum];
 
-	double currentTick = t * anim->mTicksPerSecond;
+	double currentTick = t * animation->mTicksPerSecond;
 
 	/* If the time value too large for the animation, return the
 	 * transformation matrix from the node. */
 	//if(currentTick > anim->mDuration)
 	//	return 0;
 	/* OR, if the time value is too large, use the transformation at the final tick. */
-	if(currentTick > anim->mDuration)
-		currentTick = anim->mDuration;
+	if(currentTick > animation->mDuration)
+		currentTick = animation->mDuration;
 
 	/* Find the channel corresponding to the node name passed in as
 	 * parameter. */
-	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	for(unsigned int i=0; i<animation->mNumChannels; i++)
 	{
-		if(strcmp(anim->mChannels[i]->mNodeName.data, node->mName.data) == 0)
+		if(strcmp(animation->mChannels[i]->mNodeName.data, node->mName.data) == 0)
 		{
 			/* Get this node's matrix according to the animation
-			 * information. */
-			struct aiNodeAnim *na = anim->mChannels[i];
-			kuhl_private_anim_matrix(transformResult, na, currentTick);
+			 * information. Use the resampled track if there is one,
+			 * otherwise use the keys and the cursor for this
+			 * channel. */
+			struct aiNodeAnim *na = animation->mChannels[i];
+			if(anim != NULL && anim->scene == scene && anim->tracks && anim->tracks[animationNum] &&
+			   anim->tracks[animationNum][i].frames > 0)
+				kuhl_anim_track_sample(transformResult, &(anim->tracks[animationNum][i]), currentTick);
+			else
+				kuhl_anim_sample(transformResult, na, currentTick, cursors ? &(cursors[i]) : NULL);
 			return 1;
 		}
 	}
@@ -3544,13 +4546,9 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			                                      NULL, NULL, NULL, NULL, NULL, NULL))
 			{
 				GLuint texture = 0;
-				for(int i=0; i<textureIdMapSize; i++)
-				{
-					char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
-					if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
-						texture = textureIdMap[i].textureID;
-					free(fullpath);
-				}
+				char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
+				kuhl_private_texmap_find(fullpath, &texture);
+				free(fullpath);
 				if(texture == 0)
 				{
 					msg(MSG_WARNING, "Mesh %u uses %s texture '%s'."
@@ -3602,6 +4600,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			kuhl_bonemat *bones = (kuhl_bonemat*) kuhl_malloc(sizeof(kuhl_bonemat));
 			bones->count = mesh->mNumBones;
 			bones->mesh = n;
+			bones->paletteOffset = -1;
 			for(unsigned int b=0; b < mesh->mNumBones; b++)
 				bones->boneList[b] = mesh->mBones[b];
 			// set any unused bone matrices to the identity.
@@ -3638,6 +4637,103 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 }
 
 
+/* Calculates the matrices which animate one kuhl_geometry object at
+ * a specific time. This function doesn't call OpenGL or modify the
+ * geometry, so it can be called from any thread as long as each
+ * thread uses its own cursors and output matrices.
+ *
+ * @param matrix To be filled in with the GeomTransform matrix. Only
+ * modified if the geometry has no bones.
+ *
+ * @param boneMatrices To be filled in with one matrix for each bone
+ * in g->bones. Only modified if the geometry has bones.
+ *
+ * @param g The geometry to animate.
+ *
+ * @param cursors Keyframe cursors for each channel of the requested
+ * animation. Can be NULL.
+ *
+ * @param animationNum The animation to use.
+ *
+ * @param time The time in seconds. Negative values produce the bind
+ * pose.
+ */
+static void kuhl_private_update_geom(float matrix[16], float boneMatrices[][16],
+                                     const kuhl_geometry *g, kuhl_anim_cursor *cursors,
+                                     unsigned int animationNum, float time)
+{
+	/* The aiScene object that this kuhl_geometry refers to. */
+	struct aiScene *scene = g->assimp_scene;
+	/* The aiNode object that this kuhl_geometry refers to. */
+	struct aiNode *node = g->assimp_node;
+
+	/* If the geometry contains no animations, isn't associated
+	 * with an ASSIMP scene or node, then there is no need to try
+	 * to animate it. */
+	if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
+		return;
+
+	/* If there are no bones, or if a negative time value was
+	 * provided, update g->matrix. If there are bones, we assume
+	 * that the bones will drive the animation. */
+	if(g->bones == NULL )
+	{
+		/* Start at our current node and traverse up. Apply all of the
+		 * transformation matrices as we traverse up.
+		 *
+		 * TODO: By repeatedly traversing up, we repeatedly
+		 * recalculate the transformation matrices for the nodes
+		 * near the root---potentially reducing performance.
+		 */
+		mat4f_identity(matrix);
+		do
+		{
+			float transform[16];
+			kuhl_private_node_matrix(transform, scene, node, g->anim, cursors, animationNum, time);
+			mat4f_mult_mat4f_new(matrix, transform, matrix);
+			node = node->mParent;
+		} while(node != NULL);
+
+		return;
+	}
+
+	/* Update the list of bone matrices. */
+	for(int b=0; b < g->bones->count; b++) // For each bone
+	{
+		// Find the bone node and the bone itself.
+		const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
+		if(node == NULL)
+		{
+			msg(MSG_FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
+			exit(EXIT_FAILURE);
+		}
+		const struct aiBone *bone = g->bones->boneList[b];
+
+
+		/* Start at our current node and traverse up. Apply all of the
+		 * transformation matrices as we traverse up.
+		 *
+		 * TODO: By repeatedly traversing up, we repeatedly
+		 * recalculate the transformation matrices for the nodes
+		 * near the root---potentially reducing performance.
+		 */
+		mat4f_identity(boneMatrices[b]);
+		do
+		{
+			float transform[16];
+			kuhl_private_node_matrix(transform, scene, node, g->anim, cursors, animationNum, time);
+			mat4f_mult_mat4f_new(boneMatrices[b], transform, boneMatrices[b]);
+			node = node->mParent; // move to next node up
+		} while(node != NULL);
+
+		/* Also apply the bone offset */
+		float offset[16];
+		mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
+		mat4f_mult_mat4f_new(boneMatrices[b], boneMatrices[b], offset);
+
+	} // end for each bone
+}
+
 /** Setup a model to draw at a specific time.
 
     @param modelFilename Name of model file to update.
@@ -3652,79 +4748,236 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
 {
 	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
 	{
-		/* The aiScene object that this kuhl_geometry refers to. */
-		struct aiScene *scene = g->assimp_scene;
-		/* The aiNode object that this kuhl_geometry refers to. */
-		struct aiNode *node = g->assimp_node;
+		kuhl_anim_cursor *cursors = NULL;
+		if(g->anim && animationNum < g->anim->numAnimations)
+			cursors = g->anim->cursors[animationNum];
+		kuhl_private_update_geom(g->matrix, g->bones ? g->bones->matrices : NULL,
+		                         g, cursors, animationNum, time);
+	}
+}
 
-		/* If the geometry contains no animations, isn't associated
-		 * with an ASSIMP scene or node, then there is no need to try
-		 * to animate it. */
-		if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
-			continue;
+/** Prepares an instance of an animated model. An instance lets
+ * several copies of the same model be drawn at different points in
+ * the same (or a different) animation. Each instance has its own
+ * keyframe cursors and its own copy of the matrices that animate the
+ * model (a "bone palette"), so many instances can be evaluated in
+ * parallel with kuhl_anim_instance_update_many().
+ *
+ * @param inst The instance to initialize.
+ *
+ * @param model A model returned by kuhl_load_model(). The model
+ * must not be deleted while the instance exists.
+ */
+void kuhl_anim_instance_new(kuhl_anim_instance *inst, kuhl_geometry *model)
+{
+	inst->model = model;
+	inst->animationNum = 0;
+	inst->time = -1;
+	inst->geomCount = kuhl_geometry_count(model);
+
+	/* Each kuhl_geometry gets one matrix for GeomTransform followed
+	 * by one matrix for each of its bones. */
+	inst->offsets = kuhl_malloc(sizeof(unsigned int)*(inst->geomCount > 0 ? inst->geomCount : 1));
+	unsigned int total = 0, i = 0;
+	for(kuhl_geometry *g = model; g != NULL; g = g->next, i++)
+	{
+		inst->offsets[i] = total;
+		total += 1 + (g->bones ? g->bones->count : 0);
+	}
+	inst->palette = kuhl_malloc(sizeof(float)*16*(total > 0 ? total : 1));
+	i = 0;
+	for(kuhl_geometry *g = model; g != NULL; g = g->next, i++)
+	{
+		float (*m)[16] = inst->palette + inst->offsets[i];
+		mat4f_copy(m[0], g->matrix);
+		if(g->bones)
+			memcpy(m[1], g->bones->matrices, sizeof(float)*16*g->bones->count);
+	}
+
+	inst->paletteSize = total;
+	inst->paletteBase = -1;
+
+	inst->cursors = NULL;
+	kuhl_anim *anim = model ? model->anim : NULL;
+	if(anim == NULL)
+		return;
+	inst->cursors = kuhl_malloc(sizeof(kuhl_anim_cursor*)*anim->numAnimations);
+	for(unsigned int a=0; a<anim->numAnimations; a++)
+	{
+		unsigned int numChannels = anim->scene->mAnimations[a]->mNumChannels;
+		inst->cursors[a] = calloc(numChannels > 0 ? numChannels : 1, sizeof(kuhl_anim_cursor));
+	}
+}
 
-		/* If there are no bones, or if a negative time value was
-		 * provided, update g->matrix. If there are bones, we assume
-		 * that the bones will drive the animation. */
-		if(g->bones == NULL )
+/** Frees the memory used by an instance created with
+ * kuhl_anim_instance_new(). The model itself is not freed.
+ *
+ * @param inst The instance to free.
+ */
+void kuhl_anim_instance_free(kuhl_anim_instance *inst)
+{
+	if(inst->cursors && inst->model && inst->model->anim)
+	{
+		for(unsigned int a=0; a<inst->model->anim->numAnimations; a++)
+			free(inst->cursors[a]);
+	}
+	free(inst->cursors);
+	free(inst->offsets);
+	free(inst->palette);
+	inst->cursors = NULL;
+	inst->offsets = NULL;
+	inst->palette = NULL;
+}
+
+/** Calculates the bone palette of an instance for inst->animationNum
+ * at inst->time. This function does not call OpenGL and only writes
+ * to the instance, so different instances can be updated on
+ * different threads at the same time (even if they share a model).
+ *
+ * @param inst The instance to update.
+ */
+void kuhl_anim_instance_update(kuhl_anim_instance *inst)
+{
+	/* The copy in the palette texture (if any) is now out of date. */
+	inst->paletteBase = -1;
+	unsigned int i = 0;
+	for(kuhl_geometry *g = inst->model; g != NULL; g = g->next, i++)
+	{
+		kuhl_anim_cursor *cursors = NULL;
+		if(inst->cursors && inst->animationNum < g->anim->numAnimations)
+			cursors = inst->cursors[inst->animationNum];
+		float (*m)[16] = inst->palette + inst->offsets[i];
+		kuhl_private_update_geom(m[0], m+1, g, cursors, inst->animationNum, inst->time);
+	}
+}
+
+static void kuhl_private_anim_instance_job(void *data, int index)
+{
+	kuhl_anim_instance *insts = (kuhl_anim_instance*) data;
+	kuhl_anim_instance_update(&(insts[index]));
+}
+
+/** Updates many instances in parallel using the library's thread
+ * pool (see threadpool_default()). Set the animationNum and time of
+ * each instance before calling this function. Returns when all of
+ * the instances have been updated.
+ *
+ * @param insts An array of instances.
+ *
+ * @param count The number of instances in the array.
+ */
+void kuhl_anim_instance_update_many(kuhl_anim_instance *insts, unsigned int count)
+{
+	threadpool_for(threadpool_default(), (int) count, kuhl_private_anim_instance_job, insts);
+}
+
+/** Copies the bone palettes of many instances into a single texture
+ * buffer object with one upload. When the instances are drawn with
+ * kuhl_anim_instance_draw(), each mesh is told where its bones are in
+ * the texture buffer instead of sending a BoneMat uniform array on
+ * every draw. Call this function once per frame after the instances
+ * are updated and before they are drawn. Calling it again replaces
+ * the contents of the texture buffer; instances drawn before the call
+ * are not affected.
+ *
+ * To use the palette, the vertex program must declare "uniform
+ * samplerBuffer BoneTex" and "uniform int BoneOffset" (see
+ * viewer.vert). Otherwise, the BoneMat uniform is used.
+ *
+ * Must be called on the thread which owns the OpenGL context.
+ *
+ * @param insts An array of instances.
+ *
+ * @param count The number of instances in the array.
+ */
+void kuhl_anim_instance_upload(kuhl_anim_instance *insts, unsigned int count)
+{
+	static GLint maxTexels = -1;
+	if(maxTexels < 0)
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	size_t maxMatrices = (size_t) maxTexels / 4;
+
+	size_t needed = 0;
+	for(unsigned int i=0; i<count; i++)
+		needed += insts[i].paletteSize;
+	if(needed > maxMatrices)
+		needed = maxMatrices;
+	if(needed > kuhl_palette_capacity)
+	{
+		free(kuhl_palette_staging);
+		kuhl_palette_staging = kuhl_malloc(sizeof(float)*16*needed);
+		kuhl_palette_capacity = needed;
+	}
+
+	/* Instances that don't fit in the texture buffer continue to use
+	 * the BoneMat uniform. */
+	size_t used = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		kuhl_anim_instance *inst = &(insts[i]);
+		if(used + inst->paletteSize > maxMatrices)
 		{
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->matrix);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->matrix, transform, g->matrix);
-				node = node->mParent;
-			} while(node != NULL);
+			inst->paletteBase = -1;
+			continue;
 		}
+		memcpy(kuhl_palette_staging + used*16, inst->palette, sizeof(float)*16*inst->paletteSize);
+		inst->paletteBase = (int) used;
+		used += inst->paletteSize;
+	}
+	if(used < needed)
+		msg(MSG_WARNING, "The bone palettes for %u instances don't fit into a texture buffer (max %ld matrices).",
+		    count, (long) maxMatrices);
+	if(used == 0)
+		return;
+
+	if(kuhl_palette_buffer == 0)
+	{
+		glGenBuffers(1, &kuhl_palette_buffer);
+		glGenTextures(1, &kuhl_palette_texture);
+		glBindBuffer(GL_TEXTURE_BUFFER, kuhl_palette_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, kuhl_palette_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, kuhl_palette_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+
+	/* Give the buffer new storage (so we don't wait for draw calls
+	 * that are still using the old contents) and upload the palette. */
+	glBindBuffer(GL_TEXTURE_BUFFER, kuhl_palette_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(float)*16*used, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(float)*16*used, kuhl_palette_staging);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	kuhl_errorcheck();
+}
 
-		/* Don't process bones if there aren't any. */
+/** Draws an instance of a model. If the instance was uploaded with
+ * kuhl_anim_instance_upload() after it was last updated, the meshes
+ * read their bone matrices from the palette texture buffer. Otherwise,
+ * the matrices calculated by the most recent
+ * kuhl_anim_instance_update() are copied into the model. Must be
+ * called on the thread which owns the OpenGL context.
+ *
+ * @param inst The instance to draw.
+ */
+void kuhl_anim_instance_draw(const kuhl_anim_instance *inst)
+{
+	unsigned int i = 0;
+	for(kuhl_geometry *g = inst->model; g != NULL; g = g->next, i++)
+	{
+		const float (*m)[16] = (const float (*)[16]) (inst->palette + inst->offsets[i]);
 		if(g->bones == NULL)
-			continue;
+			mat4f_copy(g->matrix, m[0]);
+		else if(inst->paletteBase >= 0 && g->boneTexLoc != -1)
+			g->bones->paletteOffset = inst->paletteBase + (int) inst->offsets[i] + 1;
+		else
+			memcpy(g->bones->matrices, m[1], sizeof(float)*16*g->bones->count);
+	}
+	kuhl_geometry_draw(inst->model);
 
-		/* Update the list of bone matrices. */
-		for(int b=0; b < g->bones->count; b++) // For each bone
-		{
-			// Find the bone node and the bone itself.
-			const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
-			if(node == NULL)
-			{
-				msg(MSG_FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
-				exit(EXIT_FAILURE);
-			}
-			const struct aiBone *bone = g->bones->boneList[b];
-
-
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->bones->matrices[b]);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->bones->matrices[b], transform, g->bones->matrices[b]);
-				node = node->mParent; // move to next node up
-			} while(node != NULL);
-
-			/* Also apply the bone offset */
-			float offset[16];
-			mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->bones->matrices[b], offset);
-
-		} // end for each bone
-	} // end for each geometry
+	/* Don't let other draws of the model use this instance's palette. */
+	for(kuhl_geometry *g = inst->model; g != NULL; g = g->next)
+		if(g->bones)
+			g->bones->paletteOffset = -1;
 }
 
 /** Loads a model without drawing it.
@@ -3766,6 +5019,14 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	                                             program, transform,
 	                                             newModelFilename, textureDirname);
 
+	/* Set up keyframe cursors (and resample the animations if
+	 * requested) so kuhl_update_model() doesn't need to search
+	 * through all of the keys every frame. All of the geometry in the
+	 * model shares the same animation state. */
+	kuhl_anim *anim = kuhl_anim_new(scene, kuhl_config_float("model.anim.resample", 0, 0));
+	for(kuhl_geometry *g = ret; g != NULL; g = g->next)
+		g->anim = anim;
+
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
 	kuhl_update_model(ret, 0, -1);
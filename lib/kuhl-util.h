@@ -78,8 +78,44 @@ typedef struct
 	unsigned int mesh; /**< The bones in this struct are associated with this matrix index */
 	const struct aiBone *boneList[MAX_BONES];
 	float matrices[MAX_BONES][16]; /**< Transformation matrices for each bone */
+	int paletteOffset; /**< Index of the first bone matrix in the bone palette texture buffer, -1 to use matrices instead. See kuhl_anim_instance_upload() */
 } kuhl_bonemat;
 
+/* ASSIMP structs used by the animation functions below. */
+struct aiScene;
+struct aiNodeAnim;
+
+/** Remembers which keys of an animation channel were used the last
+ * time the channel was sampled. See kuhl_anim_sample(). */
+typedef struct
+{
+	unsigned int position; /**< Index of the position key used last time */
+	unsigned int rotation; /**< Index of the rotation key used last time */
+	unsigned int scaling;  /**< Index of the scaling key used last time */
+} kuhl_anim_cursor;
+
+/** An animation channel which has been resampled at a uniform rate
+ * and stored as a structure of arrays. See kuhl_anim_track_new(). */
+typedef struct
+{
+	unsigned int frames;  /**< Number of samples */
+	double ticksPerFrame; /**< Time between samples (in ticks) */
+	float *data;          /**< All of the samples in one allocation, the arrays below point into it */
+	float *pos[3];        /**< x, y, z translation for each sample */
+	float *rot[4];        /**< x, y, z, w rotation quaternion for each sample */
+	float *scale[3];      /**< x, y, z scaling for each sample */
+} kuhl_anim_track;
+
+/** Animation state for a model. Created by kuhl_load_model() and shared
+ * by all of the kuhl_geometry objects in the model. */
+typedef struct
+{
+	const struct aiScene *scene; /**< Scene that the animations are in */
+	unsigned int numAnimations;  /**< Number of animations in the scene */
+	kuhl_anim_cursor **cursors;  /**< cursors[animation][channel] */
+	kuhl_anim_track **tracks;    /**< tracks[animation][channel], NULL if the animations were not resampled */
+} kuhl_anim;
+
 /** This enum is used by some kuhl_geometry related functions */
 enum
 { /* Options used for some kuhl_geometry functions */
@@ -114,6 +150,7 @@ typedef struct _kuhl_geometry_
 {
 	GLuint vao;  /**< OpenGL Vertex Array Object - created by kuhl_geometry_new() */
 	GLuint program; /**< OpenGL program object to use with this geometry - filled in by kuhl_geometry_new(). */
+	GLint boneTexLoc; /**< Location of the BoneTex uniform in program, -1 if it isn't used - filled in by kuhl_geometry_new() and kuhl_geometry_program(). */
 	GLuint vertex_count; /**< How many vertices are in this geometry? - Filled in by kuhl_geometry_new(). */
 	GLenum primitive_type; /**< GL_TRIANGLES, GL_POINTS, etc. - Filled in by kuhl_geometry_new() */
 
@@ -132,12 +169,28 @@ typedef struct _kuhl_geometry_
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
 	struct aiScene *assimp_scene; /**< Assimp scene that this kuhl_geometry object is a part of. */
 	kuhl_bonemat *bones; /**< Information about bones in the model */
+	kuhl_anim *anim; /**< Keyframe cursors and resampled animations, shared by all geometry in the model */
 
 	struct _kuhl_geometry_ *next; /**< A kuhl_geometry object can be a linked list. */
 	
 } kuhl_geometry;
 
 
+/** One copy of an animated model. Each instance can be at a
+ * different point in an animation. See kuhl_anim_instance_new(). */
+typedef struct
+{
+	kuhl_geometry *model;       /**< Model (from kuhl_load_model()) that this is an instance of */
+	unsigned int animationNum;  /**< Animation to use, set before updating the instance */
+	float time;                 /**< Time in seconds to evaluate the animation at, set before updating the instance */
+	kuhl_anim_cursor **cursors; /**< This instance's keyframe cursors: cursors[animation][channel] */
+	unsigned int geomCount;     /**< Number of kuhl_geometry objects in the model */
+	unsigned int *offsets;      /**< Index in palette of the first matrix for each kuhl_geometry */
+	float (*palette)[16];       /**< For each kuhl_geometry: GeomTransform followed by one matrix per bone */
+	unsigned int paletteSize;   /**< Number of matrices in palette */
+	int paletteBase;            /**< Index of palette in the bone palette texture buffer, -1 if it hasn't been uploaded since the last update */
+} kuhl_anim_instance;
+
 /** Call kuhl_errorcheck() with no parameters frequently for easy
  * OpenGL error checking. OpenGL doesn't report errors by
  * default. Instead, we must periodically check for errors
@@ -193,6 +246,7 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
+void kuhl_geometry_texture_usage(kuhl_geometry *geom, float screenSize, int kg_options);
 
 
 GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height, int components, GLuint wrapS, GLuint wrapT);
@@ -207,7 +261,20 @@ float kuhl_read_texture_file(const char *filename, GLuint *texName);
 void kuhl_screenshot(const char *outputImageFilename);
 void kuhl_video_record(const char *fileLabel, int fps);
 
+void kuhl_anim_sample(float result[16], const struct aiNodeAnim *na, double ticks, kuhl_anim_cursor *cursor);
+int kuhl_anim_track_new(kuhl_anim_track *track, const struct aiNodeAnim *na, double duration, double ticksPerFrame);
+void kuhl_anim_track_sample(float result[16], const kuhl_anim_track *track, double ticks);
+void kuhl_anim_track_free(kuhl_anim_track *track);
+kuhl_anim* kuhl_anim_new(const struct aiScene *scene, float resampleRate);
+void kuhl_anim_free(kuhl_anim *anim);
+
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time);
+void kuhl_anim_instance_new(kuhl_anim_instance *inst, kuhl_geometry *model);
+void kuhl_anim_instance_free(kuhl_anim_instance *inst);
+void kuhl_anim_instance_update(kuhl_anim_instance *inst);
+void kuhl_anim_instance_update_many(kuhl_anim_instance *insts, unsigned int count);
+void kuhl_anim_instance_upload(kuhl_anim_instance *insts, unsigned int count);
+void kuhl_anim_instance_draw(const kuhl_anim_instance *inst);
 kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname, GLuint program, float bbox[6]);
 
 void kuhl_bbox_fit(float result[16], const float bbox[6], int sitOnXZPlane);
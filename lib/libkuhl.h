@@ -13,6 +13,7 @@
 #pragma once
 
 #include "bufferswap.h"
+#include "capture.h"
 #include "dgr.h"
 #include "font-helper.h"
 #include "kalman.h"
@@ -21,13 +22,23 @@
 #include "kuhl-nodep.h"
 #include "kuhl-util.h"	
 #include "list.h"
+#include "list-typed.h"
 #include "mousemove.h"
 #include "msg.h"
 #include "orient-sensor.h"
+#include "predict.h"
 #include "queue.h"
+#include "ring.h"
 #include "serial.h"
 #include "tdl-util.h"
+#include "threadpool.h"
+#include "tiledimage.h"
+#include "tracklog.h"
+#include "texcompress.h"
+#include "texstream.h"
+#include "framepace.h"
 #include "vecmat.h"
+#include "vecmat-batch.h"
 #include "video.h"
 #include "viewmat.h"
 #include "vrpn-help.h"
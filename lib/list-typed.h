@@ -0,0 +1,216 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Macros that generate a list or a queue for one specific type.
+
+    The list in list.h and the queue in queue.h can store items of any
+    size, so every call checks the structure, checks the index and
+    copies the item with memcpy(). The containers generated by these
+    macros store items of a single type in a plain array, so the
+    compiler can inline the accessors and copy items with normal
+    assignments. Indices are only checked when NDEBUG is not defined
+    (CMake defines NDEBUG in Release builds).
+
+    For example, to make a list of ints:
+
+    <pre>
+    LIST_TYPED(intlist, int)
+
+    intlist l;
+    intlist_init(&l, 10);
+    intlist_append(&l, 4);
+    printf("%d\n", intlist_at(&l, 0));   // copy of an item
+    *intlist_get(&l, 0) = 5;               // pointer to an item
+    intlist_free(&l);
+    </pre>
+
+    LIST_TYPED(name, type) generates a struct named "name" (the items
+    are in name.data and name.length can be read directly) and the
+    following functions: name_init(), name_free(), name_clear(),
+    name_length(), name_reserve(), name_get(), name_at(), name_set(),
+    name_append(), name_push(), name_pop(), name_peek() and
+    name_remove().
+
+    QUEUE_TYPED(name, type) generates a first-in first-out queue
+    stored in a circular buffer with the functions name_init(),
+    name_free(), name_length(), name_add(), name_remove() and
+    name_peek().
+
+    The lists and queues grow as needed. They can be used in C and
+    C++ files.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* list_typed_grow(void *data, int *capacity, int needed, int itemSize);
+void list_typed_range_error(const char *func, int index, int length);
+
+#ifdef NDEBUG
+#define LIST_TYPED_CHECK(index, length) ((void)0)
+#else
+/** Exits with an error message if index isn't between 0 and length-1. */
+#define LIST_TYPED_CHECK(index, length) \
+	do { if((unsigned) (index) >= (unsigned) (length)) list_typed_range_error(__func__, index, length); } while(0)
+#endif
+
+
+/** Generates a list named "name" which stores items of type "type". */
+#define LIST_TYPED(name, type) \
+typedef struct { \
+	type *data; \
+	int length;   /**< Number of items in the list */ \
+	int capacity; /**< Number of items the list can hold without growing */ \
+} name; \
+\
+/** Initializes an empty list with space for capacity items. */ \
+static inline void name##_init(name *l, int capacity) \
+{ \
+	l->data = NULL; \
+	l->length = 0; \
+	l->capacity = 0; \
+	if(capacity > 0) \
+		l->data = (type*) list_typed_grow(NULL, &l->capacity, capacity, sizeof(type)); \
+} \
+/** Frees the items in the list (but not the list struct itself). */ \
+static inline void name##_free(name *l) \
+{ \
+	free(l->data); \
+	l->data = NULL; \
+	l->length = l->capacity = 0; \
+} \
+/** Removes all items from the list without freeing any memory. */ \
+static inline void name##_clear(name *l) \
+{ l->length = 0; } \
+static inline int name##_length(const name *l) \
+{ return l->length; } \
+/** Makes sure that the list can hold capacity items without growing. */ \
+static inline void name##_reserve(name *l, int capacity) \
+{ \
+	if(capacity > l->capacity) \
+		l->data = (type*) list_typed_grow(l->data, &l->capacity, capacity, sizeof(type)); \
+} \
+/** Returns a pointer to an item. It is valid until the list grows. */ \
+static inline type* name##_get(const name *l, int index) \
+{ \
+	LIST_TYPED_CHECK(index, l->length); \
+	return &l->data[index]; \
+} \
+/** Returns a copy of an item. */ \
+static inline type name##_at(const name *l, int index) \
+{ \
+	LIST_TYPED_CHECK(index, l->length); \
+	return l->data[index]; \
+} \
+static inline void name##_set(name *l, int index, type item) \
+{ \
+	LIST_TYPED_CHECK(index, l->length); \
+	l->data[index] = item; \
+} \
+/** Adds an item to the end of the list. */ \
+static inline void name##_append(name *l, type item) \
+{ \
+	if(l->length == l->capacity) \
+		l->data = (type*) list_typed_grow(l->data, &l->capacity, l->length+1, sizeof(type)); \
+	l->data[l->length++] = item; \
+} \
+/** Same as name_append(); the end of the list is the top of the stack. */ \
+static inline void name##_push(name *l, type item) \
+{ name##_append(l, item); } \
+/** Removes the last item. Returns 0 if the list was empty. */ \
+static inline int name##_pop(name *l, type *result) \
+{ \
+	if(l->length == 0) \
+		return 0; \
+	l->length--; \
+	if(result != NULL) \
+		*result = l->data[l->length]; \
+	return 1; \
+} \
+/** Returns a pointer to the last item or NULL if the list is empty. */ \
+static inline type* name##_peek(const name *l) \
+{ return l->length == 0 ? NULL : &l->data[l->length-1]; } \
+/** Removes an item and moves the following items forward. */ \
+static inline void name##_remove(name *l, int index) \
+{ \
+	LIST_TYPED_CHECK(index, l->length); \
+	for(int i=index+1; i<l->length; i++) \
+		l->data[i-1] = l->data[i]; \
+	l->length--; \
+}
+
+
+/** Generates a queue named "name" which stores items of type "type". */
+#define QUEUE_TYPED(name, type) \
+typedef struct { \
+	type *data; \
+	int read;     /**< Index of the next item to remove */ \
+	int length;   /**< Number of items in the queue */ \
+	int capacity; /**< Size of data, always a power of 2 */ \
+} name; \
+\
+/** Initializes an empty queue with space for at least capacity items. */ \
+static inline void name##_init(name *q, int capacity) \
+{ \
+	int size = 4; \
+	while(size < capacity) \
+		size *= 2; \
+	q->capacity = 0; \
+	q->data = (type*) list_typed_grow(NULL, &q->capacity, size, sizeof(type)); \
+	q->read = 0; \
+	q->length = 0; \
+} \
+static inline void name##_free(name *q) \
+{ \
+	free(q->data); \
+	q->data = NULL; \
+	q->read = q->length = q->capacity = 0; \
+} \
+static inline int name##_length(const name *q) \
+{ return q->length; } \
+/** Adds an item to the end of the queue. */ \
+static inline void name##_add(name *q, type item) \
+{ \
+	if(q->length == q->capacity) \
+	{ \
+		/* Double the size and move the items that wrapped around \
+		 * the end of the old buffer. */ \
+		int old = q->capacity; \
+		q->data = (type*) list_typed_grow(q->data, &q->capacity, old*2, sizeof(type)); \
+		for(int i=0; i<q->read; i++) \
+			q->data[old+i] = q->data[i]; \
+	} \
+	int end = q->read + q->length; \
+	if(end >= q->capacity) \
+		end -= q->capacity; \
+	q->data[end] = item; \
+	q->length++; \
+} \
+/** Removes the item at the front of the queue. Returns 0 if the queue was empty. */ \
+static inline int name##_remove(name *q, type *result) \
+{ \
+	if(q->length == 0) \
+		return 0; \
+	if(result != NULL) \
+		*result = q->data[q->read]; \
+	q->read = (q->read+1) & (q->capacity-1); \
+	q->length--; \
+	return 1; \
+} \
+/** Returns a pointer to the item at the front of the queue or NULL if the queue is empty. */ \
+static inline type* name##_peek(const name *q) \
+{ return q->length == 0 ? NULL : &q->data[q->read]; }
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -22,6 +22,7 @@
 
 
 #include "list.h"
+#include "list-typed.h"
 #include "msg.h"
 
 #define LIST_MIN_CAPACITY 4  /*< The smallest allowable capacity of a list */
@@ -1119,3 +1120,40 @@ int set_remove(list *l, void *item)
 		return 1;
 	}
 }
+
+
+/** Grows the array used by a list or queue generated with
+    LIST_TYPED() or QUEUE_TYPED() (see list-typed.h). Exits if memory
+    can't be allocated.
+
+    @param data The current array (or NULL).
+    @param capacity The number of items the array can hold. It is set
+    to the new capacity.
+    @param needed The minimum number of items the array must hold.
+    @param itemSize The size of an item in bytes.
+    @return The new array.
+*/
+void* list_typed_grow(void *data, int *capacity, int needed, int itemSize)
+{
+	/* Double the capacity so that appending items one at a time
+	 * rarely reallocates. */
+	int newCapacity = *capacity * 2;
+	if(newCapacity < needed)
+		newCapacity = needed;
+	void *newData = realloc(data, (size_t) newCapacity * itemSize);
+	if(newData == NULL)
+	{
+		msg(MSG_FATAL, "Unable to grow a list to %d items of %d bytes", newCapacity, itemSize);
+		exit(EXIT_FAILURE);
+	}
+	*capacity = newCapacity;
+	return newData;
+}
+
+/** Called when a list generated with LIST_TYPED() is accessed with
+ * an invalid index (see list-typed.h). */
+void list_typed_range_error(const char *func, int index, int length)
+{
+	msg(MSG_FATAL, "%s(): index %d is out of range (the list contains %d items)", func, index, length);
+	exit(EXIT_FAILURE);
+}
@@ -11,7 +11,8 @@
     always matches or exceeds the length of the list. Anything can be
     stored in the list, but all items in the list must be the same
     size. The code is written to include numerous checks and not
-    written with a sole focus on speed or efficiency.
+    written with a sole focus on speed or efficiency. For a faster
+    list that stores a single type, see list-typed.h.
 
     For example, if you want to store an int in the list, you would use:
 
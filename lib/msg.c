@@ -18,6 +18,16 @@
    the console are also highlighted to attract attention to the most
    significant messages.
 
+   If the log.async config option is set (and libkuhl was compiled
+   with pthreads), msg() only formats the message into a slot in a
+   lock-free queue and returns. A background thread colors the
+   messages and writes them to the console and the log file. If
+   messages are produced faster than they can be written and the
+   queue fills up, messages are dropped and the number of dropped
+   messages is written to the log. The queue is flushed before
+   MSG_FATAL messages, when msg_flush() is called and when the program
+   exits.
+
    Compile with the -DMSG_SIMPLE option to reduce the number of
    dependencies of this file.
    
@@ -36,6 +46,12 @@
 #include <string.h>
 #include <errno.h>
 
+#if defined(HAVE_PTHREADS) && !defined(MSG_SIMPLE)
+#define MSG_ASYNC
+#include <pthread.h>
+#include <sched.h> // sched_yield()
+#endif
+
 #include "msg.h"
 
 #ifndef MSG_SIMPLE
@@ -47,12 +63,25 @@
 static FILE *f = NULL;  /**< The file stream for our log file */
 static char *logfile = NULL; /**< The filename of the log file. */
 
+static long starttime = 0; /**< Time that the first message was printed */
+
+/** Returns the current time in microseconds. */
+static long msg_now(void)
+{
+#ifdef MSG_SIMPLE
+	return 0;
+#else
+	return kuhl_microseconds();
+#endif
+}
+
 /** Writes a timestamp string to a pre-allocated char array.
 
     @param buf A buffer of len bytes where the timestamp should be stored.
     @param len The length of the buffer.
+    @param nowtime The msg_now() time that the message was created at.
 */
-static void msg_timestamp(char *buf, int len)
+static void msg_timestamp(char *buf, int len, long nowtime)
 {
 	if(buf == NULL || len < 1)
 		return;
@@ -62,15 +91,6 @@ static void msg_timestamp(char *buf, int len)
 	return;
 #else
 	// time relative to start time
-	static int needsInit = 1;
-	static long starttime;
-	if(needsInit)
-	{
-		starttime = kuhl_microseconds();
-		needsInit = 0;
-	}
-
-	long nowtime = kuhl_microseconds();
 	long difftime = nowtime-starttime;
 	double timestamp = difftime / 1000000.0;
 	snprintf(buf, len, "%11.6f", timestamp);
@@ -248,6 +268,306 @@ void msg_backtrace(FILE *stream)
 
 
 
+/** Returns the filename without the directories in front of it. */
+static const char* msg_short_filename(const char *fileName)
+{
+	const char *shortFileName = fileName;
+	for(const char *c = fileName; *c != '\0'; c++)
+	{
+		if(*c == '/' || *c == '\\')
+			shortFileName = c+1;
+	}
+	return shortFileName;
+}
+
+/** Writes a formatted message to the console (if appropriate) and the
+    log file. Doesn't flush the streams.
+
+    @param type The type of message to log
+    @param fileName The filename where msg() was called from.
+    @param lineNum The line number where msg() was called from.
+    @param funcName The name of the function which called msg().
+    @param nowtime The msg_now() time when msg() was called.
+    @param msgbuf The message.
+*/
+static void msg_write(msg_type type, const char *fileName, int lineNum, const char *funcName, long nowtime, const char *msgbuf)
+{
+	/* info to prepend to message printed to console */
+	char typestr[32];
+	msg_type_string(type, typestr, 32);
+
+	/* Determine the stream that we are going to print out to: stdout,
+	 * stderr, or don't print to console */
+	FILE *stream = stdout;
+	if(type == MSG_ERROR || type == MSG_FATAL)
+		stream = stderr;
+	if(msg_show_type(type) == 0)
+		stream = NULL;
+
+	char timestamp[64];
+	msg_timestamp(timestamp, 64, nowtime);
+	const char *shortFileName = msg_short_filename(fileName);
+
+	/* Print the message to stderr or stdout */
+	if(stream)
+	{
+		// If using a non-standard logfile name, prepend the name to
+		// the message. This makes it easier to distinguish between
+		// which process is creating which message if there are
+		// multiple programs running at once.
+		char prepend[1024];
+		if(logfile == NULL || strcmp(logfile, "log.txt") == 0)
+			prepend[0] = '\0';
+		else
+			snprintf(prepend, 1024, "(%s) ", logfile);
+		
+		msg_start_color(type, stream);
+		fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
+		/* Print additional details to console for significant errors */
+		if(type == MSG_FATAL || type == MSG_ERROR)
+		{
+			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
+			        typestr, prepend, shortFileName, lineNum, funcName);
+
+			// if(type == FATAL)
+			//   msg_backtrace(stream);
+		}
+		msg_end_color(type, stream);
+	}
+
+	// Not using funcName to try to keep log shorter. The log file
+	// isn't open yet while msg_init() is loading the config file.
+	if(f != NULL)
+		fprintf(f, "%s%s %12s:%-4d %s\n", typestr, timestamp, shortFileName, lineNum, msgbuf);
+}
+
+/** Removes any newlines at the end of a message. */
+static void msg_trim_newlines(char *msgbuf)
+{
+	int msgbufidx = strlen(msgbuf)-1;
+	while(msgbufidx >= 0 && msgbuf[msgbufidx] == '\n')
+	{
+		msgbuf[msgbufidx] = '\0';
+		msgbufidx--;
+	}
+}
+
+
+#ifdef MSG_ASYNC
+
+/** Number of messages that can wait to be written. Must be a power of 2. */
+#define MSG_ASYNC_SLOTS 512
+/** Longest message (in bytes) that can be queued. */
+#define MSG_ASYNC_TEXT 1024
+
+/* A message waiting to be written. The file and function names are
+ * string literals from the msg() macro, so we can keep pointers to
+ * them. */
+typedef struct
+{
+	unsigned long seq; /**< Slot is ready to be filled when seq == position, ready to be written when seq == position+1 */
+	msg_type type;
+	const char *fileName;
+	int lineNum;
+	const char *funcName;
+	long time;
+	char text[MSG_ASYNC_TEXT];
+} msg_record;
+
+/* A bounded multiple-producer, single-consumer ring. Threads calling
+ * msg() claim a slot by atomically incrementing enqueuePos and then
+ * publish the slot by updating its sequence number. Only the writer
+ * thread reads from the ring. */
+static msg_record *ring = NULL;
+static unsigned long enqueuePos = 0;  /**< Next slot to fill (updated atomically) */
+static unsigned long dequeuePos = 0;  /**< Next slot to write (only used by the writer thread) */
+static unsigned long writtenPos = 0;  /**< Slots which have been written and flushed (protected by asyncMutex) */
+static unsigned long dropped = 0;     /**< Messages dropped since the last report (updated atomically) */
+static unsigned long droppedTotal = 0;
+
+static int asyncRunning = 0;          /**< Set while messages are queued (accessed atomically) */
+static int asyncProducers = 0;        /**< Number of threads queuing a message right now (accessed atomically) */
+static int writerStop = 0;            /**< Tells the writer to write the remaining messages and exit (protected by asyncMutex) */
+static int writerSleeping = 0;        /**< Set while the writer is waiting for messages (accessed atomically) */
+static pthread_t writerThread;
+static pthread_mutex_t asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncWake = PTHREAD_COND_INITIALIZER;    /**< Signaled when there are new messages or when the writer should stop */
+static pthread_cond_t asyncWritten = PTHREAD_COND_INITIALIZER; /**< Signaled when the writer has caught up */
+/** Held while writing to the streams so that a message written
+ * directly (MSG_FATAL) doesn't get mixed up with queued messages. */
+static pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Claims a slot in the ring for a new message.
+
+    @return The slot or NULL if the ring is full.
+*/
+static msg_record* msg_async_claim(unsigned long *position)
+{
+	unsigned long pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	while(1)
+	{
+		msg_record *r = &(ring[pos & (MSG_ASYNC_SLOTS-1)]);
+		unsigned long seq = __atomic_load_n(&(r->seq), __ATOMIC_ACQUIRE);
+		long diff = (long) seq - (long) pos;
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&enqueuePos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*position = pos;
+				return r;
+			}
+			// pos was updated with the current enqueuePos, try again.
+		}
+		else if(diff < 0)
+			return NULL; // The writer hasn't written this slot yet, the ring is full.
+		else
+			pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	}
+}
+
+/** Makes a filled slot available to the writer thread and wakes the
+ * writer if it is sleeping. */
+static void msg_async_publish(msg_record *r, unsigned long position)
+{
+	__atomic_store_n(&(r->seq), position+1, __ATOMIC_RELEASE);
+
+	/* Either the writer sees the new message before it goes to sleep
+	 * or we see that it is sleeping. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&writerSleeping, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&asyncMutex);
+		pthread_cond_signal(&asyncWake);
+		pthread_mutex_unlock(&asyncMutex);
+	}
+}
+
+/** Returns 1 if the next slot has a message waiting to be written. */
+static int msg_async_ready(void)
+{
+	msg_record *r = &(ring[dequeuePos & (MSG_ASYNC_SLOTS-1)]);
+	return __atomic_load_n(&(r->seq), __ATOMIC_ACQUIRE) == dequeuePos+1;
+}
+
+/** Writes all of the messages in the ring. Called by the writer
+ * thread. */
+static void msg_async_drain(void)
+{
+	pthread_mutex_lock(&writeMutex);
+	while(msg_async_ready())
+	{
+		msg_record *r = &(ring[dequeuePos & (MSG_ASYNC_SLOTS-1)]);
+		msg_write(r->type, r->fileName, r->lineNum, r->funcName, r->time, r->text);
+		__atomic_store_n(&(r->seq), dequeuePos+MSG_ASYNC_SLOTS, __ATOMIC_RELEASE);
+		dequeuePos++;
+	}
+
+	unsigned long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if(lost > 0)
+	{
+		droppedTotal += lost;
+		char buf[128];
+		snprintf(buf, 128, "%lu message(s) were dropped because the log queue was full.", lost);
+		msg_write(MSG_WARNING, __FILE__, __LINE__, __func__, msg_now(), buf);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	fflush(f);
+	pthread_mutex_unlock(&writeMutex);
+
+	pthread_mutex_lock(&asyncMutex);
+	writtenPos = dequeuePos;
+	pthread_cond_broadcast(&asyncWritten);
+	pthread_mutex_unlock(&asyncMutex);
+}
+
+static void* msg_async_writer(void *arg)
+{
+	pthread_mutex_lock(&asyncMutex);
+	while(!writerStop)
+	{
+		__atomic_store_n(&writerSleeping, 1, __ATOMIC_SEQ_CST);
+		if(!msg_async_ready())
+		{
+			/* Also wake up occasionally in case we only have dropped
+			 * messages to report. */
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000L; // 100ms
+			if(ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&asyncWake, &asyncMutex, &ts);
+		}
+		__atomic_store_n(&writerSleeping, 0, __ATOMIC_SEQ_CST);
+
+		pthread_mutex_unlock(&asyncMutex);
+		msg_async_drain();
+		pthread_mutex_lock(&asyncMutex);
+	}
+	pthread_mutex_unlock(&asyncMutex);
+
+	msg_async_drain();
+	return NULL;
+}
+
+/** Stops the writer thread after it writes all of the queued
+ * messages. Messages from other threads that are still running are
+ * written immediately afterwards. */
+static void msg_async_stop(void)
+{
+	if(!__atomic_load_n(&asyncRunning, __ATOMIC_ACQUIRE))
+		return;
+
+	/* Threads that call msg() from now on write their messages
+	 * directly. Wait for threads that are already queuing a message
+	 * to publish it so that the writer writes it before it exits.
+	 * Together with the order in msg_details(), this guarantees that
+	 * no thread is using the ring when we free it. */
+	__atomic_store_n(&asyncRunning, 0, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&asyncProducers, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+
+	pthread_mutex_lock(&asyncMutex);
+	writerStop = 1;
+	pthread_cond_signal(&asyncWake);
+	pthread_mutex_unlock(&asyncMutex);
+	pthread_join(writerThread, NULL);
+
+	if(droppedTotal > 0)
+	{
+		fprintf(f, "%lu message(s) were dropped because the log queue was full.\n", droppedTotal);
+		fflush(f);
+	}
+	free(ring);
+	ring = NULL;
+}
+
+/** Starts the thread which writes queued messages. */
+static void msg_async_start(void)
+{
+	ring = malloc(sizeof(msg_record)*MSG_ASYNC_SLOTS);
+	if(ring == NULL)
+		return;
+	for(unsigned long i=0; i<MSG_ASYNC_SLOTS; i++)
+		ring[i].seq = i;
+
+	__atomic_store_n(&asyncRunning, 1, __ATOMIC_RELEASE);
+	if(pthread_create(&writerThread, NULL, msg_async_writer, NULL) != 0)
+	{
+		__atomic_store_n(&asyncRunning, 0, __ATOMIC_RELEASE);
+		free(ring);
+		ring = NULL;
+		return;
+	}
+	atexit(msg_async_stop);
+}
+
+#endif // MSG_ASYNC
+
+
 /** Initializes the logging system, creates the log file if
  * needed. Also, writes a message informing the user about the
  * location of the log file. The time printed in the log file will be
@@ -260,6 +580,15 @@ static void msg_init(void)
 	if(f != NULL)
 		return;
 
+	/* Reading the settings below loads the config file, which prints
+	 * messages---calling msg() again. Those messages are only printed
+	 * to the console. If we opened the log file in the nested call,
+	 * the log settings would be read before the config file is
+	 * loaded. */
+	static int initializing = 0;
+	if(initializing)
+		return;
+	initializing = 1;
 
 #ifdef MSG_SIMPLE
 	// Set to 0 to overwrite existing log file, 1 to append.
@@ -276,18 +605,6 @@ static void msg_init(void)
 		logfile = strdup("log.txt"); // default log file name
 #endif
 
-	/* When the first message gets printed, we will also probably call
-	 * kuhl_config_get() for the first time. kuhl_config_get() will
-	 * then try to print a message about the newly loaded config
-	 * file---calling msg() again. This second call to msg() will work
-	 * because kuhl_config_get() doesn't print a message the second
-	 * time that it is called. However, the first call to msg() can
-	 * get to this point only to find that the log file is already
-	 * open (i.e., kuhl_config_get() indirectly opened the file and
-	 * completed the initialization. */
-	if(f != NULL)
-		return;
-	
 	f = fopen(logfile, append ? "a" : "w");
 	if(f == NULL)
 	{
@@ -307,6 +624,12 @@ static void msg_init(void)
 	fprintf(f, "[TYPE ]    seconds     filename:line message\n");
 	fprintf(f, "------------------------------------------\n");
 
+	starttime = msg_now();
+#ifdef MSG_ASYNC
+	if(kuhl_config_boolean("log.async", 0, 0))
+		msg_async_start();
+#endif
+
 	// Write message so user knows the log file is being created.
 	if(append)
 		msg(MSG_INFO, "Appending messages to '%s'\n", logfile);
@@ -324,76 +647,93 @@ static void msg_init(void)
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...)
 {
 	msg_init();
-	
-	/* Construct a string for the user's message */
-	char msgbuf[1024];
+	long nowtime = msg_now();
+
 	va_list args;
 	va_start(args, msg);
-	vsnprintf(msgbuf, 1024, msg, args);
-	va_end(args);
 
-	/* Remove any newlines at the end of the message. */
-	int msgbufidx = strlen(msgbuf)-1;
-	while(msgbuf[msgbufidx] == '\n')
+#ifdef MSG_ASYNC
+	/* Queue the message for the writer thread. Fatal messages are
+	 * written immediately (after everything already in the queue)
+	 * because the program is about to exit.
+	 *
+	 * We announce that we are using the ring before we check that
+	 * the writer is running; msg_async_stop() does the opposite. So
+	 * either we see that it is stopping and write the message
+	 * directly, or it waits for us to finish. */
+	int async = 0;
+	if(type != MSG_FATAL)
 	{
-		msgbuf[msgbufidx] = '\0';
-		msgbufidx--;
+		__atomic_fetch_add(&asyncProducers, 1, __ATOMIC_SEQ_CST);
+		async = __atomic_load_n(&asyncRunning, __ATOMIC_SEQ_CST);
+		if(!async)
+			__atomic_fetch_sub(&asyncProducers, 1, __ATOMIC_RELEASE);
 	}
-	
-	/* info to prepend to message printed to console */
-	char typestr[1024];
-	msg_type_string(type, typestr, 1024);
-
-	/* Determine the stream that we are going to print out to: stdout,
-	 * stderr, or don't print to console */
-	FILE *stream = stdout;
-	if(type == MSG_ERROR || type == MSG_FATAL)
-		stream = stderr;
-	if(msg_show_type(type) == 0)
-		stream = NULL;
-
-	char timestamp[1024];
-	msg_timestamp(timestamp, 1024);
-	char *fileNameCopy = strdup(fileName);
-	char *shortFileName = fileNameCopy;
-#ifndef _WIN32
-	shortFileName = basename(fileNameCopy);
-#endif
-
-	/* Print the message to stderr or stdout */
-	if(stream)
+	if(async)
 	{
-		// If using a non-standard logfile name, prepend the name to
-		// the message. This makes it easier to distinguish between
-		// which process is creating which message if there are
-		// multiple programs running at once.
-		char prepend[1024];
-		if(strcmp(logfile, "log.txt") == 0)
-			prepend[0] = '\0';
+		unsigned long position;
+		msg_record *r = msg_async_claim(&position);
+		if(r == NULL)
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
 		else
-			snprintf(prepend, 1024, "(%s) ", logfile);
-		
-		msg_start_color(type, stream);
-		fprintf(stream, "%s %s%s\n", typestr, prepend, msgbuf);
-		/* Print additional details to console for significant errors */
-		if(type == MSG_FATAL || type == MSG_ERROR)
 		{
-			fprintf(stream, "%s %sOccurred at %s:%d in the function %s()\n",
-			        typestr, prepend, shortFileName, lineNum, funcName);
-
-			// if(type == FATAL)
-			//   msg_backtrace(stream);
+			vsnprintf(r->text, MSG_ASYNC_TEXT, msg, args);
+			msg_trim_newlines(r->text);
+			r->type = type;
+			r->fileName = fileName;
+			r->lineNum = lineNum;
+			r->funcName = funcName;
+			r->time = nowtime;
+			msg_async_publish(r, position);
 		}
-		msg_end_color(type, stream);
+		__atomic_fetch_sub(&asyncProducers, 1, __ATOMIC_RELEASE);
+		va_end(args);
+		return;
 	}
+#endif
+
+	/* Construct a string for the user's message */
+	char msgbuf[1024];
+	vsnprintf(msgbuf, 1024, msg, args);
+	va_end(args);
+	msg_trim_newlines(msgbuf);
+
+#ifdef MSG_ASYNC
+	/* Don't mix this message up with the ones that the writer thread
+	 * is writing (the lock is harmless if the writer has stopped). */
+	msg_flush();
+	pthread_mutex_lock(&writeMutex);
+#endif
 
-	// Not using funcName to try to keep log shorter.
-	fprintf(f, "%s%s %12s:%-4d %s\n", typestr, timestamp, shortFileName, lineNum, msgbuf);
-	free(fileNameCopy);
+	msg_write(type, fileName, lineNum, funcName, nowtime, msgbuf);
 
 	/* Ensure messages are written to the file or console. */
-	fflush(stream);
-	fflush(f);
+	fflush(type == MSG_ERROR || type == MSG_FATAL ? stderr : stdout);
+	if(f != NULL)
+		fflush(f);
+
+#ifdef MSG_ASYNC
+	pthread_mutex_unlock(&writeMutex);
+#endif
+}
+
+/** Waits until all queued messages have been written to the console
+ * and the log file. Does nothing if messages are written immediately
+ * (i.e., log.async is not set). */
+void msg_flush(void)
+{
+#ifdef MSG_ASYNC
+	if(!__atomic_load_n(&asyncRunning, __ATOMIC_ACQUIRE))
+		return;
+	unsigned long target = __atomic_load_n(&enqueuePos, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&asyncMutex);
+	while(__atomic_load_n(&asyncRunning, __ATOMIC_ACQUIRE) && (long) (writtenPos - target) < 0)
+	{
+		pthread_cond_signal(&asyncWake);
+		pthread_cond_wait(&asyncWritten, &asyncMutex);
+	}
+	pthread_mutex_unlock(&asyncMutex);
+#endif
 }
 
 /** ASSIMP can be configured to call a callback function every time it
@@ -33,6 +33,7 @@ typedef enum {
 
 void msg_details(msg_type type, const char *fileName, int lineNum, const char *funcName, const char *msg, ...);
 void msg_assimp_callback(const char* msg, char *usr);
+void msg_flush(void);
 
 /** Prints the message and saves information to a logfile. C99
  * requires that __VA_ARGS__ corresponds to at least one parameter
@@ -0,0 +1,345 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+#include "windows-compat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "predict.h"
+#include "kuhl-config.h"
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "msg.h"
+
+
+/** Initializes a predict_state struct.
+
+    @param state The struct to initialize.
+
+    @param model PREDICT_NONE, PREDICT_VELOCITY, or PREDICT_ACCELERATION.
+
+    @param horizon The maximum number of microseconds to predict past
+    the newest sample. If we are asked to predict further, we predict
+    this far instead.
+
+    @param window Fit the motion to the samples that are at most this
+    many microseconds older than the newest sample. A short window
+    follows changes in motion quickly; a long window is less sensitive
+    to noise.
+*/
+void predict_init(predict_state *state, int model, long horizon, long window)
+{
+	memset(state, 0, sizeof(predict_state));
+	state->model = model;
+	state->horizon = horizon;
+	state->window = window;
+}
+
+/** Initializes a predict_state struct using config file settings:
+
+    - vrpn.predict - none (default), velocity, or acceleration.
+    - vrpn.predict.horizon - Maximum prediction in microseconds (default 50000).
+    - vrpn.predict.window - Fit the motion to samples from this many microseconds (default 30000).
+
+    @param state The struct to initialize.
+    @return The model that will be used (PREDICT_NONE if prediction is disabled).
+*/
+int predict_init_config(predict_state *state)
+{
+	int model = PREDICT_NONE;
+	const char *modelString = kuhl_config_get("vrpn.predict");
+	if(modelString != NULL)
+	{
+		if(strcasecmp(modelString, "velocity") == 0)
+			model = PREDICT_VELOCITY;
+		else if(strcasecmp(modelString, "acceleration") == 0)
+			model = PREDICT_ACCELERATION;
+		else if(strcasecmp(modelString, "none") != 0)
+			msg(MSG_WARNING, "vrpn.predict should be none, velocity, or acceleration. You have set it to '%s'.", modelString);
+	}
+
+	long horizon = kuhl_config_int("vrpn.predict.horizon", 50000, 50000);
+	long window = kuhl_config_int("vrpn.predict.window", 30000, 30000);
+	if(horizon < 0)
+		horizon = 0;
+	if(window < 1000)
+		window = 1000;
+	predict_init(state, model, horizon, window);
+	return model;
+}
+
+
+/** Fits a polynomial to samples using least squares and evaluates it.
+
+    @param x The time of each sample.
+    @param y Three values for each sample (y[i*3+c]).
+    @param n Number of samples.
+    @param degree Degree of the polynomial (0, 1, or 2).
+    @param at The time to evaluate the polynomial at.
+    @param result The three evaluated values.
+    @return The degree that was actually used (lower if the samples
+    don't determine a polynomial of the requested degree).
+*/
+static int predict_fit(const double *x, const double *y, int n, int degree, double at, double result[3])
+{
+	if(degree > n-1)
+		degree = n-1;
+
+	while(degree > 0)
+	{
+		/* Normal equations: a * coefficients = b */
+		int size = degree+1;
+		double a[3][4];
+		double b[3][3];
+		memset(a, 0, sizeof(a));
+		memset(b, 0, sizeof(b));
+		for(int i=0; i<n; i++)
+		{
+			double powers[5] = { 1, x[i], x[i]*x[i], x[i]*x[i]*x[i], x[i]*x[i]*x[i]*x[i] };
+			for(int r=0; r<size; r++)
+			{
+				for(int c=0; c<size; c++)
+					a[r][c] += powers[r+c];
+				for(int k=0; k<3; k++)
+					b[r][k] += powers[r]*y[i*3+k];
+			}
+		}
+
+		/* Gaussian elimination (the matrix is symmetric positive
+		 * definite unless the samples are degenerate). */
+		int singular = 0;
+		for(int r=0; r<size && !singular; r++)
+		{
+			if(fabs(a[r][r]) < 1e-12 * (1+fabs(a[0][0])))
+			{
+				singular = 1;
+				break;
+			}
+			for(int r2=r+1; r2<size; r2++)
+			{
+				double f = a[r2][r] / a[r][r];
+				for(int c=r; c<size; c++)
+					a[r2][c] -= f*a[r][c];
+				for(int k=0; k<3; k++)
+					b[r2][k] -= f*b[r][k];
+			}
+		}
+		if(singular)
+		{
+			degree--;
+			continue;
+		}
+		double coef[3][3];
+		for(int r=size-1; r>=0; r--)
+		{
+			for(int k=0; k<3; k++)
+			{
+				double sum = b[r][k];
+				for(int c=r+1; c<size; c++)
+					sum -= a[r][c]*coef[c][k];
+				coef[r][k] = sum / a[r][r];
+			}
+		}
+
+		for(int k=0; k<3; k++)
+		{
+			result[k] = 0;
+			double p = 1;
+			for(int r=0; r<size; r++)
+			{
+				result[k] += coef[r][k]*p;
+				p *= at;
+			}
+		}
+		return degree;
+	}
+
+	/* Not enough samples, use the newest one. */
+	for(int k=0; k<3; k++)
+		result[k] = y[k];
+	return 0;
+}
+
+/** Angle in radians between two unit quaternions. */
+static double predict_angle(const double a[4], const double b[4])
+{
+	double dot = fabs(vec4d_dot(a, b));
+	if(dot > 1)
+		dot = 1;
+	return 2*acos(dot);
+}
+
+/** Compares predictions against the samples that have arrived since
+ * they were made. */
+static void predict_check(predict_state *state, const vrpn_sample *samples, int count)
+{
+	long newest = samples[0].time;
+	long oldest = samples[count-1].time;
+	int done = 0;
+	for(; done < state->pendingCount; done++)
+	{
+		const predict_pending *p = &(state->pending[done]);
+		if(p->time > newest)
+			break; // the samples for this prediction (and the ones after it) haven't arrived yet
+		if(p->time < oldest)
+			continue; // too old to check
+
+		/* Interpolate between the samples on either side of the predicted time. */
+		int i = 0;
+		while(i < count-1 && samples[i+1].time > p->time)
+			i++;
+		const vrpn_sample *after = &samples[i];
+		const vrpn_sample *before = i < count-1 ? &samples[i+1] : after;
+		double t = after->time == before->time ? 1 : (double) (p->time - before->time) / (after->time - before->time);
+		double actualPos[3], actualQuat[4];
+		for(int k=0; k<3; k++)
+			actualPos[k] = before->pos[k] + t*(after->pos[k] - before->pos[k]);
+		quatd_slerp_new(actualQuat, before->quat, after->quat, t);
+		quatd_normalize(actualQuat);
+
+		double posDiff[3], baseDiff[3];
+		vec3d_sub_new(posDiff, p->pos, actualPos);
+		vec3d_sub_new(baseDiff, p->basePos, actualPos);
+		double posError = vec3d_norm(posDiff);
+		double angleError = predict_angle(p->quat, actualQuat);
+
+		state->checked++;
+		state->posError += posError;
+		state->posErrorSq += posError*posError;
+		if(posError > state->posErrorMax)
+			state->posErrorMax = posError;
+		state->angleError += angleError;
+		if(angleError > state->angleErrorMax)
+			state->angleErrorMax = angleError;
+		state->basePosError += vec3d_norm(baseDiff);
+		state->baseAngleError += predict_angle(p->baseQuat, actualQuat);
+	}
+
+	/* Remove the predictions that we checked (or couldn't check). */
+	state->pendingCount -= done;
+	memmove(state->pending, state->pending+done, sizeof(predict_pending)*state->pendingCount);
+}
+
+/** Remembers a prediction so that predict_check() can compare it
+ * against the samples when they arrive. */
+static void predict_remember(predict_state *state, long time, const double pos[3], const double quat[4], const vrpn_sample *newest)
+{
+	/* Several viewports may ask for the same prediction. */
+	if(state->pendingCount > 0 && state->pending[state->pendingCount-1].time == time)
+		return;
+	state->predictions++;
+	state->ahead += time - newest->time;
+	if(state->pendingCount == PREDICT_PENDING)
+	{
+		state->pendingCount--;
+		memmove(state->pending, state->pending+1, sizeof(predict_pending)*state->pendingCount);
+	}
+	predict_pending *p = &(state->pending[state->pendingCount]);
+	p->time = time;
+	vec3d_copy(p->pos, pos);
+	vec4d_copy(p->quat, quat);
+	vec3d_copy(p->basePos, newest->pos);
+	vec4d_copy(p->baseQuat, newest->quat);
+	state->pendingCount++;
+}
+
+/** Predicts the position and orientation of a tracked object at a
+    given time.
+
+    @param state A predict_state initialized by predict_init() or predict_init_config().
+
+    @param samples The recent samples for the object, newest first
+    (see vrpn_get_history()).
+
+    @param count The number of samples.
+
+    @param target The time to predict the pose at, in the same units
+    as kuhl_microseconds() (e.g., framepace_predicted_display()).
+
+    @param pos The predicted position.
+
+    @param quat The predicted orientation (unit quaternion, x,y,z,w).
+
+    @return 1 if a pose was returned, 0 if there were no samples.
+*/
+int predict_pose(predict_state *state, const vrpn_sample *samples, int count, long target, double pos[3], double quat[4])
+{
+	if(count < 1)
+		return 0;
+
+	const vrpn_sample *newest = &samples[0];
+	vec3d_copy(pos, newest->pos);
+	quatd_normalize_new(quat, newest->quat);
+	if(state->model == PREDICT_NONE)
+		return 1;
+
+	predict_check(state, samples, count);
+
+	/* Convert the target into the tracking system's clock. The fastest
+	 * sample tells us the offset between the clocks (plus the smallest
+	 * delay between the tracker and us). */
+	long offset = samples[0].received - samples[0].time;
+	for(int i=1; i<count; i++)
+		if(samples[i].received - samples[i].time < offset)
+			offset = samples[i].received - samples[i].time;
+	long ahead = target - offset - newest->time;
+	if(ahead < 0)
+		ahead = 0;
+	if(ahead > state->horizon)
+		ahead = state->horizon;
+
+	/* Collect the samples in the window. Times are in seconds relative
+	 * to the newest sample, orientations are rotation vectors relative
+	 * to the newest orientation. */
+	double x[VRPN_HISTORY], posY[VRPN_HISTORY*3], rotY[VRPN_HISTORY*3];
+	double inverseNewest[4] = { -quat[0], -quat[1], -quat[2], quat[3] };
+	int n = 0;
+	while(n < count && n < VRPN_HISTORY && newest->time - samples[n].time <= state->window)
+	{
+		x[n] = (samples[n].time - newest->time) / 1000000.0;
+		vec3d_copy(posY+n*3, samples[n].pos);
+		double delta[4];
+		quatd_mult_quatd_new(delta, samples[n].quat, inverseNewest);
+		quatd_to_rotvec(rotY+n*3, delta);
+		n++;
+	}
+
+	double at = ahead / 1000000.0;
+	int degree = state->model == PREDICT_ACCELERATION ? 2 : 1;
+	predict_fit(x, posY, n, degree, at, pos);
+
+	/* Constant angular velocity: rotate the newest orientation by the
+	 * fitted rotation vector. */
+	double rotvec[3], step[4];
+	predict_fit(x, rotY, n, 1, at, rotvec);
+	quatd_from_rotvec(step, rotvec);
+	quatd_mult_quatd_new(quat, step, quat);
+	quatd_normalize(quat);
+
+	predict_remember(state, newest->time + ahead, pos, quat, newest);
+	return 1;
+}
+
+/** Prints how accurate the predictions were.
+
+    @param state The predict_state.
+    @param name The name of the tracked object to include in the message.
+*/
+void predict_print_stats(const predict_state *state, const char *name)
+{
+	if(state->checked == 0)
+		return;
+	double n = (double) state->checked;
+	msg(MSG_INFO, "Prediction for %s: %lu predictions, %lu checked, predicted %.1f ms ahead on average.",
+	    name, state->predictions, state->checked, state->ahead/1000.0/state->predictions);
+	msg(MSG_INFO, "Prediction for %s: position error %.2f mm mean, %.2f mm RMS, %.2f mm max (%.2f mm mean without prediction).",
+	    name, state->posError/n*1000, sqrt(state->posErrorSq/n)*1000, state->posErrorMax*1000, state->basePosError/n*1000);
+	msg(MSG_INFO, "Prediction for %s: orientation error %.3f deg mean, %.3f deg max (%.3f deg mean without prediction).",
+	    name, state->angleError/n*180/M_PI, state->angleErrorMax*180/M_PI, state->baseAngleError/n*180/M_PI);
+}
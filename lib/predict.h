@@ -0,0 +1,87 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Predicts where a tracked object will be at a time in the near
+    future (e.g., when the frame being rendered will appear on the
+    screen, see framepace_predicted_display()) from its recent
+    samples (see vrpn_get_history()).
+
+    The position is extrapolated by fitting a line (constant velocity)
+    or a parabola (constant acceleration) to the samples from the last
+    few milliseconds. The orientation is extrapolated by fitting a
+    constant angular velocity to the rotations between those samples
+    and the newest sample, and integrating it forward.
+
+    The samples are recorded with the tracking system's clock. The
+    offset between that clock and kuhl_microseconds() is estimated
+    from the sample that arrived fastest (the smallest difference
+    between the time a sample was received and the time it was
+    recorded). The smallest delay between the tracking system and us
+    can't be separated from the offset between the clocks, so it is
+    not included in the prediction.
+
+    Each prediction is remembered until samples from the predicted
+    time arrive. Then the prediction is compared against what actually
+    happened, and against what we would have drawn without prediction
+    (the newest sample at the time of the prediction).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include "vrpn-help.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PREDICT_NONE         0 /**< Use the newest sample */
+#define PREDICT_VELOCITY     1 /**< Assume constant velocity and angular velocity */
+#define PREDICT_ACCELERATION 2 /**< Assume constant acceleration and angular velocity */
+
+/** Number of predictions that can wait for samples to arrive so that
+ * they can be checked. */
+#define PREDICT_PENDING 16
+
+/** A prediction that has not been checked yet. */
+typedef struct {
+	long time;          /**< Predicted time (tracking system's clock) */
+	double pos[3];      /**< Predicted position */
+	double quat[4];     /**< Predicted orientation */
+	double basePos[3];  /**< Newest position when the prediction was made */
+	double baseQuat[4]; /**< Newest orientation when the prediction was made */
+} predict_pending;
+
+/** Settings, state, and error statistics for predicting one object. */
+typedef struct {
+	int model;     /**< PREDICT_NONE, PREDICT_VELOCITY, or PREDICT_ACCELERATION */
+	long horizon;  /**< Never predict more than this many microseconds past the newest sample */
+	long window;   /**< Fit the motion to samples up to this many microseconds older than the newest sample */
+
+	predict_pending pending[PREDICT_PENDING]; /**< Predictions that haven't been checked yet (oldest first) */
+	int pendingCount;
+
+	unsigned long predictions; /**< Number of different predictions made */
+	double ahead;           /**< Sum of how far ahead of the newest sample we predicted (microseconds) */
+	unsigned long checked;  /**< Number of predictions compared against samples */
+	double posError;        /**< Sum of position errors (meters) */
+	double posErrorSq;      /**< Sum of squared position errors */
+	double posErrorMax;     /**< Largest position error */
+	double angleError;      /**< Sum of orientation errors (radians) */
+	double angleErrorMax;   /**< Largest orientation error */
+	double basePosError;    /**< Sum of position errors without prediction */
+	double baseAngleError;  /**< Sum of orientation errors without prediction */
+} predict_state;
+
+void predict_init(predict_state *state, int model, long horizon, long window);
+int predict_init_config(predict_state *state);
+int predict_pose(predict_state *state, const vrpn_sample *samples, int count, long target, double pos[3], double quat[4]);
+void predict_print_stats(const predict_state *state, const char *name);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -13,6 +13,9 @@
     queue---the queue does not store a list of pointers. If you want to
     make a queue of pointers, you should pass a pointer to a pointer
     into queue_enqueue();
+
+    The queue is not thread safe. To pass items between threads, see
+    ring.h.
     
     @author Scott Kuhl 
  */
@@ -0,0 +1,547 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#ifdef _WIN32
+#include "windows-compat.h" // usleep() on windows
+#include <malloc.h> // _aligned_malloc()
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <unistd.h>
+#include <sched.h> // sched_yield()
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#elif defined(HAVE_PTHREADS)
+#include <pthread.h>
+#endif
+
+#include "ring.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+
+#define RING_CACHE_LINE 64
+
+struct ring
+{
+	/* Set when the ring is created */
+	int kind;
+	int capacity;          /**< Number of slots, always a power of 2 */
+	int itemSize;
+	int slotSize;          /**< Bytes per slot (including the sequence number in RING_MPMC rings) */
+	unsigned long mask;    /**< capacity-1 */
+	unsigned char *slots;
+	char pad0[RING_CACHE_LINE];
+
+	/* Written by the producers */
+	unsigned long tail;        /**< Position of the next item to push */
+	unsigned long cachedHead;  /**< RING_SPSC: the producer's last copy of head */
+	char pad1[RING_CACHE_LINE - 2*sizeof(unsigned long)];
+
+	/* Written by the consumers */
+	unsigned long head;        /**< Position of the next item to pop */
+	unsigned long cachedTail;  /**< RING_SPSC: the consumer's last copy of tail */
+	char pad2[RING_CACHE_LINE - 2*sizeof(unsigned long)];
+
+	/* Used by ring_push_wait() and ring_pop_wait() */
+	unsigned int notEmptySeq;  /**< Incremented when an item is pushed while a consumer waits */
+	unsigned int notFullSeq;   /**< Incremented when an item is popped while a producer waits */
+	int emptyWaiters;          /**< Number of consumers waiting for an item */
+	int fullWaiters;           /**< Number of producers waiting for room */
+#if !defined(__linux__) && defined(HAVE_PTHREADS)
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+#endif
+};
+
+/* In a RING_MPMC ring, each slot starts with a sequence number. A
+ * producer may write to the slot at position pos when its sequence
+ * number is pos; a consumer may read from it when it is pos+1. */
+typedef struct
+{
+	unsigned long seq;
+} ring_slot;
+
+static void* ring_aligned_alloc(size_t size)
+{
+	void *ptr = NULL;
+#ifdef _WIN32
+	ptr = _aligned_malloc(size, RING_CACHE_LINE);
+#else
+	if(posix_memalign(&ptr, RING_CACHE_LINE, size) != 0)
+		ptr = NULL;
+#endif
+	if(ptr == NULL)
+	{
+		msg(MSG_FATAL, "Unable to allocate %lu bytes for a ring", (unsigned long) size);
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+static void ring_aligned_free(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+/** Creates a new ring.
+
+    @param capacity The number of items the ring can hold. It is
+    rounded up to a power of 2.
+
+    @param itemSize The size of each item in bytes.
+
+    @param kind RING_SPSC if only one thread pushes and one thread
+    pops, RING_MPMC if several threads push or pop.
+
+    @return The new ring or NULL if the parameters are invalid. Free
+    it with ring_free().
+*/
+ring* ring_new(int capacity, int itemSize, int kind)
+{
+	if(capacity < 1 || capacity > (1<<30) || itemSize < 1 ||
+	   (kind != RING_SPSC && kind != RING_MPMC))
+	{
+		msg(MSG_ERROR, "Invalid ring: capacity=%d itemSize=%d kind=%d", capacity, itemSize, kind);
+		return NULL;
+	}
+
+	ring *r = (ring*) ring_aligned_alloc(sizeof(ring));
+	memset(r, 0, sizeof(ring));
+	r->kind = kind;
+	r->capacity = 2;
+	while(r->capacity < capacity)
+		r->capacity *= 2;
+	r->mask = r->capacity-1;
+	r->itemSize = itemSize;
+	if(kind == RING_MPMC)
+	{
+		/* Keep the sequence numbers aligned */
+		r->slotSize = sizeof(ring_slot) + itemSize;
+		r->slotSize = (r->slotSize + sizeof(ring_slot)-1) / sizeof(ring_slot) * sizeof(ring_slot);
+	}
+	else
+		r->slotSize = itemSize;
+	r->slots = (unsigned char*) ring_aligned_alloc((size_t) r->capacity * r->slotSize);
+	if(kind == RING_MPMC)
+	{
+		for(int i=0; i<r->capacity; i++)
+			((ring_slot*) (r->slots + (size_t) i*r->slotSize))->seq = i;
+	}
+#if !defined(__linux__) && defined(HAVE_PTHREADS)
+	pthread_mutex_init(&(r->mutex), NULL);
+	pthread_cond_init(&(r->changed), NULL);
+#endif
+	return r;
+}
+
+/** Frees a ring. No other threads may be using it. */
+void ring_free(ring *r)
+{
+	if(r == NULL)
+		return;
+#if !defined(__linux__) && defined(HAVE_PTHREADS)
+	pthread_mutex_destroy(&(r->mutex));
+	pthread_cond_destroy(&(r->changed));
+#endif
+	ring_aligned_free(r->slots);
+	ring_aligned_free(r);
+}
+
+
+/* Wakes up all of the threads waiting on a sequence number if there
+ * are any. The fence makes sure that either we see the waiter or the
+ * waiter sees the change we just made to the ring. */
+static void ring_notify(ring *r, unsigned int *seq, int *waiters)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+		return;
+#if defined(__linux__)
+	__atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#elif defined(HAVE_PTHREADS)
+	pthread_mutex_lock(&(r->mutex));
+	__atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&(r->changed));
+	pthread_mutex_unlock(&(r->mutex));
+#else
+	(void) r;
+	__atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Sleeps until the sequence number is no longer 'value' or until the
+ * deadline (in kuhl_nanoseconds() time, -1 for no deadline). May
+ * return early. Returns 0 if the deadline has passed. */
+static int ring_block(ring *r, unsigned int *seq, unsigned int value, int64_t deadline)
+{
+	int64_t remain = -1;
+	if(deadline >= 0)
+	{
+		remain = deadline - kuhl_nanoseconds();
+		if(remain <= 0)
+			return 0;
+	}
+
+#if defined(__linux__)
+	(void) r;
+	struct timespec ts;
+	ts.tv_sec = remain / 1000000000;
+	ts.tv_nsec = remain % 1000000000;
+	syscall(SYS_futex, seq, FUTEX_WAIT_PRIVATE, value, remain >= 0 ? &ts : NULL, NULL, 0);
+#elif defined(HAVE_PTHREADS)
+	pthread_mutex_lock(&(r->mutex));
+	if(__atomic_load_n(seq, __ATOMIC_SEQ_CST) == value)
+	{
+		if(remain < 0)
+			pthread_cond_wait(&(r->changed), &(r->mutex));
+		else
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			int64_t ns = ts.tv_nsec + remain;
+			ts.tv_sec += ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			pthread_cond_timedwait(&(r->changed), &(r->mutex), &ts);
+		}
+	}
+	pthread_mutex_unlock(&(r->mutex));
+#else
+	/* Without threads, another thread can't change the ring; just
+	 * wait for the deadline. */
+	(void) r; (void) seq; (void) value;
+	usleep(100);
+#endif
+	return 1;
+}
+
+
+/* Number of times ring_push_wait() and ring_pop_wait() retry before
+ * sleeping. Another thread often makes room (or adds an item) within
+ * a few microseconds, which is much sooner than a sleeping thread can
+ * be woken up. */
+#define RING_SPIN 64
+#define RING_YIELD 4
+
+/* Tells the processor that we are spinning. */
+static inline void ring_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* Lets other threads run (e.g., the thread that will add an item to
+ * the ring when there is only one processor). */
+static void ring_yield(void)
+{
+#ifdef _WIN32
+	Sleep(0);
+#else
+	sched_yield();
+#endif
+}
+
+/* Pushes one item without waking up any consumers. */
+static int ring_push_nonotify(ring *r, const void *item)
+{
+	if(r->kind == RING_SPSC)
+	{
+		unsigned long tail = r->tail; // only this thread writes tail
+		if(tail - r->cachedHead >= (unsigned long) r->capacity)
+		{
+			r->cachedHead = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+			if(tail - r->cachedHead >= (unsigned long) r->capacity)
+				return 0; // full
+		}
+		memcpy(r->slots + (tail & r->mask)*r->slotSize, item, r->itemSize);
+		__atomic_store_n(&(r->tail), tail+1, __ATOMIC_RELEASE);
+		return 1;
+	}
+
+	unsigned long pos = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+	ring_slot *slot;
+	while(1)
+	{
+		slot = (ring_slot*) (r->slots + (pos & r->mask)*r->slotSize);
+		unsigned long seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		long diff = (long) (seq - pos);
+		if(diff == 0)
+		{
+			/* The slot is free; try to claim it. */
+			if(__atomic_compare_exchange_n(&(r->tail), &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return 0; // full
+		else
+			pos = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED); // another producer claimed it
+	}
+	memcpy(slot+1, item, r->itemSize);
+	__atomic_store_n(&(slot->seq), pos+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Pops one item without waking up any producers. */
+static int ring_pop_nonotify(ring *r, void *item)
+{
+	if(r->kind == RING_SPSC)
+	{
+		unsigned long head = r->head; // only this thread writes head
+		if(head == r->cachedTail)
+		{
+			r->cachedTail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+			if(head == r->cachedTail)
+				return 0; // empty
+		}
+		memcpy(item, r->slots + (head & r->mask)*r->slotSize, r->itemSize);
+		__atomic_store_n(&(r->head), head+1, __ATOMIC_RELEASE);
+		return 1;
+	}
+
+	unsigned long pos = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	ring_slot *slot;
+	while(1)
+	{
+		slot = (ring_slot*) (r->slots + (pos & r->mask)*r->slotSize);
+		unsigned long seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		long diff = (long) (seq - (pos+1));
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&(r->head), &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+			return 0; // empty
+		else
+			pos = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	}
+	memcpy(item, slot+1, r->itemSize);
+	/* The slot can be used again when the producers wrap around. */
+	__atomic_store_n(&(slot->seq), pos+r->mask+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/** Adds a copy of an item to the ring without waiting.
+
+    @param r The ring.
+    @param item A pointer to the item (itemSize bytes are copied).
+    @return 1 if the item was added, 0 if the ring was full.
+*/
+int ring_push(ring *r, const void *item)
+{
+	if(!ring_push_nonotify(r, item))
+		return 0;
+	ring_notify(r, &(r->notEmptySeq), &(r->emptyWaiters));
+	return 1;
+}
+
+/** Removes the oldest item from the ring without waiting.
+
+    @param r The ring.
+    @param item Location to copy the item into.
+    @return 1 if an item was removed, 0 if the ring was empty.
+*/
+int ring_pop(ring *r, void *item)
+{
+	if(!ring_pop_nonotify(r, item))
+		return 0;
+	ring_notify(r, &(r->notFullSeq), &(r->fullWaiters));
+	return 1;
+}
+
+/** Adds several items to the ring without waiting. The items are
+    added in order. If the ring fills up, the remaining items are not
+    added.
+
+    @param r The ring.
+    @param items An array of count items.
+    @param count The number of items to add.
+    @return The number of items that were added.
+*/
+int ring_push_many(ring *r, const void *items, int count)
+{
+	const unsigned char *src = (const unsigned char*) items;
+	int pushed = 0;
+	if(r->kind == RING_SPSC)
+	{
+		unsigned long tail = r->tail;
+		unsigned long space = r->capacity - (tail - r->cachedHead);
+		if(space < (unsigned long) count)
+		{
+			r->cachedHead = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+			space = r->capacity - (tail - r->cachedHead);
+		}
+		pushed = count < (long) space ? count : (int) space;
+		/* Copy in up to two pieces (before and after wrapping around). */
+		int first = r->capacity - (int) (tail & r->mask);
+		if(first > pushed)
+			first = pushed;
+		memcpy(r->slots + (tail & r->mask)*r->itemSize, src, (size_t) first*r->itemSize);
+		memcpy(r->slots, src + (size_t) first*r->itemSize, (size_t) (pushed-first)*r->itemSize);
+		__atomic_store_n(&(r->tail), tail+pushed, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		while(pushed < count && ring_push_nonotify(r, src + (size_t) pushed*r->itemSize))
+			pushed++;
+	}
+
+	if(pushed > 0)
+		ring_notify(r, &(r->notEmptySeq), &(r->emptyWaiters));
+	return pushed;
+}
+
+/** Removes up to count of the oldest items from the ring without
+    waiting.
+
+    @param r The ring.
+    @param items Location to copy up to count items into.
+    @param count The maximum number of items to remove.
+    @return The number of items that were removed.
+*/
+int ring_pop_many(ring *r, void *items, int count)
+{
+	unsigned char *dest = (unsigned char*) items;
+	int popped = 0;
+	if(r->kind == RING_SPSC)
+	{
+		unsigned long head = r->head;
+		unsigned long avail = r->cachedTail - head;
+		if(avail < (unsigned long) count)
+		{
+			r->cachedTail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+			avail = r->cachedTail - head;
+		}
+		popped = count < (long) avail ? count : (int) avail;
+		int first = r->capacity - (int) (head & r->mask);
+		if(first > popped)
+			first = popped;
+		memcpy(dest, r->slots + (head & r->mask)*r->itemSize, (size_t) first*r->itemSize);
+		memcpy(dest + (size_t) first*r->itemSize, r->slots, (size_t) (popped-first)*r->itemSize);
+		__atomic_store_n(&(r->head), head+popped, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		while(popped < count && ring_pop_nonotify(r, dest + (size_t) popped*r->itemSize))
+			popped++;
+	}
+
+	if(popped > 0)
+		ring_notify(r, &(r->notFullSeq), &(r->fullWaiters));
+	return popped;
+}
+
+/** Adds a copy of an item to the ring, waiting for room if the ring
+    is full.
+
+    @param r The ring.
+    @param item A pointer to the item.
+    @param timeoutUsec The maximum time to wait in microseconds, or -1
+    to wait forever.
+    @return 1 if the item was added, 0 if the timeout expired.
+*/
+int ring_push_wait(ring *r, const void *item, long timeoutUsec)
+{
+	for(int i=0; i<RING_SPIN+RING_YIELD; i++)
+	{
+		if(ring_push(r, item))
+			return 1;
+		if(i < RING_SPIN)
+			ring_relax();
+		else
+			ring_yield();
+	}
+	int64_t deadline = timeoutUsec < 0 ? -1 : kuhl_nanoseconds() + (int64_t) timeoutUsec*1000;
+	while(1)
+	{
+		/* Tell consumers that we are waiting and then check again
+		 * (see ring_notify()). */
+		unsigned int seq = __atomic_load_n(&(r->notFullSeq), __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&(r->fullWaiters), 1, __ATOMIC_SEQ_CST);
+		int done = ring_push(r, item);
+		int timedOut = !done && !ring_block(r, &(r->notFullSeq), seq, deadline);
+		__atomic_fetch_sub(&(r->fullWaiters), 1, __ATOMIC_SEQ_CST);
+		if(done)
+			return 1;
+		if(timedOut)
+			return ring_push(r, item);
+	}
+}
+
+/** Removes the oldest item from the ring, waiting for an item if the
+    ring is empty.
+
+    @param r The ring.
+    @param item Location to copy the item into.
+    @param timeoutUsec The maximum time to wait in microseconds, or -1
+    to wait forever.
+    @return 1 if an item was removed, 0 if the timeout expired.
+*/
+int ring_pop_wait(ring *r, void *item, long timeoutUsec)
+{
+	for(int i=0; i<RING_SPIN+RING_YIELD; i++)
+	{
+		if(ring_pop(r, item))
+			return 1;
+		if(i < RING_SPIN)
+			ring_relax();
+		else
+			ring_yield();
+	}
+	int64_t deadline = timeoutUsec < 0 ? -1 : kuhl_nanoseconds() + (int64_t) timeoutUsec*1000;
+	while(1)
+	{
+		unsigned int seq = __atomic_load_n(&(r->notEmptySeq), __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&(r->emptyWaiters), 1, __ATOMIC_SEQ_CST);
+		int done = ring_pop(r, item);
+		int timedOut = !done && !ring_block(r, &(r->notEmptySeq), seq, deadline);
+		__atomic_fetch_sub(&(r->emptyWaiters), 1, __ATOMIC_SEQ_CST);
+		if(done)
+			return 1;
+		if(timedOut)
+			return ring_pop(r, item);
+	}
+}
+
+/** Returns the number of items in the ring. If other threads are
+ * using the ring, the number may be out of date. */
+int ring_length(const ring *r)
+{
+	unsigned long head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+	unsigned long tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+	long length = (long) (tail - head);
+	if(length < 0)
+		return 0;
+	if(length > r->capacity)
+		return r->capacity;
+	return (int) length;
+}
+
+/** Returns the number of items the ring can hold. */
+int ring_capacity(const ring *r)
+{
+	return r->capacity;
+}
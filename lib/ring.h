@@ -0,0 +1,64 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Bounded ring buffers for handing items from one thread to another
+    without locks (e.g., tracking samples, decoded video frames or log
+    records). Unlike queue.h, a ring never grows: pushing onto a full
+    ring fails (or waits) and popping from an empty ring fails (or
+    waits). Like queue.h, each item is copied into and out of the ring.
+
+    There are two kinds of rings:
+
+    - RING_SPSC: exactly one thread pushes and exactly one thread pops.
+      This is the fastest kind: each side owns its own index and only
+      reads the other side's index when it appears to be out of room.
+
+    - RING_MPMC: any number of threads push and pop (each slot has a
+      sequence number, see Dmitry Vyukov's bounded MPMC queue).
+
+    The producer and consumer indices are kept on separate cache lines
+    so the two sides don't slow each other down. ring_push_many() and
+    ring_pop_many() move several items at once; on a RING_SPSC ring
+    they only touch the shared indices once per call.
+
+    ring_push_wait() and ring_pop_wait() block until there is room or
+    an item is available. Threads that block sleep in the kernel
+    (futex on Linux, a condition variable elsewhere) and are only
+    woken up when another thread changes the ring. When nobody is
+    waiting, pushing and popping never make a system call.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RING_SPSC 0 /**< One producer thread, one consumer thread */
+#define RING_MPMC 1 /**< Any number of producer and consumer threads */
+
+/** A bounded ring buffer. Create with ring_new(). */
+typedef struct ring ring;
+
+ring* ring_new(int capacity, int itemSize, int kind);
+void ring_free(ring *r);
+
+int ring_push(ring *r, const void *item);
+int ring_pop(ring *r, void *item);
+int ring_push_many(ring *r, const void *items, int count);
+int ring_pop_many(ring *r, void *items, int count);
+
+int ring_push_wait(ring *r, const void *item, long timeoutUsec);
+int ring_pop_wait(ring *r, void *item, long timeoutUsec);
+
+int ring_length(const ring *r);
+int ring_capacity(const ring *r);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,1091 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#else
+#include "windows-compat.h"
+#include <process.h> // getpid()
+#endif
+
+#include <GL/glew.h>
+
+#include "texcompress.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "threadpool.h"
+#include "msg.h"
+#include "stb_image.h"
+
+#define TEXCOMPRESS_FOURCC(a,b,c,d) ((uint32_t)(a) | ((uint32_t)(b)<<8) | ((uint32_t)(c)<<16) | ((uint32_t)(d)<<24))
+#define TEXCOMPRESS_MARKER TEXCOMPRESS_FOURCC('K','U','H','L')
+#define TEXCOMPRESS_VERSION 1
+
+/* Values used in DDS headers. See "Programming Guide for DDS" in the
+ * DirectX documentation. */
+#define DDSD_CAPS        0x1
+#define DDSD_HEIGHT      0x2
+#define DDSD_WIDTH       0x4
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE  0x80000
+#define DDPF_FOURCC      0x4
+#define DDSCAPS_COMPLEX  0x8
+#define DDSCAPS_TEXTURE  0x1000
+#define DDSCAPS_MIPMAP   0x400000
+#define DXGI_FORMAT_BC1_UNORM      71
+#define DXGI_FORMAT_BC1_UNORM_SRGB 72
+#define DXGI_FORMAT_BC3_UNORM      77
+#define DXGI_FORMAT_BC3_UNORM_SRGB 78
+#define DXGI_FORMAT_BC7_UNORM      98
+#define DXGI_FORMAT_BC7_UNORM_SRGB 99
+#define DDS_DIMENSION_TEXTURE2D    3
+
+/* The header which follows "DDS " at the start of a DDS file. We
+ * store TEXCOMPRESS_MARKER and TEXCOMPRESS_VERSION in the first two
+ * reserved values. */
+typedef struct
+{
+	uint32_t size;
+	uint32_t flags;
+	uint32_t height;
+	uint32_t width;
+	uint32_t pitchOrLinearSize;
+	uint32_t depth;
+	uint32_t mipMapCount;
+	uint32_t reserved1[11];
+	struct
+	{
+		uint32_t size;
+		uint32_t flags;
+		uint32_t fourCC;
+		uint32_t rgbBitCount;
+		uint32_t bitMask[4];
+	} pixelFormat;
+	uint32_t caps;
+	uint32_t caps2;
+	uint32_t caps3;
+	uint32_t caps4;
+	uint32_t reserved2;
+} texcompress_dds_header;
+
+/* Extra header used when pixelFormat.fourCC is "DX10". BC7 textures
+ * can only be described with this header. */
+typedef struct
+{
+	uint32_t dxgiFormat;
+	uint32_t resourceDimension;
+	uint32_t miscFlag;
+	uint32_t arraySize;
+	uint32_t miscFlags2;
+} texcompress_dds_header_dx10;
+
+/** Converts a format name ("auto", "bc1", "bc3" or "bc7") into one of
+ * the TEXCOMPRESS_* values. Returns -1 if the name is not
+ * recognized. */
+int texcompress_format_parse(const char *name)
+{
+	if(strcasecmp(name, "auto") == 0)
+		return TEXCOMPRESS_AUTO;
+	if(strcasecmp(name, "bc1") == 0 || strcasecmp(name, "dxt1") == 0)
+		return TEXCOMPRESS_BC1;
+	if(strcasecmp(name, "bc3") == 0 || strcasecmp(name, "dxt5") == 0)
+		return TEXCOMPRESS_BC3;
+	if(strcasecmp(name, "bc7") == 0)
+		return TEXCOMPRESS_BC7;
+	return -1;
+}
+
+/** Returns the name of a TEXCOMPRESS_* format. */
+const char* texcompress_format_name(int format)
+{
+	switch(format)
+	{
+		case TEXCOMPRESS_AUTO: return "auto";
+		case TEXCOMPRESS_BC1:  return "BC1";
+		case TEXCOMPRESS_BC3:  return "BC3";
+		case TEXCOMPRESS_BC7:  return "BC7";
+		default:               return "unknown";
+	}
+}
+
+/** Returns the number of bytes needed to store a compressed image
+ * (or one mipmap level of a compressed image). Each 4x4 block of
+ * pixels uses 8 bytes in BC1 and 16 bytes in BC3 and BC7. */
+size_t texcompress_level_bytes(int format, int width, int height)
+{
+	size_t blockBytes = format == TEXCOMPRESS_BC1 ? 8 : 16;
+	return (size_t)((width+3)/4) * ((height+3)/4) * blockBytes;
+}
+
+
+/* sRGB encoded value (0 to 255) to linear intensity (0 to 1). Filled
+ * in by texcompress_init(). */
+static float texcompress_srgb_to_linear[256];
+
+static void texcompress_init(void)
+{
+	static int initialized = 0;
+	if(initialized)
+		return;
+	for(int i=0; i<256; i++)
+	{
+		float v = i/255.0f;
+		texcompress_srgb_to_linear[i] = v <= 0.04045f ? v/12.92f : powf((v+0.055f)/1.055f, 2.4f);
+	}
+	initialized = 1;
+}
+
+static unsigned char texcompress_linear_to_srgb(float v)
+{
+	v = v <= 0.0031308f ? v*12.92f : 1.055f*powf(v, 1/2.4f) - 0.055f;
+	int i = (int) (v*255.0f + 0.5f);
+	if(i < 0)
+		return 0;
+	if(i > 255)
+		return 255;
+	return (unsigned char) i;
+}
+
+/* Creates the next smaller mipmap level by averaging 2x2 blocks of
+ * pixels. The color channels are averaged in linear space so that the
+ * smaller levels don't get darker. */
+static unsigned char* texcompress_downsample(const unsigned char *image, int width, int height,
+                                             int newWidth, int newHeight)
+{
+	unsigned char *result = kuhl_malloc((size_t)newWidth*newHeight*4);
+	for(int y=0; y<newHeight; y++)
+	{
+		int y1 = 2*y < height ? 2*y : height-1;
+		int y2 = 2*y+1 < height ? 2*y+1 : height-1;
+		for(int x=0; x<newWidth; x++)
+		{
+			int x1 = 2*x < width ? 2*x : width-1;
+			int x2 = 2*x+1 < width ? 2*x+1 : width-1;
+			const unsigned char *a = image + ((size_t)y1*width+x1)*4;
+			const unsigned char *b = image + ((size_t)y1*width+x2)*4;
+			const unsigned char *c = image + ((size_t)y2*width+x1)*4;
+			const unsigned char *d = image + ((size_t)y2*width+x2)*4;
+			unsigned char *out = result + ((size_t)y*newWidth+x)*4;
+			for(int i=0; i<3; i++)
+			{
+				float sum = texcompress_srgb_to_linear[a[i]] + texcompress_srgb_to_linear[b[i]] +
+					texcompress_srgb_to_linear[c[i]] + texcompress_srgb_to_linear[d[i]];
+				out[i] = texcompress_linear_to_srgb(sum/4);
+			}
+			out[3] = (unsigned char) ((a[3]+b[3]+c[3]+d[3]+2)/4);
+		}
+	}
+	return result;
+}
+
+
+/* Copies a 4x4 block of pixels out of an image, repeating the last
+ * column and row if the block extends past the edge of the image. */
+static void texcompress_get_block(float px[16][4], const unsigned char *rgba, int width, int height, int bx, int by)
+{
+	for(int y=0; y<4; y++)
+	{
+		int sy = by*4+y < height ? by*4+y : height-1;
+		for(int x=0; x<4; x++)
+		{
+			int sx = bx*4+x < width ? bx*4+x : width-1;
+			const unsigned char *p = rgba + ((size_t)sy*width+sx)*4;
+			for(int c=0; c<4; c++)
+				px[y*4+x][c] = p[c];
+		}
+	}
+}
+
+static float texcompress_clamp255(float v)
+{
+	if(v < 0)
+		return 0;
+	if(v > 255)
+		return 255;
+	return v;
+}
+
+/* Finds the line that best fits the colors in a block (the principal
+ * axis) and returns the ends of the segment of that line which covers
+ * all of the colors. Only the first "channels" channels are used. */
+static void texcompress_fit_line(float px[16][4], int channels, float e0[4], float e1[4])
+{
+	float mean[4] = { 0, 0, 0, 0 };
+	for(int i=0; i<16; i++)
+		for(int c=0; c<channels; c++)
+			mean[c] += px[i][c]/16.0f;
+
+	float cov[4][4];
+	memset(cov, 0, sizeof(cov));
+	for(int i=0; i<16; i++)
+		for(int a=0; a<channels; a++)
+			for(int b=0; b<channels; b++)
+				cov[a][b] += (px[i][a]-mean[a])*(px[i][b]-mean[b]);
+
+	/* Power iteration, starting with the channel that varies the
+	 * most. */
+	int start = 0;
+	for(int c=1; c<channels; c++)
+		if(cov[c][c] > cov[start][start])
+			start = c;
+	float axis[4] = { 0, 0, 0, 0 };
+	for(int c=0; c<channels; c++)
+		axis[c] = cov[start][c];
+	for(int iter=0; iter<8; iter++)
+	{
+		float v[4] = { 0, 0, 0, 0 };
+		float length = 0;
+		for(int a=0; a<channels; a++)
+		{
+			for(int b=0; b<channels; b++)
+				v[a] += cov[a][b]*axis[b];
+			length += v[a]*v[a];
+		}
+		length = sqrtf(length);
+		if(length < 1e-6f)
+			break;
+		for(int c=0; c<channels; c++)
+			axis[c] = v[c]/length;
+	}
+
+	float tmin = 0, tmax = 0;
+	for(int i=0; i<16; i++)
+	{
+		float t = 0;
+		for(int c=0; c<channels; c++)
+			t += (px[i][c]-mean[c])*axis[c];
+		if(t < tmin)
+			tmin = t;
+		if(t > tmax)
+			tmax = t;
+	}
+	for(int c=0; c<4; c++)
+	{
+		e0[c] = texcompress_clamp255(mean[c] + tmin*axis[c]);
+		e1[c] = texcompress_clamp255(mean[c] + tmax*axis[c]);
+	}
+}
+
+/* Given the position t of each pixel between two endpoints (0 is e0, 1
+ * is e1), finds the endpoints which minimize the squared error. The
+ * endpoints are unchanged if there is no unique solution. */
+static void texcompress_least_squares(float px[16][4], int channels, const float t[16], float e0[4], float e1[4])
+{
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = { 0, 0, 0, 0 };
+	float bx[4] = { 0, 0, 0, 0 };
+	for(int i=0; i<16; i++)
+	{
+		float a = 1-t[i];
+		float b = t[i];
+		aa += a*a;
+		ab += a*b;
+		bb += b*b;
+		for(int c=0; c<channels; c++)
+		{
+			ax[c] += a*px[i][c];
+			bx[c] += b*px[i][c];
+		}
+	}
+	float det = aa*bb - ab*ab;
+	if(fabsf(det) < 1e-6f)
+		return;
+	for(int c=0; c<channels; c++)
+	{
+		e0[c] = texcompress_clamp255((bb*ax[c] - ab*bx[c]) / det);
+		e1[c] = texcompress_clamp255((aa*bx[c] - ab*ax[c]) / det);
+	}
+}
+
+
+/* BC1 ------------------------------------------------------------ */
+
+static uint16_t texcompress_pack565(const float c[3])
+{
+	int r = (int) (c[0]*31/255.0f + 0.5f);
+	int g = (int) (c[1]*63/255.0f + 0.5f);
+	int b = (int) (c[2]*31/255.0f + 0.5f);
+	return (uint16_t) ((r<<11) | (g<<5) | b);
+}
+
+static void texcompress_unpack565(uint16_t v, float c[3])
+{
+	int r = (v>>11) & 31;
+	int g = (v>>5) & 63;
+	int b = v & 31;
+	c[0] = (float) ((r<<3) | (r>>2));
+	c[1] = (float) ((g<<2) | (g>>4));
+	c[2] = (float) ((b<<3) | (b>>2));
+}
+
+/* Quantizes two endpoints, picks the closest palette entry for each
+ * pixel and returns the squared error. The endpoints are ordered so
+ * that the block is decoded in four color mode. */
+static float texcompress_bc1_make(float px[16][4], const float e0[4], const float e1[4],
+                                  uint16_t *c0, uint16_t *c1, unsigned char idx[16])
+{
+	*c0 = texcompress_pack565(e0);
+	*c1 = texcompress_pack565(e1);
+	if(*c0 < *c1)
+	{
+		uint16_t tmp = *c0;
+		*c0 = *c1;
+		*c1 = tmp;
+	}
+
+	float palette[4][3];
+	texcompress_unpack565(*c0, palette[0]);
+	texcompress_unpack565(*c1, palette[1]);
+	for(int c=0; c<3; c++)
+	{
+		palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+	}
+	/* If the endpoints are the same, the block is decoded in three
+	 * color mode---but index 0 still means c0. */
+	int numColors = *c0 == *c1 ? 1 : 4;
+
+	float error = 0;
+	for(int i=0; i<16; i++)
+	{
+		float best = FLT_MAX;
+		idx[i] = 0;
+		for(int j=0; j<numColors; j++)
+		{
+			float d = 0;
+			for(int c=0; c<3; c++)
+				d += (px[i][c]-palette[j][c])*(px[i][c]-palette[j][c]);
+			if(d < best)
+			{
+				best = d;
+				idx[i] = (unsigned char) j;
+			}
+		}
+		error += best;
+	}
+	return error;
+}
+
+/* Encodes the color of a block into 8 bytes of BC1. Alpha is
+ * ignored. */
+static void texcompress_bc1_block(unsigned char *out, float px[16][4])
+{
+	/* Position of each BC1 index between c0 and c1. */
+	static const float weights[4] = { 0, 1, 1/3.0f, 2/3.0f };
+
+	float e0[4], e1[4];
+	texcompress_fit_line(px, 3, e0, e1);
+	uint16_t c0, c1;
+	unsigned char idx[16];
+	float error = texcompress_bc1_make(px, e0, e1, &c0, &c1, idx);
+
+	/* Refine the endpoints now that we know which pixels use which
+	 * palette entry. */
+	for(int iter=0; iter<2 && error > 0 && c0 != c1; iter++)
+	{
+		float t[16];
+		for(int i=0; i<16; i++)
+			t[i] = weights[idx[i]];
+		texcompress_unpack565(c0, e0);
+		texcompress_unpack565(c1, e1);
+		texcompress_least_squares(px, 3, t, e0, e1);
+
+		uint16_t newC0, newC1;
+		unsigned char newIdx[16];
+		float newError = texcompress_bc1_make(px, e0, e1, &newC0, &newC1, newIdx);
+		if(newError >= error)
+			break;
+		error = newError;
+		c0 = newC0;
+		c1 = newC1;
+		memcpy(idx, newIdx, 16);
+	}
+
+	uint32_t bits = 0;
+	for(int i=0; i<16; i++)
+		bits |= (uint32_t)idx[i] << (2*i);
+	out[0] = (unsigned char) (c0 & 0xff);
+	out[1] = (unsigned char) (c0 >> 8);
+	out[2] = (unsigned char) (c1 & 0xff);
+	out[3] = (unsigned char) (c1 >> 8);
+	for(int i=0; i<4; i++)
+		out[4+i] = (unsigned char) (bits >> (8*i));
+}
+
+/* Encodes the alpha of a block into the 8 byte alpha block used by
+ * BC3. */
+static void texcompress_bc3_alpha_block(unsigned char *out, float px[16][4])
+{
+	int amin = 255, amax = 0;
+	for(int i=0; i<16; i++)
+	{
+		int a = (int) px[i][3];
+		if(a < amin)
+			amin = a;
+		if(a > amax)
+			amax = a;
+	}
+	memset(out, 0, 8);
+	out[0] = (unsigned char) amax;
+	out[1] = (unsigned char) amin;
+	if(amax == amin)
+		return;
+
+	/* With a0 > a1, there are six values between the endpoints. */
+	float palette[8];
+	palette[0] = (float) amax;
+	palette[1] = (float) amin;
+	for(int i=2; i<8; i++)
+		palette[i] = ((8-i)*amax + (i-1)*amin) / 7.0f;
+
+	uint64_t bits = 0;
+	for(int i=0; i<16; i++)
+	{
+		int best = 0;
+		for(int j=1; j<8; j++)
+			if(fabsf(px[i][3]-palette[j]) < fabsf(px[i][3]-palette[best]))
+				best = j;
+		bits |= (uint64_t)best << (3*i);
+	}
+	for(int i=0; i<6; i++)
+		out[2+i] = (unsigned char) (bits >> (8*i));
+}
+
+
+/* BC7 ------------------------------------------------------------ */
+
+/* We only use BC7 mode 6: One pair of RGBA endpoints (7 bits per
+ * channel plus one extra "p-bit" per endpoint) and 16 palette entries
+ * between them. It is the simplest mode that handles both color and
+ * alpha and is the mode most BC7 encoders pick for smooth images. */
+static const int texcompress_bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+/* Quantizes an endpoint to 7 bits per channel and picks the p-bit
+ * which is shared by all four channels. */
+static void texcompress_bc7_quantize(const float e[4], int q[4], int *p)
+{
+	float bestError = FLT_MAX;
+	for(int pbit=0; pbit<2; pbit++)
+	{
+		int v[4];
+		float error = 0;
+		for(int c=0; c<4; c++)
+		{
+			v[c] = (int) floorf((e[c]-pbit)/2 + 0.5f);
+			if(v[c] < 0)
+				v[c] = 0;
+			if(v[c] > 127)
+				v[c] = 127;
+			float d = ((v[c]<<1)|pbit) - e[c];
+			error += d*d;
+		}
+		if(error < bestError)
+		{
+			bestError = error;
+			memcpy(q, v, sizeof(v));
+			*p = pbit;
+		}
+	}
+}
+
+/* Picks the closest palette entry for each pixel and returns the
+ * squared error. */
+static float texcompress_bc7_indices(float px[16][4], const int q0[4], int p0, const int q1[4], int p1,
+                                     unsigned char idx[16])
+{
+	float palette[16][4];
+	for(int c=0; c<4; c++)
+	{
+		int a = (q0[c]<<1) | p0;
+		int b = (q1[c]<<1) | p1;
+		for(int j=0; j<16; j++)
+		{
+			int w = texcompress_bc7_weights[j];
+			palette[j][c] = (float) (((64-w)*a + w*b + 32) >> 6);
+		}
+	}
+
+	float error = 0;
+	for(int i=0; i<16; i++)
+	{
+		float best = FLT_MAX;
+		idx[i] = 0;
+		for(int j=0; j<16; j++)
+		{
+			float d = 0;
+			for(int c=0; c<4; c++)
+				d += (px[i][c]-palette[j][c])*(px[i][c]-palette[j][c]);
+			if(d < best)
+			{
+				best = d;
+				idx[i] = (unsigned char) j;
+			}
+		}
+		error += best;
+	}
+	return error;
+}
+
+/* Writes the lowest "bits" bits of value into a block, starting at bit
+ * *pos. */
+static void texcompress_put_bits(unsigned char *out, int *pos, int value, int bits)
+{
+	for(int i=0; i<bits; i++, (*pos)++)
+		if((value >> i) & 1)
+			out[*pos/8] |= (unsigned char) (1 << (*pos%8));
+}
+
+/* Encodes a block into 16 bytes of BC7 (mode 6). */
+static void texcompress_bc7_block(unsigned char *out, float px[16][4])
+{
+	float e0[4], e1[4];
+	texcompress_fit_line(px, 4, e0, e1);
+	int q0[4], q1[4], p0, p1;
+	texcompress_bc7_quantize(e0, q0, &p0);
+	texcompress_bc7_quantize(e1, q1, &p1);
+	unsigned char idx[16];
+	float error = texcompress_bc7_indices(px, q0, p0, q1, p1, idx);
+
+	for(int iter=0; iter<2 && error > 0; iter++)
+	{
+		float t[16];
+		for(int i=0; i<16; i++)
+			t[i] = texcompress_bc7_weights[idx[i]] / 64.0f;
+		texcompress_least_squares(px, 4, t, e0, e1);
+
+		int newQ0[4], newQ1[4], newP0, newP1;
+		unsigned char newIdx[16];
+		texcompress_bc7_quantize(e0, newQ0, &newP0);
+		texcompress_bc7_quantize(e1, newQ1, &newP1);
+		float newError = texcompress_bc7_indices(px, newQ0, newP0, newQ1, newP1, newIdx);
+		if(newError >= error)
+			break;
+		error = newError;
+		memcpy(q0, newQ0, sizeof(q0));
+		memcpy(q1, newQ1, sizeof(q1));
+		p0 = newP0;
+		p1 = newP1;
+		memcpy(idx, newIdx, 16);
+	}
+
+	/* The most significant bit of the first index isn't stored; it is
+	 * always 0. Swap the endpoints if necessary to make that true. */
+	if(idx[0] & 8)
+	{
+		for(int c=0; c<4; c++)
+		{
+			int tmp = q0[c];
+			q0[c] = q1[c];
+			q1[c] = tmp;
+		}
+		int tmp = p0;
+		p0 = p1;
+		p1 = tmp;
+		for(int i=0; i<16; i++)
+			idx[i] = (unsigned char) (15-idx[i]);
+	}
+
+	memset(out, 0, 16);
+	int pos = 0;
+	texcompress_put_bits(out, &pos, 1<<6, 7); // mode 6
+	for(int c=0; c<4; c++)
+	{
+		texcompress_put_bits(out, &pos, q0[c], 7);
+		texcompress_put_bits(out, &pos, q1[c], 7);
+	}
+	texcompress_put_bits(out, &pos, p0, 1);
+	texcompress_put_bits(out, &pos, p1, 1);
+	texcompress_put_bits(out, &pos, idx[0], 3);
+	for(int i=1; i<16; i++)
+		texcompress_put_bits(out, &pos, idx[i], 4);
+}
+
+
+/* Work shared by the threads in texcompress_encode(). Each thread
+ * encodes one row of blocks at a time. */
+typedef struct
+{
+	unsigned char *out;
+	const unsigned char *rgba;
+	int width, height;
+	int format;
+} texcompress_job;
+
+static void texcompress_encode_row(void *data, int by)
+{
+	const texcompress_job *job = (const texcompress_job*) data;
+	int blocksX = (job->width+3)/4;
+	size_t blockBytes = job->format == TEXCOMPRESS_BC1 ? 8 : 16;
+	unsigned char *out = job->out + (size_t)by*blocksX*blockBytes;
+	for(int bx=0; bx<blocksX; bx++)
+	{
+		float px[16][4];
+		texcompress_get_block(px, job->rgba, job->width, job->height, bx, by);
+		switch(job->format)
+		{
+			case TEXCOMPRESS_BC1:
+				texcompress_bc1_block(out, px);
+				break;
+			case TEXCOMPRESS_BC3:
+				texcompress_bc3_alpha_block(out, px);
+				texcompress_bc1_block(out+8, px);
+				break;
+			case TEXCOMPRESS_BC7:
+				texcompress_bc7_block(out, px);
+				break;
+		}
+		out += blockBytes;
+	}
+}
+
+/** Compresses an RGBA image. The rows of blocks are compressed in
+ * parallel with the library's thread pool.
+ *
+ * @param out Where to store the compressed image. Must be
+ * texcompress_level_bytes() bytes long.
+ *
+ * @param rgba The image to compress with 4 bytes per pixel. The rows
+ * are compressed in the order they appear in the array.
+ *
+ * @param width The width of the image in pixels.
+ *
+ * @param height The height of the image in pixels.
+ *
+ * @param format TEXCOMPRESS_BC1, TEXCOMPRESS_BC3 or TEXCOMPRESS_BC7.
+ */
+void texcompress_encode(unsigned char *out, const unsigned char *rgba, int width, int height, int format)
+{
+	texcompress_job job;
+	job.out = out;
+	job.rgba = rgba;
+	job.width = width;
+	job.height = height;
+	job.format = format;
+	threadpool_for(threadpool_default(), (height+3)/4, texcompress_encode_row, &job);
+}
+
+/** Reads an image, compresses it and all of its mipmap levels, and
+ * writes the result to a DDS file. Does not use OpenGL.
+ *
+ * @param imageFilename The image to read.
+ *
+ * @param ddsFilename The file to write. kuhl_read_texture_file() will
+ * use the file if it is named imageFilename with ".dds" appended.
+ *
+ * @param format TEXCOMPRESS_BC1, TEXCOMPRESS_BC3, TEXCOMPRESS_BC7 or
+ * TEXCOMPRESS_AUTO.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int texcompress_convert(const char *imageFilename, const char *ddsFilename, int format)
+{
+	long startTime = kuhl_microseconds();
+	int width = -1, height = -1, comp = -1;
+	unsigned char *image = stbi_load(imageFilename, &width, &height, &comp, STBI_rgb_alpha);
+	if(image == NULL)
+	{
+		msg(MSG_ERROR, "Unable to read image: %s", imageFilename);
+		return 0;
+	}
+	/* Store the bottom row first. */
+	kuhl_flip_texture_array(image, width, height, 4);
+	texcompress_init();
+
+	if(format == TEXCOMPRESS_AUTO)
+	{
+		format = TEXCOMPRESS_BC1;
+		for(size_t i=0; i<(size_t)width*height; i++)
+			if(image[i*4+3] != 255)
+			{
+				format = TEXCOMPRESS_BC3;
+				break;
+			}
+	}
+
+	int numLevels = 1;
+	while(numLevels < TEXCOMPRESS_MAX_LEVELS && ((width>>numLevels) > 0 || (height>>numLevels) > 0))
+		numLevels++;
+
+	texcompress_dds_header header;
+	memset(&header, 0, sizeof(header));
+	header.size = sizeof(header);
+	header.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+	header.height = height;
+	header.width = width;
+	header.pitchOrLinearSize = (uint32_t) texcompress_level_bytes(format, width, height);
+	header.mipMapCount = numLevels;
+	header.reserved1[0] = TEXCOMPRESS_MARKER;
+	header.reserved1[1] = TEXCOMPRESS_VERSION;
+	header.pixelFormat.size = sizeof(header.pixelFormat);
+	header.pixelFormat.flags = DDPF_FOURCC;
+	header.caps = DDSCAPS_COMPLEX | DDSCAPS_TEXTURE | DDSCAPS_MIPMAP;
+	texcompress_dds_header_dx10 dx10;
+	memset(&dx10, 0, sizeof(dx10));
+	if(format == TEXCOMPRESS_BC1)
+		header.pixelFormat.fourCC = TEXCOMPRESS_FOURCC('D','X','T','1');
+	else if(format == TEXCOMPRESS_BC3)
+		header.pixelFormat.fourCC = TEXCOMPRESS_FOURCC('D','X','T','5');
+	else
+	{
+		header.pixelFormat.fourCC = TEXCOMPRESS_FOURCC('D','X','1','0');
+		dx10.dxgiFormat = DXGI_FORMAT_BC7_UNORM_SRGB;
+		dx10.resourceDimension = DDS_DIMENSION_TEXTURE2D;
+		dx10.arraySize = 1;
+	}
+
+	char tmpFilename[1100];
+	snprintf(tmpFilename, 1100, "%s.%d.tmp", ddsFilename, (int) getpid());
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to write compressed texture %s", tmpFilename);
+		free(image);
+		return 0;
+	}
+	int ok = fwrite("DDS ", 4, 1, f) == 1 &&
+	         fwrite(&header, sizeof(header), 1, f) == 1;
+	if(ok && format == TEXCOMPRESS_BC7)
+		ok = fwrite(&dx10, sizeof(dx10), 1, f) == 1;
+
+	unsigned char *compressed = kuhl_malloc(texcompress_level_bytes(format, width, height));
+	size_t totalBytes = 0, uncompressedBytes = 0;
+	int levelWidth = width, levelHeight = height;
+	for(int l=0; l<numLevels && ok; l++)
+	{
+		size_t bytes = texcompress_level_bytes(format, levelWidth, levelHeight);
+		texcompress_encode(compressed, image, levelWidth, levelHeight, format);
+		ok = fwrite(compressed, bytes, 1, f) == 1;
+		totalBytes += bytes;
+		uncompressedBytes += (size_t)levelWidth*levelHeight*4;
+
+		if(l+1 < numLevels)
+		{
+			int newWidth = levelWidth > 1 ? levelWidth/2 : 1;
+			int newHeight = levelHeight > 1 ? levelHeight/2 : 1;
+			unsigned char *smaller = texcompress_downsample(image, levelWidth, levelHeight, newWidth, newHeight);
+			free(image);
+			image = smaller;
+			levelWidth = newWidth;
+			levelHeight = newHeight;
+		}
+	}
+	free(compressed);
+	free(image);
+	if(fclose(f) != 0)
+		ok = 0;
+
+	if(ok == 0)
+	{
+		msg(MSG_ERROR, "Failed to write compressed texture %s", tmpFilename);
+		remove(tmpFilename);
+		return 0;
+	}
+#ifdef _WIN32
+	remove(ddsFilename); // rename() won't replace an existing file on Windows
+#endif
+	if(rename(tmpFilename, ddsFilename) != 0)
+	{
+		msg(MSG_ERROR, "Failed to rename %s to %s", tmpFilename, ddsFilename);
+		remove(tmpFilename);
+		return 0;
+	}
+	msg(MSG_INFO, "Compressed %s (%dx%d) into %s: %s, %d levels, %.1f MiB (%.1fx smaller than RGBA) in %.1f seconds",
+	    imageFilename, width, height, ddsFilename, texcompress_format_name(format), numLevels,
+	    totalBytes/(1024.0*1024.0), uncompressedBytes/(double)totalBytes,
+	    (kuhl_microseconds()-startTime)/1000000.0);
+	return 1;
+}
+
+
+/** Opens a DDS file created by texcompress_convert(). The file is
+ * memory mapped when possible.
+ *
+ * @param ddsFilename The file to open.
+ *
+ * @return The compressed texture or NULL if the file couldn't be
+ * read. Close with texcompress_close().
+ */
+texcompress_image* texcompress_open(const char *ddsFilename)
+{
+	size_t minSize = 4 + sizeof(texcompress_dds_header);
+	size_t size = 0;
+	unsigned char *data = NULL;
+#ifndef _WIN32
+	int fd = open(ddsFilename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > (off_t) minSize)
+	{
+		size = (size_t) st.st_size;
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED)
+			data = NULL;
+	}
+	close(fd);
+#else
+	FILE *f = fopen(ddsFilename, "rb");
+	if(f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long fileSize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(fileSize > (long) minSize)
+	{
+		size = (size_t) fileSize;
+		data = kuhl_malloc(size);
+		if(fread(data, 1, size, f) != size)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+#endif
+	if(data == NULL)
+		return NULL;
+
+	texcompress_dds_header header;
+	memcpy(&header, data+4, sizeof(header));
+	size_t offset = minSize;
+	int format = -1;
+	if(header.pixelFormat.fourCC == TEXCOMPRESS_FOURCC('D','X','T','1'))
+		format = TEXCOMPRESS_BC1;
+	else if(header.pixelFormat.fourCC == TEXCOMPRESS_FOURCC('D','X','T','5'))
+		format = TEXCOMPRESS_BC3;
+	else if(header.pixelFormat.fourCC == TEXCOMPRESS_FOURCC('D','X','1','0') &&
+	        size > offset + sizeof(texcompress_dds_header_dx10))
+	{
+		texcompress_dds_header_dx10 dx10;
+		memcpy(&dx10, data+offset, sizeof(dx10));
+		offset += sizeof(dx10);
+		if(dx10.dxgiFormat == DXGI_FORMAT_BC1_UNORM || dx10.dxgiFormat == DXGI_FORMAT_BC1_UNORM_SRGB)
+			format = TEXCOMPRESS_BC1;
+		else if(dx10.dxgiFormat == DXGI_FORMAT_BC3_UNORM || dx10.dxgiFormat == DXGI_FORMAT_BC3_UNORM_SRGB)
+			format = TEXCOMPRESS_BC3;
+		else if(dx10.dxgiFormat == DXGI_FORMAT_BC7_UNORM || dx10.dxgiFormat == DXGI_FORMAT_BC7_UNORM_SRGB)
+			format = TEXCOMPRESS_BC7;
+	}
+
+	int numLevels = header.mipMapCount > 0 ? (int) header.mipMapCount : 1;
+	int valid = memcmp(data, "DDS ", 4) == 0 && header.size == sizeof(header) &&
+		header.width > 0 && header.height > 0 && format > 0 && numLevels <= TEXCOMPRESS_MAX_LEVELS;
+	if(valid && (header.reserved1[0] != TEXCOMPRESS_MARKER || header.reserved1[1] != TEXCOMPRESS_VERSION))
+	{
+		msg(MSG_WARNING, "%s was not created by texture-compress (or it was made by a different version of libkuhl).", ddsFilename);
+		valid = 0;
+	}
+
+	texcompress_image *img = NULL;
+	if(valid)
+	{
+		img = kuhl_malloc(sizeof(texcompress_image));
+		memset(img, 0, sizeof(texcompress_image));
+		img->format = format;
+		img->width = header.width;
+		img->height = header.height;
+		img->numLevels = numLevels;
+		img->data = data;
+		img->length = size;
+		for(int l=0; l<numLevels && valid; l++)
+		{
+			int levelWidth = img->width >> l > 0 ? img->width >> l : 1;
+			int levelHeight = img->height >> l > 0 ? img->height >> l : 1;
+			img->level[l] = data + offset;
+			img->levelBytes[l] = texcompress_level_bytes(format, levelWidth, levelHeight);
+			offset += img->levelBytes[l];
+			valid = offset <= size; // make sure the file isn't truncated
+		}
+		if(!valid)
+			msg(MSG_WARNING, "%s is truncated.", ddsFilename);
+	}
+	if(!valid)
+	{
+		free(img);
+#ifndef _WIN32
+		munmap(data, size);
+#else
+		free(data);
+#endif
+		return NULL;
+	}
+	return img;
+}
+
+/** Closes a file opened with texcompress_open(). */
+void texcompress_close(texcompress_image *img)
+{
+	if(img == NULL)
+		return;
+#ifndef _WIN32
+	munmap((void*) img->data, img->length);
+#else
+	free((void*) img->data);
+#endif
+	free(img);
+}
+
+
+/** Returns the OpenGL internal format for a TEXCOMPRESS_* format. Like
+ * kuhl_read_texture_array(), we use the sRGB formats if color.linear
+ * is set. */
+GLenum texcompress_gl_format(int format)
+{
+	int linear = kuhl_config_int("color.linear", 1, 1);
+	switch(format)
+	{
+		case TEXCOMPRESS_BC1:
+			return linear ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case TEXCOMPRESS_BC3:
+			return linear ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case TEXCOMPRESS_BC7:
+			return linear ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM_ARB : GL_COMPRESSED_RGBA_BPTC_UNORM_ARB;
+		default:
+			return 0;
+	}
+}
+
+/** Returns 1 if the graphics card can use textures in a compressed
+ * format. Requires an OpenGL context. */
+int texcompress_supported(int format)
+{
+	if(format == TEXCOMPRESS_BC7)
+		return GLEW_VERSION_4_2 || glewIsSupported("GL_ARB_texture_compression_bptc");
+	if(format != TEXCOMPRESS_BC1 && format != TEXCOMPRESS_BC3)
+		return 0;
+	if(!glewIsSupported("GL_EXT_texture_compression_s3tc"))
+		return 0;
+	/* The sRGB versions of the S3TC formats come from a separate
+	 * extension. */
+	if(kuhl_config_int("color.linear", 1, 1))
+		return glewIsSupported("GL_EXT_texture_sRGB") || glewIsSupported("GL_EXT_texture_compression_s3tc_srgb");
+	return 1;
+}
+
+/** Creates an OpenGL texture from a compressed image. All of the
+ * mipmap levels in the file are uploaded (none are generated).
+ *
+ * @param img The compressed image.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The texture name or 0 if the card doesn't support the
+ * format or OpenGL rejected the texture.
+ */
+GLuint texcompress_upload(const texcompress_image *img, GLuint wrapS, GLuint wrapT)
+{
+	return texcompress_upload_levels(img, 0, wrapS, wrapT);
+}
+
+/** Like texcompress_upload() but only uploads the smaller mipmap
+ * levels starting at firstLevel. GL_TEXTURE_BASE_LEVEL is set to
+ * firstLevel so that the texture can be used right away; the larger
+ * levels can be added later (see texstream.h). */
+GLuint texcompress_upload_levels(const texcompress_image *img, int firstLevel, GLuint wrapS, GLuint wrapT)
+{
+	if(!texcompress_supported(img->format))
+		return 0;
+	GLenum internalformat = texcompress_gl_format(img->format);
+
+	kuhl_errorcheck();
+	GLuint texName = 0;
+	glGenTextures(1, &texName);
+	glBindTexture(GL_TEXTURE_2D, texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, firstLevel);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, img->numLevels-1);
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+	kuhl_errorcheck();
+
+	for(int l=firstLevel; l<img->numLevels; l++)
+	{
+		int levelWidth = img->width >> l > 0 ? img->width >> l : 1;
+		int levelHeight = img->height >> l > 0 ? img->height >> l : 1;
+		glCompressedTexImage2D(GL_TEXTURE_2D, l, internalformat, levelWidth, levelHeight, 0,
+		                       (GLsizei) img->levelBytes[l], img->level[l]);
+	}
+	GLenum err = glGetError();
+	glBindTexture(GL_TEXTURE_2D, 0);
+	if(err != GL_NO_ERROR)
+	{
+		msg(MSG_WARNING, "Unable to load %dx%d %s texture (OpenGL error 0x%x).",
+		    img->width, img->height, texcompress_format_name(img->format), err);
+		glDeleteTextures(1, &texName);
+		return 0;
+	}
+	return texName;
+}
+
+/** Loads the compressed version of an image (the image filename with
+ * ".dds" appended) if it exists, is not older than the image, and the
+ * graphics card supports its format. Set the texture.compressed
+ * config option to 0 to always use the original images.
+ *
+ * @param imageFilename The image that the caller wants to load.
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ * @param width Set to the width of the texture.
+ * @param height Set to the height of the texture.
+ *
+ * @return The texture name or 0 if the compressed version can't be
+ * used (the caller should load the original image instead).
+ */
+GLuint texcompress_load_cached(const char *imageFilename, GLuint wrapS, GLuint wrapT, int *width, int *height)
+{
+	if(!kuhl_config_boolean("texture.compressed", 1, 1))
+		return 0;
+
+	char ddsFilename[1024];
+	snprintf(ddsFilename, 1024, "%s.dds", imageFilename);
+	struct stat imageStat, ddsStat;
+	if(stat(ddsFilename, &ddsStat) != 0)
+		return 0;
+	if(stat(imageFilename, &imageStat) == 0 && imageStat.st_mtime > ddsStat.st_mtime)
+	{
+		msg(MSG_WARNING, "Ignoring %s because %s is newer. Run texture-compress again to update it.", ddsFilename, imageFilename);
+		return 0;
+	}
+
+	texcompress_image *img = texcompress_open(ddsFilename);
+	if(img == NULL)
+		return 0;
+	GLuint texName = 0;
+	if(!texcompress_supported(img->format))
+		msg(MSG_DEBUG, "Not using %s because your graphics card doesn't support %s textures.", ddsFilename, texcompress_format_name(img->format));
+	else
+		texName = texcompress_upload(img, wrapS, wrapT);
+	if(texName != 0)
+	{
+		*width = img->width;
+		*height = img->height;
+		msg(MSG_DEBUG, "Finished reading '%s' (%dx%d, %s, %d levels, texName=%d)\n",
+		    ddsFilename, img->width, img->height, texcompress_format_name(img->format), img->numLevels, texName);
+	}
+	texcompress_close(img);
+	return texName;
+}
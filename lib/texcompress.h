@@ -0,0 +1,79 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Block compressed textures. Images can be converted ahead of time
+    into BC1 (DXT1), BC3 (DXT5) or BC7 (BPTC) textures with all of
+    their mipmap levels already generated. Compressed textures use 4
+    to 8 times less video memory than uncompressed RGBA textures and
+    load faster because the mipmaps don't need to be generated.
+
+    The encoder runs entirely on the CPU (it doesn't need a graphics
+    card). The texture-compress program writes a file named after the
+    image with ".dds" appended (e.g., "brick.png.dds").
+    kuhl_read_texture_file() and the model loader use that file instead
+    of the image when it exists, is newer than the image, and the
+    graphics card supports the format.
+
+    The files use the DDS format. Unlike most DDS files, the rows are
+    stored with the bottom of the image first (the order OpenGL
+    expects) and the files are marked so that we don't accidentally
+    load DDS files from other programs upside down.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <stddef.h>
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEXCOMPRESS_MAX_LEVELS 16
+
+/** Pick BC1 for opaque images and BC3 for images with transparency. */
+#define TEXCOMPRESS_AUTO 0
+/** BC1/DXT1: 4 bits per pixel, no alpha. */
+#define TEXCOMPRESS_BC1 1
+/** BC3/DXT5: 8 bits per pixel, BC1 color plus a separate alpha block. */
+#define TEXCOMPRESS_BC3 2
+/** BC7/BPTC: 8 bits per pixel, higher quality color and alpha. Requires OpenGL 4.2 or ARB_texture_compression_bptc. */
+#define TEXCOMPRESS_BC7 3
+
+/** A compressed texture read from a file with texcompress_open(). */
+typedef struct
+{
+	int format;    /**< TEXCOMPRESS_BC1, TEXCOMPRESS_BC3 or TEXCOMPRESS_BC7 */
+	int width;     /**< Width of level 0 in pixels */
+	int height;    /**< Height of level 0 in pixels */
+	int numLevels; /**< Number of mipmap levels in the file */
+	const unsigned char *level[TEXCOMPRESS_MAX_LEVELS]; /**< Compressed blocks for each level */
+	size_t levelBytes[TEXCOMPRESS_MAX_LEVELS];          /**< Size of each level in bytes */
+
+	const unsigned char *data; /**< The contents of the file */
+	size_t length;             /**< Size of the file in bytes */
+} texcompress_image;
+
+int texcompress_format_parse(const char *name);
+const char* texcompress_format_name(int format);
+size_t texcompress_level_bytes(int format, int width, int height);
+void texcompress_encode(unsigned char *out, const unsigned char *rgba, int width, int height, int format);
+int texcompress_convert(const char *imageFilename, const char *ddsFilename, int format);
+
+texcompress_image* texcompress_open(const char *ddsFilename);
+void texcompress_close(texcompress_image *img);
+
+int texcompress_supported(int format);
+GLenum texcompress_gl_format(int format);
+GLuint texcompress_upload(const texcompress_image *img, GLuint wrapS, GLuint wrapT);
+GLuint texcompress_upload_levels(const texcompress_image *img, int firstLevel, GLuint wrapS, GLuint wrapT);
+GLuint texcompress_load_cached(const char *imageFilename, GLuint wrapS, GLuint wrapT, int *width, int *height);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
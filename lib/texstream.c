@@ -0,0 +1,467 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <sys/stat.h>
+
+#include <GL/glew.h>
+
+#include "texstream.h"
+#include "texcompress.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "vecmat.h"
+#include "msg.h"
+
+/* A streamed texture. Levels residentBase through numLevels-1 are in
+ * the OpenGL texture (and GL_TEXTURE_BASE_LEVEL is residentBase). */
+typedef struct
+{
+	GLuint texName;
+	texcompress_image *img; /**< Memory mapped compressed file that the levels are uploaded from */
+	int residentBase;       /**< Largest level in video memory */
+	int desiredBase;        /**< Largest level needed the last time the texture was drawn */
+	int minBase;            /**< Levels from here down are always resident */
+	float frameSize;        /**< Largest screen size reported this frame, 0 if none (full resolution) */
+	unsigned long lastUsed; /**< Frame that the texture was last drawn in, 0 if never */
+} texstream_texture;
+
+static texstream_texture *textures = NULL;
+static int numTextures = 0;
+static int texturesCapacity = 0;
+
+/* Hash table (open addressing) from OpenGL texture name to an index
+ * in textures, -1 for an empty slot. kuhl_geometry_draw() looks up
+ * every texture it binds, so this needs to be fast. */
+static int *lookup = NULL;
+static unsigned int lookupCapacity = 0;
+
+static unsigned long frame = 1;   /**< Current frame number, incremented by texstream_update() */
+static size_t residentBytes = 0;  /**< Bytes of all resident levels */
+
+static struct
+{
+	size_t maxResidentBytes;
+	unsigned long levelsUploaded;
+	double mibUploaded;
+	unsigned long levelsEvicted;
+	unsigned long blocked; /**< Number of times that the budget prevented adding detail */
+} stats;
+
+
+/* Video memory that the streamed textures may use in bytes (the
+ * texture.stream.budget config option, in MiB). Read through a handle
+ * because texstream_update() needs it every frame. */
+static size_t texstream_budget(void)
+{
+	static kuhl_config_handle budget = NULL;
+	if(budget == NULL)
+		budget = kuhl_config_handle_get("texture.stream.budget");
+	return (size_t) kuhl_config_handle_int(budget, 512, 512) * 1024*1024;
+}
+
+/* Bytes that may be uploaded per frame (the texture.stream.upload
+ * config option, in MiB). */
+static size_t texstream_upload_limit(void)
+{
+	static kuhl_config_handle upload = NULL;
+	if(upload == NULL)
+		upload = kuhl_config_handle_get("texture.stream.upload");
+	return (size_t) kuhl_config_handle_int(upload, 16, 16) * 1024*1024;
+}
+
+/** Returns 1 if textures for models should be streamed (the
+ * texture.stream config option). */
+int texstream_enabled(void)
+{
+	return kuhl_config_boolean("texture.stream", 0, 0);
+}
+
+static unsigned int texstream_hash(GLuint texName)
+{
+	return (texName * 2654435761u) & (lookupCapacity-1);
+}
+
+static texstream_texture* texstream_find(GLuint texName)
+{
+	if(lookupCapacity == 0)
+		return NULL;
+	unsigned int i = texstream_hash(texName);
+	while(lookup[i] >= 0)
+	{
+		if(textures[lookup[i]].texName == texName)
+			return &(textures[lookup[i]]);
+		i = (i+1) & (lookupCapacity-1);
+	}
+	return NULL;
+}
+
+static void texstream_lookup_insert(int index)
+{
+	unsigned int i = texstream_hash(textures[index].texName);
+	while(lookup[i] >= 0)
+		i = (i+1) & (lookupCapacity-1);
+	lookup[i] = index;
+}
+
+static size_t texstream_bytes(const texstream_texture *t, int firstLevel)
+{
+	size_t bytes = 0;
+	for(int l=firstLevel; l<t->img->numLevels; l++)
+		bytes += t->img->levelBytes[l];
+	return bytes;
+}
+
+static void texstream_exit(void)
+{
+	if(numTextures > 0)
+		texstream_print_stats();
+}
+
+/** Loads a texture that will be streamed. Only the levels which are
+ * texture.stream.minsize or smaller are uploaded right away.
+ *
+ * @param imageFilename The image to load. It is compressed into a
+ * ".dds" file first if necessary (see texcompress_convert()).
+ *
+ * @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+ * @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+ *
+ * @return The OpenGL texture name (which doesn't change as levels are
+ * streamed in and out) or 0 if the texture can't be streamed.
+ */
+GLuint texstream_load(const char *imageFilename, GLuint wrapS, GLuint wrapT)
+{
+	char ddsFilename[1024];
+	snprintf(ddsFilename, 1024, "%s.dds", imageFilename);
+	struct stat imageStat, ddsStat;
+	int needsConvert = stat(ddsFilename, &ddsStat) != 0;
+	if(!needsConvert && stat(imageFilename, &imageStat) == 0 &&
+	   imageStat.st_mtime > ddsStat.st_mtime)
+		needsConvert = 1;
+	if(needsConvert)
+	{
+		msg(MSG_INFO, "Compressing %s for texture streaming. This only happens once but may take a while.", imageFilename);
+		if(texcompress_convert(imageFilename, ddsFilename, TEXCOMPRESS_AUTO) == 0)
+			return 0;
+	}
+
+	texcompress_image *img = texcompress_open(ddsFilename);
+	if(img == NULL)
+		return 0;
+	if(!texcompress_supported(img->format))
+	{
+		msg(MSG_WARNING, "Can't stream %s because your graphics card doesn't support %s textures.",
+		    imageFilename, texcompress_format_name(img->format));
+		texcompress_close(img);
+		return 0;
+	}
+
+	int minSize = kuhl_config_int("texture.stream.minsize", 64, 64);
+	int minBase = 0;
+	while(minBase < img->numLevels-1 &&
+	      ((img->width >> minBase) > minSize || (img->height >> minBase) > minSize))
+		minBase++;
+
+	GLuint texName = texcompress_upload_levels(img, minBase, wrapS, wrapT);
+	if(texName == 0)
+	{
+		texcompress_close(img);
+		return 0;
+	}
+
+	if(numTextures == texturesCapacity)
+	{
+		texturesCapacity = texturesCapacity ? texturesCapacity*2 : 64;
+		textures = realloc(textures, sizeof(texstream_texture)*texturesCapacity);
+		if(textures == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate memory for %d streamed textures.", texturesCapacity);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if((unsigned int)(numTextures+1)*2 > lookupCapacity)
+	{
+		free(lookup);
+		lookupCapacity = lookupCapacity ? lookupCapacity*2 : 128;
+		lookup = kuhl_malloc(sizeof(int)*lookupCapacity);
+		memset(lookup, -1, sizeof(int)*lookupCapacity);
+		for(int i=0; i<numTextures; i++)
+			texstream_lookup_insert(i);
+	}
+	if(numTextures == 0)
+		atexit(texstream_exit);
+
+	texstream_texture *t = &(textures[numTextures]);
+	t->texName = texName;
+	t->img = img;
+	t->residentBase = minBase;
+	t->desiredBase = minBase;
+	t->minBase = minBase;
+	t->frameSize = 0;
+	t->lastUsed = 0;
+	texstream_lookup_insert(numTextures);
+	numTextures++;
+
+	residentBytes += texstream_bytes(t, minBase);
+	if(residentBytes > stats.maxResidentBytes)
+		stats.maxResidentBytes = residentBytes;
+	size_t budget = texstream_budget();
+	if(residentBytes > budget && residentBytes - texstream_bytes(t, minBase) <= budget)
+		msg(MSG_WARNING, "The smallest levels of the streamed textures don't fit in texture.stream.budget (%lu MiB).",
+		    (unsigned long) (budget/(1024*1024)));
+	return texName;
+}
+
+/** Tells the texture streaming code that a texture is being drawn
+ * this frame. kuhl_geometry_draw() calls this for every texture it
+ * binds; it does nothing for textures that aren't streamed.
+ *
+ * @param texName The OpenGL texture.
+ *
+ * @param screenSize The approximate number of pixels that the
+ * texture covers on the screen (across its largest dimension). The
+ * texture will be streamed until its resolution matches this
+ * size. Use 0 if the size is unknown; if no size is reported for a
+ * texture during a frame, it is streamed up to full resolution.
+ */
+void texstream_use(GLuint texName, float screenSize)
+{
+	texstream_texture *t = texstream_find(texName);
+	if(t == NULL)
+		return;
+	t->lastUsed = frame;
+	if(screenSize > t->frameSize)
+		t->frameSize = screenSize;
+}
+
+/* Changes which levels of a texture are resident. */
+static void texstream_set_base(texstream_texture *t, int newBase)
+{
+	const texcompress_image *img = t->img;
+	GLenum format = texcompress_gl_format(img->format);
+	glBindTexture(GL_TEXTURE_2D, t->texName);
+	if(newBase < t->residentBase)
+	{
+		for(int l=newBase; l<t->residentBase; l++)
+		{
+			int levelWidth = img->width >> l > 0 ? img->width >> l : 1;
+			int levelHeight = img->height >> l > 0 ? img->height >> l : 1;
+			glCompressedTexImage2D(GL_TEXTURE_2D, l, format, levelWidth, levelHeight, 0,
+			                       (GLsizei) img->levelBytes[l], img->level[l]);
+			stats.levelsUploaded++;
+			stats.mibUploaded += img->levelBytes[l]/(1024.0*1024.0);
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, newBase);
+		residentBytes += texstream_bytes(t, newBase) - texstream_bytes(t, t->residentBase);
+	}
+	else
+	{
+		/* Stop using the levels and then replace them with empty
+		 * images so OpenGL can free the memory. */
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, newBase);
+		for(int l=t->residentBase; l<newBase; l++)
+		{
+			glCompressedTexImage2D(GL_TEXTURE_2D, l, format, 0, 0, 0, 0, NULL);
+			stats.levelsEvicted++;
+		}
+		residentBytes -= texstream_bytes(t, t->residentBase) - texstream_bytes(t, newBase);
+	}
+	t->residentBase = newBase;
+	if(residentBytes > stats.maxResidentBytes)
+		stats.maxResidentBytes = residentBytes;
+}
+
+/* Sorts textures so the most recently used textures are first. Ties
+ * are broken by how many levels the texture is missing. */
+static int texstream_compare_recent(const void *a, const void *b)
+{
+	const texstream_texture *ta = &(textures[*(const int*)a]);
+	const texstream_texture *tb = &(textures[*(const int*)b]);
+	if(ta->lastUsed != tb->lastUsed)
+		return ta->lastUsed > tb->lastUsed ? -1 : 1;
+	int missingA = ta->residentBase - ta->desiredBase;
+	int missingB = tb->residentBase - tb->desiredBase;
+	return missingB - missingA;
+}
+
+/* Sorts textures so the least recently used textures are first. */
+static int texstream_compare_lru(const void *a, const void *b)
+{
+	const texstream_texture *ta = &(textures[*(const int*)a]);
+	const texstream_texture *tb = &(textures[*(const int*)b]);
+	if(ta->lastUsed != tb->lastUsed)
+		return ta->lastUsed < tb->lastUsed ? -1 : 1;
+	return 0;
+}
+
+/* Removes the largest level from the least recently used texture
+ * which can give up a level. Textures that were drawn this frame only
+ * give up levels that are larger than they need.
+ *
+ * @param lru Indices of textures sorted by texstream_compare_lru().
+ * @param keep Don't take levels from this texture or any texture used more recently.
+ *
+ * @return 1 if a level was evicted, 0 if there was nothing to evict.
+ */
+static int texstream_evict_one(const int *lru, const texstream_texture *keep)
+{
+	for(int i=0; i<numTextures; i++)
+	{
+		texstream_texture *t = &(textures[lru[i]]);
+		if(t == keep || (t->lastUsed >= keep->lastUsed && t->residentBase >= t->desiredBase))
+			continue;
+		if(t->residentBase >= t->minBase)
+			continue;
+		if(t->lastUsed == frame && t->residentBase >= t->desiredBase)
+			continue;
+		texstream_set_base(t, t->residentBase+1);
+		return 1;
+	}
+	return 0;
+}
+
+/** Uploads and evicts levels of streamed textures based on which
+ * textures were drawn during the frame. Called once per frame by
+ * bufferswap(). */
+void texstream_update(void)
+{
+	if(numTextures == 0)
+		return;
+
+	/* Figure out which level each texture drawn this frame needs. */
+	for(int i=0; i<numTextures; i++)
+	{
+		texstream_texture *t = &(textures[i]);
+		if(t->lastUsed != frame)
+			continue;
+		int desired = 0;
+		if(t->frameSize > 0)
+		{
+			int size = t->img->width > t->img->height ? t->img->width : t->img->height;
+			while(desired < t->minBase && (size >> (desired+1)) >= t->frameSize)
+				desired++;
+		}
+		t->desiredBase = desired;
+		t->frameSize = 0;
+	}
+
+	int *recent = kuhl_malloc(sizeof(int)*numTextures);
+	int *lru = kuhl_malloc(sizeof(int)*numTextures);
+	for(int i=0; i<numTextures; i++)
+		recent[i] = lru[i] = i;
+	qsort(recent, numTextures, sizeof(int), texstream_compare_recent);
+	qsort(lru, numTextures, sizeof(int), texstream_compare_lru);
+
+	size_t budget = texstream_budget();
+	size_t uploadLimit = texstream_upload_limit();
+	size_t uploaded = 0;
+
+	/* Add one level at a time to the textures drawn this frame that
+	 * need more detail. Always allow at least one level per
+	 * frame even if it is larger than the upload limit. */
+	int progress = 1;
+	while(progress && uploaded < uploadLimit)
+	{
+		progress = 0;
+		for(int i=0; i<numTextures && uploaded < uploadLimit; i++)
+		{
+			texstream_texture *t = &(textures[recent[i]]);
+			if(t->lastUsed != frame || t->desiredBase >= t->residentBase)
+				continue;
+			size_t bytes = t->img->levelBytes[t->residentBase-1];
+			if(uploaded > 0 && uploaded + bytes > uploadLimit)
+				continue;
+			int fits = 1;
+			while(residentBytes + bytes > budget && fits)
+				fits = texstream_evict_one(lru, t);
+			if(!fits)
+			{
+				stats.blocked++;
+				continue;
+			}
+			texstream_set_base(t, t->residentBase-1);
+			uploaded += bytes;
+			progress = 1;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_errorcheck();
+
+	free(recent);
+	free(lru);
+	frame++;
+}
+
+/** Estimates how large an object appears on the screen. The result
+ * can be passed to texstream_use() or kuhl_geometry_texture_usage().
+ *
+ * @param bbox The bounding box of the object (xmin, xmax, ymin, ymax,
+ * zmin, zmax) such as the one from kuhl_load_model().
+ *
+ * @param modelview The modelview matrix used to draw the object.
+ *
+ * @param projection The projection matrix used to draw the object.
+ *
+ * @param viewport The viewport (x, y, width, height) from viewmat_get_viewport().
+ *
+ * @return The width or height (whichever is larger) of the bounding
+ * box on the screen in pixels. Returns FLT_MAX if part of the
+ * bounding box is behind the camera.
+ */
+float texstream_screen_size(const float bbox[6], const float modelview[16], const float projection[16], const int viewport[4])
+{
+	float mvp[16];
+	mat4f_mult_mat4f_new(mvp, projection, modelview);
+	float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+	for(int i=0; i<8; i++)
+	{
+		float corner[4] = { bbox[i&1], bbox[2+((i>>1)&1)], bbox[4+((i>>2)&1)], 1 };
+		float clip[4];
+		mat4f_mult_vec4f_new(clip, mvp, corner);
+		if(clip[3] <= 0)
+			return FLT_MAX;
+		float x = clip[0]/clip[3];
+		float y = clip[1]/clip[3];
+		if(x < minX) minX = x;
+		if(x > maxX) maxX = x;
+		if(y < minY) minY = y;
+		if(y > maxY) maxY = y;
+	}
+	/* Normalized device coordinates range from -1 to 1. */
+	float width = (maxX-minX)/2 * viewport[2];
+	float height = (maxY-minY)/2 * viewport[3];
+	return width > height ? width : height;
+}
+
+/** Prints information about the streamed textures: how much video
+ * memory they use, how many are at full resolution, how many that were
+ * drawn in the last frame still need more detail, and how much data
+ * has been uploaded and evicted. */
+void texstream_print_stats(void)
+{
+	int full = 0, waiting = 0;
+	for(int i=0; i<numTextures; i++)
+	{
+		if(textures[i].residentBase == 0)
+			full++;
+		if(textures[i].lastUsed+1 == frame && textures[i].residentBase > textures[i].desiredBase)
+			waiting++;
+	}
+	size_t budget = texstream_budget();
+	msg(MSG_INFO, "Texture streaming: %d textures, %.1f of %.1f MiB resident (max %.1f MiB), %d at full resolution, %d waiting for detail",
+	    numTextures, residentBytes/(1024.0*1024.0), budget/(1024.0*1024.0),
+	    stats.maxResidentBytes/(1024.0*1024.0), full, waiting);
+	msg(MSG_INFO, "Texture streaming: %lu levels uploaded (%.1f MiB), %lu levels evicted, %lu uploads blocked by the budget",
+	    stats.levelsUploaded, stats.mibUploaded, stats.levelsEvicted, stats.blocked);
+}
@@ -0,0 +1,56 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Texture streaming for models which have more textures than fit in
+    video memory.
+
+    When the texture.stream config option is set, the model loader
+    creates streamed textures with texstream_load(). Only the small
+    mipmap levels of a streamed texture are uploaded when the model is
+    loaded. After each frame, texstream_update() uploads larger levels
+    for the textures that were drawn, up to the size that they appear
+    on the screen. If the textures don't fit within the budget
+    (texture.stream.budget, in MiB), detail is removed from the
+    textures which were used least recently.
+
+    kuhl_geometry_draw() tells the streaming code which textures are
+    being used. Programs can also report how large a texture appears
+    on the screen with texstream_use() or
+    kuhl_geometry_texture_usage(); textures without a report are
+    streamed up to full resolution.
+
+    Streamed textures are read from the compressed files made by
+    texture-compress (see texcompress.h). If an image hasn't been
+    compressed yet, texstream_load() compresses it the first time it
+    is loaded.
+
+    Config options:
+    - texture.stream - Set to 1 to stream model textures (default 0).
+    - texture.stream.budget - Video memory for streamed textures in MiB (default 512).
+    - texture.stream.upload - Maximum MiB to upload per frame (default 16).
+    - texture.stream.minsize - Mipmap levels this size and smaller are always loaded (default 64).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int texstream_enabled(void);
+GLuint texstream_load(const char *imageFilename, GLuint wrapS, GLuint wrapT);
+void texstream_use(GLuint texName, float screenSize);
+void texstream_update(void);
+float texstream_screen_size(const float bbox[6], const float modelview[16], const float projection[16], const int viewport[4]);
+void texstream_print_stats(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
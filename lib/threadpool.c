@@ -0,0 +1,255 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h> // sysconf()
+#endif
+
+#include "threadpool.h"
+#include "kuhl-config.h"
+#include "msg.h"
+
+struct threadpool
+{
+	int numThreads;      /**< Number of worker threads (not including the thread calling threadpool_for()) */
+#ifdef HAVE_PTHREADS
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t workReady; /**< Signaled when a new job is available or when the workers should quit */
+	pthread_cond_t workDone;  /**< Signaled when the last worker finishes the current job */
+	unsigned long job;   /**< Incremented every time a new job is started */
+	int working;         /**< Number of workers that haven't finished the current job */
+	int running;         /**< Set while threadpool_for() is running */
+	int quit;            /**< Set when the workers should exit */
+#endif
+
+	/* The current job */
+	threadpool_func func;
+	void *data;
+	int count;           /**< Number of items in the job */
+	int chunk;           /**< Number of items a thread claims at a time */
+	int next;            /**< Next item that hasn't been claimed (updated atomically) */
+};
+
+/** Returns the number of processors that are online. Returns 1 if
+ * the number is unknown. */
+int threadpool_num_cpus(void)
+{
+#if defined(HAVE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0)
+		return (int) n;
+#endif
+	return 1;
+}
+
+/* Claims chunks of items from the current job and processes them
+ * until there are none left. Called by the workers and by the thread
+ * that called threadpool_for(). */
+static void threadpool_private_work(threadpool *pool)
+{
+	while(1)
+	{
+#ifdef HAVE_PTHREADS
+		int start = __sync_fetch_and_add(&(pool->next), pool->chunk);
+#else
+		int start = pool->next;
+		pool->next += pool->chunk;
+#endif
+		if(start >= pool->count)
+			return;
+		int end = start + pool->chunk;
+		if(end > pool->count)
+			end = pool->count;
+		for(int i=start; i<end; i++)
+			pool->func(pool->data, i);
+	}
+}
+
+#ifdef HAVE_PTHREADS
+static void* threadpool_private_worker(void *arg)
+{
+	threadpool *pool = (threadpool*) arg;
+	unsigned long lastJob = 0;
+
+	pthread_mutex_lock(&(pool->mutex));
+	while(1)
+	{
+		while(pool->quit == 0 && pool->job == lastJob)
+			pthread_cond_wait(&(pool->workReady), &(pool->mutex));
+		if(pool->quit)
+			break;
+		lastJob = pool->job;
+		pthread_mutex_unlock(&(pool->mutex));
+
+		threadpool_private_work(pool);
+
+		pthread_mutex_lock(&(pool->mutex));
+		pool->working--;
+		if(pool->working == 0)
+			pthread_cond_signal(&(pool->workDone));
+	}
+	pthread_mutex_unlock(&(pool->mutex));
+	return NULL;
+}
+#endif
+
+/** Creates a new pool of threads.
+
+    @param numThreads The total number of threads which should work on
+    each job (including the thread which calls threadpool_for()). If
+    less than 1, one thread per processor is used.
+
+    @return A new thread pool. Free with threadpool_free().
+*/
+threadpool* threadpool_new(int numThreads)
+{
+	if(numThreads < 1)
+		numThreads = threadpool_num_cpus();
+
+	threadpool *pool = calloc(1, sizeof(threadpool));
+	if(pool == NULL)
+	{
+		msg(MSG_FATAL, "Failed to allocate thread pool.");
+		exit(EXIT_FAILURE);
+	}
+	pool->numThreads = 0;
+
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&(pool->mutex), NULL);
+	pthread_cond_init(&(pool->workReady), NULL);
+	pthread_cond_init(&(pool->workDone), NULL);
+	pool->threads = malloc(sizeof(pthread_t)*numThreads);
+	for(int i=0; i<numThreads-1; i++)
+	{
+		if(pthread_create(&(pool->threads[i]), NULL, threadpool_private_worker, pool) != 0)
+		{
+			msg(MSG_WARNING, "Failed to create thread %d, using %d threads instead of %d.",
+			    i+1, i+1, numThreads);
+			break;
+		}
+		pool->numThreads++;
+	}
+#endif
+
+	msg(MSG_DEBUG, "Created thread pool with %d thread(s).", pool->numThreads+1);
+	return pool;
+}
+
+/** Stops the threads in a thread pool and frees it.
+
+    @param pool The pool to free. Must not be the pool returned by
+    threadpool_default().
+*/
+void threadpool_free(threadpool *pool)
+{
+	if(pool == NULL)
+		return;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&(pool->mutex));
+	pool->quit = 1;
+	pthread_cond_broadcast(&(pool->workReady));
+	pthread_mutex_unlock(&(pool->mutex));
+	for(int i=0; i<pool->numThreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_cond_destroy(&(pool->workDone));
+	pthread_cond_destroy(&(pool->workReady));
+	pthread_mutex_destroy(&(pool->mutex));
+#endif
+	free(pool);
+}
+
+/** Returns a thread pool that is shared by the whole library. The
+ * pool is created the first time this function is called and is never
+ * freed. The number of threads is set by the "threads" config file
+ * option (0 or missing means one thread per processor).
+ *
+ * This function should only be called from the main thread.
+ */
+threadpool* threadpool_default(void)
+{
+	static threadpool *pool = NULL;
+	if(pool == NULL)
+		pool = threadpool_new(kuhl_config_int("threads", 0, 0));
+	return pool;
+}
+
+/** Returns the number of threads which work on each job, including
+ * the thread which calls threadpool_for(). */
+int threadpool_size(const threadpool *pool)
+{
+	if(pool == NULL)
+		return 1;
+	return pool->numThreads + 1;
+}
+
+/** Calls func(data, i) for every i from 0 to count-1 using all of the
+ * threads in the pool and waits for all of the calls to finish. The
+ * order that the items are processed in is undefined.
+
+    @param pool The pool of threads to use. If NULL, the items are
+    processed on the calling thread.
+
+    @param count The number of items to process.
+
+    @param func The function to call for each item. It must be safe to
+    call this function from several threads at the same time and it
+    must not call threadpool_for() with the same pool.
+
+    @param data A pointer which is passed to every call of func.
+*/
+void threadpool_for(threadpool *pool, int count, threadpool_func func, void *data)
+{
+	if(count <= 0)
+		return;
+	if(pool == NULL || pool->numThreads == 0 || count == 1)
+	{
+		for(int i=0; i<count; i++)
+			func(data, i);
+		return;
+	}
+
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&(pool->mutex));
+	if(pool->running)
+	{
+		pthread_mutex_unlock(&(pool->mutex));
+		msg(MSG_FATAL, "threadpool_for() was called while the pool was already running a job.");
+		exit(EXIT_FAILURE);
+	}
+	pool->running = 1;
+	pool->func = func;
+	pool->data = data;
+	pool->count = count;
+	pool->next = 0;
+	/* Claim several items at a time so that the threads don't
+	 * compete for the counter when each item is quick to process,
+	 * but keep the chunks small enough to balance the load. */
+	pool->chunk = count / ((pool->numThreads+1)*8);
+	if(pool->chunk < 1)
+		pool->chunk = 1;
+	pool->working = pool->numThreads;
+	pool->job++;
+	pthread_cond_broadcast(&(pool->workReady));
+	pthread_mutex_unlock(&(pool->mutex));
+
+	threadpool_private_work(pool);
+
+	pthread_mutex_lock(&(pool->mutex));
+	while(pool->working > 0)
+		pthread_cond_wait(&(pool->workDone), &(pool->mutex));
+	pool->running = 0;
+	pthread_mutex_unlock(&(pool->mutex));
+#endif
+}
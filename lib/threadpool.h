@@ -0,0 +1,46 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Provides a small pool of worker threads which can run a function
+    on many items in parallel (a "parallel for" loop). The thread
+    calling threadpool_for() also works on the items and the call
+    returns once every item has been processed.
+
+    The functions passed to threadpool_for() must not call OpenGL
+    since the OpenGL context is only current on the main thread.
+
+    If the library was compiled without pthreads (for example, on
+    Windows), the items are processed one at a time on the calling
+    thread.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A function which processes item number 'index' of a job. 'data' is
+ * the pointer that was passed to threadpool_for(). */
+typedef void (*threadpool_func)(void *data, int index);
+
+/** A pool of worker threads. Create with threadpool_new(). */
+typedef struct threadpool threadpool;
+
+threadpool* threadpool_new(int numThreads);
+void threadpool_free(threadpool *pool);
+threadpool* threadpool_default(void);
+
+int threadpool_size(const threadpool *pool);
+void threadpool_for(threadpool *pool, int count, threadpool_func func, void *data);
+
+int threadpool_num_cpus(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,661 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#else
+#include "windows-compat.h"
+#include <process.h> // getpid()
+#endif
+
+#include <GL/glew.h>
+
+#include "tiledimage.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "msg.h"
+
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#endif
+#include "stb_image.h"
+
+#define TILEDIMAGE_MAGIC "KUHLTIL"
+#define TILEDIMAGE_ALIGN 4096 /**< Levels start on a page boundary */
+
+/* Reads an image into RGBA pixels with the bottom row first. */
+static unsigned char* tiledimage_read_rgba(const char *filename, int *width, int *height)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename = (char*) filename;
+	iioinfo.type = CharPixel;
+	iioinfo.map = "RGBA";
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	*width  = (int)iioinfo.width;
+	*height = (int)iioinfo.height;
+	return image;
+#else
+	/* Put the first pixel at the bottom left. */
+	int comp = -1;
+	unsigned char *image = stbi_load(filename, width, height, &comp, STBI_rgb_alpha);
+	if(image)
+		kuhl_flip_texture_array(image, *width, *height, 4);
+	return image;
+#endif
+}
+
+/* Copies one tile out of an image, repeating the last column and row
+ * if the tile extends past the edge of the image. */
+static void tiledimage_copy_tile(unsigned char *tile, int tileSize, const unsigned char *image,
+                                 int width, int height, int tx, int ty)
+{
+	int x0 = tx*tileSize;
+	int y0 = ty*tileSize;
+	for(int y=0; y<tileSize; y++)
+	{
+		int sy = y0+y < height ? y0+y : height-1;
+		const unsigned char *srcRow = image + (size_t)sy*width*4;
+		unsigned char *dstRow = tile + (size_t)y*tileSize*4;
+		int copyWidth = width - x0 < tileSize ? width - x0 : tileSize;
+		memcpy(dstRow, srcRow + (size_t)x0*4, (size_t)copyWidth*4);
+		for(int x=copyWidth; x<tileSize; x++)
+			memcpy(dstRow + x*4, srcRow + (size_t)(width-1)*4, 4);
+	}
+}
+
+/* Creates the next smaller mipmap level by averaging 2x2 blocks of
+ * pixels. */
+static unsigned char* tiledimage_downsample(const unsigned char *image, int width, int height,
+                                            int newWidth, int newHeight)
+{
+	unsigned char *result = kuhl_malloc((size_t)newWidth*newHeight*4);
+	for(int y=0; y<newHeight; y++)
+	{
+		int y1 = 2*y;
+		int y2 = 2*y+1 < height ? 2*y+1 : height-1;
+		for(int x=0; x<newWidth; x++)
+		{
+			int x1 = 2*x;
+			int x2 = 2*x+1 < width ? 2*x+1 : width-1;
+			const unsigned char *a = image + ((size_t)y1*width+x1)*4;
+			const unsigned char *b = image + ((size_t)y1*width+x2)*4;
+			const unsigned char *c = image + ((size_t)y2*width+x1)*4;
+			const unsigned char *d = image + ((size_t)y2*width+x2)*4;
+			unsigned char *out = result + ((size_t)y*newWidth+x)*4;
+			for(int i=0; i<4; i++)
+				out[i] = (unsigned char) ((a[i]+b[i]+c[i]+d[i]+2)/4);
+		}
+	}
+	return result;
+}
+
+/* Calculates the size and location of each level. Returns the number
+ * of levels. */
+static int tiledimage_layout(tiledimage_level *levels, int width, int height, int tileSize)
+{
+	uint64_t offset = sizeof(tiledimage_file_header) + sizeof(tiledimage_level)*TILEDIMAGE_MAX_LEVELS;
+	int numLevels = 0;
+	while(numLevels < TILEDIMAGE_MAX_LEVELS)
+	{
+		offset = (offset + TILEDIMAGE_ALIGN-1) / TILEDIMAGE_ALIGN * TILEDIMAGE_ALIGN;
+		tiledimage_level *l = &levels[numLevels];
+		l->width = width;
+		l->height = height;
+		l->tilesX = (width + tileSize-1) / tileSize;
+		l->tilesY = (height + tileSize-1) / tileSize;
+		l->offset = offset;
+		offset += (uint64_t)l->tilesX*l->tilesY*tileSize*tileSize*4;
+		numLevels++;
+
+		if(width <= tileSize && height <= tileSize)
+			break;
+		width = (width+1)/2;
+		height = (height+1)/2;
+	}
+	return numLevels;
+}
+
+/* Checks that the header of a tile file is from this version of the
+ * code and that every level's tiles are inside the file (size bytes
+ * long), after the header and in order. */
+static int tiledimage_header_valid(const tiledimage_file_header *header, const tiledimage_level *levels, size_t size)
+{
+	if(memcmp(header->magic, TILEDIMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != TILEDIMAGE_VERSION ||
+	   header->numLevels == 0 || header->numLevels > TILEDIMAGE_MAX_LEVELS ||
+	   header->tileSize == 0 || header->tileSize > 65536)
+		return 0;
+
+	uint64_t tileBytes = (uint64_t)header->tileSize*header->tileSize*4;
+	uint64_t end = sizeof(tiledimage_file_header) + sizeof(tiledimage_level)*TILEDIMAGE_MAX_LEVELS;
+	for(unsigned int i=0; i<header->numLevels; i++)
+	{
+		const tiledimage_level *l = &levels[i];
+		if(l->width == 0 || l->height == 0 ||
+		   l->tilesX != (l->width + (uint64_t)header->tileSize-1) / header->tileSize ||
+		   l->tilesY != (l->height + (uint64_t)header->tileSize-1) / header->tileSize ||
+		   l->offset < end || l->offset > size)
+			return 0;
+		/* Compare the number of tiles first so that the size of the
+		 * level can't overflow. */
+		uint64_t tiles = (uint64_t)l->tilesX*l->tilesY;
+		if(tiles > (size - l->offset) / tileBytes)
+			return 0;
+		end = l->offset + tiles*tileBytes;
+	}
+	return 1;
+}
+
+/** Converts an image file into a tile file containing every mipmap
+ * level of the image. This is slow for large images and needs enough
+ * memory to hold the whole image; it is intended to be run once (see
+ * samples/tiledimage-convert.c) or the first time an image is
+ * displayed.
+ *
+ * @param imageFilename The image to convert.
+ *
+ * @param tileFilename The tile file to create. It is written under a
+ * temporary name and renamed when it is complete.
+ *
+ * @param tileSize The width and height of each tile. 256 or 512 is
+ * recommended.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int tiledimage_convert(const char *imageFilename, const char *tileFilename, int tileSize)
+{
+	int width = -1, height = -1;
+	long startTime = kuhl_microseconds();
+	unsigned char *image = tiledimage_read_rgba(imageFilename, &width, &height);
+	if(image == NULL)
+	{
+		msg(MSG_ERROR, "Unable to read image: %s", imageFilename);
+		return 0;
+	}
+
+	tiledimage_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILEDIMAGE_MAGIC, sizeof(header.magic));
+	header.version = TILEDIMAGE_VERSION;
+	header.tileSize = tileSize;
+	header.width = width;
+	header.height = height;
+	tiledimage_level levels[TILEDIMAGE_MAX_LEVELS];
+	memset(levels, 0, sizeof(levels));
+	header.numLevels = tiledimage_layout(levels, width, height, tileSize);
+
+	char tmpFilename[1100];
+	snprintf(tmpFilename, 1100, "%s.%d.tmp", tileFilename, (int) getpid());
+	FILE *f = fopen(tmpFilename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to write tile file %s", tmpFilename);
+		free(image);
+		return 0;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+	         fwrite(levels, sizeof(levels), 1, f) == 1;
+
+	size_t tileBytes = (size_t)tileSize*tileSize*4;
+	unsigned char *tile = kuhl_malloc(tileBytes);
+	uint64_t pos = sizeof(header) + sizeof(levels);
+	for(unsigned int l=0; l<header.numLevels && ok; l++)
+	{
+		/* Pad up to the start of the level. */
+		while(ok && pos < levels[l].offset)
+		{
+			ok = fputc(0, f) != EOF;
+			pos++;
+		}
+
+		for(unsigned int ty=0; ty<levels[l].tilesY && ok; ty++)
+			for(unsigned int tx=0; tx<levels[l].tilesX && ok; tx++)
+			{
+				tiledimage_copy_tile(tile, tileSize, image, levels[l].width, levels[l].height, tx, ty);
+				ok = fwrite(tile, tileBytes, 1, f) == 1;
+				pos += tileBytes;
+			}
+
+		if(l+1 < header.numLevels)
+		{
+			unsigned char *smaller = tiledimage_downsample(image, levels[l].width, levels[l].height,
+			                                               levels[l+1].width, levels[l+1].height);
+			free(image);
+			image = smaller;
+		}
+	}
+	free(tile);
+	free(image);
+	if(fclose(f) != 0)
+		ok = 0;
+
+	if(ok == 0)
+	{
+		msg(MSG_ERROR, "Failed to write tile file %s", tmpFilename);
+		remove(tmpFilename);
+		return 0;
+	}
+#ifdef _WIN32
+	remove(tileFilename); // rename() won't replace an existing file on Windows
+#endif
+	if(rename(tmpFilename, tileFilename) != 0)
+	{
+		msg(MSG_ERROR, "Failed to rename %s to %s", tmpFilename, tileFilename);
+		remove(tmpFilename);
+		return 0;
+	}
+	msg(MSG_INFO, "Converted %s (%dx%d) into %s: %u levels of %dx%d tiles in %.1f seconds",
+	    imageFilename, width, height, tileFilename, header.numLevels, tileSize, tileSize,
+	    (kuhl_microseconds()-startTime)/1000000.0);
+	return 1;
+}
+
+/** Opens a tile file created by tiledimage_convert(). The file is
+ * memory mapped so tiles are only read from disk when they are used.
+ *
+ * @param tileFilename The tile file to open.
+ *
+ * @return The tiled image or NULL if the file couldn't be read. Close
+ * with tiledimage_close().
+ */
+tiledimage* tiledimage_open(const char *tileFilename)
+{
+	static unsigned int nextId = 1;
+
+	size_t size = 0;
+	unsigned char *data = NULL;
+#ifndef _WIN32
+	int fd = open(tileFilename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(tiledimage_file_header))
+	{
+		size = (size_t) st.st_size;
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED)
+			data = NULL;
+	}
+	close(fd);
+#else
+	FILE *f = fopen(tileFilename, "rb");
+	if(f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long fileSize = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(fileSize > (long) sizeof(tiledimage_file_header))
+	{
+		size = (size_t) fileSize;
+		data = kuhl_malloc(size);
+		if(fread(data, 1, size, f) != size)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+#endif
+	if(data == NULL)
+		return NULL;
+
+	tiledimage_file_header header;
+	tiledimage_level levels[TILEDIMAGE_MAX_LEVELS];
+	int valid = size >= sizeof(header) + sizeof(levels);
+	if(valid)
+	{
+		memcpy(&header, data, sizeof(header));
+		memcpy(levels, data + sizeof(header), sizeof(levels));
+		valid = tiledimage_header_valid(&header, levels, size);
+	}
+	if(!valid)
+	{
+		msg(MSG_WARNING, "%s is not a valid tile file (or it was made by a different version of libkuhl).", tileFilename);
+#ifndef _WIN32
+		munmap(data, size);
+#else
+		free(data);
+#endif
+		return NULL;
+	}
+
+	tiledimage *img = kuhl_malloc(sizeof(tiledimage));
+	memset(img, 0, sizeof(tiledimage));
+	img->width = header.width;
+	img->height = header.height;
+	img->aspectRatio = header.width / (float) header.height;
+	img->tileSize = header.tileSize;
+	img->numLevels = header.numLevels;
+	memcpy(img->levels, levels, sizeof(levels));
+	img->id = nextId++;
+	snprintf(img->filename, 1024, "%s", tileFilename);
+	img->data = data;
+	img->length = size;
+	return img;
+}
+
+/** Opens the tile file for an image, converting the image first if
+ * the tile file doesn't exist or is older than the image. The tile
+ * file is named after the image with ".kuhltiles" appended. Doesn't
+ * read any config settings, so it can be called from any thread.
+ *
+ * @param imageFilename The image to open.
+ *
+ * @param tileSize The tile size to use if the tile file needs to be
+ * created (see tiledimage_convert()). Existing tile files are used
+ * regardless of their tile size.
+ *
+ * @return The tiled image or NULL on failure.
+ */
+tiledimage* tiledimage_open_image(const char *imageFilename, int tileSize)
+{
+	char tileFilename[1024];
+	snprintf(tileFilename, 1024, "%s.kuhltiles", imageFilename);
+
+	struct stat imageStat, tileStat;
+	int needsConvert = stat(tileFilename, &tileStat) != 0;
+	if(!needsConvert && stat(imageFilename, &imageStat) == 0 &&
+	   imageStat.st_mtime > tileStat.st_mtime)
+		needsConvert = 1;
+
+	tiledimage *img = NULL;
+	if(!needsConvert)
+		img = tiledimage_open(tileFilename);
+	if(img == NULL)
+	{
+		msg(MSG_INFO, "Converting %s into tiles. This only happens once but may take a while.", imageFilename);
+		if(tiledimage_convert(imageFilename, tileFilename, tileSize))
+			img = tiledimage_open(tileFilename);
+	}
+	return img;
+}
+
+/** Returns a pointer to the RGBA pixels of a tile (tileSize*tileSize*4
+ * bytes, bottom row first) or NULL if the tile doesn't exist. */
+const unsigned char* tiledimage_tile(const tiledimage *img, int level, int tx, int ty)
+{
+	if(level < 0 || level >= img->numLevels)
+		return NULL;
+	const tiledimage_level *l = &(img->levels[level]);
+	if(tx < 0 || ty < 0 || tx >= (int) l->tilesX || ty >= (int) l->tilesY)
+		return NULL;
+	size_t tileBytes = (size_t)img->tileSize*img->tileSize*4;
+	return img->data + l->offset + ((size_t)ty*l->tilesX + tx)*tileBytes;
+}
+
+/** Asks the operating system to start reading the tiles of the given
+ * level (and all coarser levels) from disk in the background so that
+ * they are ready when they are needed. Returns immediately. */
+void tiledimage_prefetch(const tiledimage *img, int level)
+{
+#ifndef _WIN32
+	if(level < 0)
+		level = 0;
+	if(level >= img->numLevels)
+		return;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = img->levels[level].offset / page * page;
+	posix_madvise((void*) (img->data + start), img->length - start, POSIX_MADV_WILLNEED);
+#endif
+}
+
+/** Closes a tiled image. Call tilecache_evict_image() first if its
+ * tiles might be in a tilecache. */
+void tiledimage_close(tiledimage *img)
+{
+	if(img == NULL)
+		return;
+#ifndef _WIN32
+	munmap((void*) img->data, img->length);
+#else
+	free((void*) img->data);
+#endif
+	free(img);
+}
+
+
+/** One texture in a tilecache. */
+typedef struct
+{
+	GLuint texture;
+	unsigned int imageId;  /**< 0 if the slot is empty */
+	int level, tx, ty;
+	unsigned long lastUsed; /**< Frame number that the tile was last used */
+	int next;              /**< Next slot in the same hash bucket, -1 at the end */
+} tilecache_slot;
+
+struct tilecache
+{
+	int tileSize;
+	int numSlots;
+	tilecache_slot *slots;
+	int *buckets;          /**< First slot in each hash bucket, -1 if empty */
+	int numBuckets;        /**< Power of two */
+
+	unsigned long frame;   /**< Incremented by tilecache_begin_frame() */
+	int uploadsPerFrame;
+	int uploadsThisFrame;
+
+	/* Statistics */
+	long hits, misses, uploads, evictions, deferred;
+};
+
+static unsigned int tilecache_hash(unsigned int imageId, int level, int tx, int ty)
+{
+	unsigned int h = imageId * 2654435761u;
+	h ^= (unsigned int) level * 40503u;
+	h ^= (unsigned int) tx * 2246822519u;
+	h ^= (unsigned int) ty * 3266489917u;
+	return h ^ (h >> 15);
+}
+
+static int tilecache_find(const tilecache *c, unsigned int imageId, int level, int tx, int ty)
+{
+	int i = c->buckets[tilecache_hash(imageId, level, tx, ty) & (c->numBuckets-1)];
+	while(i >= 0)
+	{
+		const tilecache_slot *s = &(c->slots[i]);
+		if(s->imageId == imageId && s->level == level && s->tx == tx && s->ty == ty)
+			return i;
+		i = s->next;
+	}
+	return -1;
+}
+
+static void tilecache_unlink(tilecache *c, int slot)
+{
+	tilecache_slot *s = &(c->slots[slot]);
+	if(s->imageId == 0)
+		return;
+	int *p = &(c->buckets[tilecache_hash(s->imageId, s->level, s->tx, s->ty) & (c->numBuckets-1)]);
+	while(*p != slot)
+		p = &(c->slots[*p].next);
+	*p = s->next;
+	s->imageId = 0;
+	s->next = -1;
+}
+
+/** Creates a cache of tiles in OpenGL textures. Must be called on the
+ * thread which owns the OpenGL context.
+ *
+ * @param numTiles The number of tiles to keep in texture memory. Each
+ * tile uses tileSize*tileSize*4 bytes.
+ *
+ * @param tileSize The size of the tiles in the tiled images that will
+ * be used with this cache.
+ *
+ * @param uploadsPerFrame The maximum number of tiles to upload between
+ * calls to tilecache_begin_frame() (unless TILECACHE_FORCE is used).
+ */
+tilecache* tilecache_new(int numTiles, int tileSize, int uploadsPerFrame)
+{
+	tilecache *c = kuhl_malloc(sizeof(tilecache));
+	memset(c, 0, sizeof(tilecache));
+	c->tileSize = tileSize;
+	c->numSlots = numTiles;
+	c->uploadsPerFrame = uploadsPerFrame;
+	c->slots = kuhl_malloc(sizeof(tilecache_slot)*numTiles);
+	c->numBuckets = 1;
+	while(c->numBuckets < numTiles*2)
+		c->numBuckets *= 2;
+	c->buckets = kuhl_malloc(sizeof(int)*c->numBuckets);
+	for(int i=0; i<c->numBuckets; i++)
+		c->buckets[i] = -1;
+
+	for(int i=0; i<numTiles; i++)
+	{
+		tilecache_slot *s = &(c->slots[i]);
+		s->imageId = 0;
+		s->next = -1;
+		s->lastUsed = 0;
+		glGenTextures(1, &(s->texture));
+		glBindTexture(GL_TEXTURE_2D, s->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, tileSize, tileSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_errorcheck();
+	return c;
+}
+
+/** Call once per frame before calling tilecache_get(). Tiles used in
+ * the current frame are never evicted. */
+void tilecache_begin_frame(tilecache *c)
+{
+	c->frame++;
+	c->uploadsThisFrame = 0;
+}
+
+/** Returns a texture containing a tile, uploading the tile if it
+ * isn't already in the cache.
+ *
+ * @param cache The cache.
+ * @param img The image that the tile is from.
+ * @param level The mipmap level of the tile.
+ * @param tx The column of the tile.
+ * @param ty The row of the tile (0 is the bottom).
+ * @param flags TILECACHE_FORCE to upload even if the upload limit
+ * for this frame has been reached, TILECACHE_RESIDENT to never upload.
+ *
+ * @return The texture or 0 if the tile isn't in the cache and
+ * wasn't uploaded.
+ */
+GLuint tilecache_get(tilecache *c, const tiledimage *img, int level, int tx, int ty, int flags)
+{
+	int i = tilecache_find(c, img->id, level, tx, ty);
+	if(i >= 0)
+	{
+		c->hits++;
+		c->slots[i].lastUsed = c->frame;
+		return c->slots[i].texture;
+	}
+	if(flags & TILECACHE_RESIDENT)
+		return 0;
+
+	c->misses++;
+	const unsigned char *pixels = tiledimage_tile(img, level, tx, ty);
+	if(pixels == NULL || img->tileSize != c->tileSize)
+		return 0;
+	if(!(flags & TILECACHE_FORCE) && c->uploadsThisFrame >= c->uploadsPerFrame)
+	{
+		c->deferred++;
+		return 0;
+	}
+
+	/* Use the least recently used slot (which is an empty slot if
+	 * there are any). */
+	int lru = -1;
+	for(int s=0; s<c->numSlots; s++)
+	{
+		if(c->slots[s].imageId == 0)
+		{
+			lru = s;
+			break;
+		}
+		if(c->slots[s].lastUsed != c->frame &&
+		   (lru < 0 || c->slots[s].lastUsed < c->slots[lru].lastUsed))
+			lru = s;
+	}
+	if(lru < 0)
+	{
+		c->deferred++; // every tile is in use this frame
+		return 0;
+	}
+	if(c->slots[lru].imageId != 0)
+	{
+		c->evictions++;
+		tilecache_unlink(c, lru);
+	}
+
+	tilecache_slot *s = &(c->slots[lru]);
+	GLint unpackAlignment = 4;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpackAlignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, s->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, c->tileSize, c->tileSize, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpackAlignment);
+	kuhl_errorcheck();
+
+	s->imageId = img->id;
+	s->level = level;
+	s->tx = tx;
+	s->ty = ty;
+	s->lastUsed = c->frame;
+	int bucket = tilecache_hash(img->id, level, tx, ty) & (c->numBuckets-1);
+	s->next = c->buckets[bucket];
+	c->buckets[bucket] = lru;
+
+	c->uploads++;
+	c->uploadsThisFrame++;
+	return s->texture;
+}
+
+/** Removes all of the tiles from an image from the cache. */
+void tilecache_evict_image(tilecache *c, const tiledimage *img)
+{
+	for(int i=0; i<c->numSlots; i++)
+		if(c->slots[i].imageId == img->id)
+			tilecache_unlink(c, i);
+}
+
+/** Prints statistics about the cache. */
+void tilecache_print_stats(const tilecache *c)
+{
+	int used = 0;
+	for(int i=0; i<c->numSlots; i++)
+		if(c->slots[i].imageId != 0)
+			used++;
+	msg(MSG_INFO, "Tile cache: %d of %d tiles used (%.1f MiB), %ld hits, %ld misses, %ld uploads, %ld evictions, %ld deferred",
+	    used, c->numSlots, (double)c->numSlots*c->tileSize*c->tileSize*4/(1024*1024),
+	    c->hits, c->misses, c->uploads, c->evictions, c->deferred);
+}
+
+/** Deletes the textures in a tilecache and frees it. */
+void tilecache_free(tilecache *c)
+{
+	if(c == NULL)
+		return;
+	for(int i=0; i<c->numSlots; i++)
+		glDeleteTextures(1, &(c->slots[i].texture));
+	free(c->slots);
+	free(c->buckets);
+	free(c);
+}
@@ -0,0 +1,110 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Tiled image pyramids for displaying images which are too large to
+    load all at once (e.g., 100+ megapixel panoramas).
+
+    An image is converted once into a tile file which contains the
+    image and all of its mipmap levels, each split into square RGBA
+    tiles. The tile file is memory mapped, so opening it is quick and
+    only the tiles that are actually used are read from disk.
+
+    A tilecache keeps a fixed number of tiles in OpenGL textures and
+    evicts the least recently used tiles when it needs room. The
+    number of tiles uploaded each frame is limited so that moving to a
+    new part of an image doesn't stall rendering; callers can draw a
+    coarser level (which is more likely to be in the cache) until the
+    detailed tiles arrive.
+
+    Tile files begin with a header (tiledimage_file_header) followed
+    by one tiledimage_level record per level. Tiles are stored one
+    level after another, row by row starting at the bottom of the
+    image (the same order OpenGL uses). Tiles on the right and top
+    edges are padded to the full tile size by repeating the last
+    column and row.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TILEDIMAGE_MAX_LEVELS 32
+#define TILEDIMAGE_VERSION 1
+
+/** Information about one level of a tiled image. */
+typedef struct
+{
+	uint32_t width;   /**< Width of the level in pixels */
+	uint32_t height;  /**< Height of the level in pixels */
+	uint32_t tilesX;  /**< Number of tiles across */
+	uint32_t tilesY;  /**< Number of tiles up */
+	uint64_t offset;  /**< Offset of the first tile in the file */
+} tiledimage_level;
+
+/** The header at the start of a tile file. */
+typedef struct
+{
+	char magic[8];      /**< "KUHLTIL" */
+	uint32_t version;   /**< TILEDIMAGE_VERSION */
+	uint32_t tileSize;  /**< Width and height of each tile in pixels */
+	uint32_t width;     /**< Width of the full resolution image */
+	uint32_t height;    /**< Height of the full resolution image */
+	uint32_t numLevels; /**< Number of levels (level 0 is full resolution) */
+	uint32_t reserved;
+} tiledimage_file_header;
+
+/** An open tile file. */
+typedef struct
+{
+	int width;         /**< Width of the full resolution image */
+	int height;        /**< Height of the full resolution image */
+	float aspectRatio; /**< width/height */
+	int tileSize;      /**< Width and height of each tile in pixels */
+	int numLevels;     /**< Number of levels, the last level is a single tile */
+	tiledimage_level levels[TILEDIMAGE_MAX_LEVELS];
+	unsigned int id;   /**< Unique number for this image, used by tilecache */
+	char filename[1024];
+
+	const unsigned char *data; /**< The contents of the file */
+	size_t length;             /**< Size of the file in bytes */
+} tiledimage;
+
+int tiledimage_convert(const char *imageFilename, const char *tileFilename, int tileSize);
+tiledimage* tiledimage_open(const char *tileFilename);
+tiledimage* tiledimage_open_image(const char *imageFilename, int tileSize);
+const unsigned char* tiledimage_tile(const tiledimage *img, int level, int tx, int ty);
+void tiledimage_prefetch(const tiledimage *img, int level);
+void tiledimage_close(tiledimage *img);
+
+
+/** A cache of tiles in OpenGL textures. Create with tilecache_new(). */
+typedef struct tilecache tilecache;
+
+/** Flag for tilecache_get(): Upload the tile even if the upload limit
+ * for this frame has been reached. */
+#define TILECACHE_FORCE 1
+/** Flag for tilecache_get(): Never upload, only return tiles that are
+ * already in the cache. */
+#define TILECACHE_RESIDENT 2
+
+tilecache* tilecache_new(int numTiles, int tileSize, int uploadsPerFrame);
+void tilecache_begin_frame(tilecache *cache);
+GLuint tilecache_get(tilecache *cache, const tiledimage *img, int level, int tx, int ty, int flags);
+void tilecache_evict_image(tilecache *cache, const tiledimage *img);
+void tilecache_print_stats(const tilecache *cache);
+void tilecache_free(tilecache *cache);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,560 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+#include "windows-compat.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tracklog.h"
+#include "list-typed.h"
+#include "kuhl-util.h"
+#include "msg.h"
+
+/* File layout:
+
+   header (tracklog_file_header)
+   object names (objectCount * TRACKLOG_NAME_MAX bytes)
+   blocks (tracklog_block_header followed by its records)
+   index (one tracklog_index_entry per block)
+   trailer (tracklog_trailer)
+
+   The index and trailer are only present if the log was closed with
+   tracklog_close().
+*/
+
+/** Identifies .trk files. Like PNG files, the header contains a
+ * non-ASCII character and different kinds of line endings so that
+ * damage from text-mode transfers can be detected. */
+static const char tracklog_magic[8] = { (char)219, 'T', 'R', 'K', '\r', '\n', 26, '\n' };
+#define TRACKLOG_VERSION 1
+#define TRACKLOG_BYTE_ORDER  0x01020304u
+#define TRACKLOG_BLOCK_MAGIC 0x4b4c4254u /* "TBLK" on little-endian computers */
+#define TRACKLOG_INDEX_MAGIC 0x58444954u /* "TIDX" */
+
+typedef struct {
+	char magic[8];
+	uint32_t byteOrder;
+	uint32_t version;
+	uint32_t objectCount;
+	uint32_t recordSize;
+} tracklog_file_header;
+
+typedef struct {
+	int64_t time;
+	uint32_t object;
+	float pos[3];
+	float quat[4];
+} tracklog_file_record;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t count;     /**< Number of records in the block */
+	int64_t firstTime;  /**< Earliest time in the block */
+	int64_t lastTime;   /**< Latest time in the block */
+} tracklog_block_header;
+
+/** A block is written and read with a single fwrite()/fread(). */
+typedef struct {
+	tracklog_block_header header;
+	tracklog_file_record records[TRACKLOG_BLOCK_RECORDS];
+} tracklog_block;
+
+typedef struct {
+	int64_t firstTime;
+	int64_t lastTime;
+	int64_t offset;     /**< Location of the block header in the file */
+	uint32_t count;
+	uint32_t unused;
+} tracklog_index_entry;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t blockCount;
+	int64_t indexOffset;
+} tracklog_trailer;
+
+LIST_TYPED(tracklog_index_list, tracklog_index_entry)
+
+struct tracklog {
+	FILE *f;
+	char *path;
+	int writing;
+	int objectCount;
+	char (*names)[TRACKLOG_NAME_MAX];
+	tracklog_index_list index;
+	long records;       /**< Total number of records in the blocks in the index */
+
+	tracklog_block block;
+	int blockIndex;     /**< Index of the block in memory when reading (-1 if none) */
+	int blockPos;       /**< Next record in the block to read */
+};
+
+
+static tracklog* tracklog_alloc(const char *path, int writing)
+{
+	tracklog *log = (tracklog*) kuhl_malloc(sizeof(tracklog));
+	memset(log, 0, sizeof(tracklog));
+	log->path = strdup(path);
+	log->writing = writing;
+	log->blockIndex = -1;
+	tracklog_index_list_init(&(log->index), 64);
+	return log;
+}
+
+static void tracklog_free(tracklog *log)
+{
+	if(log->f != NULL)
+		fclose(log->f);
+	tracklog_index_list_free(&(log->index));
+	free(log->names);
+	free(log->path);
+	free(log);
+}
+
+
+/** Creates a new tracking log.
+
+    @param path The file to create (usually ending in .trk). If the
+    file exists, it is overwritten.
+
+    @param names The names of the tracked objects that will be stored
+    in the log. The object field of each record is an index into this
+    array. Names longer than TRACKLOG_NAME_MAX-1 characters are
+    truncated.
+
+    @param count The number of names.
+
+    @return A log to pass to tracklog_write() and tracklog_close(), or
+    NULL if the file couldn't be created.
+*/
+tracklog* tracklog_create(const char *path, const char **names, int count)
+{
+	FILE *f = fopen(path, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Failed to create tracking log %s", path);
+		return NULL;
+	}
+
+	tracklog *log = tracklog_alloc(path, 1);
+	log->f = f;
+	log->objectCount = count;
+	log->names = kuhl_malloc(TRACKLOG_NAME_MAX * (count > 0 ? count : 1));
+	memset(log->names, 0, TRACKLOG_NAME_MAX * (count > 0 ? count : 1));
+	for(int i=0; i<count; i++)
+	{
+		if(strlen(names[i]) >= TRACKLOG_NAME_MAX)
+			msg(MSG_WARNING, "Object name '%s' is too long, it will be truncated in %s.", names[i], path);
+		strncpy(log->names[i], names[i], TRACKLOG_NAME_MAX-1);
+	}
+
+	tracklog_file_header header;
+	memcpy(header.magic, tracklog_magic, sizeof(header.magic));
+	header.byteOrder = TRACKLOG_BYTE_ORDER;
+	header.version = TRACKLOG_VERSION;
+	header.objectCount = (uint32_t) count;
+	header.recordSize = sizeof(tracklog_file_record);
+	if(fwrite(&header, sizeof(header), 1, f) != 1 ||
+	   (count > 0 && fwrite(log->names, TRACKLOG_NAME_MAX * count, 1, f) != 1))
+	{
+		msg(MSG_ERROR, "Failed to write header to %s", path);
+		tracklog_free(log);
+		return NULL;
+	}
+	return log;
+}
+
+/** Writes the records that are buffered in memory to the file. */
+static int tracklog_write_block(tracklog *log)
+{
+	tracklog_block_header *header = &(log->block.header);
+	if(header->count == 0)
+		return 1;
+
+	tracklog_index_entry entry;
+	entry.firstTime = header->firstTime;
+	entry.lastTime = header->lastTime;
+	entry.offset = ftell(log->f);
+	entry.count = header->count;
+	entry.unused = 0;
+
+	header->magic = TRACKLOG_BLOCK_MAGIC;
+	size_t size = sizeof(tracklog_block_header) + header->count * sizeof(tracklog_file_record);
+	int ok = fwrite(&(log->block), size, 1, log->f) == 1;
+	if(ok)
+	{
+		tracklog_index_list_append(&(log->index), entry);
+		log->records += header->count;
+	}
+	else
+		msg(MSG_ERROR, "Failed to write %u records to %s", header->count, log->path);
+	header->count = 0;
+	return ok;
+}
+
+/** Adds a record to a tracking log. Records are collected in memory
+    and written to the file TRACKLOG_BLOCK_RECORDS at a time.
+
+    Records should be written in the order they were captured:
+    tracklog_seek() assumes that the records in one block are not
+    older than the records in the previous block.
+
+    @param log A log from tracklog_create().
+    @param record The record to add.
+    @return 1 on success, 0 if the record couldn't be written.
+*/
+int tracklog_write(tracklog *log, const tracklog_record *record)
+{
+	if(!log->writing)
+	{
+		msg(MSG_ERROR, "%s was opened for reading.", log->path);
+		return 0;
+	}
+	if(record->object < 0 || record->object >= log->objectCount)
+	{
+		msg(MSG_ERROR, "Object %d is not in %s (it has %d objects).", record->object, log->path, log->objectCount);
+		return 0;
+	}
+
+	tracklog_block_header *header = &(log->block.header);
+	tracklog_file_record *r = &(log->block.records[header->count]);
+	r->time = record->time;
+	r->object = (uint32_t) record->object;
+	memcpy(r->pos, record->pos, sizeof(r->pos));
+	memcpy(r->quat, record->quat, sizeof(r->quat));
+
+	if(header->count == 0 || r->time < header->firstTime)
+		header->firstTime = r->time;
+	if(header->count == 0 || r->time > header->lastTime)
+		header->lastTime = r->time;
+	header->count++;
+
+	if(header->count == TRACKLOG_BLOCK_RECORDS)
+		return tracklog_write_block(log);
+	return 1;
+}
+
+/** Writes any buffered records to the file so that they are kept if
+    the program is killed before it calls tracklog_close(). Writing
+    small blocks makes the file slightly larger, so call this
+    occasionally (e.g., once a second), not after every record.
+
+    @param log A log from tracklog_create().
+*/
+void tracklog_flush(tracklog *log)
+{
+	if(!log->writing)
+		return;
+	tracklog_write_block(log);
+	fflush(log->f);
+}
+
+
+/** Builds the index by following the block headers from the start of
+    the data. Used when a log wasn't closed properly. A block that was
+    only partially written is ignored. */
+static void tracklog_rebuild_index(tracklog *log, long dataStart, long fileSize)
+{
+	long offset = dataStart;
+	tracklog_block_header header;
+	while(offset + (long) sizeof(header) <= fileSize)
+	{
+		if(fseek(log->f, offset, SEEK_SET) != 0 ||
+		   fread(&header, sizeof(header), 1, log->f) != 1 ||
+		   header.magic != TRACKLOG_BLOCK_MAGIC ||
+		   header.count == 0 || header.count > TRACKLOG_BLOCK_RECORDS)
+			break;
+		long size = sizeof(header) + header.count * sizeof(tracklog_file_record);
+		if(offset + size > fileSize)
+			break;
+
+		tracklog_index_entry entry = { header.firstTime, header.lastTime, offset, header.count, 0 };
+		tracklog_index_list_append(&(log->index), entry);
+		log->records += header.count;
+		offset += size;
+	}
+	if(offset < fileSize)
+		msg(MSG_WARNING, "Ignoring %ld bytes at the end of %s (the program that wrote it may have been killed while writing).", fileSize - offset, log->path);
+}
+
+/** Reads the index at the end of the file. Returns 0 if there isn't a
+ * valid index. Every entry must describe a block that fits in
+ * tracklog.block and lies between the object names and the index. */
+static int tracklog_read_index(tracklog *log, long dataStart, long fileSize)
+{
+	tracklog_trailer trailer;
+	if(fileSize < dataStart + (long) sizeof(trailer) ||
+	   fseek(log->f, fileSize - (long) sizeof(trailer), SEEK_SET) != 0 ||
+	   fread(&trailer, sizeof(trailer), 1, log->f) != 1 ||
+	   trailer.magic != TRACKLOG_INDEX_MAGIC)
+		return 0;
+
+	long indexSize = trailer.blockCount * (long) sizeof(tracklog_index_entry);
+	if(trailer.indexOffset < dataStart ||
+	   trailer.indexOffset + indexSize + (long) sizeof(trailer) != fileSize)
+		return 0;
+
+	tracklog_index_list_reserve(&(log->index), trailer.blockCount);
+	if(trailer.blockCount > 0 &&
+	   (fseek(log->f, (long) trailer.indexOffset, SEEK_SET) != 0 ||
+	    fread(log->index.data, indexSize, 1, log->f) != 1))
+		return 0;
+	log->index.length = trailer.blockCount;
+	for(int i=0; i<log->index.length; i++)
+	{
+		const tracklog_index_entry *entry = &(log->index.data[i]);
+		if(entry->count == 0 || entry->count > TRACKLOG_BLOCK_RECORDS ||
+		   entry->offset < dataStart ||
+		   entry->offset + (int64_t) (sizeof(tracklog_block_header) + entry->count * sizeof(tracklog_file_record)) > trailer.indexOffset)
+			return 0;
+		log->records += entry->count;
+	}
+	return 1;
+}
+
+/** Opens a tracking log for reading.
+
+    @param path The file to open.
+
+    @return A log to pass to tracklog_read() and tracklog_close(), or
+    NULL if the file couldn't be opened or isn't a tracking log.
+*/
+tracklog* tracklog_open(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Failed to open tracking log %s", path);
+		return NULL;
+	}
+
+	tracklog *log = tracklog_alloc(path, 0);
+	log->f = f;
+
+	tracklog_file_header header;
+	if(fread(&header, sizeof(header), 1, f) != 1 ||
+	   memcmp(header.magic, tracklog_magic, sizeof(header.magic)) != 0)
+	{
+		msg(MSG_ERROR, "%s is not a tracking log.", path);
+		tracklog_free(log);
+		return NULL;
+	}
+	if(header.byteOrder != TRACKLOG_BYTE_ORDER)
+	{
+		msg(MSG_ERROR, "%s was written on a computer with a different byte order.", path);
+		tracklog_free(log);
+		return NULL;
+	}
+	if(header.version != TRACKLOG_VERSION || header.recordSize != sizeof(tracklog_file_record))
+	{
+		msg(MSG_ERROR, "%s was written with an unsupported version (%u) of the tracking log format.", path, header.version);
+		tracklog_free(log);
+		return NULL;
+	}
+
+	log->objectCount = (int) header.objectCount;
+	int nameBytes = TRACKLOG_NAME_MAX * log->objectCount;
+	log->names = kuhl_malloc(nameBytes > 0 ? nameBytes : 1);
+	if(nameBytes > 0 && fread(log->names, nameBytes, 1, f) != 1)
+	{
+		msg(MSG_ERROR, "Failed to read the object names in %s", path);
+		tracklog_free(log);
+		return NULL;
+	}
+	for(int i=0; i<log->objectCount; i++)
+		log->names[i][TRACKLOG_NAME_MAX-1] = '\0';
+
+	long dataStart = (long) sizeof(header) + nameBytes;
+	fseek(f, 0, SEEK_END);
+	long fileSize = ftell(f);
+	if(!tracklog_read_index(log, dataStart, fileSize))
+	{
+		msg(MSG_WARNING, "%s has no valid index (it may not have been closed properly), rebuilding it.", path);
+		tracklog_index_list_clear(&(log->index));
+		log->records = 0;
+		tracklog_rebuild_index(log, dataStart, fileSize);
+	}
+	return log;
+}
+
+/** Loads a block from the file into memory. */
+static int tracklog_load_block(tracklog *log, int blockIndex)
+{
+	const tracklog_index_entry *entry = tracklog_index_list_get(&(log->index), blockIndex);
+	size_t size = sizeof(tracklog_block_header) + entry->count * sizeof(tracklog_file_record);
+	log->blockIndex = -1;
+	log->blockPos = 0;
+	if(entry->count > TRACKLOG_BLOCK_RECORDS ||
+	   fseek(log->f, (long) entry->offset, SEEK_SET) != 0 ||
+	   fread(&(log->block), size, 1, log->f) != 1 ||
+	   log->block.header.magic != TRACKLOG_BLOCK_MAGIC ||
+	   log->block.header.count != entry->count)
+	{
+		msg(MSG_ERROR, "Failed to read block %d from %s", blockIndex, log->path);
+		return 0;
+	}
+	log->blockIndex = blockIndex;
+	return 1;
+}
+
+/** Reads the next record from a tracking log.
+
+    @param log A log from tracklog_open().
+    @param record The record that was read.
+    @return 1 if a record was read, 0 at the end of the log (or if
+    there was an error).
+*/
+int tracklog_read(tracklog *log, tracklog_record *record)
+{
+	if(log->writing)
+	{
+		msg(MSG_ERROR, "%s was opened for writing.", log->path);
+		return 0;
+	}
+
+	if(log->blockIndex < 0 || log->blockPos >= (int) log->block.header.count)
+	{
+		int next = log->blockIndex + 1;
+		if(next >= log->index.length)
+			return 0;
+		if(!tracklog_load_block(log, next))
+		{
+			/* Don't read the same block again. */
+			log->blockIndex = log->index.length;
+			return 0;
+		}
+	}
+
+	const tracklog_file_record *r = &(log->block.records[log->blockPos++]);
+	record->time = (long) r->time;
+	record->object = (int) r->object;
+	memcpy(record->pos, r->pos, sizeof(record->pos));
+	memcpy(record->quat, r->quat, sizeof(record->quat));
+	if(record->object >= log->objectCount)
+	{
+		msg(MSG_WARNING, "Record for object %d in %s, but the file only has %d objects.", record->object, log->path, log->objectCount);
+		record->object = 0;
+	}
+	return 1;
+}
+
+/** Moves to a time in a tracking log so that the next call to
+    tracklog_read() returns the first record captured at or after that
+    time. The index is used to find the block that contains the
+    record, so only that block is read from the file.
+
+    @param log A log from tracklog_open().
+
+    @param time The time to move to (use tracklog_first_time() to go
+    back to the beginning).
+
+    @return 1 if there is a record at or after the time, 0 if the time
+    is after the end of the log.
+*/
+int tracklog_seek(tracklog *log, long time)
+{
+	if(log->writing)
+		return 0;
+
+	/* Find the first block that ends at or after the time. */
+	int lo = 0, hi = log->index.length;
+	while(lo < hi)
+	{
+		int mid = (lo+hi)/2;
+		if(log->index.data[mid].lastTime < time)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if(lo == log->index.length)
+	{
+		/* Past the end: the next read returns 0. No block is marked
+		 * as loaded so that a later seek reads its block again. */
+		log->blockIndex = log->index.length;
+		log->blockPos = TRACKLOG_BLOCK_RECORDS;
+		return 0;
+	}
+
+	if(log->blockIndex != lo && !tracklog_load_block(log, lo))
+		return 0;
+	int pos = 0;
+	while(pos < (int) log->block.header.count && log->block.records[pos].time < time)
+		pos++;
+	log->blockPos = pos;
+	return 1;
+}
+
+/** Returns the time of the first record in a log opened with
+ * tracklog_open() (0 if the log is empty). */
+long tracklog_first_time(const tracklog *log)
+{
+	if(log->index.length == 0)
+		return 0;
+	return (long) log->index.data[0].firstTime;
+}
+
+/** Returns the time of the last record in a log opened with
+ * tracklog_open() (0 if the log is empty). */
+long tracklog_last_time(const tracklog *log)
+{
+	if(log->index.length == 0)
+		return 0;
+	return (long) log->index.data[log->index.length-1].lastTime;
+}
+
+/** Returns the number of records in a log opened with tracklog_open()
+ * (or the number written so far to a log from tracklog_create()). */
+long tracklog_record_count(const tracklog *log)
+{
+	return log->records + (log->writing ? (long) log->block.header.count : 0);
+}
+
+/** Returns the number of tracked objects in the log. */
+int tracklog_object_count(const tracklog *log)
+{
+	return log->objectCount;
+}
+
+/** Returns the name of a tracked object in the log (or NULL if there
+ * is no such object). */
+const char* tracklog_object_name(const tracklog *log, int object)
+{
+	if(object < 0 || object >= log->objectCount)
+		return NULL;
+	return log->names[object];
+}
+
+/** Closes a tracking log. If the log is being written, the buffered
+    records and the index are written before the file is closed.
+
+    @param log The log to close. It is freed and can't be used
+    afterwards.
+*/
+void tracklog_close(tracklog *log)
+{
+	if(log == NULL)
+		return;
+	if(log->writing)
+	{
+		tracklog_write_block(log);
+		tracklog_trailer trailer;
+		trailer.magic = TRACKLOG_INDEX_MAGIC;
+		trailer.blockCount = (uint32_t) log->index.length;
+		trailer.indexOffset = ftell(log->f);
+		if((log->index.length > 0 &&
+		    fwrite(log->index.data, sizeof(tracklog_index_entry) * log->index.length, 1, log->f) != 1) ||
+		   fwrite(&trailer, sizeof(trailer), 1, log->f) != 1)
+			msg(MSG_ERROR, "Failed to write the index to %s", log->path);
+		if(fclose(log->f) != 0)
+			msg(MSG_ERROR, "Failed to close %s", log->path);
+		log->f = NULL;
+	}
+	tracklog_free(log);
+}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Tracking logs (.trk files) store timestamped samples from any
+    number of tracked objects in one file so that a tracking session
+    can be played back later with the original timing (see
+    vrpn/recorder.c and vrpn/fake-server.cpp). Unlike .tdl files (see
+    tdl-util.h), every record has the time it was captured, and
+    records from several objects are interleaved in the order they
+    were captured.
+
+    The file starts with a header that contains the names of the
+    objects. Records are written in blocks: they are collected in
+    memory and each block is written with a single fwrite(). When the
+    log is closed, an index containing the time and file offset of
+    every block is written at the end of the file so that
+    tracklog_seek() can jump to any time without reading the records
+    before it. If a program is killed before it closes the log, the
+    index is missing; tracklog_open() then rebuilds it by skipping
+    from one block header to the next.
+
+    The numbers in the file are stored in the byte order of the
+    computer that wrote it (a marker in the header lets us detect a
+    file written with a different byte order).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACKLOG_NAME_MAX 64       /**< Maximum length of an object name (including the null terminator) */
+#define TRACKLOG_BLOCK_RECORDS 256 /**< Number of records in a block */
+
+/** One record in a tracking log. */
+typedef struct {
+	long time;     /**< Time that the sample was captured (microseconds) */
+	int object;    /**< Index of the object (see tracklog_object_name()) */
+	float pos[3];  /**< Position */
+	float quat[4]; /**< Orientation (x,y,z,w) */
+} tracklog_record;
+
+/** A tracking log that is open for reading or writing. */
+typedef struct tracklog tracklog;
+
+tracklog* tracklog_create(const char *path, const char **names, int count);
+int tracklog_write(tracklog *log, const tracklog_record *record);
+void tracklog_flush(tracklog *log);
+
+tracklog* tracklog_open(const char *path);
+int tracklog_read(tracklog *log, tracklog_record *record);
+int tracklog_seek(tracklog *log, long time);
+long tracklog_first_time(const tracklog *log);
+long tracklog_last_time(const tracklog *log);
+long tracklog_record_count(const tracklog *log);
+
+int tracklog_object_count(const tracklog *log);
+const char* tracklog_object_name(const tracklog *log, int object);
+void tracklog_close(tracklog *log);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,372 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <math.h>
+
+#include "vecmat.h"
+#include "vecmat-batch.h"
+#include "threadpool.h"
+
+/** Number of items that a thread processes at a time. */
+#define VECMAT_BATCH_CHUNK 8192
+
+static threadpool *batchPool = NULL;
+static int batchPoolSet = 0;
+
+/* One call to a batch function. The kernel processes the items from
+ * start to end-1. */
+typedef struct vecmat_batch_job vecmat_batch_job;
+struct vecmat_batch_job
+{
+	void (*kernel)(const vecmat_batch_job *job, int start, int end);
+	float *out[3];
+	const float *in[3];
+	const float *m;
+	int count;
+};
+
+/** Sets the pool of threads that large batches are split across.
+
+    @param pool The pool to use, or NULL to process every batch on the
+    calling thread. By default, threadpool_default() is used.
+*/
+void vecmat_batch_set_pool(threadpool *pool)
+{
+	batchPool = pool;
+	batchPoolSet = 1;
+}
+
+static void vecmat_batch_chunk(void *data, int index)
+{
+	const vecmat_batch_job *job = (const vecmat_batch_job*) data;
+	int start = index * VECMAT_BATCH_CHUNK;
+	int end = start + VECMAT_BATCH_CHUNK;
+	if(end > job->count)
+		end = job->count;
+	job->kernel(job, start, end);
+}
+
+/* Runs a job on the calling thread or, if it is large enough, on all
+ * of the threads in the pool. */
+static void vecmat_batch_run(vecmat_batch_job *job)
+{
+	if(job->count <= 0)
+		return;
+	if(job->count < VECMAT_BATCH_THREAD_MIN)
+	{
+		job->kernel(job, 0, job->count);
+		return;
+	}
+
+	threadpool *pool = batchPoolSet ? batchPool : threadpool_default();
+	if(threadpool_size(pool) == 1)
+		job->kernel(job, 0, job->count);
+	else
+		threadpool_for(pool, (job->count + VECMAT_BATCH_CHUNK-1) / VECMAT_BATCH_CHUNK,
+		               vecmat_batch_chunk, job);
+}
+
+
+static void vecmat_batch_vec4(const vecmat_batch_job *job, int start, int end)
+{
+	for(int i=start; i<end; i++)
+		mat4f_mult_vec4f_new(job->out[0]+i*4, job->m, job->in[0]+i*4);
+}
+
+/** Multiplies many column vectors by a 4x4 matrix (i.e., m * v for
+    each v).
+
+    @param out Location to store count*4 floats (can be the same as in).
+    @param in An array of count vectors (x0,y0,z0,w0,x1,...).
+    @param count The number of vectors.
+    @param m The matrix.
+*/
+void mat4f_mult_vec4f_batch(float *out, const float *in, int count, const float m[16])
+{
+	vecmat_batch_job job = { vecmat_batch_vec4, { out }, { in }, m, count };
+	vecmat_batch_run(&job);
+}
+
+
+static void vecmat_batch_point3(const vecmat_batch_job *job, int start, int end)
+{
+	const float *m = job->m;
+	const float *in = job->in[0];
+	float *out = job->out[0];
+#if defined(VECMAT_SSE)
+	__m128 c0 = _mm_loadu_ps(&m[0]);
+	__m128 c1 = _mm_loadu_ps(&m[4]);
+	__m128 c2 = _mm_loadu_ps(&m[8]);
+	__m128 c3 = _mm_loadu_ps(&m[12]);
+	for(int i=start; i<end; i++)
+	{
+		const float *p = &in[i*3];
+		__m128 r = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps(p[0])));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(p[1])));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(p[2])));
+		/* Store only x, y and z so that we don't overwrite the next
+		 * point (which we might not have read yet). */
+		_mm_storel_pi((__m64*) &out[i*3], r);
+		_mm_store_ss(&out[i*3+2], _mm_movehl_ps(r, r));
+	}
+#elif defined(VECMAT_NEON)
+	float32x4_t c0 = vld1q_f32(&m[0]);
+	float32x4_t c1 = vld1q_f32(&m[4]);
+	float32x4_t c2 = vld1q_f32(&m[8]);
+	float32x4_t c3 = vld1q_f32(&m[12]);
+	for(int i=start; i<end; i++)
+	{
+		const float *p = &in[i*3];
+		float x = p[0], y = p[1], z = p[2];
+		float32x4_t r = vmlaq_n_f32(c3, c0, x);
+		r = vmlaq_n_f32(r, c1, y);
+		r = vmlaq_n_f32(r, c2, z);
+		vst1_f32(&out[i*3], vget_low_f32(r));
+		out[i*3+2] = vgetq_lane_f32(r, 2);
+	}
+#else
+	for(int i=start; i<end; i++)
+	{
+		float x = in[i*3], y = in[i*3+1], z = in[i*3+2];
+		for(int k=0; k<3; k++)
+			out[i*3+k] = m[k]*x + m[4+k]*y + m[8+k]*z + m[12+k];
+	}
+#endif
+}
+
+/** Transforms many 3D points by a 4x4 matrix. Each point is treated
+    as (x,y,z,1) and the resulting w is discarded (i.e., there is no
+    perspective divide).
+
+    @param out Location to store count*3 floats (can be the same as in).
+    @param in An array of count points (x0,y0,z0,x1,y1,z1,...).
+    @param count The number of points.
+    @param m The matrix.
+*/
+void mat4f_mult_point3f_batch(float *out, const float *in, int count, const float m[16])
+{
+	vecmat_batch_job job = { vecmat_batch_point3, { out }, { in }, m, count };
+	vecmat_batch_run(&job);
+}
+
+
+static void vecmat_batch_point3_soa(const vecmat_batch_job *job, int start, int end)
+{
+	const float *m = job->m;
+	const float *x = job->in[0], *y = job->in[1], *z = job->in[2];
+	float *outX = job->out[0], *outY = job->out[1], *outZ = job->out[2];
+	int i = start;
+#if defined(VECMAT_AVX)
+	__m256 mm[12];
+	for(int k=0; k<12; k++)
+		mm[k] = _mm256_set1_ps(m[(k/3)*4 + k%3]); // row k%3 of column k/3
+	for(; i+8<=end; i+=8)
+	{
+		__m256 vx = _mm256_loadu_ps(&x[i]);
+		__m256 vy = _mm256_loadu_ps(&y[i]);
+		__m256 vz = _mm256_loadu_ps(&z[i]);
+		for(int row=0; row<3; row++)
+		{
+			__m256 r = _mm256_add_ps(mm[9+row], _mm256_mul_ps(mm[row], vx));
+			r = _mm256_add_ps(r, _mm256_mul_ps(mm[3+row], vy));
+			r = _mm256_add_ps(r, _mm256_mul_ps(mm[6+row], vz));
+			_mm256_storeu_ps(row == 0 ? &outX[i] : row == 1 ? &outY[i] : &outZ[i], r);
+		}
+	}
+#elif defined(VECMAT_SSE)
+	__m128 mm[12];
+	for(int k=0; k<12; k++)
+		mm[k] = _mm_set1_ps(m[(k/3)*4 + k%3]);
+	for(; i+4<=end; i+=4)
+	{
+		__m128 vx = _mm_loadu_ps(&x[i]);
+		__m128 vy = _mm_loadu_ps(&y[i]);
+		__m128 vz = _mm_loadu_ps(&z[i]);
+		for(int row=0; row<3; row++)
+		{
+			__m128 r = _mm_add_ps(mm[9+row], _mm_mul_ps(mm[row], vx));
+			r = _mm_add_ps(r, _mm_mul_ps(mm[3+row], vy));
+			r = _mm_add_ps(r, _mm_mul_ps(mm[6+row], vz));
+			_mm_storeu_ps(row == 0 ? &outX[i] : row == 1 ? &outY[i] : &outZ[i], r);
+		}
+	}
+#elif defined(VECMAT_NEON)
+	for(; i+4<=end; i+=4)
+	{
+		float32x4_t vx = vld1q_f32(&x[i]);
+		float32x4_t vy = vld1q_f32(&y[i]);
+		float32x4_t vz = vld1q_f32(&z[i]);
+		for(int row=0; row<3; row++)
+		{
+			float32x4_t r = vmlaq_n_f32(vdupq_n_f32(m[12+row]), vx, m[row]);
+			r = vmlaq_n_f32(r, vy, m[4+row]);
+			r = vmlaq_n_f32(r, vz, m[8+row]);
+			vst1q_f32(row == 0 ? &outX[i] : row == 1 ? &outY[i] : &outZ[i], r);
+		}
+	}
+#endif
+	/* Points left over after the SIMD loop (or all of them). */
+	for(; i<end; i++)
+	{
+		float px = x[i], py = y[i], pz = z[i];
+		outX[i] = m[0]*px + m[4]*py + m[8]*pz  + m[12];
+		outY[i] = m[1]*px + m[5]*py + m[9]*pz  + m[13];
+		outZ[i] = m[2]*px + m[6]*py + m[10]*pz + m[14];
+	}
+}
+
+/** Transforms many 3D points stored in separate x, y and z arrays by
+    a 4x4 matrix. Each point is treated as (x,y,z,1) and the resulting
+    w is discarded. This is the fastest way to transform a large
+    number of points.
+
+    @param outX Location to store the transformed x coordinates (can be the same as x).
+    @param outY Location to store the transformed y coordinates (can be the same as y).
+    @param outZ Location to store the transformed z coordinates (can be the same as z).
+    @param x The x coordinates of the points.
+    @param y The y coordinates of the points.
+    @param z The z coordinates of the points.
+    @param count The number of points.
+    @param m The matrix.
+*/
+void mat4f_mult_point3f_soa(float *outX, float *outY, float *outZ,
+                            const float *x, const float *y, const float *z,
+                            int count, const float m[16])
+{
+	vecmat_batch_job job = { vecmat_batch_point3_soa, { outX, outY, outZ }, { x, y, z }, m, count };
+	vecmat_batch_run(&job);
+}
+
+
+static void vecmat_batch_mat4(const vecmat_batch_job *job, int start, int end)
+{
+	const float *m = job->m;
+#if defined(VECMAT_AVX)
+	__m256 a0 = _mm256_broadcast_ps((const __m128*) &m[0]);
+	__m256 a1 = _mm256_broadcast_ps((const __m128*) &m[4]);
+	__m256 a2 = _mm256_broadcast_ps((const __m128*) &m[8]);
+	__m256 a3 = _mm256_broadcast_ps((const __m128*) &m[12]);
+	for(int i=start; i<end; i++)
+	{
+		const float *b = job->in[0] + i*16;
+		float *out = job->out[0] + i*16;
+		for(int col=0; col<4; col+=2)
+		{
+			__m256 v = _mm256_loadu_ps(&b[col*4]);
+			__m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(v, v, 0x00));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(v, v, 0x55)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(v, v, 0xaa)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(v, v, 0xff)));
+			_mm256_storeu_ps(&out[col*4], r);
+		}
+	}
+#else
+	/* Each column of the result is m times a column of the input
+	 * matrix, so mat4f_mult_vec4f_new() (which uses SSE or NEON if
+	 * available) does all of the work. */
+	for(int i=start; i<end; i++)
+	{
+		const float *b = job->in[0] + i*16;
+		float *out = job->out[0] + i*16;
+		for(int col=0; col<4; col++)
+			mat4f_mult_vec4f_new(&out[col*4], m, &b[col*4]);
+	}
+#endif
+}
+
+/** Multiplies one 4x4 matrix by many 4x4 matrices (i.e., out[i] = m *
+    mats[i]). For example, this can combine a view matrix with the
+    model matrices of many objects.
+
+    @param out Location to store count matrices (can be the same as mats).
+    @param m The matrix on the left side of every multiplication.
+    @param mats An array of count matrices.
+    @param count The number of matrices.
+*/
+void mat4f_mult_mat4f_batch(float *out, const float m[16], const float *mats, int count)
+{
+	vecmat_batch_job job = { vecmat_batch_mat4, { out }, { mats }, m, count };
+	vecmat_batch_run(&job);
+}
+
+
+/* Transforms the center of each box and then calculates how far the
+ * transformed box extends from the center (Arvo, "Transforming
+ * Axis-Aligned Bounding Boxes", Graphics Gems, 1990). This gives the
+ * same box as transforming all 8 corners. */
+static void vecmat_batch_bbox(const vecmat_batch_job *job, int start, int end)
+{
+	const float *m = job->m;
+#if defined(VECMAT_SSE)
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 c0 = _mm_loadu_ps(&m[0]);
+	__m128 c1 = _mm_loadu_ps(&m[4]);
+	__m128 c2 = _mm_loadu_ps(&m[8]);
+	__m128 c3 = _mm_loadu_ps(&m[12]);
+	__m128 abs0 = _mm_and_ps(c0, absMask);
+	__m128 abs1 = _mm_and_ps(c1, absMask);
+	__m128 abs2 = _mm_and_ps(c2, absMask);
+	for(int i=start; i<end; i++)
+	{
+		const float *b = job->in[0] + i*6;
+		float *out = job->out[0] + i*6;
+		__m128 center = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps((b[0]+b[1])*0.5f)));
+		center = _mm_add_ps(center, _mm_mul_ps(c1, _mm_set1_ps((b[2]+b[3])*0.5f)));
+		center = _mm_add_ps(center, _mm_mul_ps(c2, _mm_set1_ps((b[4]+b[5])*0.5f)));
+		__m128 extent = _mm_mul_ps(abs0, _mm_set1_ps((b[1]-b[0])*0.5f));
+		extent = _mm_add_ps(extent, _mm_mul_ps(abs1, _mm_set1_ps((b[3]-b[2])*0.5f)));
+		extent = _mm_add_ps(extent, _mm_mul_ps(abs2, _mm_set1_ps((b[5]-b[4])*0.5f)));
+		__m128 lo = _mm_sub_ps(center, extent);
+		__m128 hi = _mm_add_ps(center, extent);
+		// (xmin, xmax, ymin, ymax) and (zmin, zmax)
+		_mm_storeu_ps(&out[0], _mm_unpacklo_ps(lo, hi));
+		_mm_storel_pi((__m64*) &out[4], _mm_unpackhi_ps(lo, hi));
+	}
+#else
+	for(int i=start; i<end; i++)
+	{
+		const float *b = job->in[0] + i*6;
+		float *out = job->out[0] + i*6;
+		float center[3], extent[3];
+		for(int k=0; k<3; k++)
+		{
+			center[k] = (b[k*2]+b[k*2+1])*0.5f;
+			extent[k] = (b[k*2+1]-b[k*2])*0.5f;
+		}
+		for(int row=0; row<3; row++)
+		{
+			float c = m[12+row], e = 0;
+			for(int k=0; k<3; k++)
+			{
+				c += m[k*4+row] * center[k];
+				e += fabsf(m[k*4+row]) * extent[k];
+			}
+			out[row*2]   = c - e;
+			out[row*2+1] = c + e;
+		}
+	}
+#endif
+}
+
+/** Applies a transformation matrix to many axis-aligned bounding
+    boxes to produce new axis-aligned bounding boxes. Like
+    kuhl_bbox_transform(), the matrix is assumed to be an affine
+    transformation (the bottom row is ignored).
+
+    @param out Location to store count*6 floats (can be the same as bboxes).
+    @param bboxes An array of count bounding boxes, each stored as
+    (xmin, xmax, ymin, ymax, zmin, zmax).
+    @param count The number of bounding boxes.
+    @param m The matrix.
+*/
+void mat4f_bbox_transform_batch(float *out, const float *bboxes, int count, const float m[16])
+{
+	vecmat_batch_job job = { vecmat_batch_bbox, { out }, { bboxes }, m, count };
+	vecmat_batch_run(&job);
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Applies one 4x4 matrix to many points, vectors, matrices or
+    bounding boxes with a single call. The functions in vecmat.h
+    transform one item per call; these functions use the SIMD
+    instructions described in vecmat-simd.c on every item and, when
+    there are at least VECMAT_BATCH_THREAD_MIN items, split the work
+    across a pool of threads (see threadpool.h).
+
+    Points and vectors can be stored as an array of structures (AoS:
+    x0,y0,z0,x1,y1,z1,...) or as a structure of arrays (SoA: separate
+    x, y and z arrays). The SoA functions are the fastest because
+    they process 4 (SSE) or 8 (AVX) points at a time without
+    rearranging the data.
+
+    Unless noted, the output can be the same array as the input. The
+    matrix must not be stored in the output array.
+
+    By default, threadpool_default() is used. Since that pool can only
+    be used by the main thread, call vecmat_batch_set_pool(NULL) before
+    calling these functions from other threads (or from inside of a
+    threadpool_for() job).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include "threadpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Batches with at least this many items are split across threads. */
+#define VECMAT_BATCH_THREAD_MIN 32768
+
+void vecmat_batch_set_pool(threadpool *pool);
+
+void mat4f_mult_vec4f_batch(float *out, const float *in, int count, const float m[16]);
+void mat4f_mult_point3f_batch(float *out, const float *in, int count, const float m[16]);
+void mat4f_mult_point3f_soa(float *outX, float *outY, float *outZ,
+                            const float *x, const float *y, const float *z,
+                            int count, const float m[16]);
+void mat4f_mult_mat4f_batch(float *out, const float m[16], const float *mats, int count);
+void mat4f_bbox_transform_batch(float *out, const float *bboxes, int count, const float m[16]);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
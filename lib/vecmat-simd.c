@@ -0,0 +1,278 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    SSE, AVX and NEON versions of the 4x4 float matrix and quaternion
+    functions that libkuhl uses the most (multiplying matrices,
+    transforming vectors, inverting matrices, interpolating quaternions
+    and converting quaternions into matrices).
+
+    The instruction set is chosen when libkuhl is compiled: AVX is used
+    if the compiler targets it (e.g., -mavx or -march=native), SSE is
+    used on all other x86-64 machines and NEON is used on ARM machines
+    that support it. If none are available (or VECMAT_NO_SIMD is
+    defined), these functions call the regular versions in vecmat.c and
+    vecmat.h. vecmat_simd_name() returns the name of the instruction set
+    in use.
+
+    Most programs don't need to call these functions directly: the
+    mat4f_*() functions in vecmat.h call them automatically. The
+    instruction set is detected in vecmat.h, which also contains the
+    SIMD version of mat4f_mult_vec4f_new().
+
+    @author Scott Kuhl
+ */
+
+#include <math.h>
+#include "vecmat.h"
+
+/** Returns the name of the instruction set used by the vecmat SIMD
+ * functions: "AVX", "SSE", "NEON" or "scalar". */
+const char* vecmat_simd_name(void)
+{
+#if defined(VECMAT_AVX)
+	return "AVX";
+#elif defined(VECMAT_SSE)
+	return "SSE";
+#elif defined(VECMAT_NEON)
+	return "NEON";
+#else
+	return "scalar";
+#endif
+}
+
+/** Multiplies two 4x4 matrices together. Equivalent to
+    matNf_mult_matNf_new(result, matA, matB, 4). Works even if result
+    points to the same location as matA or matB.
+
+    @param result The resulting matrix containing matA * matB.
+    @param matA The left operand.
+    @param matB The right operand.
+*/
+void mat4f_mult_mat4f_simd(float result[16], const float matA[16], const float matB[16])
+{
+#if defined(VECMAT_AVX)
+	/* Each column of the result is a combination of the columns of
+	 * matA. Compute two columns of the result at a time. */
+	__m256 a0 = _mm256_broadcast_ps((const __m128*) &matA[0]);
+	__m256 a1 = _mm256_broadcast_ps((const __m128*) &matA[4]);
+	__m256 a2 = _mm256_broadcast_ps((const __m128*) &matA[8]);
+	__m256 a3 = _mm256_broadcast_ps((const __m128*) &matA[12]);
+	for(int col=0; col<4; col+=2)
+	{
+		__m256 b = _mm256_loadu_ps(&matB[col*4]);
+		__m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(b, b, 0x00));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(b, b, 0x55)));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(b, b, 0xaa)));
+		r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(b, b, 0xff)));
+		_mm256_storeu_ps(&result[col*4], r);
+	}
+#elif defined(VECMAT_SSE)
+	__m128 a0 = _mm_loadu_ps(&matA[0]);
+	__m128 a1 = _mm_loadu_ps(&matA[4]);
+	__m128 a2 = _mm_loadu_ps(&matA[8]);
+	__m128 a3 = _mm_loadu_ps(&matA[12]);
+	for(int col=0; col<4; col++)
+	{
+		__m128 b = _mm_loadu_ps(&matB[col*4]);
+		__m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(b, b, 0x00));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(b, b, 0x55)));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(b, b, 0xaa)));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(b, b, 0xff)));
+		_mm_storeu_ps(&result[col*4], r);
+	}
+#elif defined(VECMAT_NEON)
+	float32x4_t a0 = vld1q_f32(&matA[0]);
+	float32x4_t a1 = vld1q_f32(&matA[4]);
+	float32x4_t a2 = vld1q_f32(&matA[8]);
+	float32x4_t a3 = vld1q_f32(&matA[12]);
+	for(int col=0; col<4; col++)
+	{
+		const float *b = &matB[col*4];
+		float b0 = b[0], b1 = b[1], b2 = b[2], b3 = b[3];
+		float32x4_t r = vmulq_n_f32(a0, b0);
+		r = vmlaq_n_f32(r, a1, b1);
+		r = vmlaq_n_f32(r, a2, b2);
+		r = vmlaq_n_f32(r, a3, b3);
+		vst1q_f32(&result[col*4], r);
+	}
+#else
+	matNf_mult_matNf_new(result, matA, matB, 4);
+#endif
+}
+
+#ifdef VECMAT_SSE
+/** Shuffles elements from two vectors: returns (a[i], a[j], b[k], b[l]). */
+#define VECMAT_SHUFFLE(a, b, i, j, k, l) _mm_shuffle_ps(a, b, _MM_SHUFFLE(l, k, j, i))
+#endif
+
+/** Inverts a 4x4 float matrix. Equivalent to mat4f_invert_new_scalar().
+
+    @param out Location to store the inverted matrix (can be the same as m).
+    @param m The matrix to invert.
+    @return Returns 1 if the matrix was inverted. Returns 0 if the
+    matrix can't be inverted (a message is printed and out is left
+    unchanged).
+*/
+int mat4f_invert_simd(float out[16], const float m[16])
+{
+#if defined(VECMAT_SSE)
+	/* Like mat4f_invert_new_scalar(), we treat the columns as rows
+	 * because (A^T)^-1 == (A^-1)^T. a_ij is the value at row i and
+	 * column j. The inverse is the adjugate (calculated from the 2x2
+	 * determinants of the top two rows and the bottom two rows)
+	 * divided by the determinant. */
+	__m128 r0 = _mm_loadu_ps(&m[0]);
+	__m128 r1 = _mm_loadu_ps(&m[4]);
+	__m128 r2 = _mm_loadu_ps(&m[8]);
+	__m128 r3 = _mm_loadu_ps(&m[12]);
+
+	/* 2x2 determinants: s0-s5 from rows 0 and 1, c0-c5 from rows 2 and 3 */
+	// (s0, s1, s2, s3)
+	__m128 s0123 = _mm_sub_ps(_mm_mul_ps(VECMAT_SHUFFLE(r0, r0, 0,0,0,1), VECMAT_SHUFFLE(r1, r1, 1,2,3,2)),
+	                          _mm_mul_ps(VECMAT_SHUFFLE(r1, r1, 0,0,0,1), VECMAT_SHUFFLE(r0, r0, 1,2,3,2)));
+	// (s4, s5, c0, c1)
+	__m128 s45c01 = _mm_sub_ps(_mm_mul_ps(VECMAT_SHUFFLE(r0, r2, 1,2,0,0), VECMAT_SHUFFLE(r1, r3, 3,3,1,2)),
+	                           _mm_mul_ps(VECMAT_SHUFFLE(r1, r3, 1,2,0,0), VECMAT_SHUFFLE(r0, r2, 3,3,1,2)));
+	// (c2, c3, c4, c5)
+	__m128 c2345 = _mm_sub_ps(_mm_mul_ps(VECMAT_SHUFFLE(r2, r2, 0,1,1,2), VECMAT_SHUFFLE(r3, r3, 3,2,3,3)),
+	                          _mm_mul_ps(VECMAT_SHUFFLE(r3, r3, 0,1,1,2), VECMAT_SHUFFLE(r2, r2, 3,2,3,3)));
+
+	/* (cN, cN, sN, sN) */
+	__m128 k5 = VECMAT_SHUFFLE(c2345,  s45c01, 3,3,1,1);
+	__m128 k4 = VECMAT_SHUFFLE(c2345,  s45c01, 2,2,0,0);
+	__m128 k3 = VECMAT_SHUFFLE(c2345,  s0123,  1,1,3,3);
+	__m128 k2 = VECMAT_SHUFFLE(c2345,  s0123,  0,0,2,2);
+	__m128 k1 = VECMAT_SHUFFLE(s45c01, s0123,  3,3,1,1);
+	__m128 k0 = VECMAT_SHUFFLE(s45c01, s0123,  2,2,0,0);
+
+	/* vN = (a1N, a0N, a3N, a2N) */
+	__m128 t0 = r0, t1 = r1, t2 = r2, t3 = r3;
+	_MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+	__m128 v0 = VECMAT_SHUFFLE(t0, t0, 1,0,3,2);
+	__m128 v1 = VECMAT_SHUFFLE(t1, t1, 1,0,3,2);
+	__m128 v2 = VECMAT_SHUFFLE(t2, t2, 1,0,3,2);
+	__m128 v3 = VECMAT_SHUFFLE(t3, t3, 1,0,3,2);
+
+	const __m128 signA = _mm_setr_ps( 0.0f, -0.0f,  0.0f, -0.0f);
+	const __m128 signB = _mm_setr_ps(-0.0f,  0.0f, -0.0f,  0.0f);
+	__m128 o0 = _mm_xor_ps(signA, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(v1, k5), _mm_mul_ps(v2, k4)), _mm_mul_ps(v3, k3)));
+	__m128 o1 = _mm_xor_ps(signB, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, k5), _mm_mul_ps(v2, k2)), _mm_mul_ps(v3, k1)));
+	__m128 o2 = _mm_xor_ps(signA, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, k4), _mm_mul_ps(v1, k2)), _mm_mul_ps(v3, k0)));
+	__m128 o3 = _mm_xor_ps(signB, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(v0, k3), _mm_mul_ps(v1, k1)), _mm_mul_ps(v2, k0)));
+
+	/* Determinant: first row of the matrix times the first column of
+	 * the adjugate. */
+	__m128 col0 = _mm_movelh_ps(_mm_unpacklo_ps(o0, o1), _mm_unpacklo_ps(o2, o3));
+	__m128 d = _mm_mul_ps(r0, col0);
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2,3,0,1)));
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1,0,3,2)));
+	float det = _mm_cvtss_f32(d);
+	if(det == 0)
+		return mat4f_invert_new_scalar(out, m); // prints the error message
+
+	__m128 invDet = _mm_set1_ps(1.0f / det);
+	_mm_storeu_ps(&out[0],  _mm_mul_ps(o0, invDet));
+	_mm_storeu_ps(&out[4],  _mm_mul_ps(o1, invDet));
+	_mm_storeu_ps(&out[8],  _mm_mul_ps(o2, invDet));
+	_mm_storeu_ps(&out[12], _mm_mul_ps(o3, invDet));
+	return 1;
+#else
+	return mat4f_invert_new_scalar(out, m);
+#endif
+}
+
+/** Spherical linear interpolation of unit quaternions. Equivalent to
+    quatf_slerp_new_scalar().
+
+    @param result The interpolated quaternion.
+    @param start The starting quaternion.
+    @param end The ending quaternion.
+    @param t As t goes from 0 to 1, the result goes from start to end
+    along the shorter path between them.
+*/
+void quatf_slerp_simd(float result[4], const float start[4], const float end[4], float t)
+{
+#if defined(VECMAT_SSE)
+	__m128 s = _mm_loadu_ps(start);
+	__m128 e = _mm_loadu_ps(end);
+	__m128 d = _mm_mul_ps(s, e);
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2,3,0,1)));
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1,0,3,2)));
+	float cosOmega = _mm_cvtss_f32(d);
+
+	/* Take the shorter path */
+	if(cosOmega < 0)
+	{
+		cosOmega = -cosOmega;
+		s = _mm_xor_ps(s, _mm_set1_ps(-0.0f));
+	}
+
+	if(1+cosOmega <= 1e-10)
+	{
+		/* The quaternions are opposite each other; the scalar
+		 * version handles this rare case. */
+		quatf_slerp_new_scalar(result, start, end, t);
+		return;
+	}
+
+	float startScale, endScale;
+	if(1-cosOmega > 1e-10)
+	{
+		/* sin(acos(x)) == sqrt(1-x*x), which saves one of the three
+		 * calls to sinf() in the scalar version. */
+		float omega = acosf(cosOmega);
+		float invSinOmega = 1.0f / sqrtf((1.0f-cosOmega)*(1.0f+cosOmega));
+		startScale = sinf((1.0f-t)*omega) * invSinOmega;
+		endScale = sinf(t*omega) * invSinOmega;
+	}
+	else
+	{
+		startScale = 1.0f-t;
+		endScale = t;
+	}
+	__m128 r = _mm_add_ps(_mm_mul_ps(s, _mm_set1_ps(startScale)),
+	                      _mm_mul_ps(e, _mm_set1_ps(endScale)));
+	_mm_storeu_ps(result, r);
+#else
+	quatf_slerp_new_scalar(result, start, end, t);
+#endif
+}
+
+/** Creates a 4x4 rotation matrix from a quaternion (x,y,z,w). The
+    quaternion does not need to be unit length. Equivalent to
+    mat3f_rotateQuatVec_new() followed by mat4f_from_mat3f().
+
+    @param matrix The location to store the output matrix.
+    @param quat The input quaternion.
+*/
+void mat4f_rotateQuatVec_simd(float matrix[16], const float quat[4])
+{
+#if defined(VECMAT_SSE)
+	__m128 q = _mm_loadu_ps(quat);
+	__m128 d = _mm_mul_ps(q, q);
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2,3,0,1)));
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1,0,3,2)));
+	__m128 qs = _mm_mul_ps(q, _mm_div_ps(_mm_set1_ps(2.0f), d)); // (xs, ys, zs, ws)
+
+	/* (xx, xy, xz, yy) and (yz, zz, wx, wy) */
+	float p[8];
+	_mm_storeu_ps(&p[0], _mm_mul_ps(VECMAT_SHUFFLE(q, q, 0,0,0,1), VECMAT_SHUFFLE(qs, qs, 0,1,2,1)));
+	_mm_storeu_ps(&p[4], _mm_mul_ps(VECMAT_SHUFFLE(q, q, 1,2,3,3), VECMAT_SHUFFLE(qs, qs, 2,2,0,1)));
+	float xx = p[0], xy = p[1], xz = p[2], yy = p[3];
+	float yz = p[4], zz = p[5], wx = p[6], wy = p[7];
+	float wz = quat[3] * _mm_cvtss_f32(_mm_shuffle_ps(qs, qs, 0xaa));
+
+	_mm_storeu_ps(&matrix[0],  _mm_setr_ps(1.0f - (yy + zz), xy + wz, xz - wy, 0.0f));
+	_mm_storeu_ps(&matrix[4],  _mm_setr_ps(xy - wz, 1.0f - (xx + zz), yz + wx, 0.0f));
+	_mm_storeu_ps(&matrix[8],  _mm_setr_ps(xz + wy, yz - wx, 1.0f - (xx + yy), 0.0f));
+	_mm_storeu_ps(&matrix[12], _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f));
+#else
+	float tmpMat[9];
+	mat3f_rotateQuatVec_new(tmpMat, quat);
+	mat4f_from_mat3f(matrix, tmpMat);
+#endif
+}
@@ -399,7 +399,23 @@ void mat3d_mult_mat3d_many(double out[9], const double *in, ...)
 
 
 
-/** Inverts a 4x4 float matrix.
+/** Inverts a 4x4 float matrix. Uses mat4f_invert_simd() when SIMD
+ * instructions are available.
+ *
+ * @param out Location to store the inverted matrix.
+ * @param m The matrix to invert.
+ * @return Returns 1 if the matrix was inverted. Returns 0 if an error occurred. When an error occurs, a message is also printed out to standard out and the output matrix is left unchanged.
+ */
+int mat4f_invert_new(float out[16], const float m[16])
+{
+#ifdef VECMAT_SIMD
+	return mat4f_invert_simd(out, m);
+#else
+	return mat4f_invert_new_scalar(out, m);
+#endif
+}
+
+/** Inverts a 4x4 float matrix without using SIMD instructions.
  *
  * This works regardless of if we are treating the data as row major
  * or column major order because: (A^T)^-1 == (A^-1)^T
@@ -408,7 +424,7 @@ void mat3d_mult_mat3d_many(double out[9], const double *in, ...)
  * @param m The matrix to invert.
  * @return Returns 1 if the matrix was inverted. Returns 0 if an error occurred. When an error occurs, a message is also printed out to standard out and the output matrix is left unchanged.
  */
-int mat4f_invert_new(float out[16], const float m[16])
+int mat4f_invert_new_scalar(float out[16], const float m[16])
 {
 	float inv[16], det;
 	inv[0] =   m[5]*m[10]*m[15] - m[5]*m[11]*m[14] - m[9]*m[6]*m[15] + m[9]*m[7]*m[14] + m[13]*m[6]*m[11] - m[13]*m[7]*m[10];
@@ -1235,9 +1251,13 @@ void mat3d_rotateQuatVec_new(double matrix[9], const double quat[4])
  * full documentation, see mat4f_rotateQuatVec_new() */
 void mat4f_rotateQuatVec_new(float matrix[16], const float quat[4])
 {
+#ifdef VECMAT_SIMD
+	mat4f_rotateQuatVec_simd(matrix, quat);
+#else
 	float tmpMat[9];
 	mat3f_rotateQuatVec_new(tmpMat, quat);
 	mat4f_from_mat3f(matrix, tmpMat);
+#endif
 }
 /** Creates a 4x4 rotation matrix from a quaternion (x,y,z,w). For
  * full documentation, see mat4f_rotateQuatVec_new() */
@@ -1469,6 +1489,93 @@ void quatd_rotateAxisVec_new(double quat[4], double degrees, const double axis[3
 	quatd_rotateAxis_new(quat, degrees, axis[0], axis[1], axis[2]);
 }
 
+/** Multiplies two quaternions (x,y,z,w): result = a * b. The
+    resulting rotation is the same as rotating by b and then by a.
+
+    @param result The location to store the product. It may point to a or b.
+    @param a The quaternion on the left.
+    @param b The quaternion on the right.
+*/
+void quatf_mult_quatf_new(float result[4], const float a[4], const float b[4])
+{
+	float r[4];
+	r[0] = a[3]*b[0] + b[3]*a[0] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] + b[3]*a[1] + a[2]*b[0] - a[0]*b[2];
+	r[2] = a[3]*b[2] + b[3]*a[2] + a[0]*b[1] - a[1]*b[0];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4f_copy(result, r);
+}
+
+/** Multiplies two quaternions (x,y,z,w). See quatf_mult_quatf_new(). */
+void quatd_mult_quatd_new(double result[4], const double a[4], const double b[4])
+{
+	double r[4];
+	r[0] = a[3]*b[0] + b[3]*a[0] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] + b[3]*a[1] + a[2]*b[0] - a[0]*b[2];
+	r[2] = a[3]*b[2] + b[3]*a[2] + a[0]*b[1] - a[1]*b[0];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4d_copy(result, r);
+}
+
+/** Converts a unit quaternion (x,y,z,w) into a rotation vector (the
+    axis of rotation scaled by the angle in radians). The shorter of
+    the two rotations that the quaternion represents is used, so the
+    angle is never more than pi. Rotation vectors can be added, scaled
+    and filtered like any other vector as long as the rotations are
+    small.
+
+    @param rotvec The resulting rotation vector.
+    @param quat The unit quaternion.
+*/
+void quatf_to_rotvec(float rotvec[3], const float quat[4])
+{
+	double q[4] = { quat[0], quat[1], quat[2], quat[3] };
+	double r[3];
+	quatd_to_rotvec(r, q);
+	vec3f_set(rotvec, (float) r[0], (float) r[1], (float) r[2]);
+}
+
+/** Converts a unit quaternion into a rotation vector. See quatf_to_rotvec(). */
+void quatd_to_rotvec(double rotvec[3], const double quat[4])
+{
+	/* q and -q are the same rotation, use the one with w >= 0. */
+	double sign = quat[3] < 0 ? -1 : 1;
+	double sinHalf = vec3d_norm(quat);
+	double w = sign*quat[3];
+	/* For tiny rotations, atan2(s,w)/s approaches 1/w. */
+	double scale = sinHalf < 1e-9 ? 2/w : 2*atan2(sinHalf, w)/sinHalf;
+	vec3d_scalarMult_new(rotvec, quat, sign*scale);
+}
+
+/** Converts a rotation vector (the axis of rotation scaled by the
+    angle in radians) into a unit quaternion (x,y,z,w). This is the
+    inverse of quatf_to_rotvec().
+
+    @param quat The resulting unit quaternion.
+    @param rotvec The rotation vector.
+*/
+void quatf_from_rotvec(float quat[4], const float rotvec[3])
+{
+	double r[3] = { rotvec[0], rotvec[1], rotvec[2] };
+	double q[4];
+	quatd_from_rotvec(q, r);
+	vec4f_set(quat, (float) q[0], (float) q[1], (float) q[2], (float) q[3]);
+}
+
+/** Converts a rotation vector into a unit quaternion. See quatf_from_rotvec(). */
+void quatd_from_rotvec(double quat[4], const double rotvec[3])
+{
+	double angle = vec3d_norm(rotvec);
+	if(angle < 1e-9)
+	{
+		vec4d_set(quat, rotvec[0]/2, rotvec[1]/2, rotvec[2]/2, 1);
+		quatd_normalize(quat);
+		return;
+	}
+	double s = sin(angle/2)/angle;
+	vec4d_set(quat, rotvec[0]*s, rotvec[1]*s, rotvec[2]*s, cos(angle/2));
+}
+
 
 /** Spherical linear interpolation of unit quaternion.
 
@@ -1484,6 +1591,17 @@ void quatd_rotateAxisVec_new(double quat[4], double degrees, const double axis[3
  (the vector may be negated in the end).
  */
 void quatf_slerp_new(float result[4], const float start[4], const float end[4], float t)
+{
+#ifdef VECMAT_SIMD
+	quatf_slerp_simd(result, start, end, t);
+#else
+	quatf_slerp_new_scalar(result, start, end, t);
+#endif
+}
+
+/** Spherical linear interpolation of unit quaternions without using
+ * SIMD instructions. See quatf_slerp_new(). */
+void quatf_slerp_new_scalar(float result[4], const float start[4], const float end[4], float t)
 {
 	float copyOfStart[4];
 	vec4f_copy(copyOfStart, start);
@@ -1502,7 +1620,7 @@ void quatf_slerp_new(float result[4], const float start[4], const float end[4],
 		{
 			float omega = acosf(cosOmega);
 			float sinOmega = sinf(omega);
-			startScale = sinf((1.0f-t)*omega / sinOmega);
+			startScale = sinf((1.0f-t)*omega)/sinOmega;
 			endScale = sinf(t*omega)/sinOmega;
 		}
 		else
@@ -1560,7 +1678,7 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 		{
 			double omega = acos(cosOmega);
 			double sinOmega = sin(omega);
-			startScale = sin((1.0-t)*omega / sinOmega);
+			startScale = sin((1.0-t)*omega)/sinOmega;
 			endScale = sin(t*omega)/sinOmega;
 		}
 		else
@@ -2039,88 +2157,45 @@ void mat4d_lookat_new(double result[16], double camPosX, double camPosY, double
 }
 
 
-/** Pushes a copy of a matrix currently on top of the stack onto the
-    top of the stack. A list structure is used to represent the stack.
-
-    @param l A list structure to store the stack.
-
-    @param m The matrix to multiply against the top matrix on the
-    stack and then push the result onto the stack.
-
-    @return If l is NULL, a newly allocated stack that should
-    eventually be free()'d with list_free(). Otherwise, the same value
-    as l.
- */
-void mat4f_stack_push(list *l)
+/** Called when too many matrices are pushed onto a mat4f_stack. */
+void mat4f_stack_overflow(void)
 {
-	float peek[16];
-
-	if(l->length == 0)
-	{
-		/* Push an identity matrix if the stack is empty */
-		mat4f_identity(peek);
-		list_push(l, peek);
-	}
-	else
-	{
-		/* Get the top matrix on the stack or use the identity if the
-		 * stack is empty */
-		list_peek(l, peek);
-
-		if(list_push(l, peek) == 0)
-		{
-			msg(MSG_FATAL, "Failed to push a matrix onto the stack");
-			exit(EXIT_FAILURE);
-		}
-	}
+	msg(MSG_FATAL, "Failed to push a matrix onto the stack: it already contains %d matrices (see MAT4F_STACK_DEPTH).", MAT4F_STACK_DEPTH);
+	exit(EXIT_FAILURE);
 }
 
-/** Pop a matrix from the top of the stack. Similar to OpenGL 2.0
-    glPopMatrix().
+/** Returns the normal matrix for the top matrix on the stack: the
+    inverse transpose of the upper 3x3 part of the matrix. It is used
+    to transform normals when the matrix contains non-uniform scaling.
+    The result is cached until the top matrix changes.
 
-    @param l The stack to pop from.
- */
-void mat4f_stack_pop(list *l)
-{
-	if(l == NULL || l->length == 0)
-		return;
-	list_pop(l, NULL);
-}
-
-/** Retrieve a copy of the top matrix from the stack without changing
-    the contents of the stack.
-
-    @param l The stack to retrieve the top matrix from.
-    
-    @param m The location to copy the top matrix into.
- */
-void mat4f_stack_peek(const list *l, float m[16])
-{
-	if(list_peek(l, m) == 0)
-		mat4f_identity(m);
-}
+    @param s The stack.
 
-
-/** Multiplies the top matrix on the stack with the given matrix. A
-    list structure is used to represent the stack. If the stack is
-    empty, the matrix will instead be pushed onto the stack.
-
-    @param l The stack that the matrix should be applied to.
-
-    @param m The matrix to be multiplied against the top matrix on the
-    stack.
-    
-    @return If l is NULL, a newly allocated stack that should
-    eventually be free()'d with list_free(). Otherwise, the same value
-    as l.
- */
-void mat4f_stack_mult(list *l, float m[16])
+    @return A pointer to the 3x3 normal matrix. It is valid until the
+    stack is changed. If the matrix can't be inverted, the identity
+    matrix is returned.
+*/
+const float* mat4f_stack_normal(mat4f_stack *s)
 {
-	if(l->length == 0)
-		list_push(l, m);
+	int t = s->top;
+	if(s->normalValid[t])
+		return s->normal[t];
+
+	/* The columns of the inverse transpose of a 3x3 matrix with
+	 * columns a, b and c are b x c, c x a and a x b divided by the
+	 * determinant. */
+	const float *m = s->m[t];
+	const float *a = &m[0], *b = &m[4], *c = &m[8];
+	float *n = s->normal[t];
+	vec3f_cross_new(&n[0], b, c);
+	vec3f_cross_new(&n[3], c, a);
+	vec3f_cross_new(&n[6], a, b);
+	float det = vec3f_dot(a, &n[0]);
+	if(det == 0)
+		mat3f_identity(n);
 	else
-	{
-		float *top = (float*) list_getptr(l, l->length-1);
-		mat4f_mult_mat4f_new(top, top, m);
-	}
+		for(int i=0; i<9; i++)
+			n[i] /= det;
+	s->normalValid[t] = 1;
+	return n;
 }
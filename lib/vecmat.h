@@ -48,6 +48,32 @@ extern "C" {
 #define inline
 #endif
 
+/* Use the SSE/AVX/NEON versions of the most common 4x4 float matrix
+ * and quaternion functions when the compiler targets one of them (see
+ * vecmat-simd.c). Define VECMAT_NO_SIMD to always use the scalar
+ * versions. */
+#if !defined(VECMAT_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#define VECMAT_SIMD 1
+#define VECMAT_SSE 1
+#include <emmintrin.h>
+#ifdef __AVX__
+#define VECMAT_AVX 1
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VECMAT_SIMD 1
+#define VECMAT_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+const char* vecmat_simd_name(void);
+void mat4f_mult_mat4f_simd(float result[16], const float matA[16], const float matB[16]);
+int mat4f_invert_simd(float out[16], const float m[16]);
+void quatf_slerp_simd(float result[4], const float start[4], const float end[4], float t);
+void mat4f_rotateQuatVec_simd(float matrix[16], const float quat[4]);
+
 /** Set the values in a 3-component float vector */
 static inline void vec3f_set(float  v[3], float  a, float  b, float  c)
 { v[0]=a; v[1]=b; v[2]=c; }
@@ -1181,7 +1207,11 @@ static inline void mat3f_mult_mat3f_new(float  result[9], const float  matA[ 9],
 static inline void mat3d_mult_mat3d_new(double result[9], const double matA[ 9], const double matB[9])
 { matNd_mult_matNd_new(result, matA, matB, 3); }
 static inline void mat4f_mult_mat4f_new(float  result[16], const float  matA[16], const float  matB[16])
+#ifdef VECMAT_SIMD
+{ mat4f_mult_mat4f_simd(result, matA, matB); }
+#else
 { matNf_mult_matNf_new(result, matA, matB, 4); }
+#endif
 static inline void mat4d_mult_mat4d_new(double result[16], const double matA[16], const double matB[16])
 { matNd_mult_matNd_new(result, matA, matB, 4); }
 
@@ -1230,12 +1260,46 @@ static inline void matNd_mult_vecNd_new(double result[], const double m[], const
 	}
 	vecNd_copy(result, tmp, n);
 }
+/** Multiplies a column vector by a 4x4 matrix (i.e., m * v) with
+    SIMD instructions if they are available. Equivalent to
+    matNf_mult_vecNf_new(result, m, v, 4). This function is short
+    enough that it is faster to inline it than to call it, unlike the
+    other SIMD functions in vecmat-simd.c.
+
+    @param result The resulting vector (can be the same as v).
+    @param m The matrix.
+    @param v The vector.
+*/
+static inline void mat4f_mult_vec4f_simd(float result[4], const float m[16], const float v[4])
+{
+#if defined(VECMAT_SSE)
+	__m128 vec = _mm_loadu_ps(v);
+	__m128 r = _mm_mul_ps(_mm_loadu_ps(&m[0]), _mm_shuffle_ps(vec, vec, 0x00));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[4]),  _mm_shuffle_ps(vec, vec, 0x55)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[8]),  _mm_shuffle_ps(vec, vec, 0xaa)));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[12]), _mm_shuffle_ps(vec, vec, 0xff)));
+	_mm_storeu_ps(result, r);
+#elif defined(VECMAT_NEON)
+	float v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+	float32x4_t r = vmulq_n_f32(vld1q_f32(&m[0]), v0);
+	r = vmlaq_n_f32(r, vld1q_f32(&m[4]),  v1);
+	r = vmlaq_n_f32(r, vld1q_f32(&m[8]),  v2);
+	r = vmlaq_n_f32(r, vld1q_f32(&m[12]), v3);
+	vst1q_f32(result, r);
+#else
+	matNf_mult_vecNf_new(result, m, v, 4);
+#endif
+}
 static inline void mat3f_mult_vec3f_new(float result[3], const float m[9], const float v[3])
 { matNf_mult_vecNf_new(result, m, v, 3); }
 static inline void mat3d_mult_vec3d_new(double result[3], const double m[9], const double v[3])
 { matNd_mult_vecNd_new(result, m, v, 3); }
 static inline void mat4f_mult_vec4f_new(float result[4], const float m[16], const float v[4])
+#ifdef VECMAT_SIMD
+{ mat4f_mult_vec4f_simd(result, m, v); }
+#else
 { matNf_mult_vecNf_new(result, m, v, 4); }
+#endif
 static inline void mat4d_mult_vec4d_new(double result[4], const double m[16], const double v[4])
 { matNd_mult_vecNd_new(result, m, v, 4); }
 
@@ -1679,6 +1743,7 @@ void mat3d_mult_mat3d_many(double out[9],  const double *in, ...);
  * left unchanged.
  */
 int mat4f_invert_new(float  dest[16], const float  src[16]);
+int mat4f_invert_new_scalar(float dest[16], const float src[16]);
 int mat4d_invert_new(double dest[16], const double src[16]);
 int mat3f_invert_new(float  dest[ 9], const float  src[9]);
 int mat3d_invert_new(double dest[ 9], const double src[9]);
@@ -1738,8 +1803,17 @@ void quatd_rotateAxis_new(double quat[4], double degrees, double x, double y, do
 void quatf_rotateAxisVec_new(float quat[4], float degrees, const float axis[3]);
 void quatd_rotateAxisVec_new(double quat[4], double degrees, const double axis[3]);
 
+/* Multiply quaternions and convert them to and from rotation vectors */
+void quatf_mult_quatf_new(float  result[4], const float  a[4], const float  b[4]);
+void quatd_mult_quatd_new(double result[4], const double a[4], const double b[4]);
+void quatf_to_rotvec(float  rotvec[3], const float  quat[4]);
+void quatd_to_rotvec(double rotvec[3], const double quat[4]);
+void quatf_from_rotvec(float  quat[4], const float  rotvec[3]);
+void quatd_from_rotvec(double quat[4], const double rotvec[3]);
+
 /* Spherical linear interpolation of quaternions. */
 void quatf_slerp_new(float  result[4], const float  start[4], const float  end[4], float  t);
+void quatf_slerp_new_scalar(float result[4], const float start[4], const float end[4], float t);
 void quatd_slerp_new(double result[4], const double start[4], const double end[4], double t);
 
 /* Create a new translation matrix (rotation part set to
@@ -1776,10 +1850,111 @@ void mat4d_lookatVec_new(double result[16], const double camPos[3], const double
 
 
 /* Matrix stack implementation */
-void mat4f_stack_push(list *l);
-void mat4f_stack_mult(list *l, float m[16]);
-void mat4f_stack_pop(list *l);
-void mat4f_stack_peek(const list *l, float m[16]);
+
+/** Maximum number of matrices on a mat4f_stack. Define it before
+ * including vecmat.h to change it. */
+#ifndef MAT4F_STACK_DEPTH
+#define MAT4F_STACK_DEPTH 32
+#endif
+
+#if defined(_MSC_VER)
+#define VECMAT_ALIGN(n) __declspec(align(n))
+#else
+#define VECMAT_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+/** A stack of 4x4 float matrices, similar to the OpenGL 2.0 matrix
+    stack. The stack is a fixed-size array (usually declared as a
+    local variable), so pushing and popping never allocates memory
+    and only copies one matrix. Each matrix starts on a cache line.
+
+    The stack always contains at least one matrix. Initialize it with
+    mat4f_stack_init(), which sets the only matrix to the identity.
+
+    The normal matrix (the inverse transpose of the upper 3x3 part of
+    the top matrix) is cached for every level of the stack by
+    mat4f_stack_normal(), so it is only recalculated after the
+    matrix at that level changes.
+*/
+typedef struct
+{
+	VECMAT_ALIGN(64) float m[MAT4F_STACK_DEPTH][16];
+	float normal[MAT4F_STACK_DEPTH][9];
+	unsigned char normalValid[MAT4F_STACK_DEPTH];
+	int top; /**< Index of the top matrix */
+} mat4f_stack;
+
+void mat4f_stack_overflow(void);
+
+/** Initializes a stack so that it contains one identity matrix. */
+static inline void mat4f_stack_init(mat4f_stack *s)
+{
+	s->top = 0;
+	mat4f_identity(s->m[0]);
+	s->normalValid[0] = 0;
+}
+
+/** Pushes a copy of the matrix currently on top of the stack onto the
+ * top of the stack. Similar to OpenGL 2.0 glPushMatrix(). Exits if
+ * the stack already contains MAT4F_STACK_DEPTH matrices. */
+static inline void mat4f_stack_push(mat4f_stack *s)
+{
+	if(s->top+1 >= MAT4F_STACK_DEPTH)
+		mat4f_stack_overflow();
+	int t = s->top++;
+	mat4f_copy(s->m[t+1], s->m[t]);
+	if((s->normalValid[t+1] = s->normalValid[t]))
+		mat3f_copy(s->normal[t+1], s->normal[t]);
+}
+
+/** Pops a matrix from the top of the stack. Similar to OpenGL 2.0
+ * glPopMatrix(). Popping the last matrix on the stack sets it to the
+ * identity instead. */
+static inline void mat4f_stack_pop(mat4f_stack *s)
+{
+	if(s->top > 0)
+		s->top--;
+	else
+		mat4f_stack_init(s);
+}
+
+/** Returns a pointer to the top matrix on the stack without copying
+ * it (e.g., to pass it to glUniformMatrix4fv()). The pointer is valid
+ * until the stack is pushed or popped. */
+static inline const float* mat4f_stack_get(const mat4f_stack *s)
+{ return s->m[s->top]; }
+
+/** Returns a pointer to the top matrix on the stack so that it can
+ * be changed in place. The pointer is valid until the stack is pushed
+ * or popped. */
+static inline float* mat4f_stack_top(mat4f_stack *s)
+{
+	s->normalValid[s->top] = 0; // the caller might change the matrix
+	return s->m[s->top];
+}
+
+/** Copies the top matrix on the stack into m without changing the
+ * contents of the stack. */
+static inline void mat4f_stack_peek(const mat4f_stack *s, float m[16])
+{ mat4f_copy(m, s->m[s->top]); }
+
+/** Replaces the top matrix on the stack with m. Similar to OpenGL 2.0
+ * glLoadMatrix(). */
+static inline void mat4f_stack_load(mat4f_stack *s, const float m[16])
+{
+	mat4f_copy(s->m[s->top], m);
+	s->normalValid[s->top] = 0;
+}
+
+/** Multiplies the top matrix on the stack by m (i.e., top = top * m).
+ * Similar to OpenGL 2.0 glMultMatrix(). */
+static inline void mat4f_stack_mult(mat4f_stack *s, const float m[16])
+{
+	mat4f_mult_mat4f_new(s->m[s->top], s->m[s->top], m);
+	s->normalValid[s->top] = 0;
+}
+
+const float* mat4f_stack_normal(mat4f_stack *s);
 
 	
 #ifdef __cplusplus
@@ -30,10 +30,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "kuhl-util.h"
 #include "video.h"
 
+#ifdef HAVE_FFMPEG
+#include <libavutil/pixdesc.h>
+#endif
+
 #ifndef HAVE_FFMPEG
 
 video_state* video_get_next_frame(video_state *state, const char *filename)
@@ -46,6 +55,31 @@ void video_cleanup(video_state *state)
 	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
 	exit(EXIT_FAILURE);
 }
+video_player* video_player_new(const char *filename)
+{
+	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
+	exit(EXIT_FAILURE);
+}
+int video_player_update(video_player *player, int64_t usec)
+{
+	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
+	exit(EXIT_FAILURE);
+}
+void video_player_uniforms(const video_player *player, GLuint program)
+{
+	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
+	exit(EXIT_FAILURE);
+}
+void video_player_print_stats(const video_player *player)
+{
+	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
+	exit(EXIT_FAILURE);
+}
+void video_player_free(video_player *player)
+{
+	msg(MSG_FATAL, "Library is not compiled against FFMpeg. This function won't work.");
+	exit(EXIT_FAILURE);
+}
 
 #else
 
@@ -98,8 +132,9 @@ static int video_decode_packet(video_state *state, int cached)
 
 			/* Convert from whatever colorspace the video is into 8-bit RGB.
 
-			   TODO: It would be significantly more efficient to do
-			   this conversion in a shader program.
+			   video_player avoids this conversion by uploading
+			   the YUV planes and converting them in a shader
+			   program.
 			*/
 			uint8_t *outData[] = { (uint8_t*) state->data };
 			const int destStride[] = {3*state->width};
@@ -308,4 +343,653 @@ video_state* video_get_next_frame(video_state *state, const char *filename)
 	return state;
 }
 
+
+/* ---- video_player ---- */
+
+#define VIDEO_PLAYER_MAX_SLOTS 32
+
+/** States of a pixel buffer object in the video_player ring. Slots
+ * move through the states in order and then start over. */
+enum {
+	VIDEO_SLOT_FREE,   /**< Unmapped and unused (owned by the render thread) */
+	VIDEO_SLOT_MAPPED, /**< Mapped and waiting for the decoder to fill it */
+	VIDEO_SLOT_FILLED, /**< Filled by the decoder, still mapped */
+	VIDEO_SLOT_READY   /**< Unmapped and ready to be copied into the textures */
+};
+
+typedef struct {
+	GLuint pbo;
+	unsigned char *mapped; /**< Mapped pointer while MAPPED or FILLED */
+	int64_t usec;          /**< Presentation time of the frame in the slot */
+	int state;
+} video_slot;
+
+struct video_player_internal
+{
+	AVFormatContext *fmt_ctx;
+	AVCodecContext *dec_ctx;
+	AVStream *stream;
+	int stream_idx;
+	AVFrame *frame;
+	AVPacket *pkt;
+	struct SwsContext *sws_ctx; /**< Converts frames which aren't 8-bit planar YUV into YUV420P, NULL if not needed */
+	struct SwsContext *resize_ctx; /**< Scales frames whose size or format changed after the video was opened */
+	enum AVPixelFormat srcFormat;   /**< Pixel format of the frames when the video was opened */
+	enum AVPixelFormat planeFormat; /**< Pixel format of the planes in each slot */
+
+	int planeWidth[3];     /**< Width (and bytes per row) of each plane */
+	int planeHeight[3];    /**< Height of each plane */
+	size_t planeOffset[3]; /**< Offset of each plane in a slot */
+	size_t slotSize;       /**< Bytes in each pixel buffer object */
+
+	video_slot slots[VIDEO_PLAYER_MAX_SLOTS];
+	int numSlots;
+	int fillIndex;   /**< Next slot the decoder fills (decoder only) */
+	int showIndex;   /**< Oldest slot which hasn't been displayed (render thread only) */
+
+	/* Timing, updated by the decoder */
+	int64_t firstPts;      /**< Timestamp of the first frame since we started or looped */
+	int64_t loopOffset;    /**< Added to the timestamps after looping back to the start */
+	int64_t lastUsec;      /**< Time of the previous decoded frame */
+	int64_t frameUsec;     /**< Expected time between frames */
+	long framesSinceLoop;
+
+	int error;           /**< Set by the decoder if it stops */
+	int errorReported;
+	int changedWidth;    /**< Size of the last frame which didn't match the size the video was opened with, 0 if none */
+	int changedHeight;
+	int changeReported;
+
+#ifdef HAVE_PTHREADS
+	pthread_t thread;
+	int threadRunning;
+	pthread_mutex_t mutex;
+	pthread_cond_t slotMapped; /**< Signaled when a slot is mapped or when the decoder should quit */
+	int quit;
+#endif
+
+	/* Statistics */
+	long framesDecoded;
+	long framesDisplayed;
+	long framesSkipped;  /**< Frames that were decoded but were late and never displayed */
+	long underflows;     /**< Updates where the decoder had no frame ready */
+	long decodeUsec;
+};
+
+static void video_player_lock(struct video_player_internal *v)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&(v->mutex));
+#endif
+}
+
+static void video_player_unlock(struct video_player_internal *v)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&(v->mutex));
+#endif
+}
+
+/* Gets the next decoded frame in v->frame, looping back to the start
+ * of the video at the end. Called by the decoder thread so it must
+ * not call msg() or OpenGL.
+ *
+ * @return 1 if a frame was decoded, 0 on error.
+ */
+static int video_player_receive(struct video_player_internal *v)
+{
+	while(1)
+	{
+		int ret = avcodec_receive_frame(v->dec_ctx, v->frame);
+		if(ret == 0)
+			return 1;
+		if(ret == AVERROR_EOF)
+		{
+			/* Start over, with timestamps continuing after the
+			 * last frame. */
+			if(v->framesSinceLoop == 0)
+				return 0; // no frames in the whole file
+			v->loopOffset = v->lastUsec + v->frameUsec;
+			v->firstPts = AV_NOPTS_VALUE;
+			v->framesSinceLoop = 0;
+			if(av_seek_frame(v->fmt_ctx, v->stream_idx, 0, AVSEEK_FLAG_BACKWARD) < 0)
+				return 0;
+			avcodec_flush_buffers(v->dec_ctx);
+			continue;
+		}
+		if(ret != AVERROR(EAGAIN))
+			return 0;
+
+		/* The decoder needs another packet. */
+		if(av_read_frame(v->fmt_ctx, v->pkt) < 0)
+		{
+			avcodec_send_packet(v->dec_ctx, NULL); // end of file, drain the decoder
+			continue;
+		}
+		if(v->pkt->stream_index == v->stream_idx)
+			avcodec_send_packet(v->dec_ctx, v->pkt); // skip packets the decoder rejects
+		av_packet_unref(v->pkt);
+	}
+}
+
+/* Decodes the next frame and copies its planes into a mapped pixel
+ * buffer object. Called by the decoder thread.
+ *
+ * @return 1 on success, 0 on error.
+ */
+static int video_player_fill(struct video_player_internal *v, video_slot *slot)
+{
+	long start = kuhl_microseconds();
+	if(video_player_receive(v) == 0)
+		return 0;
+
+	uint8_t *dst[3];
+	int dstStride[3];
+	for(int p=0; p<3; p++)
+	{
+		dst[p] = slot->mapped + v->planeOffset[p];
+		dstStride[p] = v->planeWidth[p];
+	}
+
+	AVFrame *f = v->frame;
+	if(f->width != v->planeWidth[0] || f->height != v->planeHeight[0] || f->format != v->srcFormat)
+	{
+		/* The stream changed size (or format) after it was opened.
+		 * The textures and pixel buffers keep their size, so scale
+		 * the frame to fit them. */
+		if(f->width != v->planeWidth[0] || f->height != v->planeHeight[0])
+		{
+			video_player_lock(v);
+			v->changedWidth = f->width;
+			v->changedHeight = f->height;
+			video_player_unlock(v);
+		}
+		v->resize_ctx = sws_getCachedContext(v->resize_ctx, f->width, f->height, (enum AVPixelFormat) f->format,
+		                                     v->planeWidth[0], v->planeHeight[0], v->planeFormat,
+		                                     SWS_BILINEAR, NULL, NULL, NULL);
+		if(v->resize_ctx == NULL)
+		{
+			av_frame_unref(f);
+			return 0;
+		}
+		sws_scale(v->resize_ctx, (const uint8_t* const*) f->data, f->linesize, 0, f->height, dst, dstStride);
+	}
+	else if(v->sws_ctx)
+		sws_scale(v->sws_ctx, (const uint8_t* const*) f->data, f->linesize, 0, f->height, dst, dstStride);
+	else
+	{
+		for(int p=0; p<3; p++)
+			for(int y=0; y<v->planeHeight[p]; y++)
+				memcpy(dst[p] + (size_t)y*dstStride[p], f->data[p] + (size_t)y*f->linesize[p], dstStride[p]);
+	}
+
+	/* Calculate the time the frame should be displayed relative to
+	 * the start of the video. */
+	int64_t pts = f->best_effort_timestamp;
+	if(pts != AV_NOPTS_VALUE && v->firstPts == AV_NOPTS_VALUE)
+		v->firstPts = pts;
+	if(pts != AV_NOPTS_VALUE)
+		slot->usec = v->loopOffset + av_rescale_q(pts - v->firstPts, v->stream->time_base, AV_TIME_BASE_Q);
+	else if(v->framesDecoded == 0)
+		slot->usec = 0;
+	else
+		slot->usec = v->lastUsec + v->frameUsec;
+	v->lastUsec = slot->usec;
+	v->framesSinceLoop++;
+	av_frame_unref(f);
+
+	video_player_lock(v);
+	v->framesDecoded++;
+	v->decodeUsec += kuhl_microseconds() - start;
+	video_player_unlock(v);
+	return 1;
+}
+
+#ifdef HAVE_PTHREADS
+static void* video_player_thread(void *arg)
+{
+	struct video_player_internal *v = (struct video_player_internal*) arg;
+	while(1)
+	{
+		pthread_mutex_lock(&(v->mutex));
+		video_slot *slot = &(v->slots[v->fillIndex]);
+		while(v->quit == 0 && slot->state != VIDEO_SLOT_MAPPED)
+			pthread_cond_wait(&(v->slotMapped), &(v->mutex));
+		if(v->quit)
+		{
+			pthread_mutex_unlock(&(v->mutex));
+			break;
+		}
+		pthread_mutex_unlock(&(v->mutex));
+
+		int ok = video_player_fill(v, slot);
+
+		pthread_mutex_lock(&(v->mutex));
+		if(ok)
+			slot->state = VIDEO_SLOT_FILLED;
+		else
+			v->error = 1;
+		pthread_mutex_unlock(&(v->mutex));
+		if(!ok)
+			break;
+		v->fillIndex = (v->fillIndex+1) % v->numSlots;
+	}
+	return NULL;
+}
+#endif
+
+/* Sets yuvMatrix and yuvOffset from the colorspace of the video. */
+static void video_player_colorspace(video_player *player, const AVCodecContext *dec_ctx)
+{
+	int fullRange = dec_ctx->color_range == AVCOL_RANGE_JPEG ||
+		dec_ctx->pix_fmt == AV_PIX_FMT_YUVJ420P ||
+		dec_ctx->pix_fmt == AV_PIX_FMT_YUVJ422P ||
+		dec_ctx->pix_fmt == AV_PIX_FMT_YUVJ444P;
+	/* Assume HD video is BT.709 and SD video is BT.601 if the file
+	 * doesn't say. */
+	int bt709 = dec_ctx->colorspace == AVCOL_SPC_BT709 ||
+		(dec_ctx->colorspace == AVCOL_SPC_UNSPECIFIED && dec_ctx->height >= 720);
+
+	float kr = bt709 ? 0.2126f : 0.299f;
+	float kb = bt709 ? 0.0722f : 0.114f;
+	float kg = 1 - kr - kb;
+	float ys = fullRange ? 1.0f : 255/219.0f; // scale luma
+	float cs = fullRange ? 1.0f : 255/224.0f; // scale chroma
+
+	/* Column 0: Y, column 1: U (Cb), column 2: V (Cr) */
+	float m[9] = { ys, ys, ys,
+	               0, -cs*2*(1-kb)*kb/kg, cs*2*(1-kb),
+	               cs*2*(1-kr), -cs*2*(1-kr)*kr/kg, 0 };
+	memcpy(player->yuvMatrix, m, sizeof(m));
+	player->yuvOffset[0] = fullRange ? 0 : 16/255.0f;
+	player->yuvOffset[1] = 128/255.0f;
+	player->yuvOffset[2] = 128/255.0f;
+}
+
+/* Opens the video file and decoder. Returns 0 on failure. */
+static int video_player_open(video_player *player)
+{
+	struct video_player_internal *v = player->internal;
+	const char *filename = player->filename;
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+	av_register_all();
+#endif
+
+	if(avformat_open_input(&(v->fmt_ctx), filename, NULL, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Could not open source file '%s'", filename);
+		return 0;
+	}
+	if(avformat_find_stream_info(v->fmt_ctx, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Could not find stream information in '%s'", filename);
+		return 0;
+	}
+	v->stream_idx = av_find_best_stream(v->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if(v->stream_idx < 0)
+	{
+		msg(MSG_ERROR, "Could not find video stream in input for '%s'", filename);
+		return 0;
+	}
+	v->stream = v->fmt_ctx->streams[v->stream_idx];
+
+	const AVCodec *dec = avcodec_find_decoder(v->stream->codecpar->codec_id);
+	if(dec == NULL)
+	{
+		msg(MSG_ERROR, "Failed to find codec for '%s'", filename);
+		return 0;
+	}
+	v->dec_ctx = avcodec_alloc_context3(dec);
+	if(v->dec_ctx == NULL ||
+	   avcodec_parameters_to_context(v->dec_ctx, v->stream->codecpar) < 0)
+	{
+		msg(MSG_ERROR, "Failed to set up decoder for '%s'", filename);
+		return 0;
+	}
+	v->dec_ctx->thread_count = 0; // let the decoder choose
+	if(avcodec_open2(v->dec_ctx, dec, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Failed to open codec for '%s'", filename);
+		return 0;
+	}
+	av_dump_format(v->fmt_ctx, 0, filename, 0);
+
+	player->width = v->dec_ctx->width;
+	player->height = v->dec_ctx->height;
+	player->aspectRatio = player->width/(float)player->height;
+
+	/* 8-bit planar YUV is copied directly. Anything else is
+	 * converted to YUV420P on the decoder thread. */
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(v->dec_ctx->pix_fmt);
+	int chromaShiftW = 1, chromaShiftH = 1;
+	v->srcFormat = v->dec_ctx->pix_fmt;
+	v->planeFormat = AV_PIX_FMT_YUV420P;
+	if(desc != NULL && desc->nb_components == 3 &&
+	   (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+	   desc->comp[0].depth == 8 && desc->comp[1].plane == 1 && desc->comp[2].plane == 2)
+	{
+		chromaShiftW = desc->log2_chroma_w;
+		chromaShiftH = desc->log2_chroma_h;
+		v->planeFormat = v->dec_ctx->pix_fmt;
+	}
+	else
+	{
+		msg(MSG_INFO, "Video '%s' is %s, converting it to yuv420p while decoding.", filename,
+		    av_get_pix_fmt_name(v->dec_ctx->pix_fmt));
+		v->sws_ctx = sws_getContext(player->width, player->height, v->dec_ctx->pix_fmt,
+		                            player->width, player->height, AV_PIX_FMT_YUV420P,
+		                            SWS_BILINEAR, NULL, NULL, NULL);
+		if(v->sws_ctx == NULL)
+		{
+			msg(MSG_ERROR, "Unable to convert video '%s' to yuv420p", filename);
+			return 0;
+		}
+	}
+
+	v->planeWidth[0] = player->width;
+	v->planeHeight[0] = player->height;
+	for(int p=1; p<3; p++)
+	{
+		v->planeWidth[p] = (player->width + (1<<chromaShiftW) - 1) >> chromaShiftW;
+		v->planeHeight[p] = (player->height + (1<<chromaShiftH) - 1) >> chromaShiftH;
+	}
+	v->slotSize = 0;
+	for(int p=0; p<3; p++)
+	{
+		v->planeOffset[p] = v->slotSize;
+		v->slotSize += (size_t)v->planeWidth[p]*v->planeHeight[p];
+	}
+
+	if(v->stream->avg_frame_rate.num > 0 && v->stream->avg_frame_rate.den > 0)
+		v->frameUsec = (int64_t) (1000000 / av_q2d(v->stream->avg_frame_rate));
+	else
+		v->frameUsec = 1000000/30;
+	v->firstPts = AV_NOPTS_VALUE;
+
+	video_player_colorspace(player, v->dec_ctx);
+
+	v->frame = av_frame_alloc();
+	v->pkt = av_packet_alloc();
+	if(v->frame == NULL || v->pkt == NULL)
+	{
+		msg(MSG_ERROR, "Could not allocate frame for video '%s'", filename);
+		return 0;
+	}
+	return 1;
+}
+
+/** Opens a video file, creates the textures that frames will be
+ * uploaded into and starts decoding frames on a background thread.
+ * Must be called on the thread which owns the OpenGL context.
+ *
+ * @param filename The video file to play. When the end of the video
+ * is reached, it starts over from the beginning.
+ *
+ * @return A new video player or NULL if the file couldn't be
+ * opened. Free with video_player_free().
+ */
+video_player* video_player_new(const char *filename)
+{
+	video_player *player = calloc(1, sizeof(video_player));
+	struct video_player_internal *v = calloc(1, sizeof(struct video_player_internal));
+	if(player == NULL || v == NULL)
+	{
+		msg(MSG_FATAL, "Failed to allocate video player.");
+		exit(EXIT_FAILURE);
+	}
+	player->internal = v;
+	snprintf(player->filename, 1024, "%s", filename);
+
+	if(video_player_open(player) == 0)
+	{
+		video_player_free(player);
+		return NULL;
+	}
+
+	/* Create a texture for each plane. */
+	glGenTextures(3, player->tex);
+	for(int p=0; p<3; p++)
+	{
+		glBindTexture(GL_TEXTURE_2D, player->tex[p]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, v->planeWidth[p], v->planeHeight[p], 0,
+		             GL_RED, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	v->numSlots = kuhl_config_int("video.prefetch", 8, 8);
+	if(v->numSlots < 2)
+		v->numSlots = 2;
+	if(v->numSlots > VIDEO_PLAYER_MAX_SLOTS)
+		v->numSlots = VIDEO_PLAYER_MAX_SLOTS;
+	for(int i=0; i<v->numSlots; i++)
+	{
+		glGenBuffers(1, &(v->slots[i].pbo));
+		v->slots[i].state = VIDEO_SLOT_FREE;
+	}
+	kuhl_errorcheck();
+
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&(v->mutex), NULL);
+	pthread_cond_init(&(v->slotMapped), NULL);
+	if(pthread_create(&(v->thread), NULL, video_player_thread, v) == 0)
+		v->threadRunning = 1;
+	else
+		msg(MSG_WARNING, "Failed to create video decoding thread, decoding on the main thread.");
+#endif
+
+	msg(MSG_INFO, "Playing %s (%dx%d), decoding up to %d frames ahead.", filename,
+	    player->width, player->height, v->numSlots);
+
+	/* Map the pixel buffers so the decoder can start. */
+	video_player_update(player, -1);
+	return player;
+}
+
+/** Uploads the frame which should be displayed at the given time into
+ * player->tex. Frames which were decoded but are already late are
+ * skipped. Call this once per frame on the thread which owns the
+ * OpenGL context; it never waits for the decoder.
+ *
+ * @param player The video player.
+ *
+ * @param usec The time since the start of the video in microseconds.
+ *
+ * @return 1 if a new frame was uploaded, 0 if the textures didn't
+ * change.
+ */
+int video_player_update(video_player *player, int64_t usec)
+{
+	struct video_player_internal *v = player->internal;
+
+#ifdef HAVE_PTHREADS
+	int decodeHere = !v->threadRunning;
+#else
+	int decodeHere = 1;
+#endif
+	if(decodeHere)
+	{
+		while(v->error == 0 && v->slots[v->fillIndex].state == VIDEO_SLOT_MAPPED)
+		{
+			video_slot *slot = &(v->slots[v->fillIndex]);
+			if(video_player_fill(v, slot) == 0)
+				v->error = 1;
+			else
+			{
+				slot->state = VIDEO_SLOT_FILLED;
+				v->fillIndex = (v->fillIndex+1) % v->numSlots;
+			}
+		}
+	}
+
+	/* Unmap the slots the decoder has finished with. */
+	video_player_lock(v);
+	for(int i=0; i<v->numSlots; i++)
+	{
+		video_slot *slot = &(v->slots[i]);
+		if(slot->state == VIDEO_SLOT_FILLED)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			slot->mapped = NULL;
+			slot->state = VIDEO_SLOT_READY;
+		}
+	}
+
+	/* Find the newest frame that should be displayed by now. */
+	int chosen = -1;
+	while(v->slots[v->showIndex].state == VIDEO_SLOT_READY &&
+	      v->slots[v->showIndex].usec <= usec)
+	{
+		if(chosen >= 0)
+		{
+			v->slots[chosen].state = VIDEO_SLOT_FREE;
+			v->framesSkipped++;
+		}
+		chosen = v->showIndex;
+		v->showIndex = (v->showIndex+1) % v->numSlots;
+	}
+	if(usec >= 0 && v->slots[v->showIndex].state != VIDEO_SLOT_READY)
+		v->underflows++;
+	int error = v->error;
+	long decoded = v->framesDecoded;
+	int changedWidth = v->changedWidth;
+	int changedHeight = v->changedHeight;
+	video_player_unlock(v);
+
+	if(changedWidth > 0 && !v->changeReported)
+	{
+		msg(MSG_WARNING, "Video %s changed size from %dx%d to %dx%d, scaling it to %dx%d", player->filename,
+		    player->width, player->height, changedWidth, changedHeight, player->width, player->height);
+		v->changeReported = 1;
+	}
+	if(error && !v->errorReported)
+	{
+		msg(MSG_ERROR, "Stopped decoding video %s after %ld frames", player->filename, decoded);
+		v->errorReported = 1;
+	}
+
+	if(chosen >= 0)
+	{
+		video_slot *slot = &(v->slots[chosen]);
+		GLint unpackAlignment = 4;
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpackAlignment);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+		for(int p=0; p<3; p++)
+		{
+			glBindTexture(GL_TEXTURE_2D, player->tex[p]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, v->planeWidth[p], v->planeHeight[p],
+			                GL_RED, GL_UNSIGNED_BYTE, (const void*)(uintptr_t) v->planeOffset[p]);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, unpackAlignment);
+		video_player_lock(v);
+		slot->state = VIDEO_SLOT_FREE;
+		video_player_unlock(v);
+		player->usec = slot->usec;
+		v->framesDisplayed++;
+	}
+
+	/* Map the free slots and hand them to the decoder. Orphaning the
+	 * buffer lets us map it even if the upload above is still using
+	 * the old storage. */
+	video_player_lock(v);
+	for(int i=0; i<v->numSlots; i++)
+	{
+		video_slot *slot = &(v->slots[i]);
+		if(slot->state != VIDEO_SLOT_FREE)
+			continue;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, v->slotSize, NULL, GL_STREAM_DRAW);
+		slot->mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, v->slotSize,
+		                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if(slot->mapped != NULL)
+			slot->state = VIDEO_SLOT_MAPPED;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_cond_signal(&(v->slotMapped));
+#endif
+	video_player_unlock(v);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	kuhl_errorcheck();
+
+	return chosen >= 0;
+}
+
+/** Sets the YUVMatrix and YUVOffset uniforms that samples/video.frag
+ * uses to convert the planes into RGB. The program must be in use.
+ */
+void video_player_uniforms(const video_player *player, GLuint program)
+{
+	GLint matrixLoc = glGetUniformLocation(program, "YUVMatrix");
+	GLint offsetLoc = glGetUniformLocation(program, "YUVOffset");
+	if(matrixLoc >= 0)
+		glUniformMatrix3fv(matrixLoc, 1, 0, player->yuvMatrix);
+	if(offsetLoc >= 0)
+		glUniform3fv(offsetLoc, 1, player->yuvOffset);
+}
+
+/** Prints how many frames were decoded, displayed and skipped. If
+ * many updates had no frame ready, the decoder can't keep up with the
+ * video. */
+void video_player_print_stats(const video_player *player)
+{
+	struct video_player_internal *v = player->internal;
+	video_player_lock(v);
+	msg(MSG_INFO, "Video %s: %ld frame(s) decoded (%.2f ms/frame), %ld displayed, %ld skipped, %ld update(s) with no frame ready.",
+	    player->filename, v->framesDecoded,
+	    v->framesDecoded > 0 ? v->decodeUsec/1000.0/v->framesDecoded : 0.0,
+	    v->framesDisplayed, v->framesSkipped, v->underflows);
+	video_player_unlock(v);
+}
+
+/** Stops decoding and frees a video player, its textures and its
+ * buffers. Must be called on the thread which owns the OpenGL
+ * context. */
+void video_player_free(video_player *player)
+{
+	if(player == NULL)
+		return;
+	struct video_player_internal *v = player->internal;
+
+#ifdef HAVE_PTHREADS
+	if(v->threadRunning)
+	{
+		pthread_mutex_lock(&(v->mutex));
+		v->quit = 1;
+		pthread_cond_broadcast(&(v->slotMapped));
+		pthread_mutex_unlock(&(v->mutex));
+		pthread_join(v->thread, NULL);
+		pthread_cond_destroy(&(v->slotMapped));
+		pthread_mutex_destroy(&(v->mutex));
+	}
+#endif
+
+	for(int i=0; i<v->numSlots; i++)
+	{
+		if(v->slots[i].mapped)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, v->slots[i].pbo);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glDeleteBuffers(1, &(v->slots[i].pbo));
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if(player->tex[0])
+		glDeleteTextures(3, player->tex);
+
+	sws_freeContext(v->sws_ctx);
+	sws_freeContext(v->resize_ctx);
+	avcodec_free_context(&(v->dec_ctx));
+	avformat_close_input(&(v->fmt_ctx));
+	av_frame_free(&(v->frame));
+	av_packet_free(&(v->pkt));
+	free(v);
+	free(player);
+}
+
 #endif // HAVE_FFMPEG
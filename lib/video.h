@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <GL/glew.h>
+
 #ifdef HAVE_FFMPEG
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
@@ -37,3 +40,33 @@ typedef struct {
 
 video_state* video_get_next_frame(video_state *state, const char *filename);
 void video_cleanup(video_state *state);
+
+
+/** Plays a video file. Frames are decoded ahead of time on a
+ * background thread and copied directly into pixel buffer objects as
+ * separate Y, U and V planes. video_player_update() uploads the frame
+ * which should be displayed at a given time into three textures and
+ * the conversion to RGB happens in the fragment shader (see
+ * samples/video.frag).
+ *
+ * Config options:
+ * video.prefetch - Number of decoded frames to keep ready (default 8).
+ */
+typedef struct {
+	int width;           /**< Width of the video in pixels */
+	int height;          /**< Height of the video in pixels */
+	float aspectRatio;   /**< Aspect ratio of the video */
+	int64_t usec;        /**< Time of the frame in the textures in microseconds */
+	GLuint tex[3];       /**< Y, U and V planes of the current frame (single channel textures) */
+	float yuvMatrix[9];  /**< Column-major matrix which converts YUV into RGB */
+	float yuvOffset[3];  /**< Subtract from the YUV values before multiplying by yuvMatrix */
+	char filename[1024]; /**< Filename of the video we loaded */
+
+	struct video_player_internal *internal; /**< Used internally by video.c */
+} video_player;
+
+video_player* video_player_new(const char *filename);
+int video_player_update(video_player *player, int64_t usec);
+void video_player_uniforms(const video_player *player, GLuint program);
+void video_player_print_stats(const video_player *player);
+void video_player_free(video_player *player);
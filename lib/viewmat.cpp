@@ -31,6 +31,7 @@
 #include "orient-sensor.h"
 #include "dgr.h"
 #include "bufferswap.h"
+#include "framepace.h"
 
 #include "viewmat.h"
 
@@ -441,6 +442,10 @@ viewmat_eye viewmat_get(float viewmatrix[16], float projmatrix[16], int viewport
 	/* Get the current projection matrix. */
 	display->get_projmatrix(projmatrix, viewportID);
 
+	/* Let frame pacing know that we are reading input (the tracking
+	 * system or the mouse) for this frame. */
+	framepace_sample_input();
+
 	/* Get the current view matrix.
 	 * 
 	 * NOTE: There is no reason to get the view matrix if DGR is
@@ -8,11 +8,10 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
-#include <map>
-#include <string>
 
 #ifndef MISSING_VRPN
 #include <vrpn_Tracker.h>
@@ -23,55 +22,166 @@
 #include "kuhl-util.h"
 #include "vecmat.h"
 #include "kalman.h"
+#include "predict.h"
+#include "ring.h"
 #include "vrpn-help.h"
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #ifndef MISSING_VRPN
 
 
+/** Maximum number of objects that we can track. */
+#define VRPN_MAX_OBJECTS 64
+
+/** How long the polling thread waits for new records before it checks
+ * all of the connections again (microseconds). */
+#define VRPN_POLL_WAIT 1000
+
 /** A struct which we will create for every single tracked
- * object. These will be in a map so that we can easily find the
- * struct that corresponds with an object using the "object\@tracker"
- * notation. */
+ * object.
+ *
+ * The first group of variables is only used by the thread that calls
+ * the VRPN mainloop() functions (the polling thread or, if there is
+ * no polling thread, the thread calling vrpn_get()). That thread
+ * publishes each new sample into the history, which any thread can
+ * read with vrpn_sample_read() without locking. */
 typedef struct {
+	char fullname[256]; /**< The object\@tracker name */
+	vrpn_Connection *connection;  /**< The connection to the VRPN server */
 	vrpn_Tracker_Remote *tracker; /**< The VRPN tracker for this object */
-	vrpn_TRACKERCB data; /**< Data we receive from VRPN (we receive it in the callback */
-	int hasData; /**< Has data been written to? Set by handle_tracker() callback. */
-	int failCount; /**< Number of times vrpn_get() has been called with hasData == 0 */
+	vrpn_TRACKERCB data; /**< The latest record from VRPN (before filtering) */
+	int hasData; /**< Set to 1 once handle_tracker() has stored a record in data */
 	kuhl_fps_state fps_state; /**< Track how many records per second this object has sent us */
-	kalman_state kalman[7]; /**< Kalman filter state for this object */
+	kalman_multi_state kalmanPos;  /**< Kalman filter state for the position of this object */
+	kalman_quat_state  kalmanQuat; /**< Kalman filter state for the orientation of this object */
+	int filter; /**< If 0, samples are published without filtering (see vrpn_set_filter()) */
+	ring *raw; /**< If not NULL, unfiltered records are also pushed into this ring for vrpn_get_raw() */
+
+	int failCount; /**< Number of times vrpn_get() has been called before we received any data (only used by vrpn_get()) */
+	predict_state predict; /**< Predicts the pose at render time (only used by vrpn_get_predicted()) */
+
+	/* A seqlock: seq is odd while a sample is being written. */
+	unsigned long seq;    /**< Incremented before and after a sample is published */
+	unsigned long count;  /**< Number of samples published so far */
+	vrpn_sample history[VRPN_HISTORY]; /**< Newest sample is at (count-1) % VRPN_HISTORY */
 } TrackedObject;
 
-/** A mapping of object\@tracker strings to vrpn_Tracker_Remote objects
- * so we can quickly find the appropriate object given an
- * object\@tracker string. */
-std::map<std::string, TrackedObject*> nameToTracker;
+/** All of the objects that we are tracking. Objects are only added
+ * (by vrpn_connect()), never removed, so a pointer to an object
+ * remains valid. */
+static TrackedObject *objects[VRPN_MAX_OBJECTS];
+static int objectCount = 0;
+/** Whether objects connected from now on are filtered (see vrpn_set_filter()). */
+static int filterNew = 1;
+
+#ifdef HAVE_PTHREADS
+/** Held while calling VRPN functions once the polling thread is running. */
+static pthread_mutex_t vrpnMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t pollThread;
+static int pollRunning = 0;
+#endif
 
 
-static void smooth(TrackedObject *to)
+/** Publishes a sample so that vrpn_sample_read() can see it. Only
+ * one thread may publish samples for an object. */
+static void vrpn_sample_publish(TrackedObject *to, const vrpn_sample *sample)
 {
-	long microseconds = (to->data.msg_time.tv_sec* 1000000L) + to->data.msg_time.tv_usec;
-	//printf(" pre kalman quat: %f %f %f %f\n", to->data.quat[0], to->data.quat[1], to->data.quat[2], to->data.quat[3] );
+	unsigned long seq = to->seq;
+	__atomic_store_n(&(to->seq), seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	to->history[to->count % VRPN_HISTORY] = *sample;
+	__atomic_store_n(&(to->count), to->count+1, __ATOMIC_RELAXED);
+	__atomic_store_n(&(to->seq), seq+2, __ATOMIC_RELEASE);
+}
 
-	
-	/* Smooth position */
-	for(int i=0; i<3; i++)
+/** Copies the newest samples for an object, newest first. Can be
+ * called from any thread at any time; it never blocks the thread that
+ * is publishing samples (it retries if a sample was published while
+ * it was copying).
+ *
+ * @param to The object.
+ * @param samples Array to copy samples into.
+ * @param count Maximum number of samples to copy.
+ * @return The number of samples copied.
+ */
+static int vrpn_sample_read(const TrackedObject *to, vrpn_sample *samples, int count)
+{
+	if(count > VRPN_HISTORY)
+		count = VRPN_HISTORY;
+	while(1)
 	{
-		to->data.pos[i] = kalman_estimate(&(to->kalman[i]),
-		                                  to->data.pos[i],
-		                                  microseconds);
+		unsigned long seq = __atomic_load_n(&(to->seq), __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue; // a sample is being written right now
+		unsigned long available = __atomic_load_n(&(to->count), __ATOMIC_RELAXED);
+		int n = available < (unsigned long) count ? (int) available : count;
+		for(int i=0; i<n; i++)
+			samples[i] = to->history[(available-1-i) % VRPN_HISTORY];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&(to->seq), __ATOMIC_RELAXED) == seq)
+			return n;
 	}
+}
+
+/** Finds an object that vrpn_connect() has already connected to.
+
+    @param fullname The object\@tracker name.
+    @return The object or NULL if we are not tracking it.
+*/
+static TrackedObject* vrpn_find(const char *fullname)
+{
+	int n = __atomic_load_n(&objectCount, __ATOMIC_ACQUIRE);
+	for(int i=0; i<n; i++)
+		if(strcmp(objects[i]->fullname, fullname) == 0)
+			return objects[i];
+	return NULL;
+}
+
+/** Locks VRPN so that we can call VRPN functions while the polling
+ * thread is running. */
+static void vrpn_lock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&vrpnMutex);
+#endif
+}
+
+static void vrpn_unlock(void)
+{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&vrpnMutex);
+#endif
+}
 
-	/* Smooth orientation */
+
+static void smooth(TrackedObject *to)
+{
+	long microseconds = (to->data.msg_time.tv_sec* 1000000L) + to->data.msg_time.tv_usec;
+
+	vrpn_sample sample;
+	sample.time = microseconds;
+	sample.received = kuhl_microseconds();
+	for(int i=0; i<3; i++)
+		sample.pos[i] = to->data.pos[i];
 	for(int i=0; i<4; i++)
+		sample.quat[i] = to->data.quat[i];
+
+	if(to->filter == 0)
 	{
-		to->data.quat[i] = kalman_estimate(&(to->kalman[3+i]),
-		                                   to->data.quat[i],
-		                                   microseconds);
+		vrpn_sample_publish(to, &sample);
+		return;
 	}
-	
-	//printf("post kalman quat: %f %f %f %f\n", to->data.quat[0], to->data.quat[1], to->data.quat[2], to->data.quat[3]);
 
-	// printf("%ld, %lf, %lf\n", kuhl_milliseconds(), t.pos[0], smoothed);
+	/* Smooth position */
+	kalman_multi_estimate(&(to->kalmanPos), sample.pos, microseconds);
+
+	/* Smooth orientation (result is always a unit quaternion) */
+	kalman_quat_estimate(&(to->kalmanQuat), sample.quat, microseconds);
+
+	vrpn_sample_publish(to, &sample);
 }
 
 static void vrpn_sanity_check(const struct timeval lastTime,
@@ -92,15 +202,18 @@ static void vrpn_sanity_check(const struct timeval lastTime,
 /** A callback function that will get called whenever the tracker
  * provides us with new data. This may be called repeatedly for each
  * record that we have missed if many records have been delivered
- * since the last call to the VRPN mainloop() function. */
-static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
+ * since the last call to the VRPN mainloop() function.
+ *
+ * @param userdata The TrackedObject that the record is for.
+ * @param t The record.
+ */
+static void VRPN_CALLBACK handle_tracker(void *userdata, vrpn_TRACKERCB t)
 {
-	std::string s = (char*)name;
-	TrackedObject *tracked = nameToTracker[s];
+	TrackedObject *tracked = (TrackedObject*) userdata;
 		
 	float fps = kuhl_getfps(&(tracked->fps_state));
 	if(tracked->fps_state.frame == 0)
-		msg(MSG_INFO, "VRPN records per second: %.1f (%s)\n", fps, s.c_str());
+		msg(MSG_INFO, "VRPN records per second: %.1f (%s)\n", fps, tracked->fullname);
 
 	/* Create a place to store position and orientation locally. */
 	float pos[3], quat[4];
@@ -108,7 +221,7 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	vec4f_set(quat, t.quat[0], t.quat[1], t.quat[2], t.quat[3]);
 
 	if(tracked->hasData)
-		vrpn_sanity_check(tracked->data.msg_time, t.msg_time, (char*)name);
+		vrpn_sanity_check(tracked->data.msg_time, t.msg_time, tracked->fullname);
 
 	if(0)
 	{
@@ -124,6 +237,15 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	   In this case, don't update our record. */
 	if(vec3f_norm(pos) > 100)
 		return;
+
+	/* vrpn_get_raw() wants the records before they are filtered. */
+	ring *raw = (ring*) __atomic_load_n(&(tracked->raw), __ATOMIC_ACQUIRE);
+	if(raw != NULL)
+	{
+		float record[7] = { pos[0], pos[1], pos[2], quat[0], quat[1], quat[2], quat[3] };
+		if(ring_push(raw, record) == 0)
+			msg(MSG_WARNING, "Dropped a raw VRPN record for %s", tracked->fullname);
+	}
 	
 	// Store the data so we can use it later.
 	tracked->data = t;
@@ -131,6 +253,86 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	tracked->hasData = 1;
 }
 
+/** Calls the VRPN mainloop() functions for every object so that
+ * handle_tracker() gets called for any new records. The caller must
+ * hold the lock (see vrpn_lock()).
+
+    @param waitUsec If there aren't any new records, wait up to this
+    many microseconds for records to arrive on the first connection.
+ */
+static void vrpn_pump(long waitUsec)
+{
+	if(objectCount == 0)
+		return;
+	if(waitUsec > 0)
+	{
+		/* Blocks in select() until there is data to read (or the time
+		 * runs out) and calls handle_tracker() for each record. */
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = waitUsec;
+		objects[0]->connection->mainloop(&timeout);
+	}
+	for(int i=0; i<objectCount; i++)
+		objects[i]->tracker->mainloop();
+}
+
+#ifdef HAVE_PTHREADS
+/** The polling thread. It calls the VRPN mainloop() functions as
+ * soon as records arrive so that each record is filtered and
+ * published at the rate the tracking system sends them, regardless of
+ * how often the program calls vrpn_get(). */
+static void* vrpn_poll_thread(void *arg)
+{
+	unsigned long lastTotal = 0;
+	while(__atomic_load_n(&pollRunning, __ATOMIC_ACQUIRE))
+	{
+		unsigned long total = 0;
+		pthread_mutex_lock(&vrpnMutex);
+		for(int i=0; i<objectCount; i++)
+			total += objects[i]->count;
+		/* Only wait if the last pass didn't receive anything; otherwise
+		 * more records are probably already waiting. */
+		vrpn_pump(total == lastTotal ? VRPN_POLL_WAIT : 0);
+		pthread_mutex_unlock(&vrpnMutex);
+		lastTotal = total;
+	}
+	return NULL;
+}
+
+static void vrpn_poll_stop(void)
+{
+	__atomic_store_n(&pollRunning, 0, __ATOMIC_RELEASE);
+	pthread_join(pollThread, NULL);
+}
+
+/** Starts the polling thread unless the "vrpn.thread" config file
+ * setting is false. */
+static void vrpn_poll_start(void)
+{
+	if(kuhl_config_boolean("vrpn.thread", 1, 1) == 0)
+	{
+		msg(MSG_INFO, "VRPN records will be received when vrpn_get() is called (vrpn.thread is false).");
+		return;
+	}
+	__atomic_store_n(&pollRunning, 1, __ATOMIC_RELEASE);
+	if(pthread_create(&pollThread, NULL, vrpn_poll_thread, NULL) != 0)
+	{
+		msg(MSG_WARNING, "Failed to create VRPN polling thread; records will be received when vrpn_get() is called.");
+		__atomic_store_n(&pollRunning, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	atexit(vrpn_poll_stop);
+}
+#endif
+
+/** Prints how accurate the predictions made by vrpn_get_predicted() were. */
+static void vrpn_print_stats(void)
+{
+	for(int i=0; i<objectCount; i++)
+		predict_print_stats(&(objects[i]->predict), objects[i]->fullname);
+}
+
 /** Establish a VRPN connection to a specified host.
 
     @param fullname A string containing either the hostname or
@@ -141,6 +343,19 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 static int vrpn_connect(const char *fullname)
 {
 	msg(MSG_INFO, "Connecting to VRPN server to track '%s'\n", fullname);
+	if(objectCount == VRPN_MAX_OBJECTS)
+	{
+		msg(MSG_ERROR, "Can't track '%s', already tracking %d objects.\n", fullname, VRPN_MAX_OBJECTS);
+		return 0;
+	}
+	if(strlen(fullname) >= sizeof(objects[0]->fullname))
+	{
+		msg(MSG_ERROR, "VRPN object name is too long: %s\n", fullname);
+		return 0;
+	}
+
+	/* The polling thread may be using this connection. */
+	vrpn_lock();
 
 	/* If we are making a TCP connection and the server isn't up, the
 	 * following function call may hang for a long time. Also, the
@@ -159,92 +374,69 @@ static int vrpn_connect(const char *fullname)
 	if(!connection->connected())
 	{
 		delete connection;
+		vrpn_unlock();
 		msg(MSG_ERROR, "Failed to connect to tracker: %s\n", fullname);
 		return 0;
 	}
 
-	/* Create a vrpn_Tracker_Remove object, register the callback function. */
-	vrpn_Tracker_Remote *tkr = new vrpn_Tracker_Remote(fullname, connection);
-	tkr->register_change_handler((void*) strdup(fullname), handle_tracker);
-
 	/* Store all of the information we will need later about this tracked object */
-	TrackedObject *to = (TrackedObject*) malloc(sizeof(TrackedObject));
-	to->tracker = tkr;
-	to->hasData = 0;
-	to->failCount = 0;
+	TrackedObject *to = (TrackedObject*) kuhl_malloc(sizeof(TrackedObject));
+	memset(to, 0, sizeof(TrackedObject));
+	strcpy(to->fullname, fullname);
+	to->connection = connection;
 	kuhl_getfps_init(&(to->fps_state));
+	to->filter = filterNew;
 
 	/* Initialize kalman filter */
-	for(int i=0; i<3; i++) /* position */
-		kalman_initialize(&(to->kalman[i]), 0.00004f, 0.01f);
-	for(int i=3; i<7; i++) /* orientation */
-		kalman_initialize(&(to->kalman[i]), 0.0001f, 0.01f);
-		
-	nameToTracker[std::string(fullname)] = to;
+	const float posSigma[3] = { 0.00004f, 0.00004f, 0.00004f };
+	kalman_multi_initialize(&(to->kalmanPos), 3, posSigma, 0.01f);
+	/* A rotation of angle a changes the quaternion components by about
+	 * a/2, so this matches the 0.0001 per component we used when we
+	 * filtered each component separately. */
+	kalman_quat_initialize(&(to->kalmanQuat), 0.0002f, 0.01f);
+
+	if(predict_init_config(&(to->predict)) != PREDICT_NONE && objectCount == 0)
+	{
+		msg(MSG_INFO, "VRPN: Predicting up to %.1f ms ahead using %.1f ms of samples.", to->predict.horizon/1000.0, to->predict.window/1000.0);
+		atexit(vrpn_print_stats);
+	}
+
+	/* Create a vrpn_Tracker_Remove object, register the callback function. */
+	to->tracker = new vrpn_Tracker_Remote(fullname, connection);
+	to->tracker->register_change_handler((void*) to, handle_tracker);
+
+	objects[objectCount] = to;
+	__atomic_store_n(&objectCount, objectCount+1, __ATOMIC_RELEASE);
+	vrpn_unlock();
+
+#ifdef HAVE_PTHREADS
+	if(objectCount == 1)
+		vrpn_poll_start();
+#endif
 	return 1;
 }
 
-/** Retrieves the latest information from a VRPN connection and stores
-    it in an appropriate TrackerObject.
+/** Converts a sample into a position and an orientation matrix in
+    the OpenGL coordinate system.
 
  @param fullname A string in the format object\@hostname.
 
+ @param sample The sample to convert.
+
  @param pos An array to store the resulting position data.
 
  @param orient A matrix to store the resulting orientation data.
-
- @return Returns 1 on success; 0 on failure.
 */
-static int vrpn_update(const char *fullname, float pos[3], float orient[16])
+static void vrpn_sample_pose(const char *fullname, const vrpn_sample *sample, float pos[3], float orient[16])
 {
-	TrackedObject *to = nameToTracker[fullname];
-	if(to == NULL)
-	{
-		msg(MSG_FATAL, "vrpn_update() was called before vrpn_connect() was called for object '%s'", fullname);
-		return 0;
-	}
-		
-	/* If we already have a tracker object, ask it to run the main
-	 * loop (and therefore call our handle_tracker() function if
-	 * there is new data). */
-	to->tracker->mainloop();
-
-	if(to->hasData == 0) /* If mainloop() called our callback, hasData should be 1 */
-	{
-		const static int maxmessages = 4;  /** How many times should error messages be displayed */
-		const static int messagemod = 500; /** How many times does vrpn_get() get called before message is printed */
-
-		/* Don't repeatedly print messages about this */
-		if(to->failCount >= maxmessages*messagemod)
-			return 0;
-
-		/* If our callback never seems to get called for this
-		 * object, print a warning message about it */
-		to->failCount++;
-		if(to->failCount % messagemod == 0)
-		{
-			msg(MSG_WARNING, "VRPN has not received any data for %s", fullname);
-			msg(MSG_WARNING, "As a result, you may see VRPN messages about receiving no response from server.");
-			if(to->failCount == messagemod*maxmessages)
-				msg(MSG_WARNING, "This is your last message about %s", fullname);
-		}
-
-		return 0;
-	}
-
-	/* If we get to here, to->hasData indicates that the VRPN callback
-	 * has been called at least once and we have therefore received some data. */
-	to->failCount = 0;
-		
-	vrpn_TRACKERCB t = to->data;
 	float pos4[4];
 	for(int i=0; i<3; i++)
-		pos4[i] = t.pos[i];
+		pos4[i] = (float) sample->pos[i];
 	pos4[3]=1;
 
 	double orientd[16];
 	// Convert quaternion into orientation matrix.
-	q_to_ogl_matrix(orientd, t.quat);
+	q_to_ogl_matrix(orientd, sample->quat);
 	for(int i=0; i<16; i++)
 		orient[i] = (float) orientd[i];
 
@@ -277,16 +469,59 @@ static int vrpn_update(const char *fullname, float pos[3], float orient[16])
 		                             0,0,0,1 };
 		mat4f_mult_mat4f_new(orient, viconTransform, orient);
 		mat4f_mult_vec4f_new(pos4, viconTransform, pos4);
-		vec3f_copy(pos,pos4);
-		return 1; // we successfully collected some data
 	}
-	else // Non-Vicon tracker
+	/* Don't transform other tracking systems */
+	vec3f_copy(pos, pos4);
+}
+
+/** Retrieves the latest sample for an object. If the polling thread
+    isn't running, this also receives any new records from VRPN.
+
+ @param to The object.
+
+ @param sample The newest sample.
+
+ @return Returns 1 on success; 0 if we haven't received any data yet.
+*/
+static int vrpn_update(TrackedObject *to, vrpn_sample *sample)
+{
+#ifdef HAVE_PTHREADS
+	if(!__atomic_load_n(&pollRunning, __ATOMIC_ACQUIRE))
+#endif
+	{
+		/* Ask VRPN to call our handle_tracker() function if there is
+		 * new data. */
+		vrpn_lock();
+		vrpn_pump(0);
+		vrpn_unlock();
+	}
+
+	if(vrpn_sample_read(to, sample, 1) == 0)
 	{
-		/* Don't transform other tracking systems */
-		// orient is already filled in
-		vec3f_copy(pos, pos4);
-		return 1; // we successfully collected some data
+		const static int maxmessages = 4;  /** How many times should error messages be displayed */
+		const static int messagemod = 500; /** How many times does vrpn_get() get called before message is printed */
+
+		/* Don't repeatedly print messages about this */
+		if(to->failCount >= maxmessages*messagemod)
+			return 0;
+
+		/* If our callback never seems to get called for this
+		 * object, print a warning message about it */
+		to->failCount++;
+		if(to->failCount % messagemod == 0)
+		{
+			msg(MSG_WARNING, "VRPN has not received any data for %s", to->fullname);
+			msg(MSG_WARNING, "As a result, you may see VRPN messages about receiving no response from server.");
+			if(to->failCount == messagemod*maxmessages)
+				msg(MSG_WARNING, "This is your last message about %s", to->fullname);
+		}
+
+		return 0;
 	}
+
+	/* If we get to here, we have received some data. */
+	to->failCount = 0;
+	return 1;
 }
 
 
@@ -405,12 +640,122 @@ int vrpn_get(const char *object, const char *hostname, float pos[3], float orien
 	char fullname[256];
 	vrpn_fullname(object, hostname, fullname);
 
-	/* Check if we have a tracker object for that string in our map. */
-	if(nameToTracker.count(fullname))
-		return vrpn_update(fullname, pos, orient);
-	else
+	/* Check if we are already tracking this object. */
+	TrackedObject *to = vrpn_find(fullname);
+	if(to == NULL)
+		return vrpn_connect(fullname);
+
+	vrpn_sample sample;
+	if(vrpn_update(to, &sample) == 0)
+		return 0;
+	vrpn_sample_pose(fullname, &sample, pos, orient);
+	return 1;
+#endif
+}
+
+/** Like vrpn_get(), but predicts where the object will be at a time
+    in the near future. The prediction is controlled by the
+    vrpn.predict, vrpn.predict.horizon, and vrpn.predict.window config
+    file settings (see predict_init_config()). If vrpn.predict isn't
+    set, this returns the same data as vrpn_get().
+
+    @param object The name of the object being tracked.
+
+    @param hostname The hostname of the VRPN server. If NULL, the
+    hostname specified in a config file with the "vrpn.server" key.
+
+    @param target The time to predict the pose for, in the same units
+    as kuhl_microseconds(). Usually framepace_predicted_display().
+
+    @param pos An array to be filled in with the predicted position.
+
+    @param orient An array to be filled in with the predicted orientation matrix.
+
+    @return 1 if we returned data from the tracker. 0 if there was
+    problems connecting to the tracker.
+*/
+int vrpn_get_predicted(const char *object, const char *hostname, long target, float pos[3], float orient[16])
+{
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+	return 0;
+#else
+	char fullname[256];
+	vrpn_fullname(object, hostname, fullname);
+	TrackedObject *to = vrpn_find(fullname);
+	if(to == NULL)
 		return vrpn_connect(fullname);
 
+	vrpn_sample samples[VRPN_HISTORY];
+	if(vrpn_update(to, samples) == 0)
+		return 0;
+	int count = 1;
+	if(to->predict.model != PREDICT_NONE)
+		count = vrpn_sample_read(to, samples, VRPN_HISTORY);
+
+	vrpn_sample predicted = samples[0];
+	predict_pose(&(to->predict), samples, count, target, predicted.pos, predicted.quat);
+	vrpn_sample_pose(fullname, &predicted, pos, orient);
+	return 1;
+#endif
+}
+
+/** Gets the most recent samples that we have received for a tracked
+    object. Unlike vrpn_get(), the samples are in the tracking
+    system's coordinate system, and they include the time that each
+    sample was recorded and received.
+
+    @param object The name of the object being tracked.
+
+    @param hostname The hostname of the VRPN server. If NULL, the
+    hostname specified in a config file with the "vrpn.server" key.
+
+    @param samples An array to be filled in with samples, newest first.
+
+    @param count The size of the samples array.
+
+    @return The number of samples copied into the array (which may be
+    less than count). 0 if we haven't received any data yet.
+*/
+int vrpn_get_history(const char *object, const char *hostname, vrpn_sample *samples, int count)
+{
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+	return 0;
+#else
+	char fullname[256];
+	vrpn_fullname(object, hostname, fullname);
+	TrackedObject *to = vrpn_find(fullname);
+	if(to == NULL)
+	{
+		vrpn_connect(fullname);
+		return 0;
+	}
+	vrpn_sample latest;
+	vrpn_update(to, &latest);
+	return vrpn_sample_read(to, samples, count);
+#endif
+}
+
+/** Chooses whether samples from objects that we start tracking
+    after this call are filtered. Samples are filtered by default;
+    programs that record the tracking data (e.g., vrpn/recorder.c)
+    should turn filtering off so that the data can be filtered again
+    when it is played back.
+
+    @param enabled 1 to filter samples, 0 to use the samples as they
+    arrive from the tracking system.
+*/
+void vrpn_set_filter(int enabled)
+{
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+#else
+	vrpn_lock();
+	filterNew = enabled;
+	vrpn_unlock();
 #endif
 }
 
@@ -444,28 +789,37 @@ float* vrpn_get_raw(const char *object, const char *hostname, int count)
 	char fullname[256];
 	vrpn_fullname(object, hostname, fullname);
 
-	TrackedObject *to = nameToTracker[std::string(fullname)];
+	TrackedObject *to = vrpn_find(fullname);
+	if(to == NULL)
+		return NULL;
 
-	/* Disable kalman filtering */
-	for(int i = 0; i<7; i++)
-		to->kalman[i].isEnabled = 0;
-	
-	float *data = (float*) malloc(sizeof(float)*7*count);
+	/* Ask handle_tracker() to give us a copy of each record before
+	 * it is filtered. */
+	ring *raw = ring_new(256, sizeof(float)*7, RING_SPSC);
+	__atomic_store_n(&(to->raw), raw, __ATOMIC_RELEASE);
 
+	float *data = (float*) malloc(sizeof(float)*7*count);
 	for(int i=0; i<count; i++)
 	{
-		while(to->hasData == 0)
-			to->tracker->mainloop();
-		to->hasData = 0;
-
-		data[i*7+0] = to->data.pos[0];
-		data[i*7+1] = to->data.pos[1];
-		data[i*7+2] = to->data.pos[2];
-		data[i*7+3] = to->data.quat[0];
-		data[i*7+4] = to->data.quat[1];
-		data[i*7+5] = to->data.quat[2];
-		data[i*7+6] = to->data.quat[3];
+#ifdef HAVE_PTHREADS
+		if(__atomic_load_n(&pollRunning, __ATOMIC_ACQUIRE))
+		{
+			ring_pop_wait(raw, data+i*7, -1);
+			continue;
+		}
+#endif
+		while(ring_pop(raw, data+i*7) == 0)
+		{
+			vrpn_lock();
+			vrpn_pump(VRPN_POLL_WAIT);
+			vrpn_unlock();
+		}
 	}
+
+	vrpn_lock(); // make sure handle_tracker() isn't using the ring
+	__atomic_store_n(&(to->raw), (ring*) NULL, __ATOMIC_RELEASE);
+	vrpn_unlock();
+	ring_free(raw);
 	return data;
 #endif
 }
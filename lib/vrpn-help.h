@@ -15,6 +15,13 @@
  *
  * VRPN uses the Boost Software License which allows code to link to
  * VRPN and be published under a different license.
+ *
+ * When libkuhl is compiled with pthreads, a background thread
+ * receives the records from every VRPN connection as soon as they
+ * arrive, filters them, and publishes them so that vrpn_get() can
+ * return the newest sample without waiting on VRPN or locking. Set
+ * "vrpn.thread = false" in a config file to receive records in
+ * vrpn_get() instead.
  */
 
 #pragma once
@@ -22,10 +29,24 @@
 extern "C" {
 #endif
 
+/** Number of recent samples kept for each object (power of 2). */
+#define VRPN_HISTORY 64
+
+/** A sample from the tracking system after it has been filtered (see vrpn_set_filter()). */
+typedef struct {
+	long time;      /**< Time that the tracking system recorded the sample (microseconds, tracking system's clock) */
+	long received;  /**< kuhl_microseconds() when we received the sample */
+	double pos[3];  /**< Position in the tracking system's coordinate system */
+	double quat[4]; /**< Orientation quaternion (x,y,z,w) in the tracking system's coordinate system */
+} vrpn_sample;
+
 int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16]);
+int vrpn_get_predicted(const char *object, const char *hostname, long target, float pos[3], float orient[16]);
+int vrpn_get_history(const char *object, const char *hostname, vrpn_sample *samples, int count);
 const char* vrpn_default_host(void);
 int vrpn_is_vicon(const char *hostname);
 float* vrpn_get_raw(const char *name, const char *host, int count);
+void vrpn_set_filter(int enabled);
 	
 #ifdef __cplusplus
 } // end extern "C"
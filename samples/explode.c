@@ -25,11 +25,9 @@ static kuhl_geometry *modelgeom = NULL;
 static float bbox[6];
 
 
-typedef struct {
-	GLfloat velocity[3];
-} particle;
-
-static particle **particles;
+/** The velocity of each vertex: velocities[geometry] stores
+ * x0,y0,z0,x1,y1,z1,... for the vertices in that kuhl_geometry. */
+static GLfloat **velocities;
 
 #define GLSL_VERT_FILE "viewer.vert"
 #define GLSL_FRAG_FILE "viewer.frag"
@@ -45,31 +43,29 @@ void explode()
 		GLfloat *norm = kuhl_geometry_attrib_get(g, "in_Normal",
 		                                         &numFloats);
 		
-		/* Calculate the velocity of each vertex when the explosion occurs */
+		/* Calculate the velocity of each vertex when the explosion
+		 * occurs. Start by setting the velocity equal to the normal
+		 * to make the particles move out and scale the initial
+		 * velocity. Instead of moving the particles only in the
+		 * direction of the normal, make them move 'up' (in object
+		 * coordinates) too. A single matrix does all of this for
+		 * every vertex at once. */
+		float scaleUp[16];
+		mat4f_scale_new(scaleUp, 10, 10, 10);
+		mat4f_setColumn(scaleUp, (float[4]){ 0, .5, 0, 1 }, 3);
+		mat4f_mult_point3f_batch(velocities[i], norm,
+		                         g->vertex_count, scaleUp);
+
+		// Add a bit of randomness
 		for(unsigned int j=0; j<g->vertex_count; j++)
-		{
-			// Start by setting the velocity equal to the normal to
-			// make the particles move out.
-			vec3f_copy(particles[i][j].velocity, &norm[j*3]);
-
-			// Scale the initial velocity
-			vec3f_scalarMult(particles[i][j].velocity, 10);
-
-			// Instead of moving the particles only in the direction
-			// of the normal, make them move 'up' (in object
-			// coordinates) too.
-			particles[i][j].velocity[1] += .5;
-
-			// Add a bit of randomness
 			for(int k=0; k<3; k++)
-				particles[i][j].velocity[k] += (drand48()-.5);
-		}
+				velocities[i][j*3+k] += (drand48()-.5);
 		g = g->next;
 	}
 }
 
 /** Update the vertex positions and the velocity stored in the
- * particles array. */
+ * velocities array. */
 void update()
 {
 	kuhl_geometry *g = modelgeom;
@@ -81,8 +77,9 @@ void update()
 
 		for(unsigned int j=0; j<g->vertex_count; j++)
 		{
+			GLfloat *velocity = velocities[i]+j*3;
 			/* If the first point isn't moving, don't update anything */
-			if(vec3f_norm(particles[i][j].velocity) == 0)
+			if(vec3f_norm(velocity) == 0)
 				return;
 
 			/* Gravity is pushing particles down -Y, but we are
@@ -94,8 +91,8 @@ void update()
 			float timestep = 0.1f; // change this to change speed of explosion
 			for(int k=0; k<3; k++)
 			{
-				pos[j*3+k] += timestep * (particles[i][j].velocity[k] + timestep * accel[k]/2);
-				particles[i][j].velocity[k] += timestep * accel[k];
+				pos[j*3+k] += timestep * (velocity[k] + timestep * accel[k]/2);
+				velocity[k] += timestep * accel[k];
 			}
 #if 1   /* Bounce the particles off the xz-plane. */
 			if(pos[j*3+1] < 0)
@@ -105,9 +102,9 @@ void update()
 				/* If particle fell through floor, negate its position */
 				pos[j*3+1] *= -velocityLossFactor;
 				/* Negative the Y velocity */
-				particles[i][j].velocity[1] *= -1;
+				velocity[1] *= -1;
 				/* Scale velocity in all directions */
-				vec3f_scalarMult(particles[i][j].velocity, velocityLossFactor); // lose energy on bounce
+				vec3f_scalarMult(velocity, velocityLossFactor); // lose energy on bounce
 			}
 #endif
 		}
@@ -305,16 +302,14 @@ int main(int argc, char** argv)
 	/* Count the number of kuhl_geometry objects for this model */
 	unsigned int geomCount = kuhl_geometry_count(modelgeom);
 	
-	/* Allocate an array of particle arrays */
-	particles = malloc(sizeof(particle*)*geomCount);
+	/* Allocate an array of velocity arrays */
+	velocities = malloc(sizeof(GLfloat*)*geomCount);
 	int i = 0;
 	for(kuhl_geometry *g = modelgeom; g != NULL; g=g->next)
 	{
 		/* allocate space to store velocity information for all of the
 		 * vertices in this kuhl_geometry */
-		particles[i] = malloc(sizeof(particle)*g->vertex_count);
-		for(unsigned int j=0; j<g->vertex_count; j++)
-			vec3f_set(particles[i][j].velocity, 0,0,0);
+		velocities[i] = calloc(g->vertex_count*3, sizeof(GLfloat));
 
 		/* Change the geometry to be drawn as points */
 		g->primitive_type = GL_POINTS; // Comment out this line to default to triangle rendering.
@@ -10,6 +10,14 @@
  * calls). For more information, see:
  * https://stackoverflow.com/questions/37058648/how-to-render-numerous-objects-in-opengl-efficiently
  *
+ * If the model is animated, each copy is at a different point in the
+ * animation. The animations for all of the copies are calculated in
+ * parallel by the library's thread pool (see
+ * kuhl_anim_instance_update_many()) and only the upload of the bone
+ * matrices (see kuhl_anim_instance_upload()) and the drawing happen
+ * on the main thread. A different model can be specified on the command
+ * line.
+ *
  * @author Scott Kuhl
  */
 
@@ -43,6 +51,9 @@ static const float initCamUp[3]   = {0,1,0};
 
 #define NUM_MODELS 5000
 static float positions[NUM_MODELS][3];
+static float timeOffsets[NUM_MODELS]; /**< Each model starts at a different point in the animation */
+static kuhl_anim_instance instances[NUM_MODELS];
+static long animMicroseconds = 0; /**< Time spent updating animations in the last frame */
 
 #define GLSL_VERT_FILE "viewer.vert"
 #define GLSL_FRAG_FILE "viewer.frag"
@@ -98,7 +109,7 @@ void display()
 			
 			float fps = bufferswap_fps(); // get current fps
 			char message[1024];
-			snprintf(message, 1024, "FPS: %0.2f", fps); // make a string with fps in it
+			snprintf(message, 1024, "FPS: %0.2f Anim: %0.2fms", fps, animMicroseconds/1000.0f); // make a string with fps in it
 			float labelColor[3] = { 1.0f,1.0f,1.0f };
 			float labelBg[4] = { 0.0f,0.0f,0.0f,.3f };
 
@@ -178,7 +189,7 @@ void display()
 			                   modelview); // value
 
 			kuhl_errorcheck();
-			kuhl_geometry_draw(modelgeom); /* Draw the model */
+			kuhl_anim_instance_draw(&instances[i]); /* Draw the model */
 			kuhl_errorcheck();
 		}
 
@@ -217,7 +228,13 @@ void display()
 	 * animation to repeat. */
 	double time = glfwGetTime();
 	dgr_setget("time", &time, sizeof(double));
-	kuhl_update_model(modelgeom, 0, fmod(time,10));
+	long animStart = kuhl_microseconds();
+	for(int i=0; i<NUM_MODELS; i++)
+		instances[i].time = fmod(time+timeOffsets[i], 10);
+	kuhl_anim_instance_update_many(instances, NUM_MODELS);
+	animMicroseconds = kuhl_microseconds() - animStart;
+	/* Send the bones for all of the models to the GPU at once. */
+	kuhl_anim_instance_upload(instances, NUM_MODELS);
 
 	viewmat_end_frame();
 
@@ -252,6 +269,8 @@ int main(int argc, char** argv)
 
 	// Load the model from the file
 	const char *modelFile = "../models/duck/duck.dae";
+	if(argc > 1)
+		modelFile = argv[1];
 	modelgeom = kuhl_load_model(modelFile, NULL, program, bbox);
 
 
@@ -261,6 +280,8 @@ int main(int argc, char** argv)
 		positions[i][0] = drand48()*50-25;
 		positions[i][1] = drand48()*50-25;
 		positions[i][2] = drand48()*50-25;
+		timeOffsets[i] = drand48()*10;
+		kuhl_anim_instance_new(&instances[i], modelgeom);
 	}
 	
 	while(!glfwWindowShouldClose(kuhl_get_window()))
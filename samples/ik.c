@@ -69,37 +69,36 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
  * the arm1 matrix applied to it. */
 void get_arm_matrices(float arm1[16], float arm2[16], float angles[])
 {
-	list *stack = list_new(16, sizeof(float)*16, NULL);
+	mat4f_stack stack;
+	mat4f_stack_init(&stack);
 
 	float baseRotate[16];
 	mat4f_rotateEuler_new(baseRotate, angles[0], angles[1], angles[2], "XYZ");
-	mat4f_stack_mult(stack, baseRotate);
-	mat4f_stack_push(stack);
+	mat4f_stack_mult(&stack, baseRotate);
+	mat4f_stack_push(&stack);
 
 	float scale[16];
 	mat4f_scale_new(scale, .5, 4, .5);
 	float decenter[16];
 	mat4f_translate_new(decenter, 0, .5, 0);
 
-	mat4f_stack_mult(stack, scale);
-	mat4f_stack_mult(stack, decenter);
-	mat4f_stack_peek(stack, arm1);
-	mat4f_stack_pop(stack);
+	mat4f_stack_mult(&stack, scale);
+	mat4f_stack_mult(&stack, decenter);
+	mat4f_stack_peek(&stack, arm1);
+	mat4f_stack_pop(&stack);
 
 	float trans[16];
 	mat4f_translate_new(trans, 0, 4, 0);
-	mat4f_stack_mult(stack, trans);
+	mat4f_stack_mult(&stack, trans);
 
 	mat4f_rotateEuler_new(baseRotate, angles[3], angles[4], angles[5], "XYZ");
-	mat4f_stack_mult(stack, baseRotate);
-	mat4f_stack_push(stack);
+	mat4f_stack_mult(&stack, baseRotate);
+	mat4f_stack_push(&stack);
 
-	mat4f_stack_mult(stack, scale);
-	mat4f_stack_mult(stack, decenter);
-	mat4f_stack_peek(stack, arm2);
-	mat4f_stack_pop(stack);
-
-	list_free(stack);
+	mat4f_stack_mult(&stack, scale);
+	mat4f_stack_mult(&stack, decenter);
+	mat4f_stack_peek(&stack, arm2);
+	mat4f_stack_pop(&stack);
 }
 
 /* Given a list of angles, calculate end effector location */
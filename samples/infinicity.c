@@ -1063,14 +1063,19 @@ void display()
 							modelview); // value
 		kuhl_geometry_draw(&roads);
 
+		/* Calculate the modelview matrix for every cell at once. */
+		float cellModelview[10][10][16];
+		for (int i = 0; i < 10; i++)
+			for (int j = 0; j < 10; j++)
+				mat4f_translate_new(cellModelview[i][j], i-4.8, 0, -j+shiftBreak);
+		mat4f_mult_mat4f_batch(&cellModelview[0][0][0], viewMat, &cellModelview[0][0][0], 10*10);
+
 		for (int i = 0; i < 10; i++) {
 			for (int j = 0; j < 10; j++) {	
-			mat4f_translate_new(transMat, i-4.8, 0, -j+shiftBreak);
-			mat4f_mult_mat4f_many(modelview, viewMat, transMat, NULL);
 			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
 							1, // number of 4x4 float matrices
 							0, // transpose
-							modelview); // value
+							cellModelview[i][j]); // value
 			kuhl_errorcheck();
 			kuhl_geometry_draw(&building[i][j]);
 			kuhl_geometry_draw(&windows[i][j]);
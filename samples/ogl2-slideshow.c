@@ -20,191 +20,245 @@
 #include <sys/stat.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
 #include "libkuhl.h"
 
 #define SCROLL_SPEED 30  // number of seconds to scroll past one screen-width of image.
-#define MAX_TILES 100
 #define SLIDESHOW_WAIT 10 // time in seconds to wait when autoadvance is turned on.
-#define MAX_TILES 100
 
 int autoAdvance = 0; // Automatically advance from image to image after a time out.
 double lastAdvance = 0; // Time (in ms from when our program started) that we advanced picture.
 float scrollAmount = 0; // How far has the image scrolled?
 
-/* The current image that we are displaying. */
-GLuint numTiles=0;
-GLuint texNames[MAX_TILES];
-float aspectRatio;
+/* The current image that we are displaying. Images are converted
+ * into tiled image pyramids (see tiledimage.h) the first time they are
+ * displayed. Only the tiles which are visible are uploaded to the
+ * GPU, at the resolution that is needed. */
+tiledimage *image = NULL;
+tilecache *cache = NULL;
+float aspectRatio = 1;
+int displayLevel = 0; // Level of detail used in the last frame
+
+/* The next image is opened (and converted if needed) in the
+ * background so that advancing to it is quick. The prefetch thread
+ * only uses the values in prefetchRequest, which are set before the
+ * thread starts. */
+typedef struct
+{
+	int index;    // Image to open
+	int level;    // Level of detail to read ahead
+	int tileSize; // Tile size if the image needs to be converted
+} prefetch_request;
+prefetch_request prefetchRequest = { -1, 0, 512 };
+tiledimage *prefetchImage = NULL;
+#ifdef HAVE_PTHREADS
+pthread_t prefetchThread;
+int prefetchRunning = 0;
+#endif
 
 int alreadyDisplayedTexture = 0; // Used to determine if we need to reload currentTexture.
 int currentTexture = 0; // The texture to be displayed.
 int totalTextures = 0;
 char **globalargv = NULL;
+int cache_tile_size = 0; // Tile size of the tiles in cache
 
-/* Readfile uses imageio to read in an image, and binds it to an OpenGL
- * texture name.  Requires OpenGL 2.0 or better.
- *
- * filename: name of file to load
- *
- * texName: A pointer to where the OpenGL texture name should be stored.
- * (Remember that the "texture name" is really just some unsigned int).
- *
- * returns: aspect ratio of the image in the file.
- */
-float readfile(char *filename, GLuint *texName, GLuint *numTiles)
+int getNextTexture()
 {
-	static int verbose=1;  // change this to 0 to print out less info
-
-	/* Try to load the image. */
-#if KUHL_UTIL_USE_IMAGEMAGICK
-	imageio_info iioinfo;
-	iioinfo.filename = filename;
-	iioinfo.type = CharPixel;
-	iioinfo.map = "RGBA";
-	unsigned char *image = (unsigned char*) imagein(&iioinfo);
-	int width  = (int)iioinfo.width;
-	int height = (int)iioinfo.height;
-#else
-	int width  = -1;
-	int height = -1;
-	int comp = -1;
-	int requestedComponents = STBI_rgb_alpha;
-	stbi_set_flip_vertically_on_load(1);
-	unsigned char *image = (unsigned char*) stbi_load(filename, &width, &height, &comp, requestedComponents);
-#endif
+	int next = currentTexture+1;
+	if(next >= totalTextures)
+		return 0;
+	return next;
+}
 
-	if(image == NULL)
-	{
-		msg(MSG_FATAL, "Unable to read image: %s\n", filename);
-		return -1;
-	}
+int getPrevTexture()
+{
+	int next = currentTexture-1;
+	if(next < 0)
+		return totalTextures-1;
+	return next;
+}
 
-	/* "image" is a 1D array of characters (unsigned bytes) with four
-	 * bytes for each pixel (red, green, blue, alpha). The data in "image"
-	 * is in row major order. The first 4 bytes are the color information
-	 * for the lowest left pixel in the texture. */
-	float original_aspectRatio = (float)width/height;
-	if(verbose)
-		msg(MSG_INFO, "Finished reading %s (%dx%d)\n", filename, width, height);
-
-	/* OpenGL only supports textures if they are small enough. If
-	 * the texture is too large, we need to split it into smaller
-	 * textures and render each texture on its own
-	 * quad. Typically, the limit is 4096 pixels in each
-	 * dimension. This code will always split the image vertically
-	 * in half...and then decide how many tiles are necessary
-	 * horizontally. This allows for long horizontal panoramas but
-	 * not long vertical panoramas. */
-	
-	/* Since we display image as being two tiles tall, make sure
-	 * image isn't too tall. */
-	if(height > 4096*2)
+/* Opens the image that we expect to display next and asks the OS to
+ * start reading it. Runs on a background thread if possible. */
+static void* prefetch(void *arg)
+{
+	const prefetch_request *request = (const prefetch_request*) arg;
+	prefetchImage = tiledimage_open_image(globalargv[request->index], request->tileSize);
+	if(prefetchImage)
+		tiledimage_prefetch(prefetchImage, request->level);
+	return NULL;
+}
+
+static void prefetch_start(int textureIndex)
+{
+	prefetchRequest.index = textureIndex;
+	prefetchRequest.level = displayLevel;
+	prefetchRequest.tileSize = kuhl_config_int("tiledimage.tilesize", 512, 512);
+	prefetchImage = NULL;
+#ifdef HAVE_PTHREADS
+	if(pthread_create(&prefetchThread, NULL, prefetch, &prefetchRequest) == 0)
 	{
-		msg(MSG_FATAL, "Source image must <= 8192 pixels tall.");
-		exit(EXIT_FAILURE);
+		prefetchRunning = 1;
+		return;
 	}
+#endif
+	prefetch(&prefetchRequest);
+}
 
-	int subimgH = height/2; // height of a the tiles
-	int workingWidth = width;
-	*numTiles = 1; // number of tiles in horizontal direction
-	/* Calculate number of tiles horizontally we need. */
-	while(workingWidth > 4096)
+/* Returns the prefetched image if it is textureIndex (waiting for the
+ * prefetch to finish if necessary), otherwise closes it and returns
+ * NULL. */
+static tiledimage* prefetch_finish(int textureIndex)
+{
+#ifdef HAVE_PTHREADS
+	if(prefetchRunning)
 	{
-		/* If image is too wide, split the width of the tile
-		 * in half---doubling the number of tiles in the
-		 * horizontal direction */
-		*numTiles = *numTiles * 2;
-		workingWidth = workingWidth / 2;
+		pthread_join(prefetchThread, NULL);
+		prefetchRunning = 0;
 	}
-	int subimgW = workingWidth;
-
-	if(*numTiles > MAX_TILES/2.0)
+#endif
+	tiledimage *result = prefetchImage;
+	if(result != NULL && prefetchRequest.index != textureIndex)
 	{
-		msg(MSG_FATAL, "Too many tiles");
-		exit(EXIT_FAILURE);
+		tiledimage_close(result);
+		result = NULL;
 	}
+	prefetchImage = NULL;
+	prefetchRequest.index = -1;
+	return result;
+}
 
-	glTexImage2D(GL_PROXY_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	int tmp;
-	glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tmp);
-
-	if(tmp == 0)
+/* Closes the image that is already loaded and then opens the current
+ * image. */
+void loadTexture(int textureIndex)
+{
+	if(image)
 	{
-		msg(MSG_FATAL, "%s: File is too large (%d x %d). I can't load it!\n", filename, subimgW, subimgH);
-		free(image);
-		exit(EXIT_FAILURE);
+		tilecache_print_stats(cache);
+		tilecache_evict_image(cache, image);
+		tiledimage_close(image);
 	}
 
-
-	/* Generate all of the textures that we need. */
-	glGenTextures(*numTiles*2, texName);
-
-	for(GLuint curTile=0; curTile < *numTiles*2; curTile = curTile+2)
+	image = prefetch_finish(textureIndex);
+	if(image == NULL)
+		image = tiledimage_open_image(globalargv[textureIndex], kuhl_config_int("tiledimage.tilesize", 512, 512));
+	if(image == NULL)
+		msg(MSG_ERROR, "Unable to display image: %s\n", globalargv[textureIndex]);
+	else
 	{
-		/* Prepare to copy the data from the array into the
-		 * texture, tell OpenGL to skip pixels appropriately
-		 * so that each tile gets the right part of the
-		 * image. */
-		glPixelStorei(GL_UNPACK_ROW_LENGTH,  width);
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS,   0);
-
-		glBindTexture(GL_TEXTURE_2D, texName[curTile]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-		             0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-
-		glPixelStorei( GL_UNPACK_SKIP_PIXELS, curTile/2.0*subimgW );
-		glPixelStorei( GL_UNPACK_SKIP_ROWS, subimgH);
-
-		glBindTexture(GL_TEXTURE_2D, texName[curTile+1]);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, subimgW, subimgH,
-		             0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+		msg(MSG_INFO, "Displaying %s (%dx%d)\n", globalargv[textureIndex], image->width, image->height);
+		aspectRatio = image->aspectRatio;
+
+		/* The cache must use the same tile size as the image. */
+		if(cache == NULL || image->tileSize != cache_tile_size)
+		{
+			tilecache_free(cache);
+			cache = tilecache_new(kuhl_config_int("slideshow.tiles", 256, 256), image->tileSize,
+			                      kuhl_config_int("slideshow.uploads", 8, 8));
+			cache_tile_size = image->tileSize;
+		}
 	}
 
-	free(image);
-	return original_aspectRatio;
-}
+	scrollAmount = 0;
+	lastAdvance = glfwGetTime();
 
-int getNextTexture()
-{
-	int next = currentTexture+1;
-	if(next >= totalTextures)
-		return 0;
-	return next;
+	if(totalTextures > 1)
+		prefetch_start(getNextTexture());
 }
 
-int getPrevTexture()
+/* Draws the part of a tile at 'level' that is in the rectangle of
+ * pixels (px0,py0) to (px1,py1). If the tile isn't in the cache, draws
+ * the same area from a coarser level instead. The coarsest level
+ * (a single tile) is always uploaded. */
+static void draw_tile(int level, int tx, int ty, int px0, int py0, int px1, int py1,
+                      float x0, float y0, float x1, float y1)
 {
-	int next = currentTexture-1;
-	if(next < 0)
-		return totalTextures-1;
-	return next;
+	int T = image->tileSize;
+	for(int lv=level; lv<image->numLevels; lv++)
+	{
+		int d = lv-level;
+		int flags = TILECACHE_RESIDENT;
+		if(lv == image->numLevels-1)
+			flags = TILECACHE_FORCE;
+		else if(d == 0)
+			flags = 0;
+		GLuint tex = tilecache_get(cache, image, lv, tx>>d, ty>>d, flags);
+		if(tex == 0)
+			continue;
+
+		/* Location of the rectangle within the tile at this level. */
+		float scale = 1.0f/(1<<d);
+		float s0 = (px0*scale - (tx>>d)*T) / T;
+		float s1 = (px1*scale - (tx>>d)*T) / T;
+		float t0 = (py0*scale - (ty>>d)*T) / T;
+		float t1 = (py1*scale - (ty>>d)*T) / T;
+
+		glBindTexture(GL_TEXTURE_2D, tex);
+		glBegin(GL_QUADS);
+		glTexCoord2f(s0, t0); glVertex2d(x0, y0); // lower left
+		glTexCoord2f(s1, t0); glVertex2d(x1, y0); // lower right
+		glTexCoord2f(s1, t1); glVertex2d(x1, y1); // upper right
+		glTexCoord2f(s0, t1); glVertex2d(x0, y1); // upper left
+		glEnd();
+		return;
+	}
 }
 
-/* Deletes any tiles that are already loaded and then loads up the
- * current texture image. */
-void loadTexture(int textureIndex)
+/* Draws the tiles of the current image that are visible in this
+ * process's frustum. The image fills the master frustum vertically
+ * and its left edge is at left. */
+static void draw_image(const float frustum[6], const float masterFrustum[6], float left, float quadWidth)
 {
-	if(numTiles > 0)
-		glDeleteTextures(numTiles*2, texNames);
+	float masterFrustumHeight = masterFrustum[3]-masterFrustum[2];
 
-	scrollAmount = 0;
-	aspectRatio = readfile(globalargv[textureIndex], texNames, &numTiles);
-	lastAdvance = glfwGetTime();
+	/* Choose the level where one image pixel is about the size of
+	 * one screen pixel. */
+	int viewport[4];
+	viewmat_get_viewport(viewport, 0);
+	float screenPixelsPerUnit = viewport[3] / (frustum[3]-frustum[2]);
+	float imagePixelsPerUnit = image->height / masterFrustumHeight;
+	int level = 0;
+	while(imagePixelsPerUnit >= 2*screenPixelsPerUnit && level < image->numLevels-1)
+	{
+		imagePixelsPerUnit /= 2;
+		level++;
+	}
+	displayLevel = level;
+
+	const tiledimage_level *l = &(image->levels[level]);
+	int T = image->tileSize;
+	float unitsPerPixelX = quadWidth / l->width;
+	float unitsPerPixelY = masterFrustumHeight / l->height;
+
+	/* Range of tiles which are visible */
+	int txMin = (int) floorf((frustum[0]-left) / (T*unitsPerPixelX));
+	int txMax = (int) floorf((frustum[1]-left) / (T*unitsPerPixelX));
+	int tyMin = (int) floorf((frustum[2]-masterFrustum[2]) / (T*unitsPerPixelY));
+	int tyMax = (int) floorf((frustum[3]-masterFrustum[2]) / (T*unitsPerPixelY));
+	if(txMin < 0) txMin = 0;
+	if(tyMin < 0) tyMin = 0;
+	if(txMax > (int) l->tilesX-1) txMax = l->tilesX-1;
+	if(tyMax > (int) l->tilesY-1) tyMax = l->tilesY-1;
+
+	for(int ty=tyMin; ty<=tyMax; ty++)
+	{
+		for(int tx=txMin; tx<=txMax; tx++)
+		{
+			int px0 = tx*T;
+			int py0 = ty*T;
+			int px1 = px0+T < (int) l->width  ? px0+T : (int) l->width;
+			int py1 = py0+T < (int) l->height ? py0+T : (int) l->height;
+			draw_tile(level, tx, ty, px0, py0, px1, py1,
+			          left + px0*unitsPerPixelX, masterFrustum[2] + py0*unitsPerPixelY,
+			          left + px1*unitsPerPixelX, masterFrustum[2] + py1*unitsPerPixelY);
+		}
+	}
 }
 
 void display(void)
@@ -248,20 +302,15 @@ void display(void)
 	        -1, 1);
 	glMatrixMode(GL_MODELVIEW);
 
-	// Middle of master frustum in the vertical direction. It divides the top
-	// tiles from the bottom tiles.
-	float masterFrustumMid = (masterFrustum[2]+masterFrustum[3])/2;
 	// Dimensions of the master view frustum
 	float masterFrustumWidth  = masterFrustum[1]-masterFrustum[0];
 	float masterFrustumHeight = masterFrustum[3]-masterFrustum[2];
 
 	// The width of the quad (in frustum units). Since the image will
 	// be stretched to fit the screen vertically, and our units are in
-	// frustum units, the width of the tile is the height of the
-	// frustum times the aspect ratio divided by the number of tiles
-	// in the horizontal direction.
+	// frustum units, the width of the image is the height of the
+	// frustum times the aspect ratio.
 	float quadWidth = aspectRatio * masterFrustumHeight;
-	float tileWidth = quadWidth/numTiles;
 
 // TODO: Maybe just scale the image vertically if the image almost fits in the screen horizontally?
 
@@ -314,32 +363,15 @@ void display(void)
 
 	glClear(GL_COLOR_BUFFER_BIT);
 	glEnable(GL_TEXTURE_2D);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
 	glColor3f(1,1,1); // color of quad
 
-	// Draw the top and bottom quad for each of the tiles going across the screen horizontally. */
-	for(GLuint i=0; i<numTiles*2; i=i+2)
+	if(image != NULL)
 	{
-		float tileLeft  = (i/2  )*tileWidth + masterFrustum[0];
-		float tileRight = (i/2+1)*tileWidth + masterFrustum[0];
-		
-		// Draw bottom tile
-		glBindTexture(GL_TEXTURE_2D, texNames[i]);
-		glBegin(GL_QUADS);
-		glTexCoord2f(0.0, 0.0); glVertex2d(tileLeft -scrollAmount, masterFrustum[2]); // lower left
-		glTexCoord2f(1.0, 0.0); glVertex2d(tileRight-scrollAmount, masterFrustum[2]); // lower right
-		glTexCoord2f(1.0, 1.0); glVertex2d(tileRight-scrollAmount, masterFrustumMid); // upper right
-		glTexCoord2f(0.0, 1.0); glVertex2d(tileLeft -scrollAmount, masterFrustumMid); // upper left
-		glEnd();
-
-		// Draw top tile
-		glBindTexture(GL_TEXTURE_2D, texNames[i+1]);
-		glBegin(GL_QUADS);
-		glTexCoord2f(0.0, 0.0); glVertex2d(tileLeft -scrollAmount, masterFrustumMid); // lower left
-		glTexCoord2f(1.0, 0.0); glVertex2d(tileRight-scrollAmount, masterFrustumMid); // lower right
-		glTexCoord2f(1.0, 1.0); glVertex2d(tileRight-scrollAmount, masterFrustum[3]); // upper right
-		glTexCoord2f(0.0, 1.0); glVertex2d(tileLeft -scrollAmount, masterFrustum[3]); // upper left
-		glEnd();
+		tilecache_begin_frame(cache);
+		draw_image(frustum, masterFrustum, masterFrustum[0]-scrollAmount, quadWidth);
 	}
+	glBindTexture(GL_TEXTURE_2D, 0);
 
 	glDisable(GL_TEXTURE_2D);
 	
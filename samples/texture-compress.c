@@ -0,0 +1,55 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Compresses images into block compressed textures (see
+ * texcompress.h). Each image is written to a file with the same name
+ * and ".dds" appended, which is where kuhl_read_texture_file() and the
+ * model loader look for it. This program doesn't use the graphics
+ * card, so it can be run on machines without one.
+ *
+ * Usage: texture-compress [-f auto|bc1|bc3|bc7] image1.jpg [image2.png ...]
+ *
+ * The default format (auto) uses BC1 for opaque images and BC3 for
+ * images with transparency. BC7 looks better but requires OpenGL 4.2.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libkuhl.h"
+
+int main(int argc, char** argv)
+{
+	int format = TEXCOMPRESS_AUTO;
+	int first = 1;
+	if(argc > 2 && strcmp(argv[1], "-f") == 0)
+	{
+		format = texcompress_format_parse(argv[2]);
+		first = 3;
+	}
+	if(first >= argc || format < 0)
+	{
+		msg(MSG_FATAL, "Usage: %s [-f auto|bc1|bc3|bc7] image1.jpg [image2.png ...]", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int failures = 0;
+	for(int i=first; i<argc; i++)
+	{
+		char ddsFilename[1024];
+		snprintf(ddsFilename, 1024, "%s.dds", argv[i]);
+		if(texcompress_convert(argv[i], ddsFilename, format) == 0)
+			failures++;
+	}
+	if(failures > 0)
+	{
+		msg(MSG_ERROR, "Failed to compress %d of %d images.", failures, argc-first);
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
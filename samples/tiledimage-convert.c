@@ -0,0 +1,51 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Converts images into tiled image pyramids (see tiledimage.h)
+ * so that ogl2-slideshow can display them without converting them
+ * first. Each image is written to a file with the same name and
+ * ".kuhltiles" appended, which is where ogl2-slideshow looks for it.
+ *
+ * Usage: tiledimage-convert [-t tileSize] image1.jpg [image2.png ...]
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libkuhl.h"
+
+int main(int argc, char** argv)
+{
+	int tileSize = 512;
+	int first = 1;
+	if(argc > 2 && strcmp(argv[1], "-t") == 0)
+	{
+		tileSize = atoi(argv[2]);
+		first = 3;
+	}
+	if(first >= argc || tileSize < 16)
+	{
+		msg(MSG_FATAL, "Usage: %s [-t tileSize] image1.jpg [image2.png ...]", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int failures = 0;
+	for(int i=first; i<argc; i++)
+	{
+		char tileFilename[1024];
+		snprintf(tileFilename, 1024, "%s.kuhltiles", argv[i]);
+		if(tiledimage_convert(argv[i], tileFilename, tileSize) == 0)
+			failures++;
+	}
+	if(failures > 0)
+	{
+		msg(MSG_ERROR, "Failed to convert %d of %d images.", failures, argc-first);
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
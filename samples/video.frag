@@ -0,0 +1,24 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+out vec4 fragColor;
+in vec2 out_TexCoord;
+
+/* The Y, U and V planes of a video frame (see video_player in
+ * video.h). The U and V textures are usually smaller than the Y
+ * texture. */
+uniform sampler2D texY;
+uniform sampler2D texU;
+uniform sampler2D texV;
+
+/* Converts YUV into RGB, set by video_player_uniforms(). */
+uniform mat3 YUVMatrix;
+uniform vec3 YUVOffset;
+
+void main() 
+{
+	vec3 yuv = vec3(texture(texY, out_TexCoord).r,
+	                texture(texU, out_TexCoord).r,
+	                texture(texV, out_TexCoord).r);
+	vec3 rgb = YUVMatrix * (yuv - YUVOffset);
+	fragColor = vec4(clamp(rgb, 0.0, 1.0), 1.0);
+}
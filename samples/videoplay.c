@@ -18,60 +18,40 @@
 static GLuint program = 0; /**< id value for the GLSL program */
 
 static kuhl_geometry quad;
-static video_state* video = NULL;
+static video_player* video = NULL;
 static char *videofilename = NULL;
 
 
-/* Call to update the video_state struct with the latest information */
+/* Call to upload the frame of the video that should be displayed now */
 static void update_video()
 {
-	static GLuint texId = 0;
 	static long startTime = 0;
 
 	if(video == NULL) // if it is our first time
 	{
-		/* Get the next frame */
-		video = video_get_next_frame(video, videofilename);
+		/* Open the video and start decoding frames in the background */
+		video = video_player_new(videofilename);
 		if(video == NULL)
 		{
 			msg(MSG_FATAL, "Failed to load video file %s\n", videofilename);
 			exit(EXIT_FAILURE);
 		}
-		
-		/* Send the new frame to OpenGL */
-		texId = kuhl_read_texture_array(video->data, video->width, video->height, 3, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 
 		startTime = kuhl_microseconds();
-		
-		/* Tell this piece of geometry to use the texture we just loaded. */
-		kuhl_geometry_texture(&quad, texId, "tex", KG_WARN);
 
-		/* Get the frame that should be displayed next */
-		video = video_get_next_frame(video, videofilename);
-	}
-	else
-	{
-		/* If previously loaded frame is to be displayed in the future, do nothing. */
-		if(video->usec > kuhl_microseconds()-startTime)
-			return;
-
-		/* Display the frame we previously loaded */
-		glDeleteTextures(1, &texId);
-		texId = kuhl_read_texture_array(video->data, video->width, video->height, 3, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
-
-		/* Tell this piece of geometry to use the texture we just
-		 * loaded. Frequently, texId won't change because we just
-		 * deleted the texture and then reloaded a texture (causing
-		 * the same id to be used again). */
-		kuhl_geometry_texture(&quad, texId, "tex", KG_WARN);
-
-		/* Get the next frame that should be displayed next */
-		video = video_get_next_frame(video, videofilename);
+		/* Tell this piece of geometry to use the textures that the
+		 * video frames are uploaded into. The Y, U and V planes are
+		 * converted to RGB in video.frag */
+		kuhl_geometry_texture(&quad, video->tex[0], "texY", KG_WARN);
+		kuhl_geometry_texture(&quad, video->tex[1], "texU", KG_WARN);
+		kuhl_geometry_texture(&quad, video->tex[2], "texV", KG_WARN);
 	}
 
+	/* Upload the newest frame that should be displayed by now (if it
+	 * isn't already in the textures). */
+	video_player_update(video, kuhl_microseconds()-startTime);
 }
 
-
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -89,6 +69,8 @@ void display()
 	counter++;
 	if(counter % 60 == 0)
 		msg(MSG_INFO, "FPS: %0.2f\n", bufferswap_fps());
+	if(counter % 600 == 0 && video != NULL)
+		video_player_print_stats(video);
 	
 	/* Render the scene once for each viewport. Frequently one
 	 * viewport will fill the entire screen. However, this loop will
@@ -131,8 +113,8 @@ void display()
 		viewmat_get(viewMat, perspective, viewportID);
 
 		/* Create a scale matrix.  Flip the video vertically since
-		   ffmpeg reads in the textures are "upside down" according to
-		   OpenGL. */
+		   the first row of each video frame is the top row but OpenGL
+		   expects the first row of a texture to be the bottom. */
 		float scaleMatrix[16];
 		if(video != NULL)
 			mat4f_scale_new(scaleMatrix, 3*video->aspectRatio, -3, 3);
@@ -149,6 +131,10 @@ void display()
 		glUseProgram(program);
 		kuhl_errorcheck();
 		
+		/* Send the colorspace of the video to the fragment program. */
+		if(video != NULL)
+			video_player_uniforms(video, program);
+
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
 		                   1, // number of 4x4 float matrices
@@ -233,7 +219,7 @@ int main(int argc, char** argv)
 
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
-	program = kuhl_create_program("texture.vert", "texture.frag");
+	program = kuhl_create_program("texture.vert", "video.frag");
 	glUseProgram(program);
 	kuhl_errorcheck();
 
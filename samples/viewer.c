@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
@@ -24,6 +25,7 @@ static kuhl_geometry *fpsgeom = NULL;
 static kuhl_geometry *modelgeom  = NULL;
 static kuhl_geometry *origingeom = NULL;
 static float bbox[6];
+static float *geomBboxes = NULL; /**< Bounding box of each kuhl_geometry in modelgeom */
 
 static int fitToView=0;  // was --fit option used?
 
@@ -98,6 +100,48 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 }
 
 
+/** Calculates the bounding box of the vertices in each kuhl_geometry
+ * in a list (before GeomTransform is applied) so that the size of
+ * each piece of a model on the screen can be reported to the texture
+ * streaming code.
+ *
+ * @param geom The list of geometry.
+ *
+ * @return An array of bounding boxes (xmin, xmax, ymin, ...), six
+ * floats for each kuhl_geometry in the list.
+ */
+static float* get_geometry_bboxes(kuhl_geometry *geom)
+{
+	int count = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		count++;
+	float *result = kuhl_malloc(sizeof(float)*6*(count > 0 ? count : 1));
+
+	for(int i=0; geom != NULL; geom = geom->next, i++)
+	{
+		float *b = result+6*i;
+		b[0] = b[2] = b[4] = FLT_MAX;
+		b[1] = b[3] = b[5] = -FLT_MAX;
+		GLint size = 0;
+		GLfloat *pos = kuhl_geometry_attrib_get(geom, "in_Position", &size);
+		for(GLint v=0; pos != NULL && v+2 < size; v += 3)
+		{
+			for(int c=0; c<3; c++)
+			{
+				if(pos[v+c] < b[2*c])
+					b[2*c] = pos[v+c];
+				if(pos[v+c] > b[2*c+1])
+					b[2*c+1] = pos[v+c];
+			}
+		}
+		/* Fall back to an empty box at the origin. */
+		if(b[0] > b[1])
+			for(int c=0; c<6; c++)
+				b[c] = 0;
+	}
+	return result;
+}
+
 /** Given a bounding box (bbox) calculate a matrix that places the
  * bounding box on top of the specified location. "On top" means that
  * if you specify 0,0,0, then the model will be scaled to fit into a
@@ -217,6 +261,20 @@ void display()
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
+		/* If texture streaming is enabled, only load each piece of
+		 * the model's textures at the resolution needed for its
+		 * size on the screen. */
+		if(geomBboxes != NULL)
+		{
+			int i = 0;
+			for(kuhl_geometry *g = modelgeom; g != NULL; g = g->next, i++)
+			{
+				float geomModelview[16];
+				mat4f_mult_mat4f_new(geomModelview, modelview, g->matrix);
+				kuhl_geometry_texture_usage(g, texstream_screen_size(geomBboxes+6*i, geomModelview, perspective, viewport), 0);
+			}
+		}
+
 		kuhl_errorcheck();
 		kuhl_geometry_draw(modelgeom); /* Draw the model */
 		kuhl_errorcheck();
@@ -358,6 +416,8 @@ int main(int argc, char** argv)
 
 	// Load the model from the file
 	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
+	if(texstream_enabled())
+		geomBboxes = get_geometry_bboxes(modelgeom);
 	if(showOrigin)
 		origingeom = kuhl_load_model("../models/origin/origin.obj", modelTexturePath, program, NULL);
 
@@ -8,6 +8,8 @@ in vec3 in_Color;    /* Vertex color */
 in vec4 in_BoneIndex;
 in vec4 in_BoneWeight;
 uniform mat4 BoneMat[128];
+uniform samplerBuffer BoneTex; /* Bone matrices for many instances, see kuhl_anim_instance_upload() */
+uniform int BoneOffset;        /* Index of this mesh's first matrix in BoneTex, -1 to use BoneMat */
 uniform int NumBones;
 
 uniform mat4 ModelView;
@@ -19,6 +21,19 @@ out vec3 out_Color;
 out vec3 out_Normal_CC;   // normal vector (camera coordinates)
 out vec3 out_Position_CC; // vertex position (camera coordinates)
 
+/* Returns the matrix for a bone. Each matrix in BoneTex is stored in
+ * four texels, one for each column. */
+mat4 boneMatrix(float index)
+{
+	if(BoneOffset < 0)
+		return BoneMat[int(index)];
+	int texel = (BoneOffset + int(index))*4;
+	return mat4(texelFetch(BoneTex, texel),
+	            texelFetch(BoneTex, texel+1),
+	            texelFetch(BoneTex, texel+2),
+	            texelFetch(BoneTex, texel+3));
+}
+
 void main() 
 {
 	// Copy texture coordinates and color to fragment program
@@ -31,10 +46,10 @@ void main()
 	{
 		/* If we have an animated model/character that contains bones,
 		   we need to account for the bone matrices. */
-		mat4 m = in_BoneWeight.x * BoneMat[int(in_BoneIndex.x)] +
-		         in_BoneWeight.y * BoneMat[int(in_BoneIndex.y)] +
-		         in_BoneWeight.z * BoneMat[int(in_BoneIndex.z)] +
-		         in_BoneWeight.w * BoneMat[int(in_BoneIndex.w)];
+		mat4 m = in_BoneWeight.x * boneMatrix(in_BoneIndex.x) +
+		         in_BoneWeight.y * boneMatrix(in_BoneIndex.y) +
+		         in_BoneWeight.z * boneMatrix(in_BoneIndex.z) +
+		         in_BoneWeight.w * boneMatrix(in_BoneIndex.w);
 		actualModelView = ModelView * m;
 	}
 	else
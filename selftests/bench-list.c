@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "list.h"
+#include "queue.h"
+#include "list-typed.h"
+#include "kuhl-util.h"
+
+/* Compares the speed of the generic list and queue (list.h, queue.h)
+ * with the typed versions generated by the macros in list-typed.h. */
+
+#define COUNT 1000000
+
+typedef struct
+{
+	float m[16];
+} matrix;
+
+LIST_TYPED(intlist, int)
+LIST_TYPED(matrixlist, matrix)
+QUEUE_TYPED(intqueue, int)
+
+static void report(const char *name, int64_t genericNs, int64_t typedNs, long genericSum, long typedSum)
+{
+	printf("%-24s generic %6.2f ns  typed %6.2f ns  speedup %5.2fx\n", name,
+	       (double) genericNs/COUNT, (double) typedNs/COUNT, (double) genericNs/typedNs);
+	if(genericSum != typedSum)
+		printf("ERROR: %s: the generic and typed versions gave different results (%ld, %ld)\n", name, genericSum, typedSum);
+}
+
+int main(void)
+{
+	int64_t start, genericNs, typedNs;
+	long genericSum = 0, typedSum = 0;
+
+	/* Append ints to a list, starting with a small capacity. */
+	list *l = list_new(4, sizeof(int), NULL);
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+		list_append(l, &i);
+	genericNs = kuhl_nanoseconds() - start;
+
+	intlist tl;
+	intlist_init(&tl, 4);
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+		intlist_append(&tl, i);
+	typedNs = kuhl_nanoseconds() - start;
+	report("int append", genericNs, typedNs, list_length(l), intlist_length(&tl));
+
+	/* Read every item. */
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+	{
+		int value = 0;
+		list_get(l, i, &value);
+		genericSum += value;
+	}
+	genericNs = kuhl_nanoseconds() - start;
+
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+		typedSum += intlist_at(&tl, i);
+	typedNs = kuhl_nanoseconds() - start;
+	report("int get", genericNs, typedNs, genericSum, typedSum);
+	list_free(l);
+	intlist_free(&tl);
+
+	/* Use a list of matrices as a stack. */
+	l = list_new(16, sizeof(matrix), NULL);
+	matrixlist ml;
+	matrixlist_init(&ml, 16);
+	matrix m = { { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1 } };
+	genericSum = typedSum = 0;
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+	{
+		m.m[12] = (float) (i % 8);
+		list_push(l, &m);
+		list_push(l, &m);
+		matrix top;
+		list_peek(l, &top);
+		genericSum += (long) top.m[12];
+		list_pop(l, NULL);
+		list_pop(l, NULL);
+	}
+	genericNs = kuhl_nanoseconds() - start;
+
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+	{
+		m.m[12] = (float) (i % 8);
+		matrixlist_push(&ml, m);
+		matrixlist_push(&ml, m);
+		typedSum += (long) matrixlist_peek(&ml)->m[12];
+		matrixlist_pop(&ml, NULL);
+		matrixlist_pop(&ml, NULL);
+	}
+	typedNs = kuhl_nanoseconds() - start;
+	report("matrix push/peek/pop", genericNs, typedNs, genericSum, typedSum);
+	list_free(l);
+	matrixlist_free(&ml);
+
+	/* Keep a few items in a queue, adding one and removing one each
+	 * time so that the read and write indices wrap around. */
+	queue *q = queue_new(8, sizeof(int));
+	intqueue tq;
+	intqueue_init(&tq, 8);
+	for(int i=0; i<5; i++)
+	{
+		queue_add(q, &i);
+		intqueue_add(&tq, i);
+	}
+	genericSum = typedSum = 0;
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+	{
+		int value = 0;
+		queue_add(q, &i);
+		queue_remove(q, &value);
+		genericSum += value;
+	}
+	genericNs = kuhl_nanoseconds() - start;
+
+	start = kuhl_nanoseconds();
+	for(int i=0; i<COUNT; i++)
+	{
+		int value = 0;
+		intqueue_add(&tq, i);
+		intqueue_remove(&tq, &value);
+		typedSum += value;
+	}
+	typedNs = kuhl_nanoseconds() - start;
+	report("int queue add/remove", genericNs, typedNs, genericSum, typedSum);
+	queue_free(q);
+
+	/* Check that the typed queue keeps items in order while it grows. */
+	for(int i=0; i<100; i++)
+		intqueue_add(&tq, COUNT+i);
+	int expect = COUNT-5, value;
+	while(intqueue_remove(&tq, &value))
+	{
+		if(value != expect)
+		{
+			printf("ERROR: intqueue returned %d instead of %d\n", value, expect);
+			break;
+		}
+		expect++;
+	}
+	intqueue_free(&tq);
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "ring.h"
+#include "queue.h"
+#include "kuhl-util.h"
+
+/* Measures how many items per second can be passed between threads
+ * with the rings in ring.h and with a queue protected by a mutex. */
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+
+#define ITEMS 4000000
+#define BATCH 64
+
+static ring *r;
+static queue *q;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int producers = 1;
+static long consumed = 0; /**< Items removed by all of the consumers */
+
+static void* ring_producer(void *arg)
+{
+	int batch = (int) (long) arg;
+	int items[BATCH];
+	for(int i=0; i<ITEMS/producers; i+=batch)
+	{
+		if(batch == 1)
+			ring_push_wait(r, &i, -1);
+		else
+		{
+			for(int j=0; j<batch; j++)
+				items[j] = i+j;
+			int pushed = 0;
+			while(pushed < batch)
+			{
+				pushed += ring_push_many(r, items+pushed, batch-pushed);
+				if(pushed < batch)
+				{
+					ring_push_wait(r, items+pushed, -1);
+					pushed++;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static void* ring_consumer(void *arg)
+{
+	int batch = (int) (long) arg;
+	int items[BATCH];
+	long long sum = 0;
+	/* Each consumer stops once all of the items have been removed by
+	 * any of the consumers. */
+	while(__atomic_load_n(&consumed, __ATOMIC_RELAXED) < ITEMS)
+	{
+		int n = batch == 1 ? 0 : ring_pop_many(r, items, batch);
+		if(n == 0)
+			n = ring_pop_wait(r, items, 1000);
+		for(int i=0; i<n; i++)
+			sum += items[i];
+		__atomic_fetch_add(&consumed, n, __ATOMIC_RELAXED);
+	}
+	return (void*) (long) sum;
+}
+
+static void* queue_producer(void *arg)
+{
+	for(int i=0; i<ITEMS/producers; i++)
+	{
+		pthread_mutex_lock(&mutex);
+		while(queue_length(q) >= 1024)
+			pthread_cond_wait(&changed, &mutex);
+		queue_add(q, &i);
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+static void* queue_consumer(void *arg)
+{
+	long long sum = 0;
+	while(1)
+	{
+		int value;
+		pthread_mutex_lock(&mutex);
+		while(queue_length(q) == 0 && consumed < ITEMS)
+			pthread_cond_wait(&changed, &mutex);
+		if(consumed >= ITEMS)
+		{
+			pthread_mutex_unlock(&mutex);
+			break;
+		}
+		queue_remove(q, &value);
+		consumed++;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&mutex);
+		sum += value;
+	}
+	return (void*) (long) sum;
+}
+
+/* Runs 'threads' producers and the same number of consumers. */
+static void run(const char *name, void* (*producer)(void*), void* (*consumer)(void*), int threads, int batch)
+{
+	pthread_t p[8], c[8];
+	producers = threads;
+	consumed = 0;
+	int64_t start = kuhl_nanoseconds();
+	for(int i=0; i<threads; i++)
+	{
+		pthread_create(&c[i], NULL, consumer, (void*) (long) batch);
+		pthread_create(&p[i], NULL, producer, (void*) (long) batch);
+	}
+	for(int i=0; i<threads; i++)
+	{
+		pthread_join(p[i], NULL);
+		pthread_join(c[i], NULL);
+	}
+	double sec = (kuhl_nanoseconds() - start) / 1e9;
+	printf("%-28s %7.2f million items/second\n", name, ITEMS / sec / 1e6);
+}
+
+int main(void)
+{
+	r = ring_new(1024, sizeof(int), RING_SPSC);
+	run("SPSC ring", ring_producer, ring_consumer, 1, 1);
+	run("SPSC ring, batches of 64", ring_producer, ring_consumer, 1, BATCH);
+	ring_free(r);
+
+	r = ring_new(1024, sizeof(int), RING_MPMC);
+	run("MPMC ring, 1x1", ring_producer, ring_consumer, 1, 1);
+	run("MPMC ring, 4x4", ring_producer, ring_consumer, 4, 1);
+	ring_free(r);
+
+	q = queue_new(1024, sizeof(int));
+	run("queue + mutex, 1x1", queue_producer, queue_consumer, 1, 1);
+	run("queue + mutex, 4x4", queue_producer, queue_consumer, 4, 1);
+	queue_free(q);
+	return 0;
+}
+
+#else
+int main(void)
+{
+	printf("This benchmark requires pthreads.\n");
+	return 0;
+}
+#endif
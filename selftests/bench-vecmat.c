@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "vecmat.h"
+#include "vecmat-batch.h"
+#include "kuhl-util.h"
+
+/* Measures how long the scalar and SIMD versions of the common 4x4
+ * matrix and quaternion functions take. */
+
+#define COUNT 1024
+#define REPEAT 2000
+
+static float mats[COUNT][16];
+static float vecs[COUNT][4];
+static float quats[COUNT][4];
+static float out[COUNT][16];
+static volatile float sink;
+
+static void report(const char *name, int64_t scalarNs, int64_t simdNs)
+{
+	double ops = (double) COUNT * REPEAT;
+	printf("%-20s scalar %7.2f ns  %-6s %7.2f ns  speedup %5.2fx\n", name,
+	       scalarNs/ops, vecmat_simd_name(), simdNs/ops, (double)scalarNs/simdNs);
+}
+
+/* Times a loop over all of the inputs, REPEAT times. */
+#define TIME(result, statement)	  \
+	do { \
+		int64_t start = kuhl_nanoseconds(); \
+		for(int r=0; r<REPEAT; r++) \
+			for(int i=0; i<COUNT; i++) \
+			{ statement; } \
+		result = kuhl_nanoseconds() - start; \
+		sink = out[COUNT/2][0]; \
+	} while(0)
+
+int main(void)
+{
+	for(int i=0; i<COUNT; i++)
+	{
+		double m[16];
+		mat4d_rotateEuler_new(m, drand48()*360, drand48()*360, drand48()*360, "XYZ");
+		m[12] = drand48(); m[13] = drand48(); m[14] = drand48();
+		mat4f_from_mat4d(mats[i], m);
+		vec4f_set(vecs[i], drand48(), drand48(), drand48(), 1);
+		vec4f_set(quats[i], drand48()-.5, drand48()-.5, drand48()-.5, drand48()-.5);
+		vec4f_normalize(quats[i]);
+	}
+
+	int64_t scalar, simd;
+	TIME(scalar, matNf_mult_matNf_new(out[i], mats[i], mats[(i+1)%COUNT], 4));
+	TIME(simd,   mat4f_mult_mat4f_simd(out[i], mats[i], mats[(i+1)%COUNT]));
+	report("mat4 * mat4", scalar, simd);
+
+	TIME(scalar, matNf_mult_vecNf_new(out[i], mats[i], vecs[i], 4));
+	TIME(simd,   mat4f_mult_vec4f_simd(out[i], mats[i], vecs[i]));
+	report("mat4 * vec4", scalar, simd);
+
+	TIME(scalar, mat4f_invert_new_scalar(out[i], mats[i]));
+	TIME(simd,   mat4f_invert_simd(out[i], mats[i]));
+	report("mat4 invert", scalar, simd);
+
+	TIME(scalar, quatf_slerp_new_scalar(out[i], quats[i], quats[(i+1)%COUNT], .3f));
+	TIME(simd,   quatf_slerp_simd(out[i], quats[i], quats[(i+1)%COUNT], .3f));
+	report("quat slerp", scalar, simd);
+
+	float m3[9];
+	TIME(scalar, mat3f_rotateQuatVec_new(m3, quats[i]); mat4f_from_mat3f(out[i], m3));
+	TIME(simd,   mat4f_rotateQuatVec_simd(out[i], quats[i]));
+	report("quat to mat4", scalar, simd);
+
+	/* A scene graph style traversal: push, apply a transformation,
+	 * read the result and pop. */
+	mat4f_stack stack;
+	mat4f_stack_init(&stack);
+	TIME(simd, mat4f_stack_push(&stack);
+	     mat4f_stack_mult(&stack, mats[i]);
+	     mat4f_stack_peek(&stack, out[i]);
+	     mat4f_stack_pop(&stack));
+	printf("%-20s %7.2f ns\n", "matrix stack", simd/((double) COUNT * REPEAT));
+
+	/* Transform many points at once. */
+	const int points = 1000000;
+	float *pts = kuhl_malloc(sizeof(float)*points*4);
+	float *soa = kuhl_malloc(sizeof(float)*points*3);
+	for(int i=0; i<points*4; i++)
+		pts[i] = drand48();
+	for(int i=0; i<points*3; i++)
+		soa[i] = drand48();
+	int64_t start = kuhl_nanoseconds();
+	for(int i=0; i<points; i++)
+		matNf_mult_vecNf_new(&pts[i*4], mats[0], &pts[i*4], 4);
+	scalar = kuhl_nanoseconds() - start;
+
+	vecmat_batch_set_pool(NULL);
+	start = kuhl_nanoseconds();
+	mat4f_mult_vec4f_batch(pts, pts, points, mats[0]);
+	simd = kuhl_nanoseconds() - start;
+	int64_t aos = kuhl_nanoseconds();
+	mat4f_mult_point3f_batch(soa, soa, points, mats[0]);
+	aos = kuhl_nanoseconds() - aos;
+	int64_t soaTime = kuhl_nanoseconds();
+	mat4f_mult_point3f_soa(soa, soa+points, soa+points*2, soa, soa+points, soa+points*2, points, mats[0]);
+	soaTime = kuhl_nanoseconds() - soaTime;
+	printf("%d points, 1 thread: scalar vec4 %.2f ms, vec4 batch %.2f ms, point3 batch %.2f ms, point3 SoA %.2f ms\n",
+	       points, scalar/1e6, simd/1e6, aos/1e6, soaTime/1e6);
+
+	vecmat_batch_set_pool(threadpool_default());
+	start = kuhl_nanoseconds();
+	mat4f_mult_vec4f_batch(pts, pts, points, mats[0]);
+	simd = kuhl_nanoseconds() - start;
+	soaTime = kuhl_nanoseconds();
+	mat4f_mult_point3f_soa(soa, soa+points, soa+points*2, soa, soa+points, soa+points*2, points, mats[0]);
+	soaTime = kuhl_nanoseconds() - soaTime;
+	printf("%d points, %d threads: vec4 batch %.2f ms, point3 SoA %.2f ms\n",
+	       points, threadpool_size(threadpool_default()), simd/1e6, soaTime/1e6);
+	sink = pts[points/2] + soa[points/2];
+	free(pts);
+	free(soa);
+
+	return 0;
+}
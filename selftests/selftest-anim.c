@@ -0,0 +1,271 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Loads every animated model in a directory (../models by
+ * default) and compares the different ways libkuhl can sample
+ * keyframes:
+ *
+ * - linear: Searches from the first key every time (the way libkuhl
+ *   used to do it).
+ * - bsearch: Binary search, see kuhl_anim_sample() with a NULL cursor.
+ * - cursor: Remembers the previous key, see kuhl_anim_sample().
+ * - resampled: Uniform rate samples, see kuhl_anim_track_new().
+ *
+ * The results from the cursor and binary search must match
+ * exactly. The error introduced by resampling is printed.
+ *
+ * Usage: selftest-anim [directory] [resampleRate]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+
+#define FRAMES 2000 /* Number of times each animation is sampled */
+
+static double resampleRate = 30;
+static int errors = 0;
+static volatile float sink = 0; /* Keeps the compiler from optimizing the benchmarks away */
+
+/* A copy of the keyframe lookup that libkuhl used before it had
+ * cursors: Every channel is searched from key 0 for every sample. */
+static void linear_sample(float result[16], const struct aiNodeAnim *na, double ticks)
+{
+	unsigned int p = 0, r = 0, s = 0;
+	for(unsigned int j=0; j+1<na->mNumPositionKeys; j++)
+		if(ticks < na->mPositionKeys[j+1].mTime) { p = j; break; }
+	for(unsigned int j=0; j+1<na->mNumRotationKeys; j++)
+		if(ticks < na->mRotationKeys[j+1].mTime) { r = j; break; }
+	for(unsigned int j=0; j+1<na->mNumScalingKeys; j++)
+		if(ticks < na->mScalingKeys[j+1].mTime) { s = j; break; }
+
+	/* Use the keys that were found so that the compiler can't skip
+	 * the searches. */
+	mat4f_identity(result);
+	result[12] = na->mPositionKeys[p].mValue.x;
+	result[13] = (float) na->mRotationKeys[r].mTime;
+	result[14] = na->mScalingKeys[s].mValue.z;
+}
+
+static long time_linear(const struct aiAnimation *anim)
+{
+	float m[16];
+	long start = kuhl_microseconds();
+	for(int f=0; f<FRAMES; f++)
+	{
+		double ticks = anim->mDuration * f / FRAMES;
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
+		{
+			linear_sample(m, anim->mChannels[c], ticks);
+			sink += m[12];
+		}
+	}
+	return kuhl_microseconds() - start;
+}
+
+static long time_keys(const struct aiAnimation *anim, kuhl_anim_cursor *cursors)
+{
+	float m[16];
+	long start = kuhl_microseconds();
+	for(int f=0; f<FRAMES; f++)
+	{
+		double ticks = anim->mDuration * f / FRAMES;
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
+		{
+			kuhl_anim_sample(m, anim->mChannels[c], ticks, cursors ? &cursors[c] : NULL);
+			sink += m[12];
+		}
+	}
+	return kuhl_microseconds() - start;
+}
+
+static long time_tracks(const struct aiAnimation *anim, const kuhl_anim_track *tracks)
+{
+	float m[16];
+	long start = kuhl_microseconds();
+	for(int f=0; f<FRAMES; f++)
+	{
+		double ticks = anim->mDuration * f / FRAMES;
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
+		{
+			kuhl_anim_track_sample(m, &tracks[c], ticks);
+			sink += m[12];
+		}
+	}
+	return kuhl_microseconds() - start;
+}
+
+/* Checks that the cursor gives the same answer as a binary search
+ * (forward, backward and random seeks) and measures how far the
+ * resampled track is from the original keys. */
+static float check_animation(const char *filename, const struct aiAnimation *anim,
+                             const kuhl_anim_track *tracks)
+{
+	float maxResampleErr = 0;
+	for(unsigned int c=0; c<anim->mNumChannels; c++)
+	{
+		kuhl_anim_cursor cursor = { 0, 0, 0 };
+		for(int f=0; f<3*FRAMES/10; f++)
+		{
+			double ticks;
+			if(f < FRAMES/10)
+				ticks = anim->mDuration * f / (FRAMES/10);      // forward
+			else if(f < 2*FRAMES/10)
+				ticks = anim->mDuration * (2*FRAMES/10 - f) / (FRAMES/10); // backward
+			else
+				ticks = anim->mDuration * drand48();             // seeks
+
+			float a[16], b[16], r[16];
+			kuhl_anim_sample(a, anim->mChannels[c], ticks, &cursor);
+			kuhl_anim_sample(b, anim->mChannels[c], ticks, NULL);
+			if(memcmp(a, b, sizeof(float)*16) != 0)
+			{
+				printf("ERROR: %s channel %s: cursor and binary search disagree at tick %f\n",
+				       filename, anim->mChannels[c]->mNodeName.data, ticks);
+				errors++;
+			}
+			if(tracks)
+			{
+				kuhl_anim_track_sample(r, &tracks[c], ticks);
+				for(int i=0; i<16; i++)
+				{
+					float err = fabsf(r[i]-b[i]);
+					if(err > maxResampleErr)
+						maxResampleErr = err;
+				}
+			}
+		}
+	}
+	return maxResampleErr;
+}
+
+static void bench_file(const char *filename)
+{
+	const struct aiScene *scene = aiImportFile(filename, 0);
+	if(scene == NULL || scene->mNumAnimations == 0)
+	{
+		if(scene)
+			aiReleaseImport(scene);
+		return;
+	}
+
+	for(unsigned int a=0; a<scene->mNumAnimations; a++)
+	{
+		const struct aiAnimation *anim = scene->mAnimations[a];
+		if(anim->mNumChannels == 0)
+			continue;
+		unsigned int maxKeys = 0;
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
+		{
+			const struct aiNodeAnim *na = anim->mChannels[c];
+			if(na->mNumPositionKeys > maxKeys) maxKeys = na->mNumPositionKeys;
+			if(na->mNumRotationKeys > maxKeys) maxKeys = na->mNumRotationKeys;
+			if(na->mNumScalingKeys > maxKeys) maxKeys = na->mNumScalingKeys;
+		}
+
+		kuhl_anim_track *tracks = NULL;
+		if(anim->mTicksPerSecond > 0)
+		{
+			tracks = malloc(sizeof(kuhl_anim_track)*anim->mNumChannels);
+			for(unsigned int c=0; c<anim->mNumChannels; c++)
+				kuhl_anim_track_new(&tracks[c], anim->mChannels[c], anim->mDuration,
+				                    anim->mTicksPerSecond / resampleRate);
+		}
+		kuhl_anim_cursor *cursors = calloc(anim->mNumChannels, sizeof(kuhl_anim_cursor));
+
+		float err = check_animation(filename, anim, tracks);
+
+		double samples = (double) FRAMES * anim->mNumChannels;
+		long linear = time_linear(anim);
+		long bsearch = time_keys(anim, NULL);
+		long cursor = time_keys(anim, cursors);
+		long resampled = tracks ? time_tracks(anim, tracks) : 0;
+
+		printf("%s anim %u: %u channels, up to %u keys\n", filename, a, anim->mNumChannels, maxKeys);
+		printf("   ns/sample: linear %8.1f  bsearch %8.1f  cursor %8.1f  resampled %8.1f (max err %g)\n",
+		       linear*1000/samples, bsearch*1000/samples, cursor*1000/samples,
+		       resampled*1000/samples, err);
+
+		if(tracks)
+		{
+			for(unsigned int c=0; c<anim->mNumChannels; c++)
+				kuhl_anim_track_free(&tracks[c]);
+			free(tracks);
+		}
+		free(cursors);
+	}
+	aiReleaseImport(scene);
+}
+
+static int is_model_file(const char *filename)
+{
+	const char *exts[] = { ".dae", ".fbx", ".x", ".md5mesh", ".bvh", ".ms3d", ".b3d",
+	                       ".blend", ".gltf", ".glb", ".3ds", ".smd", ".mdl", NULL };
+	const char *dot = strrchr(filename, '.');
+	if(dot == NULL)
+		return 0;
+	for(int i=0; exts[i] != NULL; i++)
+		if(strcasecmp(dot, exts[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static void bench_dir(const char *dirname)
+{
+	DIR *dir = opendir(dirname);
+	if(dir == NULL)
+		return;
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL)
+	{
+		if(ent->d_name[0] == '.')
+			continue;
+		char path[2048];
+		snprintf(path, 2048, "%s/%s", dirname, ent->d_name);
+		struct stat st;
+		if(stat(path, &st) != 0)
+			continue;
+		if(S_ISDIR(st.st_mode))
+			bench_dir(path);
+		else if(is_model_file(path))
+			bench_file(path);
+	}
+	closedir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dirname = "../models";
+	if(argc > 1)
+		dirname = argv[1];
+	if(argc > 2)
+		resampleRate = atof(argv[2]);
+
+	/* A track that couldn't be created has no samples. */
+	kuhl_anim_track empty;
+	memset(&empty, 0, sizeof(empty));
+	float m[16], identity[16];
+	mat4f_identity(identity);
+	kuhl_anim_track_sample(m, &empty, 10);
+	if(memcmp(m, identity, sizeof(m)) != 0)
+	{
+		printf("ERROR: Sampling a track without samples should return the identity matrix\n");
+		errors++;
+	}
+
+	printf("Sampling each animation %d times, resampling at %.1f samples/sec\n", FRAMES, resampleRate);
+	bench_dir(dirname);
+	printf("This program will print out ERROR above if an error occurs (%d errors).\n", errors);
+	return errors > 0;
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "kalman.h"
+#include "vecmat.h"
+#include "kuhl-util.h"
+
+/* Checks that kalman_multi_estimate() gives the same results as
+ * kalman_estimate(), that kalman_quat_estimate() follows a rotating
+ * object even if the tracker flips the sign of the quaternion, and
+ * measures how long each filter takes per tracker record. */
+
+#define RECORDS 100000
+
+/* Uniform noise in [-amount, amount] */
+static double noise(double amount)
+{
+	return amount * (2.0*rand()/RAND_MAX - 1);
+}
+
+static void test_multi(void)
+{
+	float sigma[7] = { .00004f, .00004f, .00004f, .0001f, .0001f, .0001f, .0001f };
+	kalman_state single[7];
+	for(int i=0; i<7; i++)
+		kalman_initialize(&single[i], sigma[i], .01f);
+	kalman_multi_state multi;
+	kalman_multi_initialize(&multi, 7, sigma, .01f);
+
+	/* Records arrive at about 100Hz with some jitter. */
+	long time = 1000000;
+	double maxError = 0;
+	for(int r=0; r<1000; r++)
+	{
+		time += 10000 + (r % 3) * 500;
+		double values[7];
+		for(int i=0; i<7; i++)
+			values[i] = sin(r*.01 + i) + noise(.001);
+		float expect[7];
+		for(int i=0; i<7; i++)
+			expect[i] = kalman_estimate(&single[i], (float) values[i], time);
+		for(int i=0; i<7; i++)
+			values[i] = (float) values[i]; // kalman_estimate() only gets floats
+		kalman_multi_estimate(&multi, values, time);
+		for(int i=0; i<7; i++)
+		{
+			double error = fabs(values[i] - expect[i]);
+			if(error > maxError)
+				maxError = error;
+		}
+	}
+	if(maxError > 1e-5)
+		printf("ERROR: kalman_multi_estimate() differs from kalman_estimate() by %g\n", maxError);
+}
+
+/* Angle in radians between two unit quaternions */
+static double quat_angle(const double a[4], const double b[4])
+{
+	double dot = fabs(vec4d_dot(a, b));
+	if(dot > 1)
+		dot = 1;
+	return 2*acos(dot);
+}
+
+static void test_quat(void)
+{
+	kalman_quat_state state;
+	kalman_quat_initialize(&state, .0002f, .01f);
+
+	/* Rotate around an axis at one radian per second. */
+	double axis[3] = { .3, .8, .5 };
+	vec3d_normalize(axis);
+	long time = 1000000;
+	double maxError = 0;
+	for(int r=0; r<2000; r++)
+	{
+		time += 10000;
+		double angle = r * .01;
+		double truth[4] = { axis[0]*sin(angle/2), axis[1]*sin(angle/2), axis[2]*sin(angle/2), cos(angle/2) };
+		double measured[4];
+		for(int i=0; i<4; i++)
+			measured[i] = truth[i] + noise(.0001);
+		/* Tracking systems may send either q or -q. */
+		if(r % 2)
+			vec4d_scalarMult(measured, -1);
+
+		kalman_quat_estimate(&state, measured, time);
+		if(fabs(vec4d_norm(measured) - 1) > 1e-9)
+			printf("ERROR: kalman_quat_estimate() returned a quaternion with length %f\n", vec4d_norm(measured));
+		double error = quat_angle(measured, truth);
+		if(r > 100 && error > maxError)
+			maxError = error;
+	}
+	if(maxError > .01)
+		printf("ERROR: kalman_quat_estimate() was %f radians away from the actual orientation\n", maxError);
+}
+
+static void bench(void)
+{
+	float sigma[7] = { .00004f, .00004f, .00004f, .0001f, .0001f, .0001f, .0001f };
+	kalman_state single[7];
+	for(int i=0; i<7; i++)
+		kalman_initialize(&single[i], sigma[i], .01f);
+	kalman_multi_state multi;
+	kalman_multi_initialize(&multi, 3, sigma, .01f);
+	kalman_quat_state quat;
+	kalman_quat_initialize(&quat, .0002f, .01f);
+
+	float sum = 0;
+	int64_t start = kuhl_nanoseconds();
+	for(int r=0; r<RECORDS; r++)
+	{
+		for(int i=0; i<7; i++)
+			sum += kalman_estimate(&single[i], (float) i, 1000000 + r*10000L);
+	}
+	int64_t singleNs = kuhl_nanoseconds() - start;
+
+	start = kuhl_nanoseconds();
+	for(int r=0; r<RECORDS; r++)
+	{
+		double pos[3] = { 0, 1, 2 };
+		double q[4] = { 0, 0, 0, 1 };
+		kalman_multi_estimate(&multi, pos, 1000000 + r*10000L);
+		kalman_quat_estimate(&quat, q, 1000000 + r*10000L);
+		sum += (float) (pos[0] + q[3]);
+	}
+	int64_t multiNs = kuhl_nanoseconds() - start;
+
+	printf("Filtering one tracker record: kalman_estimate() x 7: %.1f ns, kalman_multi_estimate() + kalman_quat_estimate(): %.1f ns (%.1f)\n",
+	       (double) singleNs/RECORDS, (double) multiNs/RECORDS, sum/RECORDS);
+}
+
+int main(void)
+{
+	srand(1);
+	test_multi();
+	test_quat();
+	bench();
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
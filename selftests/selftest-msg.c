@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "msg.h"
+#include "kuhl-config.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+
+/* Sends messages from several threads through the asynchronous log
+ * queue (see log.async in msg.c) so that the queue is frequently
+ * full, and checks that every message is either written in order or
+ * counted as dropped. Then exits while the threads are still sending
+ * messages so that the queue is shut down while it is in use. Compile
+ * with -fsanitize=thread or -fsanitize=address to also check for
+ * data races and use-after-free errors. */
+
+#define CONFIG "selftest-msg.ini"
+#define LOGFILE "selftest-msg.log"
+#define MESSAGES 20000
+#define PRODUCERS 4
+
+static pthread_t producers[PRODUCERS];
+static volatile int stopProducers = 0;
+
+static void* producer(void *arg)
+{
+	long id = (long) arg;
+	for(int i=0; i<MESSAGES; i++)
+		msg(MSG_DEBUG, "producer %ld message %d", id, i);
+	return NULL;
+}
+
+static void* endless_producer(void *arg)
+{
+	long id = (long) arg;
+	for(int i=0; !__atomic_load_n(&stopProducers, __ATOMIC_RELAXED); i++)
+		msg(MSG_DEBUG, "producer %ld message %d", id, i);
+	return NULL;
+}
+
+/* Registered before msg() starts the queue, so it runs after the
+ * queue is stopped at exit. */
+static void join_endless_producers(void)
+{
+	__atomic_store_n(&stopProducers, 1, __ATOMIC_RELAXED);
+	for(long i=0; i<PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	unlink(LOGFILE);
+}
+
+static void test_producers(void)
+{
+	for(long i=0; i<PRODUCERS; i++)
+		pthread_create(&producers[i], NULL, producer, (void*) i);
+	for(long i=0; i<PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	msg_flush();
+
+	FILE *f = fopen(LOGFILE, "r");
+	if(f == NULL)
+	{
+		printf("ERROR: Failed to open %s\n", LOGFILE);
+		return;
+	}
+	int next[PRODUCERS] = { 0 };
+	long written = 0, dropped = 0;
+	char line[2048];
+	while(fgets(line, sizeof(line), f))
+	{
+		long id;
+		int i;
+		char *p = strstr(line, "producer ");
+		if(p && sscanf(p, "producer %ld message %d", &id, &i) == 2)
+		{
+			if(id < 0 || id >= PRODUCERS || i < next[id])
+			{
+				printf("ERROR: Message %d from producer %ld is out of order\n", i, id);
+				break;
+			}
+			next[id] = i+1;
+			written++;
+		}
+		else if((p = strstr(line, " message(s) were dropped")) != NULL)
+		{
+			while(p > line && p[-1] >= '0' && p[-1] <= '9')
+				p--;
+			dropped += atol(p);
+		}
+	}
+	fclose(f);
+
+	printf("%ld messages written, %ld dropped.\n", written, dropped);
+	if(written + dropped != (long) PRODUCERS*MESSAGES)
+		printf("ERROR: %ld messages were written and %ld were dropped, expected %ld in total\n",
+		       written, dropped, (long) PRODUCERS*MESSAGES);
+	if(written == 0)
+		printf("ERROR: No messages were written\n");
+}
+
+int main(void)
+{
+	FILE *f = fopen(CONFIG, "w");
+	if(f == NULL)
+	{
+		printf("ERROR: Failed to create %s\n", CONFIG);
+		return EXIT_FAILURE;
+	}
+	fprintf(f, "log.async = true\n");
+	fprintf(f, "log.filename = %s\n", LOGFILE);
+	fclose(f);
+	kuhl_config_filename(CONFIG);
+	atexit(join_endless_producers);
+	/* msg() must be used once before other threads use it. */
+	msg(MSG_DEBUG, "Starting the producers.");
+
+	printf("Testing the log queue with %d messages per producer.\n", MESSAGES);
+	test_producers();
+	unlink(CONFIG);
+
+	/* Leave the producers running; the queue is stopped at exit
+	 * while they are using it. */
+	for(long i=0; i<PRODUCERS; i++)
+		pthread_create(&producers[i], NULL, endless_producer, (void*) i);
+	usleep(10000);
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
+
+#else
+int main(void)
+{
+	printf("This test requires pthreads.\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "predict.h"
+#include "vecmat.h"
+
+/* Predicts the pose of simulated tracked objects and checks that the
+ * predictions are exact for motion that matches the model and that
+ * they reduce the error for smooth motion that doesn't. */
+
+#define RATE 5000     // microseconds between samples (200Hz)
+#define LATENCY 3000  // microseconds between recording and receiving a sample
+#define OFFSET 123456789L // tracker clock minus our clock
+
+/* A rotating object moving along a path. */
+static void simulate(vrpn_sample *s, long time, int curved)
+{
+	double t = time / 1000000.0;
+	s->time = time + OFFSET;
+	s->received = time + LATENCY;
+	if(curved)
+		vec3d_set(s->pos, sin(t*3), cos(t*2), .5*sin(t));
+	else
+		vec3d_set(s->pos, 1+.5*t, 2-t, 3+.25*t);
+
+	/* Rotate at 2 radians per second around an axis. */
+	double rotvec[3] = { 2*t*.6, 2*t*.8, 0 };
+	if(curved)
+		rotvec[2] = sin(t*4);
+	quatd_from_rotvec(s->quat, rotvec);
+}
+
+static void run(const char *name, int model, int curved, double maxPosError, double maxAngleError)
+{
+	predict_state state;
+	predict_init(&state, model, 50000, 30000);
+
+	vrpn_sample history[VRPN_HISTORY];
+	int count = 0;
+	for(long time=0; time<5000000; time+=RATE)
+	{
+		/* Add a new sample (newest first) */
+		for(int i=(count < VRPN_HISTORY ? count : VRPN_HISTORY-1); i>0; i--)
+			history[i] = history[i-1];
+		simulate(&history[0], time, curved);
+		if(count < VRPN_HISTORY)
+			count++;
+
+		/* Predict the pose 20ms after we received the newest sample
+		 * once we have a few samples. */
+		if(count < 8)
+			continue;
+		long target = time + LATENCY + 20000;
+		double pos[3], quat[4];
+		predict_pose(&state, history, count, target, pos, quat);
+		if(fabs(vec4d_norm(quat)-1) > 1e-9)
+			printf("ERROR: %s: predicted quaternion has length %f\n", name, vec4d_norm(quat));
+	}
+
+	double n = (double) state.checked;
+	double posError = state.posError/n, basePosError = state.basePosError/n;
+	double angleError = state.angleError/n, baseAngleError = state.baseAngleError/n;
+	printf("%-24s %lu checked, %.1f ms ahead: position error %.4f mm (%.2f mm without), orientation error %.5f deg (%.3f deg without)\n",
+	       name, state.checked, state.ahead/1000.0/state.predictions,
+	       posError*1000, basePosError*1000, angleError*180/M_PI, baseAngleError*180/M_PI);
+	if(state.checked < 900)
+		printf("ERROR: %s: only %lu predictions were checked\n", name, state.checked);
+	if(posError > maxPosError || angleError > maxAngleError)
+		printf("ERROR: %s: prediction error is too large\n", name);
+	if(posError >= basePosError || angleError >= baseAngleError)
+		printf("ERROR: %s: prediction didn't reduce the error\n", name);
+}
+
+int main(void)
+{
+	/* Errors are in meters and radians. */
+	run("velocity, straight", PREDICT_VELOCITY, 0, 1e-9, 1e-9);
+	run("acceleration, straight", PREDICT_ACCELERATION, 0, 1e-9, 1e-9);
+	run("velocity, curved", PREDICT_VELOCITY, 1, .005, .006);
+	run("acceleration, curved", PREDICT_ACCELERATION, 1, .0005, .006);
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
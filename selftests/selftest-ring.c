@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "ring.h"
+#include "kuhl-util.h"
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+
+/* Passes many items between threads through small rings so that the
+ * rings are frequently full and empty, and checks that every item
+ * arrives exactly once and in order. Compile with -fsanitize=thread
+ * to also check for data races. */
+
+#define ITEMS 1000000
+#define PRODUCERS 4
+#define CONSUMERS 4
+
+typedef struct
+{
+	int producer;
+	int value;
+} item;
+
+static ring *r;
+static long received[CONSUMERS];
+static long long receivedSum[CONSUMERS];
+
+/* Producer for the SPSC test: mixes single and batched pushes. */
+static void* spsc_producer(void *arg)
+{
+	int batch[37];
+	int next = 0;
+	while(next < ITEMS)
+	{
+		if(next % 3 == 0)
+		{
+			int count = 0;
+			while(count < 37 && next+count < ITEMS)
+			{
+				batch[count] = next+count;
+				count++;
+			}
+			int pushed = ring_push_many(r, batch, count);
+			next += pushed;
+			if(pushed == 0)
+			{
+				/* Full, wait for room instead of spinning. */
+				ring_push_wait(r, &next, -1);
+				next++;
+			}
+		}
+		else
+		{
+			ring_push_wait(r, &next, -1);
+			next++;
+		}
+	}
+	return NULL;
+}
+
+static void test_spsc(void)
+{
+	r = ring_new(64, sizeof(int), RING_SPSC);
+	pthread_t thread;
+	pthread_create(&thread, NULL, spsc_producer, NULL);
+
+	int expect = 0;
+	int batch[29];
+	while(expect < ITEMS)
+	{
+		int count;
+		if(expect % 2 == 0)
+			count = ring_pop_many(r, batch, 29);
+		else
+			count = ring_pop_wait(r, batch, -1);
+		for(int i=0; i<count; i++)
+		{
+			if(batch[i] != expect)
+			{
+				printf("ERROR: SPSC ring returned %d instead of %d\n", batch[i], expect);
+				exit(EXIT_FAILURE);
+			}
+			expect++;
+		}
+	}
+	pthread_join(thread, NULL);
+	if(ring_length(r) != 0)
+		printf("ERROR: SPSC ring should be empty, has %d items\n", ring_length(r));
+	ring_free(r);
+}
+
+static void* mpmc_producer(void *arg)
+{
+	item it;
+	it.producer = (int) (long) arg;
+	for(it.value=0; it.value<ITEMS; it.value++)
+	{
+		/* Mix batched pushes (which don't wait) with single pushes. */
+		if(it.value % 5 != 0 || ring_push_many(r, &it, 1) == 0)
+			ring_push_wait(r, &it, -1);
+	}
+	return NULL;
+}
+
+static void* mpmc_consumer(void *arg)
+{
+	int id = (int) (long) arg;
+	int last[PRODUCERS];
+	for(int i=0; i<PRODUCERS; i++)
+		last[i] = -1;
+	while(1)
+	{
+		item it;
+		ring_pop_wait(r, &it, -1);
+		if(it.producer < 0)
+			break; // no more items
+		/* Items from one producer must arrive in order. */
+		if(it.value <= last[it.producer])
+			printf("ERROR: MPMC ring returned item %d from producer %d after item %d\n", it.value, it.producer, last[it.producer]);
+		last[it.producer] = it.value;
+		received[id]++;
+		receivedSum[id] += it.value;
+	}
+	return NULL;
+}
+
+static void test_mpmc(void)
+{
+	r = ring_new(32, sizeof(item), RING_MPMC);
+	pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+	for(long i=0; i<CONSUMERS; i++)
+		pthread_create(&consumers[i], NULL, mpmc_consumer, (void*) i);
+	for(long i=0; i<PRODUCERS; i++)
+		pthread_create(&producers[i], NULL, mpmc_producer, (void*) i);
+	for(int i=0; i<PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+
+	/* Tell each consumer to stop. */
+	item stop = { -1, 0 };
+	for(int i=0; i<CONSUMERS; i++)
+		ring_push_wait(r, &stop, -1);
+	for(int i=0; i<CONSUMERS; i++)
+		pthread_join(consumers[i], NULL);
+
+	long total = 0;
+	long long sum = 0;
+	for(int i=0; i<CONSUMERS; i++)
+	{
+		total += received[i];
+		sum += receivedSum[i];
+	}
+	long long expectSum = (long long) PRODUCERS * ITEMS * (ITEMS-1) / 2;
+	if(total != (long) PRODUCERS*ITEMS || sum != expectSum)
+		printf("ERROR: MPMC ring delivered %ld items (sum %lld), expected %ld (sum %lld)\n",
+		       total, sum, (long) PRODUCERS*ITEMS, expectSum);
+	ring_free(r);
+}
+
+static void test_timeout(void)
+{
+	r = ring_new(2, sizeof(int), RING_MPMC);
+	int value = 0;
+	int64_t start = kuhl_nanoseconds();
+	if(ring_pop_wait(r, &value, 20000) != 0)
+		printf("ERROR: ring_pop_wait() returned an item from an empty ring\n");
+	int64_t elapsed = kuhl_nanoseconds() - start;
+	if(elapsed < 20000000)
+		printf("ERROR: ring_pop_wait() returned after %lld ns instead of waiting 20 ms\n", (long long) elapsed);
+
+	ring_push(r, &value);
+	ring_push(r, &value);
+	if(ring_push_wait(r, &value, 1000) != 0)
+		printf("ERROR: ring_push_wait() added an item to a full ring\n");
+	ring_free(r);
+}
+
+int main(void)
+{
+	printf("Testing rings with %d items per producer.\n", ITEMS);
+	test_spsc();
+	test_mpmc();
+	test_timeout();
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
+
+#else
+int main(void)
+{
+	printf("This test requires pthreads.\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "texcompress.h"
+
+/* Compresses a few 4x4 blocks (a solid color, gradients in both
+ * directions and an edge between transparent and opaque pixels) into
+ * BC1, BC3 and BC7, decodes them with the decoders below (written
+ * from the format specifications, not from the encoder) and checks
+ * the endpoints, mode bits and how far each decoded pixel is from the
+ * original. */
+
+#define BLOCKS 4
+static const char *blockNames[BLOCKS] = { "solid", "gradient", "reversed gradient", "alpha edge" };
+#define SOLID 0
+#define ALPHA_EDGE 3
+
+/* Fills in a 4x4 RGBA block. */
+static void make_block(unsigned char rgba[64], int block)
+{
+	for(int y=0; y<4; y++)
+	{
+		for(int x=0; x<4; x++)
+		{
+			unsigned char *p = rgba + (y*4+x)*4;
+			switch(block)
+			{
+				case 0: // solid
+					p[0] = 200; p[1] = 100; p[2] = 37; p[3] = 255;
+					break;
+				case 1: // gradient from left to right (the colors are on a line)
+				case 2: // the same gradient from right to left
+				{
+					int t = block == 1 ? x : 3-x;
+					p[0] = (unsigned char) (10 + t*80);
+					p[1] = (unsigned char) (255 - t*60);
+					p[2] = (unsigned char) (100 + t*20);
+					p[3] = (unsigned char) (255 - t*70);
+					break;
+				}
+				case 3: // left half transparent, right half opaque
+					p[0] = 90; p[1] = 160; p[2] = 220;
+					p[3] = x < 2 ? 0 : 255;
+					break;
+			}
+		}
+	}
+}
+
+static uint16_t pack565(const unsigned char *p)
+{
+	int r = (int) (p[0]*31/255.0f + 0.5f);
+	int g = (int) (p[1]*63/255.0f + 0.5f);
+	int b = (int) (p[2]*31/255.0f + 0.5f);
+	return (uint16_t) ((r<<11) | (g<<5) | b);
+}
+
+static void unpack565(uint16_t v, int c[3])
+{
+	int r = (v>>11) & 31;
+	int g = (v>>5) & 63;
+	int b = v & 31;
+	c[0] = (r<<3) | (r>>2);
+	c[1] = (g<<2) | (g>>4);
+	c[2] = (b<<3) | (b>>2);
+}
+
+/* Decodes the 8 byte BC1 color block. In BC3, the color block is
+ * always decoded in four color mode. */
+static void decode_bc1(const unsigned char *in, unsigned char rgba[64], int alwaysFourColors)
+{
+	uint16_t c0 = (uint16_t) (in[0] | (in[1]<<8));
+	uint16_t c1 = (uint16_t) (in[2] | (in[3]<<8));
+	int palette[4][4];
+	unpack565(c0, palette[0]);
+	unpack565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+	for(int c=0; c<3; c++)
+	{
+		if(c0 > c1 || alwaysFourColors)
+		{
+			palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+		}
+		else
+		{
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+			palette[3][c] = 0;
+		}
+	}
+	if(c0 <= c1 && !alwaysFourColors)
+		palette[3][3] = 0;
+
+	uint32_t bits = (uint32_t) in[4] | ((uint32_t) in[5]<<8) | ((uint32_t) in[6]<<16) | ((uint32_t) in[7]<<24);
+	for(int i=0; i<16; i++)
+		for(int c=0; c<4; c++)
+			rgba[i*4+c] = (unsigned char) palette[(bits >> (2*i)) & 3][c];
+}
+
+/* Decodes the 8 byte BC3 alpha block into the alpha channel. */
+static void decode_bc3_alpha(const unsigned char *in, unsigned char rgba[64])
+{
+	int palette[8];
+	palette[0] = in[0];
+	palette[1] = in[1];
+	if(palette[0] > palette[1])
+	{
+		for(int i=2; i<8; i++)
+			palette[i] = ((8-i)*palette[0] + (i-1)*palette[1]) / 7;
+	}
+	else
+	{
+		for(int i=2; i<6; i++)
+			palette[i] = ((6-i)*palette[0] + (i-1)*palette[1]) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+
+	uint64_t bits = 0;
+	for(int i=0; i<6; i++)
+		bits |= (uint64_t) in[2+i] << (8*i);
+	for(int i=0; i<16; i++)
+		rgba[i*4+3] = (unsigned char) palette[(bits >> (3*i)) & 7];
+}
+
+static int get_bits(const unsigned char *in, int *pos, int bits)
+{
+	int value = 0;
+	for(int i=0; i<bits; i++, (*pos)++)
+		value |= ((in[*pos/8] >> (*pos%8)) & 1) << i;
+	return value;
+}
+
+/* Decodes a 16 byte BC7 block. Returns the mode, or -1 if the block
+ * doesn't use mode 6 (the only mode we decode). */
+static int decode_bc7(const unsigned char *in, unsigned char rgba[64])
+{
+	static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	int mode = 0;
+	while(mode < 8 && !(in[0] & (1<<mode)))
+		mode++;
+	if(mode != 6)
+		return -1;
+
+	int pos = 7;
+	int e[2][4];
+	for(int c=0; c<4; c++)
+		for(int j=0; j<2; j++)
+			e[j][c] = get_bits(in, &pos, 7);
+	for(int j=0; j<2; j++)
+	{
+		int pbit = get_bits(in, &pos, 1);
+		for(int c=0; c<4; c++)
+			e[j][c] = (e[j][c]<<1) | pbit;
+	}
+	for(int i=0; i<16; i++)
+	{
+		int w = weights[get_bits(in, &pos, i == 0 ? 3 : 4)];
+		for(int c=0; c<4; c++)
+			rgba[i*4+c] = (unsigned char) (((64-w)*e[0][c] + w*e[1][c] + 32) >> 6);
+	}
+	return mode;
+}
+
+/* Largest difference between the original and decoded values of the
+ * first "channels" channels. */
+static int max_error(const unsigned char a[64], const unsigned char b[64], int channels)
+{
+	int result = 0;
+	for(int i=0; i<16; i++)
+		for(int c=0; c<channels; c++)
+		{
+			int d = abs(a[i*4+c] - b[i*4+c]);
+			if(d > result)
+				result = d;
+		}
+	return result;
+}
+
+static void test_bc1(int block, const unsigned char rgba[64])
+{
+	unsigned char out[8], decoded[64];
+	texcompress_encode(out, rgba, 4, 4, TEXCOMPRESS_BC1);
+	decode_bc1(out, decoded, 0);
+
+	uint16_t c0 = (uint16_t) (out[0] | (out[1]<<8));
+	uint16_t c1 = (uint16_t) (out[2] | (out[3]<<8));
+	if(block == SOLID && (c0 != pack565(rgba) || c1 != c0 || out[4] || out[5] || out[6] || out[7]))
+		printf("ERROR: BC1 %s: Endpoints should both be %04x and every index should be 0\n", blockNames[block], pack565(rgba));
+	if(block != SOLID && block != ALPHA_EDGE && c0 <= c1)
+		printf("ERROR: BC1 %s: Block should use four color mode (c0 > c1)\n", blockNames[block]);
+
+	/* Only 565 rounding for colors that are on the palette. */
+	int error = max_error(rgba, decoded, 3);
+	if(error > 4)
+		printf("ERROR: BC1 %s: Color is off by %d\n", blockNames[block], error);
+}
+
+static void test_bc3(int block, const unsigned char rgba[64])
+{
+	unsigned char out[16], decoded[64];
+	texcompress_encode(out, rgba, 4, 4, TEXCOMPRESS_BC3);
+	decode_bc1(out+8, decoded, 1);
+	decode_bc3_alpha(out, decoded);
+
+	/* The alpha endpoints are the largest and smallest alpha. */
+	int amin = 255, amax = 0;
+	for(int i=0; i<16; i++)
+	{
+		if(rgba[i*4+3] < amin)
+			amin = rgba[i*4+3];
+		if(rgba[i*4+3] > amax)
+			amax = rgba[i*4+3];
+	}
+	if(out[0] != amax || out[1] != amin)
+		printf("ERROR: BC3 %s: Alpha endpoints are %d and %d instead of %d and %d\n", blockNames[block], out[0], out[1], amax, amin);
+
+	int error = max_error(rgba, decoded, 3);
+	if(error > 4)
+		printf("ERROR: BC3 %s: Color is off by %d\n", blockNames[block], error);
+	/* Alpha values that are endpoints are exact, others are within
+	 * half of the distance between the 8 palette entries. */
+	int alphaBound = (amax-amin)/14 + 1;
+	for(int i=0; i<16; i++)
+	{
+		int a = rgba[i*4+3];
+		int d = abs(decoded[i*4+3] - a);
+		if(d > ((a == amin || a == amax) ? 0 : alphaBound))
+		{
+			printf("ERROR: BC3 %s: Alpha of pixel %d is %d instead of %d\n", blockNames[block], i, decoded[i*4+3], a);
+			break;
+		}
+	}
+}
+
+static void test_bc7(int block, const unsigned char rgba[64])
+{
+	unsigned char out[16], decoded[64];
+	texcompress_encode(out, rgba, 4, 4, TEXCOMPRESS_BC7);
+	if(decode_bc7(out, decoded) != 6)
+	{
+		printf("ERROR: BC7 %s: Block doesn't use mode 6 (first byte is %02x)\n", blockNames[block], out[0]);
+		return;
+	}
+	/* Every pixel of a solid block should use an endpoint. The
+	 * indices start at bit 65 and the first one only has 3 bits. */
+	if(block == SOLID)
+	{
+		int pos = 65;
+		for(int i=0; i<16; i++)
+		{
+			int index = get_bits(out, &pos, i == 0 ? 3 : 4);
+			if(index != 0 && index != 15)
+			{
+				printf("ERROR: BC7 %s: Pixel %d uses index %d instead of an endpoint\n", blockNames[block], i, index);
+				break;
+			}
+		}
+	}
+
+	/* 7 bit endpoints with a shared p-bit: a solid color can be off by
+	 * one and each palette entry is within a few steps of the
+	 * gradient and edge colors. */
+	int bound = block == SOLID ? 1 : 3;
+	int error = max_error(rgba, decoded, 4);
+	if(error > bound)
+		printf("ERROR: BC7 %s: Color or alpha is off by %d (expected at most %d)\n", blockNames[block], error, bound);
+}
+
+int main(void)
+{
+	for(int block=0; block<BLOCKS; block++)
+	{
+		unsigned char rgba[64];
+		make_block(rgba, block);
+		test_bc1(block, rgba);
+		test_bc3(block, rgba);
+		test_bc7(block, rgba);
+	}
+
+	/* Blocks at the right and bottom edges of an image that isn't a
+	 * multiple of 4 pixels repeat the last row and column. */
+	unsigned char rgba[6*5*4];
+	for(int i=0; i<6*5; i++)
+	{
+		rgba[i*4+0] = 50; rgba[i*4+1] = 150; rgba[i*4+2] = 250; rgba[i*4+3] = 255;
+	}
+	size_t bytes = texcompress_level_bytes(TEXCOMPRESS_BC1, 6, 5);
+	if(bytes != 4*8)
+		printf("ERROR: A 6x5 BC1 image should use 32 bytes, not %zu\n", bytes);
+	unsigned char out[4*8];
+	texcompress_encode(out, rgba, 6, 5, TEXCOMPRESS_BC1);
+	for(int b=1; b<4; b++)
+		if(memcmp(out, out+b*8, 8) != 0)
+			printf("ERROR: Block %d of a solid 6x5 BC1 image is different than block 0\n", b);
+
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
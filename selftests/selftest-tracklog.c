@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "tracklog.h"
+
+/* Writes a tracking log with several interleaved objects, reads it
+ * back, seeks around in it, and checks that a log that was never
+ * closed (so it has no index) can still be read. */
+
+#define FILENAME "selftest-tracklog.trk"
+#define OBJECTS 3
+#define RECORDS 3000   // per object
+#define RATE 4167      // microseconds between samples (240Hz)
+#define START 1234567890000L
+
+static void make_record(tracklog_record *r, int i)
+{
+	int object = i % OBJECTS;
+	r->object = object;
+	r->time = START + (i / OBJECTS) * (long) RATE + object*100;
+	for(int k=0; k<3; k++)
+		r->pos[k] = (float) (i + k*.25);
+	for(int k=0; k<4; k++)
+		r->quat[k] = (float) (i*.5 + k);
+}
+
+static int same_record(const tracklog_record *a, const tracklog_record *b)
+{
+	return a->time == b->time && a->object == b->object &&
+		memcmp(a->pos, b->pos, sizeof(a->pos)) == 0 &&
+		memcmp(a->quat, b->quat, sizeof(a->quat)) == 0;
+}
+
+static tracklog* write_log(int close)
+{
+	const char *names[OBJECTS] = { "Head", "Hand", "a-very-long-object-name-that-does-not-fit-in-the-name-field-at-all" };
+	tracklog *log = tracklog_create(FILENAME, names, OBJECTS);
+	if(log == NULL)
+	{
+		printf("ERROR: Failed to create %s\n", FILENAME);
+		exit(EXIT_FAILURE);
+	}
+	for(int i=0; i<RECORDS*OBJECTS; i++)
+	{
+		tracklog_record r;
+		make_record(&r, i);
+		if(tracklog_write(log, &r) == 0)
+			printf("ERROR: Failed to write record %d\n", i);
+	}
+	if(close)
+	{
+		tracklog_close(log);
+		return NULL;
+	}
+	tracklog_flush(log);
+	return log;
+}
+
+static void check_log(const char *label, long expected)
+{
+	tracklog *log = tracklog_open(FILENAME);
+	if(log == NULL)
+	{
+		printf("ERROR: %s: Failed to open %s\n", label, FILENAME);
+		return;
+	}
+	if(tracklog_object_count(log) != OBJECTS ||
+	   strcmp(tracklog_object_name(log, 1), "Hand") != 0 ||
+	   strlen(tracklog_object_name(log, 2)) != TRACKLOG_NAME_MAX-1)
+		printf("ERROR: %s: Object names are wrong\n", label);
+	if(tracklog_record_count(log) != expected)
+		printf("ERROR: %s: Log has %ld records instead of %ld\n", label, tracklog_record_count(log), expected);
+
+	/* Read every record */
+	tracklog_record r, expect;
+	long count = 0;
+	while(tracklog_read(log, &r))
+	{
+		make_record(&expect, (int) count);
+		if(!same_record(&r, &expect))
+		{
+			printf("ERROR: %s: Record %ld is wrong\n", label, count);
+			break;
+		}
+		count++;
+	}
+	if(count != expected)
+		printf("ERROR: %s: Read %ld records instead of %ld\n", label, count, expected);
+
+	/* Seek to the middle, exactly onto a record and between records. */
+	int target = (int) (expected / 2) + 1;
+	make_record(&expect, target);
+	for(int between=0; between<2; between++)
+	{
+		if(tracklog_seek(log, expect.time - between) == 0 || tracklog_read(log, &r) == 0 || !same_record(&r, &expect))
+			printf("ERROR: %s: Seeking to record %d failed\n", label, target);
+	}
+
+	/* Seek backwards to the start, then past the end. */
+	make_record(&expect, 0);
+	if(tracklog_seek(log, tracklog_first_time(log)) == 0 || tracklog_read(log, &r) == 0 || !same_record(&r, &expect))
+		printf("ERROR: %s: Seeking to the first record failed\n", label);
+	if(tracklog_seek(log, tracklog_last_time(log)+1) != 0 || tracklog_read(log, &r) != 0)
+		printf("ERROR: %s: Seeking past the end failed\n", label);
+
+	/* Seek back into the last block after seeking past the end. */
+	make_record(&expect, (int) expected-1);
+	if(tracklog_seek(log, expect.time) == 0 || tracklog_read(log, &r) == 0 || !same_record(&r, &expect))
+		printf("ERROR: %s: Seeking to the last record after seeking past the end failed\n", label);
+	tracklog_close(log);
+}
+
+int main(void)
+{
+	write_log(1);
+	check_log("closed", RECORDS*OBJECTS);
+
+	/* A damaged index is ignored and rebuilt from the blocks. Set the
+	 * record count of the first index entry (the index is at the end
+	 * of the file, before a trailer with the number of blocks and the
+	 * index offset) far beyond the size of a block. */
+	write_log(1);
+	FILE *f = fopen(FILENAME, "r+b");
+	struct { uint32_t magic; uint32_t blockCount; int64_t indexOffset; } trailer;
+	uint32_t badCount = 1000000;
+	if(f == NULL || fseek(f, -(long) sizeof(trailer), SEEK_END) != 0 ||
+	   fread(&trailer, sizeof(trailer), 1, f) != 1 ||
+	   fseek(f, (long) trailer.indexOffset + 24, SEEK_SET) != 0 || // offset of count in the entry
+	   fwrite(&badCount, sizeof(badCount), 1, f) != 1)
+		printf("ERROR: Failed to damage the index in %s\n", FILENAME);
+	if(f)
+		fclose(f);
+	check_log("damaged index", RECORDS*OBJECTS);
+
+	/* A program that is killed before it closes the log loses the
+	 * index but keeps every block that it flushed. */
+	tracklog *log = write_log(0);
+	check_log("not closed", RECORDS*OBJECTS);
+	tracklog_close(log);
+
+	/* A partially written block at the end is ignored. */
+	log = write_log(0);
+	tracklog_record r;
+	make_record(&r, RECORDS*OBJECTS);
+	tracklog_write(log, &r);
+	tracklog_flush(log);
+	f = fopen(FILENAME, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	if(truncate(FILENAME, size-10) != 0)
+		printf("ERROR: Failed to truncate %s\n", FILENAME);
+	check_log("truncated", RECORDS*OBJECTS);
+	tracklog_close(log);
+
+	unlink(FILENAME);
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include <string.h>
+#include "vecmat.h"
+#include "vecmat-batch.h"
+#include "kuhl-util.h"
+
+void random_matrix(float m[16])
+{
+	double rot[16], trans[16], scale[16];
+	mat4d_rotateEuler_new(rot, drand48()*360, drand48()*360, drand48()*360, "XYZ");
+	mat4d_translate_new(trans, (drand48()-.5)*100, (drand48()-.5)*100, (drand48()-.5)*100);
+	mat4d_scale_new(scale, drand48()*4+.1, drand48()*4+.1, drand48()*4+.1);
+	double md[16];
+	mat4d_mult_mat4d_many(md, trans, rot, scale, NULL);
+	mat4f_from_mat4d(m, md);
+}
+
+void random_quat(float q[4])
+{
+	vec4f_set(q, drand48()-.5, drand48()-.5, drand48()-.5, drand48()-.5);
+	vec4f_normalize(q);
+}
+
+/* Largest error allowed when summing the products of n pairs of
+ * values in a different order (or with fused multiply-adds). The
+ * error depends on the size of the products, not the size of the
+ * sum, because the sum can have cancellation. */
+float sum_tolerance(const float *a, int aStride, const float *b, int bStride, int n)
+{
+	float total = 0;
+	for(int k=0; k<n; k++)
+		total += fabsf(a[k*aStride] * b[k*bStride]);
+	return total * 8 * FLT_EPSILON;
+}
+
+void test_mult(void)
+{
+	float a[16], b[16], simd[16], scalar[16];
+	random_matrix(a);
+	random_matrix(b);
+	mat4f_mult_mat4f_simd(simd, a, b);
+	matNf_mult_matNf_new(scalar, a, b, 4);
+	for(int row=0; row<4; row++)
+		for(int col=0; col<4; col++)
+		{
+			int i = col*4+row;
+			float tol = sum_tolerance(&a[row], 4, &b[col*4], 1, 4);
+			if(fabsf(simd[i]-scalar[i]) > tol)
+			{
+				printf("ERROR: mat4f_mult_mat4f_simd() differs from scalar version by %g (tolerance %g)\n", fabsf(simd[i]-scalar[i]), tol);
+				mat4f_print(simd);
+				mat4f_print(scalar);
+				return;
+			}
+		}
+
+	/* Check that the result can overwrite an input. */
+	mat4f_mult_mat4f_simd(a, a, b);
+	if(memcmp(a, simd, sizeof(float)*16) != 0)
+		printf("ERROR: mat4f_mult_mat4f_simd(a, a, b) gave a different result\n");
+}
+
+void test_mult_vec(void)
+{
+	float m[16], v[4], simd[4], scalar[4];
+	random_matrix(m);
+	vec4f_set(v, (drand48()-.5)*100, (drand48()-.5)*100, (drand48()-.5)*100, 1);
+	mat4f_mult_vec4f_simd(simd, m, v);
+	matNf_mult_vecNf_new(scalar, m, v, 4);
+	for(int row=0; row<4; row++)
+	{
+		float tol = sum_tolerance(&m[row], 4, v, 1, 4);
+		if(fabsf(simd[row]-scalar[row]) > tol)
+			printf("ERROR: mat4f_mult_vec4f_simd() differs from scalar version by %g (tolerance %g)\n", fabsf(simd[row]-scalar[row]), tol);
+	}
+}
+
+void test_invert(void)
+{
+	float m[16], simd[16], scalar[16];
+	random_matrix(m);
+	mat4f_invert_simd(simd, m);
+	mat4f_invert_new_scalar(scalar, m);
+
+	/* The SIMD version computes the determinant differently, compare
+	 * relative to the largest value in the matrix. */
+	float largest = 0, diff = 0;
+	for(int i=0; i<16; i++)
+	{
+		if(fabsf(scalar[i]) > largest)
+			largest = fabsf(scalar[i]);
+		if(fabsf(simd[i]-scalar[i]) > diff)
+			diff = fabsf(simd[i]-scalar[i]);
+	}
+	if(diff > largest * 1e-5f)
+	{
+		printf("ERROR: mat4f_invert_simd() differs from scalar version by %g (largest value %g)\n", diff, largest);
+		mat4f_print(simd);
+		mat4f_print(scalar);
+	}
+}
+
+void test_slerp(void)
+{
+	float a[4], b[4], simd[4], scalar[4];
+	random_quat(a);
+	random_quat(b);
+	float t = drand48();
+	quatf_slerp_simd(simd, a, b, t);
+	quatf_slerp_new_scalar(scalar, a, b, t);
+	float diff[4];
+	vec4f_sub_new(diff, simd, scalar);
+	if(vec4f_norm(diff) > 1e-6f)
+		printf("ERROR: quatf_slerp_simd() differs from scalar version by %g\n", vec4f_norm(diff));
+	if(fabsf(vec4f_norm(simd) - 1) > 1e-5f)
+		printf("ERROR: quatf_slerp_simd() returned a quaternion with length %f\n", vec4f_norm(simd));
+}
+
+void test_quat_matrix(void)
+{
+	float q[4], simd[16], scalar[16], scalar3[9];
+	random_quat(q);
+	vec4f_scalarMult(q, drand48()*3+.1); // doesn't need to be unit length
+	mat4f_rotateQuatVec_simd(simd, q);
+	mat3f_rotateQuatVec_new(scalar3, q);
+	mat4f_from_mat3f(scalar, scalar3);
+	/* Entries like 1-2(yy+zz) can have cancellation, so compare with
+	 * an absolute tolerance. The entries are between -1 and 1. */
+	for(int i=0; i<16; i++)
+		if(fabsf(simd[i]-scalar[i]) > 8*FLT_EPSILON)
+		{
+			printf("ERROR: mat4f_rotateQuatVec_simd() differs from scalar version by %g\n", fabsf(simd[i]-scalar[i]));
+			mat4f_print(simd);
+			mat4f_print(scalar);
+			return;
+		}
+}
+
+/* The batch functions should give the same results as calling the
+ * single-item functions one at a time. BATCH_COUNT is large enough
+ * that the work is split across threads. */
+#define BATCH_COUNT (VECMAT_BATCH_THREAD_MIN*2+5)
+void test_batch(void)
+{
+	float m[16];
+	random_matrix(m);
+	float *in = kuhl_malloc(sizeof(float)*BATCH_COUNT*16);
+	float *out = kuhl_malloc(sizeof(float)*BATCH_COUNT*16);
+	for(int i=0; i<BATCH_COUNT*16; i++)
+		in[i] = (drand48()-.5)*100;
+
+	float expect[16];
+	mat4f_mult_vec4f_batch(out, in, BATCH_COUNT, m);
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		mat4f_mult_vec4f_new(expect, m, &in[i*4]);
+		if(memcmp(expect, &out[i*4], sizeof(float)*4) != 0)
+		{
+			printf("ERROR: mat4f_mult_vec4f_batch() differs for vector %d\n", i);
+			break;
+		}
+	}
+
+	/* Points: compare the AoS and SoA versions against a vec4 with w=1 */
+	float *x = kuhl_malloc(sizeof(float)*BATCH_COUNT*3);
+	float *y = x + BATCH_COUNT, *z = y + BATCH_COUNT;
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		x[i] = in[i*3];
+		y[i] = in[i*3+1];
+		z[i] = in[i*3+2];
+	}
+	mat4f_mult_point3f_batch(out, in, BATCH_COUNT, m);
+	mat4f_mult_point3f_soa(x, y, z, x, y, z, BATCH_COUNT, m);
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		float p[4] = { in[i*3], in[i*3+1], in[i*3+2], 1 };
+		matNf_mult_vecNf_new(expect, m, p, 4);
+		float aos[3] = { out[i*3], out[i*3+1], out[i*3+2] };
+		float soa[3] = { x[i], y[i], z[i] };
+		for(int k=0; k<3; k++)
+		{
+			float tol = sum_tolerance(&m[k], 4, p, 1, 4);
+			if(fabsf(aos[k]-expect[k]) > tol || fabsf(soa[k]-expect[k]) > tol)
+			{
+				printf("ERROR: mat4f_mult_point3f_batch() or mat4f_mult_point3f_soa() differs for point %d: %f %f %f\n", i, aos[k], soa[k], expect[k]);
+				i = BATCH_COUNT;
+				break;
+			}
+		}
+	}
+	free(x);
+
+	/* Check that the output can overwrite the input. */
+	memcpy(out, in, sizeof(float)*BATCH_COUNT*16);
+	mat4f_mult_mat4f_batch(out, m, out, BATCH_COUNT);
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		mat4f_mult_mat4f_simd(expect, m, &in[i*16]);
+		if(memcmp(expect, &out[i*16], sizeof(float)*16) != 0)
+		{
+			printf("ERROR: mat4f_mult_mat4f_batch() differs for matrix %d\n", i);
+			break;
+		}
+	}
+
+	/* Bounding boxes: compare against the 8 transformed corners. */
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		float *b = &in[i*6];
+		for(int k=0; k<3; k++)
+			if(b[k*2] > b[k*2+1])
+			{
+				float tmp = b[k*2];
+				b[k*2] = b[k*2+1];
+				b[k*2+1] = tmp;
+			}
+	}
+	mat4f_bbox_transform_batch(out, in, BATCH_COUNT, m);
+	for(int i=0; i<BATCH_COUNT; i++)
+	{
+		const float *b = &in[i*6];
+		float box[6] = { FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX };
+		for(int corner=0; corner<8; corner++)
+		{
+			float p[4] = { b[corner&1], b[2+((corner>>1)&1)], b[4+((corner>>2)&1)], 1 };
+			matNf_mult_vecNf_new(expect, m, p, 4);
+			for(int k=0; k<3; k++)
+			{
+				if(expect[k] < box[k*2])
+					box[k*2] = expect[k];
+				if(expect[k] > box[k*2+1])
+					box[k*2+1] = expect[k];
+			}
+		}
+		for(int k=0; k<6; k++)
+			if(fabsf(box[k]-out[i*6+k]) > 1e-3f)
+			{
+				printf("ERROR: mat4f_bbox_transform_batch() differs for box %d: %f %f\n", i, out[i*6+k], box[k]);
+				i = BATCH_COUNT;
+				break;
+			}
+	}
+
+	free(in);
+	free(out);
+}
+
+int main(void)
+{
+	printf("Testing vecmat SIMD functions (%s) against the scalar versions.\n", vecmat_simd_name());
+	for(int i=0; i<10000; i++)
+	{
+		test_mult();
+		test_mult_vec();
+		test_invert();
+		test_slerp();
+		test_quat_matrix();
+	}
+	test_batch();
+
+	printf("This program will print out ERROR above if an error occurs.\n");
+}
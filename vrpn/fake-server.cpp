@@ -7,6 +7,13 @@
    
    Modified by John Thomas to support multiple Tracked objects
    and reading from log files. (2015) 
+
+   Tracking logs saved by recorder (see tracklog.h) can be played
+   back with -l, either with the original timing or faster (-s).
+
+   For load testing, -g generates many moving objects at a fixed rate
+   with optional jitter, packet loss, and bursts so that clients can
+   be tested with as many objects as a motion capture system sends.
 */
 
 #define LINE_UP "\033[F"
@@ -35,6 +42,7 @@
 #include "vecmat.h"
 #include "kuhl-util.h"
 #include "tdl-util.h"
+#include "tracklog.h"
 
 using namespace std;
 
@@ -44,6 +52,7 @@ class myTracker : public vrpn_Tracker
 	myTracker( const char* name, bool* flags, vrpn_Connection *c = 0, FILE* fs = NULL );
 	virtual ~myTracker() {};
 	virtual void mainloop();
+	void send(const float p[3], const float q[4], const struct timeval *captured = NULL);
 
   protected:
 	struct timeval _timestamp;
@@ -197,11 +206,261 @@ void myTracker::mainloop()
 	server_mainloop();
 }
 
+/** Sends a record with the given position and orientation
+ * (quaternion) instead of generating or reading one. The record is
+ * timestamped with the current time unless a capture time is given. */
+void myTracker::send(const float p[3], const float q[4], const struct timeval *captured)
+{
+	if(captured != NULL)
+		_timestamp = *captured;
+	else
+		vrpn_gettimeofday(&_timestamp, NULL);
+	vrpn_Tracker::timestamp = _timestamp;
+	for(int i=0; i<3; i++)
+		pos[i] = p[i];
+	for(int i=0; i<4; i++)
+		d_quat[i] = q[i];
+
+	char msgbuf[1000];
+	int len = vrpn_Tracker::encode_to(msgbuf);
+	if (d_connection->pack_message(len, _timestamp, position_m_id, d_sender_id, msgbuf,
+	                               vrpn_CONNECTION_LOW_LATENCY))
+	{
+		fprintf(stderr,"can't write message: tossing\n");
+	}
+	server_mainloop();
+}
+
+/** Plays back a tracking log forever. Each record is sent when the
+    same amount of time has passed since the start of playback as had
+    passed since the start of the recording (divided by speed). When
+    we reach the end of the log, we start over from the beginning.
+
+    @param log The tracking log.
+    @param trackers One tracker for each object in the log.
+    @param connection The connection the trackers use.
+    @param speed Playback speed (1 = original timing, 2 = twice as
+    fast). If 0, records are sent as fast as possible.
+    @param offset Start playing this many seconds into the log.
+    @param quiet If false, print the playback rate once a second.
+*/
+static void replay_log(tracklog *log, myTracker **trackers, vrpn_Connection *connection,
+                       double speed, double offset, bool quiet)
+{
+	long first = tracklog_first_time(log);
+	long last = tracklog_last_time(log);
+	long count = tracklog_record_count(log);
+	if(count == 0)
+	{
+		fprintf(stderr, "The tracking log is empty.\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Leave the average time between records between the end of the
+	 * log and the start of the next time through it. */
+	long gap = (last - first) / count;
+
+	long startAt = first + (long) (offset * 1000000);
+	if(!tracklog_seek(log, startAt))
+	{
+		fprintf(stderr, "The tracking log is only %.1f seconds long.\n", (last-first)/1000000.0);
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t start = kuhl_nanoseconds();
+	long loopOffset = -(startAt - first); // log time that has passed before this time through the log
+	int timeThroughData = 1;
+	long sent = 0;
+	int64_t nextReport = start + 1000000000LL;
+	long sentAtReport = 0;
+
+	tracklog_record r;
+	while(true)
+	{
+		if(!tracklog_read(log, &r))
+		{
+			/* Start over again from the beginning of the log. */
+			loopOffset += last - first + gap;
+			timeThroughData++;
+			tracklog_seek(log, first);
+			continue;
+		}
+
+		if(speed > 0)
+		{
+			int64_t due = start + (int64_t) ((loopOffset + r.time - first) * 1000.0 / speed);
+			if(kuhl_nanoseconds() < due)
+			{
+				/* Send the records that we have queued up before waiting. */
+				connection->mainloop();
+				kuhl_sleep_until(due);
+			}
+		}
+		else if(sent % 64 == 0)
+			connection->mainloop();
+
+		trackers[r.object]->send(r.pos, r.quat);
+		sent++;
+
+		int64_t now = kuhl_nanoseconds();
+		if(now >= nextReport)
+		{
+			double seconds = (now - nextReport + 1000000000LL) / 1e9;
+			if(!quiet)
+				printf("Time %d through log, at %.1f seconds: %.1f records per second\n",
+				       timeThroughData, (r.time - first)/1000000.0, (sent - sentAtReport)/seconds);
+			sentAtReport = sent;
+			nextReport = now + 1000000000LL;
+		}
+	}
+}
+
+/** An object that the load generator sends records for. */
+typedef struct
+{
+	myTracker *tracker;
+	double phase;    /**< Offset so that objects don't all move together */
+	long frame;      /**< Number of the next record (captured at start + frame * period) */
+	int64_t sendAt;  /**< kuhl_nanoseconds() time to send the next record */
+} LoadObject;
+
+/** Settings for the load generator. */
+typedef struct
+{
+	int objects;     /**< Number of objects */
+	double rate;     /**< Records per second for each object */
+	double jitter;   /**< Each record is sent up to this many microseconds late */
+	double loss;     /**< Fraction of the records that are dropped */
+	int burst;       /**< Records are held and sent this many frames at a time */
+	bool noise;
+	bool quiet;
+} LoadSettings;
+
+/** Picks when to send the next record for an object. Records are
+ * captured on a fixed schedule (an absolute deadline for each frame so
+ * that we don't drift); bursts and jitter only delay when they are
+ * sent. */
+static void load_schedule(LoadObject *o, const LoadSettings *settings, int64_t start, int64_t period)
+{
+	/* Every record in a burst is sent when its last frame is captured. */
+	long sendFrame = (o->frame / settings->burst) * settings->burst + settings->burst - 1;
+	o->sendAt = start + sendFrame * period;
+	if(settings->jitter > 0)
+		o->sendAt += (int64_t) (settings->jitter * 1000 * ((double) rand() / RAND_MAX));
+}
+
+/** Generates records for many objects forever and prints how many
+    records were sent each second.
+
+    @param trackers One tracker for each object.
+    @param connection The connection the trackers use.
+    @param settings The load to generate.
+*/
+static void generate_load(myTracker **trackers, vrpn_Connection *connection, const LoadSettings *settings)
+{
+	LoadObject *objects = (LoadObject*) malloc(sizeof(LoadObject) * settings->objects);
+	int64_t period = (int64_t) (1000000000.0 / settings->rate);
+
+	/* Timestamps use the same clock as vrpn_gettimeofday(). */
+	struct timeval wallStart;
+	vrpn_gettimeofday(&wallStart, NULL);
+	int64_t start = kuhl_nanoseconds();
+	int64_t wallStartUsec = wallStart.tv_sec * 1000000LL + wallStart.tv_usec;
+
+	for(int i = 0; i < settings->objects; i++)
+	{
+		objects[i].tracker = trackers[i];
+		objects[i].phase = i * 2 * M_PI / settings->objects;
+		objects[i].frame = 0;
+		load_schedule(&objects[i], settings, start, period);
+	}
+
+	long sent = 0, lost = 0, wakeups = 0;
+	int64_t lateSum = 0, lateMax = 0;
+	int64_t nextReport = start + 1000000000LL;
+	int64_t lastReport = start;
+
+	while(true)
+	{
+		int64_t next = objects[0].sendAt;
+		for(int i = 1; i < settings->objects; i++)
+			if(objects[i].sendAt < next)
+				next = objects[i].sendAt;
+		kuhl_sleep_until(next);
+		wakeups++;
+
+		int64_t now = kuhl_nanoseconds();
+		for(int i = 0; i < settings->objects; i++)
+		{
+			LoadObject *o = &objects[i];
+			/* An object can have several records waiting in a burst
+			 * (or if we fell behind). */
+			while(o->sendAt <= now)
+			{
+				int64_t late = now - o->sendAt;
+				lateSum += late;
+				if(late > lateMax)
+					lateMax = late;
+
+				if(settings->loss > 0 && (double) rand() / RAND_MAX < settings->loss)
+					lost++;
+				else
+				{
+					int64_t captured = start + o->frame * period;
+					double t = (captured - start) / 1e9;
+					float p[3] = { (float) sin(t + o->phase),
+					               (float) (1.5 + .1 * sin(2*t + o->phase)),
+					               (float) cos(t + o->phase) };
+					float rotMat[9], q[4];
+					mat3f_rotateEuler_new(rotMat, 0, (float) (t*90 + o->phase*180/M_PI), 0, "XYZ");
+					if(settings->noise)
+					{
+						for(int k=0; k<3; k++)
+							p[k] += (float) (kuhl_gauss() * .0001);
+					}
+					quatf_from_mat3f(q, rotMat);
+
+					int64_t capturedUsec = wallStartUsec + (captured - start) / 1000;
+					struct timeval tv;
+					tv.tv_sec = (long) (capturedUsec / 1000000);
+					tv.tv_usec = (long) (capturedUsec % 1000000);
+					o->tracker->send(p, q, &tv);
+					sent++;
+				}
+				o->frame++;
+				load_schedule(o, settings, start, period);
+			}
+		}
+		connection->mainloop();
+
+		if(now >= nextReport)
+		{
+			double seconds = (now - lastReport) / 1e9;
+			long records = sent + lost;
+			if(!settings->quiet)
+				printf("Sent %.1f records per second (%.1f per object, %.1f lost per second) in %.1f wakeups per second; late by %.1f us on average, %.1f us max\n",
+				       sent/seconds, sent/seconds/settings->objects, lost/seconds, wakeups/seconds,
+				       records > 0 ? lateSum/1000.0/records : 0.0, lateMax/1000.0);
+			sent = lost = wakeups = 0;
+			lateSum = lateMax = 0;
+			lastReport = now;
+			nextReport += 1000000000LL;
+		}
+	}
+}
+
 /**
  * -f (files)- Takes one or more parameters, this will read from a log file instead of generating data.
+ * -b (burst)- Takes one parameter, load generator: send records this many frames at a time.
+ * -g (generate)- Takes one parameter, the number of objects to generate load for.
  * -h (help)- Prints a helpful message
+ * -j (jitter)- Takes one parameter, load generator: send each record up to this many microseconds late.
+ * -l (log)- Takes one parameter, plays back a tracking log saved by recorder.
  * -n (noise)- Adds noise to each data point.
+ * -o (offset)- Takes one parameter, the number of seconds into the tracking log to start at.
+ * -p (packet loss)- Takes one parameter, load generator: percentage of the records to drop.
  * -q (quiet)- Turns off almost all debugging.
+ * -r (rate)- Takes one parameter, load generator: records per second for each object.
+ * -s (speed)- Takes one parameter, the tracking log playback speed (0 = as fast as possible).
  * -t (tracker)- Takes one or more parameters. Uses the specified names for the tracked objects, multiple names will create multiple objects.
  * -v (verbose)- Turns on some extra debugging.
  */
@@ -219,10 +478,16 @@ int main(int argc, char* argv[])
 	char** filesv = NULL;
 	int filesc = 0;
 
+	const char* logFile = NULL;
+	double speed = 1;
+	double offset = 0;
+
+	LoadSettings load = { 0, 240, 0, 0, 1, false, false };
+
 	//Check the arguments for any options supplied
 	//See Linux man(3) getopt for more info
 	int option = 0;
-	const char* options = "f:hnqt:v";
+	const char* options = "b:f:g:hj:l:no:p:qr:s:t:v";
 	while((option = getopt(argc, argv, options)) != -1){
 
     	switch(option)
@@ -247,16 +512,69 @@ int main(int argc, char* argv[])
 				printf("Runs a fake vrpn server that simulates a real tracking system.\n");
 				printf("If no data files are specified, data will be generated.\n");
 				printf("\t-f [FILE]...\tFiles: use the specified data files (one or more).\n");
+				printf("\t-g COUNT\tGenerate: send records for COUNT moving objects (named Object0, Object1, ...) to test clients under load.\n");
 				printf("\t-h\t\tHelp: print this message.\n");
+				printf("\t-l FILE\t\tLog: play back a tracking log (.trk) saved by recorder.\n");
 				printf("\t-n\t\tNoise: adds noise to each data point.\n");
+				printf("\t-o SECONDS\tOffset: start this many seconds into the tracking log.\n");
 				printf("\t-q\t\tQuiet: turn off most of the debugging.\n");
+				printf("\t-s SPEED\tSpeed: tracking log playback speed (default 1, 0 = as fast as possible).\n");
 				printf("\t-t [NAME]...\tTracker: use the specified names for tracked objects.\n\t\t\t\t NOTE: does nothing if any files are specified.\n");
 				printf("\t-v\t\tVerbose: turn on extra debugging.\n");
+				printf("Options for -g:\n");
+				printf("\t-r HZ\t\tRate: records per second for each object (default 240).\n");
+				printf("\t-j USEC\t\tJitter: send each record up to USEC microseconds late.\n");
+				printf("\t-p PERCENT\tPacket loss: drop this percentage of the records.\n");
+				printf("\t-b FRAMES\tBurst: hold records and send FRAMES frames at a time.\n");
 				exit(0);
         		break;
+        	case 'b':
+				load.burst = atoi(optarg);
+				if(load.burst < 1)
+				{
+					fprintf(stderr, "The burst size must be at least 1.\n");
+					exit(1);
+				}
+        		break;
+        	case 'g':
+				load.objects = atoi(optarg);
+				if(load.objects < 1 || load.objects > 128)
+				{
+					fprintf(stderr, "The number of objects must be between 1 and 128.\n");
+					exit(1);
+				}
+        		break;
+        	case 'j':
+				load.jitter = atof(optarg);
+        		break;
+        	case 'l':
+				logFile = optarg;
+        		break;
+        	case 'p':
+				load.loss = atof(optarg) / 100;
+        		break;
+        	case 'r':
+				load.rate = atof(optarg);
+				if(load.rate <= 0)
+				{
+					fprintf(stderr, "The rate must be positive.\n");
+					exit(1);
+				}
+        		break;
         	case 'n':
 				noise = true;
         		break;
+        	case 'o':
+				offset = atof(optarg);
+        		break;
+        	case 's':
+				speed = atof(optarg);
+				if(speed < 0)
+				{
+					fprintf(stderr, "The playback speed can't be negative.\n");
+					exit(1);
+				}
+        		break;
         	case 'q':
 				quiet = true;
 				verbose = false;
@@ -323,6 +641,41 @@ int main(int argc, char* argv[])
 	
 	if(verbose)printf("Opening VRPN connection\n");
 	vrpn_Connection_IP* m_Connection = new vrpn_Connection_IP();
+
+	if(logFile != NULL)
+	{
+		tracklog *log = tracklog_open(logFile);
+		if(log == NULL)
+			exit(EXIT_FAILURE);
+		int objects = tracklog_object_count(log);
+		myTracker** trackers = (myTracker**) malloc(sizeof(myTracker*) * (objects > 0 ? objects : 1));
+		bool flags[4] = {verbose, quiet, noise, DATA_TRACKER};
+		for(int i = 0; i < objects; i++)
+			trackers[i] = new myTracker(tracklog_object_name(log, i), flags, m_Connection);
+
+		printf("Starting VRPN server: playing %ld records (%.1f seconds) from %s at %g times the original speed.\n",
+		       tracklog_record_count(log), (tracklog_last_time(log)-tracklog_first_time(log))/1000000.0,
+		       logFile, speed);
+		replay_log(log, trackers, m_Connection, speed, offset, quiet);
+	}
+
+	if(load.objects > 0)
+	{
+		load.noise = noise;
+		load.quiet = quiet;
+		myTracker* trackers[128];
+		char names[128][32];
+		bool flags[4] = {verbose, quiet, noise, DATA_TRACKER};
+		for(int i = 0; i < load.objects; i++)
+		{
+			snprintf(names[i], sizeof(names[i]), "Object%d", i);
+			trackers[i] = new myTracker(names[i], flags, m_Connection);
+		}
+
+		printf("Starting VRPN server: generating %d objects at %g Hz (jitter %g us, %g%% loss, bursts of %d frames).\n",
+		       load.objects, load.rate, load.jitter, load.loss*100, load.burst);
+		generate_load(trackers, m_Connection, &load);
+	}
 	
 	//Set the tracker type to file if files were specified, otherwise set it to data type.
 	bool trackerst = filesc > 0 ? FILE_TRACKER : DATA_TRACKER;
@@ -364,6 +717,12 @@ int main(int argc, char* argv[])
 	}
 
 	printf("Starting VRPN server.\n");
+
+	/* Send records at exactly 100Hz (the rate that recorder saves
+	 * them at). If we fall behind, send the records we missed right
+	 * away so that playback doesn't slow down. */
+	kuhl_periodic timer;
+	kuhl_periodic_init(&timer, 100, 1);
 	
 	while(true)
 	{
@@ -378,7 +737,9 @@ int main(int argc, char* argv[])
 		}
 
 		m_Connection->mainloop();
-		kuhl_limitfps(100);
+		kuhl_periodic_wait(&timer);
+		if(verbose && timer.ticks % 6000 == 0) // every minute
+			kuhl_periodic_print_stats(&timer, "Fake server timing");
 	}
 	if(filesv != NULL)free(filesv);
 	if(objNamesv != NULL)free(objNamesv);
@@ -1,20 +1,38 @@
 /*
  * This is a simple program that will read from the VRPN
- * server set in the home directory and print the entries 
- * it reads to the specified file.
+ * server set in the home directory and save every sample it
+ * receives to a tracking log (see tracklog.h) that fake-server can
+ * play back later.
  *
  * @author John Thomas
  * @LastModified June 2015
  */
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/time.h> // gettimeofday
 #include <time.h> // localtime
 
 #include "vrpn-help.h"
 #include "kuhl-util.h"
-#include "vecmat.h"
-#include "tdl-util.h"
+#include "tracklog.h"
+#include "msg.h"
+
+/** Set by the SIGINT handler so that we can close the log. */
+static volatile sig_atomic_t stopRecording = 0;
+
+static void handle_sigint(int sig)
+{
+	stopRecording = 1;
+}
+
+/** Sorts records by the time they were captured. */
+static int compare_records(const void *a, const void *b)
+{
+	long timeA = ((const tracklog_record*) a)->time;
+	long timeB = ((const tracklog_record*) b)->time;
+	return (timeA > timeB) - (timeA < timeB);
+}
 
 int main(int argc, char* argv[])
 {
@@ -23,7 +41,7 @@ int main(int argc, char* argv[])
 	{
 		printf("Usage\n\trecorder serverHost objName1 [ objName2 ... ]\n");
 		printf("\n");
-		printf("This program reads data from a VRPN server and saves it to a file that can be played back later.\n");
+		printf("This program reads data from a VRPN server and saves it to a file that can be played back later with fake-server. Press Ctrl+C to stop recording.\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -39,54 +57,85 @@ int main(int argc, char* argv[])
 	char timestamp[1024]; // construct a string without microseconds
 	strftime(timestamp, 1024, "%Y%m%d-%H%M%S", nowtm);
 
+	const char *host = argv[1];
+	const char **objects = (const char**) argv+2;
 	int objectsToRecord = argc - 2;
-	FILE **outputFiles = malloc(sizeof(FILE*)*objectsToRecord);
-	
-	for(int i=0; i<objectsToRecord; i++) // for each object to record
-	{
-		char filename[2048];
-		snprintf(filename, 2048, "%s-%s.tdl", argv[i+2], timestamp);
 
-		//Create a new TDL file.
-		printf("Output file: %s\n", filename);
-		outputFiles[i] = tdl_create(filename, argv[i+2]);
-		if(outputFiles[i] == NULL)
-		{
-			printf("Failed to create file: %s\n", filename);
-			exit(EXIT_FAILURE);
-		}
-		else
-			printf("Storing data from object '%s' in file '%s\n", argv[i+2], filename);
+	char filename[2048];
+	snprintf(filename, 2048, "tracking-%s.trk", timestamp);
+	tracklog *log = tracklog_create(filename, objects, objectsToRecord);
+	if(log == NULL)
+	{
+		printf("Failed to create file: %s\n", filename);
+		exit(EXIT_FAILURE);
 	}
+	printf("Storing data from %d object(s) in file '%s'\n", objectsToRecord, filename);
+
+	/* Record the samples as the tracking system sent them. The
+	 * program that plays them back will filter them. */
+	vrpn_set_filter(0);
+	signal(SIGINT, handle_sigint);
+
+	/* Time of the newest sample that we have saved for each object. */
+	long *lastTime = (long*) calloc(objectsToRecord, sizeof(long));
+	tracklog_record *batch = (tracklog_record*) malloc(sizeof(tracklog_record)*VRPN_HISTORY*objectsToRecord);
 
+	/* Every sample has the time it was captured, so we don't need to
+	 * ask for samples at a fixed rate. We just need to ask often
+	 * enough that the history kept for each object doesn't fill up
+	 * (VRPN_HISTORY samples, more than 250ms at 240Hz). */
+	kuhl_periodic timer;
+	kuhl_periodic_init(&timer, 100, 0);
 
 	//Loop until Ctrl+C.
-	while(1)
+	while(!stopRecording)
 	{
-		//Buffers for the data.
-		float pos[3];
-		float rotMat4[16];  // 4x4 matrix, what we vrpn_get() gives us.
-		float rotMat3[9];   // a 3x3 rotation matrix, what we need to give to tdl_write()
-
+		int batchCount = 0;
 		for(int i=0; i<objectsToRecord; i++)
 		{
-			//Get the next vrpn entry
-			vrpn_get(argv[i+2], argv[1], pos, rotMat4);
-			
-			//Write that entry to the file
-			mat3f_from_mat4f(rotMat3, rotMat4);
-			tdl_write(outputFiles[i], pos, rotMat3);
+			vrpn_sample samples[VRPN_HISTORY];
+			int count = vrpn_get_history(objects[i], host, samples, VRPN_HISTORY);
+
+			/* Samples are newest first; find the ones we haven't saved yet. */
+			int newCount = 0;
+			while(newCount < count && samples[newCount].time > lastTime[i])
+				newCount++;
+			if(newCount == VRPN_HISTORY && lastTime[i] != 0)
+				msg(MSG_WARNING, "Some samples for '%s' may have been lost.", objects[i]);
+			if(newCount > 0)
+				lastTime[i] = samples[0].time;
+
+			for(int j=newCount-1; j>=0; j--)
+			{
+				tracklog_record *r = &batch[batchCount++];
+				r->time = samples[j].time;
+				r->object = i;
+				for(int k=0; k<3; k++)
+					r->pos[k] = (float) samples[j].pos[k];
+				for(int k=0; k<4; k++)
+					r->quat[k] = (float) samples[j].quat[k];
+			}
+		}
+
+		/* Interleave the samples from all of the objects in the order
+		 * they were captured. */
+		qsort(batch, batchCount, sizeof(tracklog_record), compare_records);
+		for(int i=0; i<batchCount; i++)
+			tracklog_write(log, &batch[i]);
+
+		kuhl_periodic_wait(&timer);
+		if(timer.ticks % 100 == 0) // every second
+			tracklog_flush(log);
+		if(timer.ticks % 6000 == 0) // every minute
+		{
+			printf("Recorded %ld samples\n", tracklog_record_count(log));
+			kuhl_periodic_print_stats(&timer, "Recorder timing");
 		}
-		
-		//IMPORTANT! Since there are no time stamps, this MUST be the same value as the fake
-		//server that is going to be reading the file, otherwise artificial speed ups or delays
-		//may occur in the final reading and output of the file.
-		kuhl_limitfps(100);
 	}
-	
 
-	//Close the fd (Useless code until code to stop loop is added)
-	for(int i=0; i<objectsToRecord; i++)
-		fclose(outputFiles[i]);
-	         
+	printf("Recorded %ld samples in '%s'\n", tracklog_record_count(log), filename);
+	tracklog_close(log);
+	free(batch);
+	free(lastTime);
+	return 0;
 }